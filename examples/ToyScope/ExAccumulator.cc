@@ -92,17 +92,23 @@ void ExAccumulator::poll()
 {
     int ctr = 0;
     poll_thread_started.signal(true);
-    double avg, sum, sample;
-    int i;
+    double avg, sum;
+    vector<double> samples;
+    int i, n;
     while (1)
     {
         sum = 0.0;
-        for (i=0; i<decimate_factor; ++i)
+        n = decimate_factor;
+        samples.resize(n);
+        for (i=0; i<n; )
         {
-            input_signal_sink.get(sample);
-            sum += sample;
+            i += input_signal_sink.get_n(&samples[i], n - i);
         }
-        avg = sum/decimate_factor;
+        for (i=0; i<n; ++i)
+        {
+            sum += samples[i];
+        }
+        avg = sum/n;
         output_signal_source.publish(avg);
     }        
 }
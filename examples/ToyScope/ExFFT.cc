@@ -122,6 +122,7 @@ void ExFFT::poll()
     int i;
     fftw_complex *in, *out;
     fftw_plan p;
+    vector<double> datain(N);
     
     in = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * N);
     out = (fftw_complex*) fftw_malloc(sizeof(fftw_complex) * N);
@@ -130,13 +131,16 @@ void ExFFT::poll()
       
     while (1)
     {
-        // spin until N values have been read
+        // wait until N values have been read, taking as many at a
+        // time as are available.
+        for (i=0; i<N; )
+        {
+            i += input_signal_sink.get_n(&datain[i], N - i);
+        }
         for (i=0; i<N; ++i)
         {
-            double datain;
-            input_signal_sink.get(datain);
             // should probably generate both I/Q values ...
-            in[i][0] = datain;
+            in[i][0] = datain[i];
             in[i][1] = 0.0;
         }
         // perform the complex-complex FFT
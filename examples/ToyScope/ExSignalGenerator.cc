@@ -119,41 +119,51 @@ void ExSignalGenerator::poll()
 {
     int ctr = 0;
     poll_thread_started.signal(true);
-    double avg, sum, sample;
-    int i;
+    double sample;
+    int i, nper;
     double n;
     double s_per_c;
-    float grc_sample;
+    vector<double> samples;
+    vector<float> grc_samples;
     n = 0;
     while (1)
     {
-        Time_t delay = 1000000000 / static_cast<Time_t>(rate_factor);
+        // At high rates wake up at most ~100 times a second, and
+        // publish the samples generated in that time as one batch.
+        nper = rate_factor > 100 ? rate_factor / 100 : 1;
+        Time_t delay = 1000000000 * static_cast<Time_t>(nper) / static_cast<Time_t>(rate_factor);
         Time::thread_delay(delay);
         s_per_c = rate_factor / frequency;
-        switch (waveform_type)
+        samples.resize(nper);
+        grc_samples.resize(nper);
+        for (i=0; i<nper; ++i)
         {
-            case TONE:
-                sample = amplitude * cos(n / s_per_c * M_PI);
-                n = n + 1.0;
-                break;
-            case NOISE:
-                sample = amplitude * static_cast<double>(rand()) / RAND_MAX;
-                break;
-            case DC:
-                sample = amplitude;
-                break;
-            default:
-                printf("unknown waveform?\n");
-                break;
+            switch (waveform_type)
+            {
+                case TONE:
+                    sample = amplitude * cos(n / s_per_c * M_PI);
+                    n = n + 1.0;
+                    break;
+                case NOISE:
+                    sample = amplitude * static_cast<double>(rand()) / RAND_MAX;
+                    break;
+                case DC:
+                    sample = amplitude;
+                    break;
+                default:
+                    printf("unknown waveform?\n");
+                    break;
+            }
+
+            samples[i] = sample;
+            grc_samples[i] = (float)sample;
+
+            if (ctr++ % 512 == 0)
+                printf("SG: %f\n", sample);
         }
 
-        output_signal_source.publish(sample);
-
-        grc_sample = (float)sample;
-        grc_src.publish(grc_sample);
-
-        if (ctr++ % 512 == 0)
-            printf("SG: %f\n", sample);
+        output_signal_source.publish_n(samples.data(), nper);
+        grc_src.publish(grc_samples.data(), nper);
     }
 }
 
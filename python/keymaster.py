@@ -32,7 +32,8 @@ import string
 import random
 import inspect
 import weakref
-from time import sleep
+import copy
+from time import sleep, time
 
 
 def gen_random_string(rand_len=10, chars=string.ascii_uppercase +
@@ -44,15 +45,24 @@ def gen_random_string(rand_len=10, chars=string.ascii_uppercase +
     return ''.join(random.choice(chars) for _ in range(rand_len))
 
 
+# The topic of delta publications, when the KeymasterServer's
+# 'Keymaster.delta_publishing' is true.
+DELTA_TOPIC = '@delta'
+
+
 class Keymaster(object):
 
     class subscriber_task(threading.Thread):
         """Thread for subscriber services."""
 
+        # a rate-limited key's pending value, to be taken from the mirror
+        MIRRORED = object()
+
         def __init__(self, keymaster):
             threading.Thread.__init__(self)
             self._keymaster = weakref.ref(keymaster)
             km_url = keymaster._km_url
+            self._km_url = km_url
             # Get the as-configured publication URLs
             pub_urls = self._keymaster().get('Keymaster.URLS.AsConfigured.Pub')
             # choose the one who's transport is the same as that of our
@@ -62,6 +72,16 @@ class Keymaster(object):
             # main thread communicates to this thread via ZMQ inproc REQ/REP.
             self.pipe_url = "inproc://" + gen_random_string(20)
             self._callbacks = {}
+            # rate-limited subscriptions: key -> [interval (s), time
+            # of the next call, latest value not yet delivered]
+            self._rate_limits = {}
+            # With delta publishing only the changes are published,
+            # from which a mirror of the store is kept (see
+            # '_handle_delta()').
+            self._delta = keymaster.get('Keymaster.delta_publishing') is True
+            self._mirror = None
+            self._mirror_seq = 0
+            self._mirror_epoch = None
             self.end_thread = False
 
         def __del__(self):
@@ -83,11 +103,17 @@ class Keymaster(object):
                 poller = zmq.Poller()
                 sub_sock.connect(self._pub_url)
                 pipe.bind(self.pipe_url)
+
+                if self._delta:
+                    sub_sock.setsockopt(zmq.SUBSCRIBE, DELTA_TOPIC)
+
                 poller.register(sub_sock, flags=zmq.POLLIN)
                 poller.register(pipe, flags=zmq.POLLIN)
 
+                timeout = None
+
                 while not self.end_thread:
-                    event = poller.poll()
+                    event = poller.poll(timeout)
 
                     for e in event:
                         sock = e[0]  # e[1] always POLLIN
@@ -112,6 +138,7 @@ class Keymaster(object):
                                 if key in self._callbacks:
                                     sub_sock.setsockopt(zmq.UNSUBSCRIBE, key)
                                     self._callbacks.pop(key)
+                                    self._rate_limits.pop(key, None)
                                     pipe.send_pyobj(True, zmq.SNDMORE)
                                     pipe.send_pyobj("'%s' unsubscribed." % key)
                                 else:
@@ -126,6 +153,7 @@ class Keymaster(object):
                                     sub_sock.setsockopt(zmq.UNSUBSCRIBE, key)
 
                                 self._callbacks.clear()
+                                self._rate_limits.clear()
                                 pipe.send_pyobj(True, zmq.SNDMORE)
                                 pipe.send_pyobj('Keys cleared: %s' %
                                                 ', '.join(keys_cleared))
@@ -141,11 +169,17 @@ class Keymaster(object):
                             msg = sub_sock.recv_multipart()
                             key = msg[0]
 
-                            if len(msg) > 1:
-                                if key in self._callbacks:
+                            if key == DELTA_TOPIC:
+                                self._handle_delta(msg[1:])
+                            elif len(msg) > 1:
+                                if key in self._rate_limits:
+                                    self._rate_limits[key][2] = msg[1]
+                                elif key in self._callbacks:
                                     n = yaml.load(msg[1])
                                     mci = self._callbacks[key]
                                     mci(key, n)
+
+                    timeout = self._deliver_rate_limited()
                 pipe.close()
                 sub_sock.close()
 
@@ -158,6 +192,169 @@ class Keymaster(object):
             finally:
                 print "Keymaster: Ending subscriber thread."
 
+        def _deliver_rate_limited(self):
+            """Calls the rate-limited callbacks that have a new value,
+            unless they were called less than their minimum interval
+            ago. Returns the time in ms until the next one held back
+            is due, or None if there are none.
+
+            """
+            now = time()
+            wait = None
+
+            for key, rl in self._rate_limits.items():
+                if rl[2] is None:
+                    continue
+
+                if rl[1] > now:
+                    due = int((rl[1] - now) * 1000) + 1
+                    wait = due if wait is None else min(wait, due)
+                    continue
+
+                val = rl[2]
+                rl[1] = now + rl[0]
+                rl[2] = None
+
+                if key in self._callbacks:
+                    if val is self.MIRRORED:
+                        self._callbacks[key](key, self._mirror_value(key))
+                    else:
+                        self._callbacks[key](key, yaml.load(val))
+
+            return wait
+
+        def _handle_delta(self, frames):
+            """Applies a delta publication to the mirror of the store,
+            and calls the callbacks of the keys it changed: those of
+            the changed keys, and of the keys above them. 'frames' are
+            the sequence number, the server's epoch, then "PUT" or
+            "DEL", the key, and the value for each change. If changes
+            were missed, or the epoch shows the server was restarted
+            (its sequence numbers start over), or they don't apply,
+            the mirror is reloaded instead.
+
+            """
+            if len(frames) < 2 or len(frames) % 3 != 2:
+                return
+
+            seq = int(frames[0])
+            epoch = frames[1]
+            same = self._mirror is not None and epoch == self._mirror_epoch
+
+            if same and seq <= self._mirror_seq:
+                return  # already in the mirror
+
+            if not same or seq != self._mirror_seq + 1:
+                # if this fails, try again on the next delta.
+                if not self._load_mirror() or epoch != self._mirror_epoch \
+                   or seq != self._mirror_seq + 1:
+                    return
+
+            changed = []
+
+            try:
+                for i in range(2, len(frames), 3):
+                    key = frames[i + 1]
+
+                    if frames[i] == 'DEL':
+                        self._mirror_del(key)
+                    else:
+                        self._mirror_put(key, yaml.load(frames[i + 2]))
+
+                    changed.append(key)
+            except (KeyError, TypeError, AttributeError, yaml.YAMLError):
+                self._load_mirror()
+                return
+
+            self._mirror_seq = seq
+
+            for k in self._callbacks.keys():
+                for key in changed:
+                    if (k == 'Root' and key == '') or k == key \
+                       or key.startswith(k + '.'):
+                        self._mirror_changed(k)
+                        break
+
+        def _load_mirror(self):
+            """(Re)loads the mirror from a snapshot of the store, and
+            calls all the callbacks, whose values may have changed
+            meanwhile. Returns True if the mirror was loaded.
+
+            """
+            sock = self._keymaster()._ctx.socket(zmq.REQ)
+            sock.setsockopt(zmq.LINGER, 0)
+            sock.connect(self._km_url)
+
+            try:
+                sock.send('SNAP')
+
+                if not sock.poll(5000):
+                    self._mirror = None
+                    return False
+
+                seq, epoch, text = sock.recv_multipart()
+                self._mirror = yaml.load(text)
+                self._mirror_seq = int(seq)
+                self._mirror_epoch = epoch
+            finally:
+                sock.close()
+
+            for k in self._callbacks.keys():
+                self._mirror_changed(k)
+
+            return True
+
+        def _mirror_value(self, key):
+            """A copy of the mirror's value of 'key', or None."""
+            node = self._mirror
+
+            if key not in ('', 'Root'):
+                for k in key.split('.'):
+                    if not isinstance(node, dict) or k not in node:
+                        return None
+                    node = node[k]
+
+            return copy.deepcopy(node)
+
+        def _mirror_put(self, key, val):
+            """Puts 'val' at 'key' in the mirror, creating the keys
+            above it if need be.
+
+            """
+            if key == '':
+                self._mirror = val
+                return
+
+            keys = key.split('.')
+            node = self._mirror
+
+            for k in keys[:-1]:
+                if not isinstance(node.get(k), dict):
+                    node[k] = {}
+                node = node[k]
+
+            node[keys[-1]] = val
+
+        def _mirror_del(self, key):
+            """Deletes 'key' from the mirror."""
+            keys = key.split('.')
+            node = self._mirror
+
+            for k in keys[:-1]:
+                node = node[k]
+
+            del node[keys[-1]]
+
+        def _mirror_changed(self, key):
+            """Calls the callback of 'key' with its value in the
+            mirror, or has it called once its minimum interval is up.
+
+            """
+            if key in self._rate_limits:
+                self._rate_limits[key][2] = self.MIRRORED
+            elif key in self._callbacks:
+                self._callbacks[key](key, self._mirror_value(key))
+
     def __init__(self, url, ctx=None):
         self.SUBSCRIBE = 10
         self.UNSUBSCRIBE = 11
@@ -230,7 +427,7 @@ class Keymaster(object):
         """Deletes a key from the Keymaster"""
         return self._call_keymaster('DEL', key)
 
-    def subscribe(self, key, cb_fun):
+    def subscribe(self, key, cb_fun, min_interval_ms=0):
         """Subscribes to a key on the Keymaster
 
         *key:*
@@ -239,6 +436,11 @@ class Keymaster(object):
         *cb_fun:*
           the callback function, which must take 2 args: the key, and a yaml node
 
+        *min_interval_ms:*
+          if not 0, the least time between two calls of 'cb_fun'.
+          Updates that arrive sooner are conflated: 'cb_fun' is called
+          once the interval is up, with the latest value only.
+
         returns 'True' if the subscription was successful, 'False'
         otherwise. The function will fail if 'key' is already
         subscribed.
@@ -270,6 +472,9 @@ class Keymaster(object):
 
         # everything is good, set up the callback
         self._sub_task._callbacks[key] = cb_fun
+
+        if min_interval_ms > 0:
+            self._sub_task._rate_limits[key] = [min_interval_ms / 1000.0, 0, None]
         pipe = self._ctx.socket(zmq.REQ)
         pipe.connect(self._sub_task.pipe_url)
         pipe.send_pyobj(self.SUBSCRIBE, zmq.SNDMORE)
@@ -25,6 +25,7 @@
 #include <map>
 #include <iostream>
 #include <algorithm>
+#include <future>
 #include "matrix/Architect.h"
 #include <yaml-cpp/yaml.h>
 #include "matrix/ThreadLock.h"
@@ -163,6 +164,7 @@ namespace matrix
     bool Architect::create_component_instances()
     {
         YAML::Node km_components = keymaster->get("components");
+        vector<future<mxutils::yaml_result> > puts;
 
         dbprintf("Architect::_create_component_instances\n");
 
@@ -201,10 +203,18 @@ namespace matrix
                 components[comp_instance_name].active = true;
                 l.unlock();
                 // component will now be listening to these...
-                keymaster->put(root + comp_instance_name + ".command", "do_init");
-                keymaster->put(root + comp_instance_name + ".mode", "default");
+                puts.push_back(keymaster->put_async(root + comp_instance_name + ".command",
+                                                    YAML::Node("do_init")));
+                puts.push_back(keymaster->put_async(root + comp_instance_name + ".mode",
+                                                    YAML::Node("default")));
             }
         }
+
+        for (auto f = puts.begin(); f != puts.end(); ++f)
+        {
+            f->wait();
+        }
+
         return true;
     }
 
@@ -273,35 +283,42 @@ namespace matrix
             return false;
         }
         current_mode = mode;
-        // disable all components for mode change
         string root = "components.";
+        auto modeset = active_mode_components.find(mode);
+        // If there are no components or no entry for this mode, all
+        // components are disabled and we are done. TBD is this really
+        // an error???
+        bool known_mode = modeset != active_mode_components.end();
+        // All components are in Standby, so we just need to set/reset
+        // the active flags. This is done in one Keymaster transaction,
+        // so that subscribers see a single change of mode instead of
+        // a change for every component.
+        vector<KeymasterStore::change> changes;
         ThreadLock<ComponentMap> l(components);
         l.lock();
         for (auto p = components.begin(); p != components.end(); ++p)
         {
-            p->second.active = false;
-            keymaster->put(root + p->first + ".active", false);
-        }
-        l.unlock();
+            bool active = known_mode && modeset->second.find(p->first) != modeset->second.end();
+            p->second.active = active;
+            changes.push_back({root + p->first + ".active", YAML::Node(active), false, false});
 
-        auto modeset = active_mode_components.find(mode);
-        if (modeset == active_mode_components.end())
-        {
-            // no components or no entry for this mode. we are done.
-            // TBD is this really an error???
-            return false;
+            if (known_mode)
+            {
+                changes.push_back({root + p->first + ".mode", YAML::Node(mode), false, false});
+                result = true;
+            }
         }
+        l.unlock();
 
-        auto active_components = modeset->second;
-        // All components are in Standby, so we just need to set/reset active flag
-        l.lock();
-        for (auto p = components.begin(); p != components.end(); ++p)
+        auto r = keymaster->transaction(changes);
+        for (auto i = r.begin(); i != r.end(); ++i)
         {
-            bool active = active_components.find(p->first) != active_components.end();
-            p->second.active = active;
-            keymaster->put(root + p->first + ".active", active);
-            keymaster->put(root + p->first + ".mode", mode);
-            result = true;
+            if (!i->result)
+            {
+                cerr << "Setting system mode to " << mode << " failed: "
+                     << i->key << ": " << i->err << endl;
+                return false;
+            }
         }
 
         return result;
@@ -340,15 +357,22 @@ namespace matrix
     bool Architect::send_event(std::string event)
     {
         YAML::Node myevent(event);
+        vector<future<mxutils::yaml_result> > puts;
         // for each component, if its active in the current mode, then
-        // send it the event.
+        // send it the event. The puts all go out at once.
         for (auto p = components.begin(); p != components.end(); ++p)
         {
             if (p->second.active || event == "do_init")
             {
-                keymaster->put("components." + p->first + ".command", myevent);
+                puts.push_back(keymaster->put_async("components." + p->first + ".command", myevent));
             }
         }
+
+        for (auto f = puts.begin(); f != puts.end(); ++f)
+        {
+            f->wait();
+        }
+
         return true;
     }
 
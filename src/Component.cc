@@ -26,6 +26,7 @@
 #include <iostream>
 #include <cstdio>
 #include "matrix/Keymaster.h"
+#include "matrix/DataSink.h"
 
 using namespace std;
 using namespace YAML;
@@ -95,7 +96,7 @@ namespace matrix
                 for (YAML::const_iterator conn = md->second.begin(); conn != md->second.end(); ++conn)
                 {
                     YAML::Node n = *conn;
-                    if (n.size() > 2)
+                    if (n.size() > 3)
                     {
                         // for some clarity...
                         const string &mode = md->first.as<string>();
@@ -106,12 +107,50 @@ namespace matrix
 
                         if (dst_comp == my_instance_name)
                         {
-                            const string protocol = n.size() == 5 ? n[3].as<string>() : "";
+                            // optionally followed by the protocol, and/or
+                            // the sink's overflow policy (a map).
+                            string protocol;
+                            YAML::Node policy;
+
+                            for (size_t i = 4; i < n.size(); ++i)
+                            {
+                                if (n[i].IsMap())
+                                {
+                                    policy = n[i];
+                                }
+                                else
+                                {
+                                    protocol = n[i].as<string>();
+                                }
+                            }
+
+                            // a bad policy is reported here, and the
+                            // connection left out, rather than found
+                            // on the mode change.
+                            try
+                            {
+                                sink_policy::from_yaml(policy);
+                            }
+                            catch (MatrixException &e)
+                            {
+                                cerr << __PRETTY_FUNCTION__ << " " << mode << ": "
+                                     << sink_name << ": " << e.what() << endl;
+                                continue;
+                            }
 
                             ConnectionKey ck(mode,
                                              dst_comp,
                                              sink_name);
                             connections[ck] = ConnectionKey(src_comp, src_name, protocol);
+
+                            if (policy.IsMap())
+                            {
+                                sink_policies[ck] = policy;
+                            }
+                            else
+                            {
+                                sink_policies.erase(ck);
+                            }
                         }
                     }
                 }
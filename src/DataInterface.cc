@@ -269,6 +269,71 @@ namespace matrix
         return false;
     }
 
+/**
+ * Publishes 'count' elements of 'size_of_element' bytes each,
+ * contiguous at 'data'. Transports that can send these as a unit
+ * should override this; by default each element is published in
+ * turn.
+ *
+ * @param key: The data key.
+ * @param data: The first element.
+ * @param size_of_element: The size of one element, in bytes.
+ * @param count: The number of elements.
+ *
+ * @return true if all elements were published, false otherwise.
+ *
+ */
+
+    bool TransportServer::_publish_batch(string key, const void *data,
+                                         size_t size_of_element, size_t count)
+    {
+        bool rval = true;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            rval = _publish(key, (const char *)data + i * size_of_element,
+                            size_of_element) && rval;
+        }
+
+        return rval;
+    }
+
+/**
+ * Interns a data key, returning a handle that may be given to the
+ * handle taking `publish()` and `publish_batch()` along with the key
+ * itself. Transports that can dispatch on a small integer faster than
+ * on a string override this; the default returns NO_HANDLE.
+ *
+ * @param key: The data key.
+ *
+ * @return The handle, or NO_HANDLE.
+ *
+ */
+
+    TransportServer::key_handle_t TransportServer::_intern(string )
+    {
+        return NO_HANDLE;
+    }
+
+    bool TransportServer::_publish_interned(key_handle_t , const string &key,
+                                            const void *data, size_t size_of_data)
+    {
+        return _publish(key, data, size_of_data);
+    }
+
+    bool TransportServer::_publish_batch_interned(key_handle_t , const string &key,
+                                                  const void *data, size_t size_of_element,
+                                                  size_t count)
+    {
+        return _publish_batch(key, data, size_of_element, count);
+    }
+
+    bool TransportServer::_publish_shared(key_handle_t h, const string &key,
+                                          shared_ptr<const void> data, size_t size_of_data)
+    {
+        return _publish_interned(h, key, data.get(), size_of_data);
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
@@ -378,6 +443,11 @@ namespace matrix
         disconnect();
     }
 
+    bool TransportClient::_configure(YAML::Node)
+    {
+        return true;
+    }
+
     bool TransportClient::_connect()
     {
         return false;
@@ -31,6 +31,75 @@ using namespace std;
 
 namespace matrix
 {
+/**
+ * Makes a sink_policy from its YAML description, a map with any of
+ * the keys:
+ *
+ *     overflow: drop_oldest, drop_newest or block (default drop_oldest)
+ *     timeout_ms: for 'block', the longest to wait; 0 (the default)
+ *                 waits for as long as it takes
+ *     decimate: keep 1 item in this many (default 1, all of them)
+ *
+ * @param n: the description. If not a map, the default policy is
+ * returned.
+ *
+ * @return The policy. Throws a MatrixException if the description is
+ * not understood.
+ *
+ */
+
+    sink_policy sink_policy::from_yaml(YAML::Node n)
+    {
+        sink_policy p;
+
+        if (!n.IsMap())
+        {
+            return p;
+        }
+
+        try
+        {
+            if (n["overflow"])
+            {
+                string o = n["overflow"].as<string>();
+
+                if (o == "drop_oldest")
+                {
+                    p.overflow = DROP_OLDEST;
+                }
+                else if (o == "drop_newest")
+                {
+                    p.overflow = DROP_NEWEST;
+                }
+                else if (o == "block")
+                {
+                    p.overflow = BLOCK;
+                }
+                else
+                {
+                    throw MatrixException("sink_policy::from_yaml()",
+                                          "unknown overflow policy '" + o + "'");
+                }
+            }
+
+            if (n["timeout_ms"])
+            {
+                p.timeout = n["timeout_ms"].as<Time::Time_t>() * 1000000L;
+            }
+
+            if (n["decimate"])
+            {
+                p.decimate = max(n["decimate"].as<unsigned int>(), 1U);
+            }
+        }
+        catch (YAML::Exception &e)
+        {
+            throw MatrixException("sink_policy::from_yaml()", e.what());
+        }
+
+        return p;
+    }
+
 /**
   * Reconnects a sink to its source. Given a KeymasterHeartbeatCB, it
   * can verify that the Keymaster is still alive. If so, it checks to
@@ -0,0 +1,300 @@
+/*******************************************************************
+ *  DataStats.cc - Counters for DataSources and DataSinks.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/DataStats.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Mutex.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/Thread.h"
+#include "matrix/TCondition.h"
+
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <map>
+#include <vector>
+
+using namespace std;
+
+namespace matrix
+{
+/**
+ * \class DataStatsPublisher
+ *
+ * The thread that puts every published DataStats to the Keymaster,
+ * as one transaction per Keymaster per interval. Only the publisher
+ * waits on the Keymasters, so a slow or absent one holds nothing else
+ * up. There is one for the process, started by the first
+ * `DataStats::publish_to()`.
+ *
+ */
+
+    class DataStatsPublisher
+    {
+    public:
+
+        static DataStatsPublisher &instance();
+
+        DataStatsPublisher();
+        ~DataStatsPublisher();
+
+        void add(DataStats *s);
+        void remove(DataStats *s);
+
+        std::atomic<int> interval;
+
+    private:
+
+        void _task();
+
+        Mutex _lock;
+        set<DataStats *> _stats;
+        TCondition<bool> _quit;
+        Thread<DataStatsPublisher> _thread;
+        bool _running;
+    };
+
+    static atomic<bool> publisher_created(false);
+
+    DataStatsPublisher &DataStatsPublisher::instance()
+    {
+        static DataStatsPublisher publisher;
+        return publisher;
+    }
+
+    DataStatsPublisher::DataStatsPublisher()
+        : interval(5),
+          _quit(false),
+          _thread(this, &DataStatsPublisher::_task),
+          _running(false)
+    {
+        publisher_created = true;
+    }
+
+    DataStatsPublisher::~DataStatsPublisher()
+    {
+        // DataStats outliving this no longer come here to unpublish.
+        publisher_created = false;
+
+        if (_running)
+        {
+            _quit.signal(true);
+            _thread.join();
+        }
+    }
+
+    void DataStatsPublisher::add(DataStats *s)
+    {
+        ThreadLock<Mutex> l(_lock);
+
+        l.lock();
+        _stats.insert(s);
+
+        if (!_running)
+        {
+            _running = true;
+            _thread.start("DataStats publisher");
+        }
+    }
+
+    void DataStatsPublisher::remove(DataStats *s)
+    {
+        ThreadLock<Mutex> l(_lock);
+
+        l.lock();
+        _stats.erase(s);
+    }
+
+    void DataStatsPublisher::_task()
+    {
+        int countdown = interval;
+
+        // wakes every second, so that a change of interval is noticed.
+        while (!_quit.wait(true, 1000000))
+        {
+            if (interval <= 0 || --countdown > 0)
+            {
+                continue;
+            }
+
+            countdown = interval;
+
+            // the counters are taken, grouped by Keymaster, under the lock, which
+            // keeps the DataStats from going away meanwhile. They are
+            // put to the Keymasters outside of it.
+            map<string, vector<KeymasterStore::change> > changes;
+            ThreadLock<Mutex> l(_lock);
+            l.lock();
+
+            for (auto i = _stats.begin(); i != _stats.end(); ++i)
+            {
+                KeymasterStore::change c = {(*i)->_key, (*i)->to_yaml(), true, false};
+                changes[(*i)->_km_urn].push_back(c);
+            }
+
+            l.unlock();
+
+            for (auto i = changes.begin(); i != changes.end(); ++i)
+            {
+                try
+                {
+                    Keymaster::shared_client(i->first)->transaction(i->second);
+                }
+                catch (exception &e)
+                {
+                    cerr << Time::isoDateTime(Time::getUTC())
+                         << " -- DataStats: " << i->first << ": " << e.what() << endl;
+                }
+            }
+        }
+    }
+
+    DataStats::DataStats()
+    {
+        reset();
+    }
+
+    DataStats::~DataStats()
+    {
+        unpublish();
+    }
+
+    uint64_t DataStats::messages() const
+    {
+        return _messages.load(memory_order_relaxed);
+    }
+
+    uint64_t DataStats::bytes() const
+    {
+        return _bytes.load(memory_order_relaxed);
+    }
+
+    uint64_t DataStats::drops() const
+    {
+        return _dropped.load(memory_order_relaxed);
+    }
+
+    uint64_t DataStats::losses() const
+    {
+        return _lost.load(memory_order_relaxed);
+    }
+
+    uint64_t DataStats::max_depth() const
+    {
+        return _max_depth.load(memory_order_relaxed);
+    }
+
+/**
+ * Zeroes the counters. Messages counted while this is going on may or
+ * may not be kept. A DataSink's receive queue keeps its own deepest
+ * depth, which comes back with the next message.
+ *
+ */
+
+    void DataStats::reset()
+    {
+        _messages.store(0, memory_order_relaxed);
+        _bytes.store(0, memory_order_relaxed);
+        _dropped.store(0, memory_order_relaxed);
+        _lost.store(0, memory_order_relaxed);
+        _max_depth.store(0, memory_order_relaxed);
+        queue_latency.reset();
+        handling.reset();
+    }
+
+/**
+ * The counters as a YAML map, as published to the Keymaster. The
+ * histograms are summarized as by `LatencyHistogram::to_yaml()`; the
+ * receive queue's is left out if nothing was recorded, as for a
+ * DataSource, which has none.
+ *
+ */
+
+    YAML::Node DataStats::to_yaml() const
+    {
+        YAML::Node n;
+
+        n["messages"] = messages();
+        n["bytes"] = bytes();
+        n["dropped"] = drops();
+        n["lost"] = losses();
+        n["max_depth"] = max_depth();
+        n["handling"] = handling.to_yaml();
+
+        if (queue_latency.count())
+        {
+            n["queue_latency"] = queue_latency.to_yaml();
+        }
+
+        return n;
+    }
+
+/**
+ * Has the counters put to the Keymaster periodically.
+ *
+ * @param km_urn: the Keymaster's URN.
+ *
+ * @param key: the key to put them under, which is created if need
+ * be.
+ *
+ */
+
+    void DataStats::publish_to(string km_urn, string key)
+    {
+        DataStatsPublisher &p = DataStatsPublisher::instance();
+
+        // taken out of the publisher's set while the key changes.
+        p.remove(this);
+        _km_urn = km_urn;
+        _key = key;
+        p.add(this);
+    }
+
+    void DataStats::unpublish()
+    {
+        if (publisher_created)
+        {
+            DataStatsPublisher::instance().remove(this);
+        }
+    }
+
+/**
+ * Sets how often, in seconds, the DataStats given a key are put to
+ * the Keymaster. 0 stops it.
+ *
+ */
+
+    void DataStats::interval(int seconds)
+    {
+        DataStatsPublisher::instance().interval = seconds;
+    }
+
+    int DataStats::interval()
+    {
+        return DataStatsPublisher::instance().interval;
+    }
+}
@@ -80,7 +80,7 @@ namespace matrix
     {
         bool run(true);
         Keymaster km(keymaster_url);
-        GenericBuffer data;
+        GenericBuffer *data;
         YAML::Node dd;
 
         try
@@ -97,13 +97,16 @@ namespace matrix
 
         while (run)
         {
-            // try to get with a time-out of 5 mS
-            if (_sink.timed_get(data, 5000000))
+            // try to get with a time-out of 5 mS. The buffer is used
+            // in place, and handed back to the sink when done.
+            if ((data = _sink.timed_peek(5000000)))
             {
                 if (_handler)
                 {
-                    _handler->exec(dd, data);
+                    _handler->exec(dd, *data);
                 }
+
+                _sink.release_slot();
             }
 
             // continue until _run is false and no heaps were read.
@@ -35,6 +35,9 @@
 #include "matrix/netUtils.h"
 #include "matrix/matrix_util.h"
 #include "matrix/yaml_util.h"
+#include "matrix/KeymasterStore.h"
+#include "matrix/KeymasterJournal.h"
+#include "matrix/LatencyHistogram.h"
 #include "matrix/Time.h"
 #include "matrix/ResourceLock.h"
 
@@ -44,16 +47,19 @@
 #include <map>
 #include <vector>
 #include <list>
+#include <set>
 #include <iostream>
 #include <sstream>
 #include <exception>
 #include <algorithm>
 #include <memory>
+#include <atomic>
 
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/eventfd.h>
 
 #include <boost/circular_buffer.hpp>
 #include <boost/algorithm/string.hpp>
@@ -66,7 +72,17 @@ using namespace matrix;
 #define SUBSCRIBE   1
 #define UNSUBSCRIBE 2
 #define QUIT        3
+#define WATCH       4
 #define KM_TIMEOUT  5000
+// The most publications read by the subscriber task before it calls
+// the rate-limited callbacks (see `Keymaster::subscribe()`)
+#define MAX_CONFLATED 1000
+
+// The topic of delta publications (see `KmImpl::publish()`)
+#define DELTA_TOPIC "@delta"
+// The prefix of the topics a client has published to learn that its
+// subscriptions are in effect (see `Keymaster::_cache_watch()`)
+#define SYNC_TOPIC "@sync."
 
 struct substring_p
 {
@@ -105,6 +121,80 @@ struct same_transport_p
     string _transport;
 };
 
+/**
+ * KmStats holds the KeymasterServer's load statistics: the number and
+ * service times of the requests, by command, and the state of the
+ * publication queue (see `KmImpl::stats()`). All but the request
+ * rates are updated without locks.
+ *
+ */
+
+struct KmStats
+{
+    enum command
+    {
+        GET,
+        PUT,
+        DEL,
+        MGET,
+        MPUT,
+        SNAP,
+        STATS,
+        OTHER,
+        N_COMMANDS
+    };
+
+    KmStats();
+
+    static command index(const string &cmd);
+    static const char *names[N_COMMANDS];
+
+    LatencyHistogram latency[N_COMMANDS];
+    LatencyHistogram publish_latency;
+    std::atomic<uint64_t> publications;
+    std::atomic<uint64_t> overflows;
+    std::atomic<uint64_t> max_queue_depth;
+    std::atomic<int> subscribed_keys;
+    Time::Time_t start;
+
+    // the request rates, over the time since they were last computed
+    Mutex rate_lock;
+    Time::Time_t last_time;
+    uint64_t last_count[N_COMMANDS];
+};
+
+const char *KmStats::names[KmStats::N_COMMANDS] =
+{
+    "GET", "PUT", "DEL", "MGET", "MPUT", "SNAP", "STATS", "other"
+};
+
+KmStats::KmStats()
+    : publications(0),
+      overflows(0),
+      max_queue_depth(0),
+      subscribed_keys(0),
+      start(Time::getUTC()),
+      last_time(start)
+{
+    for (int i = 0; i < N_COMMANDS; ++i)
+    {
+        last_count[i] = 0;
+    }
+}
+
+KmStats::command KmStats::index(const string &cmd)
+{
+    for (int i = 0; i < OTHER; ++i)
+    {
+        if (cmd == names[i])
+        {
+            return (command)i;
+        }
+    }
+
+    return OTHER;
+}
+
 /**
  * KmImpl is the private implementation of the KeymasterServer class.
  *
@@ -115,21 +205,37 @@ struct KeymasterServer::KmImpl
     KmImpl(YAML::Node config);
     ~KmImpl();
 
+    // A delta publication has no key or value, its frames are all in
+    // 'delta' instead.
     struct data_package
     {
         std::string key;
         std::string val;
+        std::vector<std::string> delta;
+        Time::Time_t queued;
     };
 
     void server_task();
     void state_manager_task();
+    void worker_task();
+    void handle_request(zmq::socket_t &sock);
+    void serve_request(zmq::socket_t &sock, const std::string &key);
+    YAML::Node stats();
+    void note_queue_depth();
+    void read_subscriptions(zmq::socket_t &data_publisher);
     void heartbeat_task();
+    void internal_put(const std::string &keychain, YAML::Node n);
     bool load_config_file(string filename);
-    bool publish(std::string key, bool block = false);
+    bool publish(std::string key, bool block = false, bool deleted = false);
+    bool publish(const std::vector<KeymasterStore::change> &changes, bool block = false);
+    void publish_overflow(zmq::socket_t &data_publisher);
     void run();
     void terminate();
 
-    void setup_urls();
+    void setup_urls(YAML::Node config);
+    void setup_journal(YAML::Node config);
+    void setup_zmq_context(YAML::Node config);
+    void journal(const std::vector<KeymasterStore::change> &changes);
     bool using_tcp();
     void bind_server(zmq::socket_t &server_sock, vector<string> &urls);
 
@@ -143,12 +249,27 @@ struct KeymasterServer::KmImpl
     int _pub_port_used;
     bool _state_manager_done;
     tsemfifo<data_package> _data_queue;
+    // keys that did not fit in '_data_queue' (see `publish()`)
+    std::set<std::string> _overflow_keys;
+    Mutex _overflow_lock;
     Mutex _cache_lock;
     std::string _state_task_url;
     std::string _hostname;
     bool _state_task_quit;
     bool _running;
-    int _clone_interval;
+    bool _delta_publishing;
+    // identifies this server instance in delta publications and
+    // snapshots, so that clients can tell a restarted server, whose
+    // sequence numbers start over, from missed changes.
+    std::string _epoch;
+    int _stats_interval;
+    KmStats _stats;
+
+    // The state manager's worker pool
+    std::string _worker_url;
+    int _worker_count;
+    std::atomic<bool> _workers_run;
+    std::vector<std::shared_ptr<Thread<KmImpl> > > _worker_threads;
 
     // The service URLs. Each interface (STATE or PUBLISH) may have
     // multiple URLs (tcp, inproc, ipc) for possible future
@@ -156,7 +277,13 @@ struct KeymasterServer::KmImpl
     std::vector<std::string> _state_service_urls;
     std::vector<std::string> _publish_service_urls;
 
-    list<YAML::Node> _root_node;    //<? THE keymaster node
+    // THE keymaster data. The store is thread-safe; '_write_lock'
+    // is held over a change and its publication so that subscribers
+    // see changes in the order they were made.
+    Mutex _write_lock;
+    KeymasterStore _store;
+    // The store's copy on disk, if configured (see `setup_journal()`)
+    std::unique_ptr<KeymasterJournal> _journal;
 };
 
 /**
@@ -188,10 +315,17 @@ KeymasterServer::KmImpl::KmImpl(YAML::Node config)
     _state_task_url(string("inproc://") + gen_random_string(20)),
     _state_task_quit(true),
     _running(true),
-    _clone_interval(0)
+    _delta_publishing(false),
+    _epoch(gen_random_string(16)),
+    _stats_interval(10),
+    _worker_url(string("inproc://") + gen_random_string(20)),
+    _worker_count(4),
+    _workers_run(false),
+    _store(config)
 {
-    _root_node.push_front(YAML::Clone(config));
-    setup_urls();
+    setup_zmq_context(config);
+    setup_urls(config);
+    setup_journal(config);
 
     if (using_tcp() && !getCanonicalHostname(_hostname))
     {
@@ -257,9 +391,8 @@ void KeymasterServer::KmImpl::run()
     }
 
     // Make sure this is run AFTER the _server_thread (publisher)
-    // because it will put publishing information in the _root_node. All
-    // access to the _root_node should be via the _state_manager_thread
-    // because the _root_node is not thread-safe.
+    // because it will put publishing information in the store, and
+    // publish it.
     if (!_state_manager_thread.running())
     {
         if (_state_manager_thread.start() != 0 || !_state_manager_thread_ready.wait(true, 1000000))
@@ -277,6 +410,8 @@ void KeymasterServer::KmImpl::run()
     }
     // Now that we're running, publish everything, so that any clients
     // already subscribed may be updated.
+    ThreadLock<Mutex> l(_write_lock);
+    l.lock();
     publish("Root", true);
 }
 
@@ -312,18 +447,36 @@ void KeymasterServer::KmImpl::terminate()
 
 /**
  * Sets up and validates all the urls. The URLs are retrieved from the
- * root node.
+ * configuration.
+ *
+ * @param config: The Keymaster's configuration.
  *
  * @return bool, false if there is a problem, true otherwise.
  *
  */
 
-void KeymasterServer::KmImpl::setup_urls()
+void KeymasterServer::KmImpl::setup_urls(YAML::Node config)
 {
     vector<string>::const_iterator cvi;
-    vector<string> urls = _root_node.front()["Keymaster"]["URLS"]["Initial"].as<vector<string> >();
-    // TODO: make key optional
-    _clone_interval = _root_node.front()["Keymaster"]["clone_interval"].as<int>();
+    vector<string> urls = config["Keymaster"]["URLS"]["Initial"].as<vector<string> >();
+    YAML::Node workers = config["Keymaster"]["workers"];
+    YAML::Node delta = config["Keymaster"]["delta_publishing"];
+    YAML::Node stats_interval = config["Keymaster"]["stats_interval"];
+
+    if (workers)
+    {
+        _worker_count = max(workers.as<int>(), 1);
+    }
+
+    if (stats_interval)
+    {
+        _stats_interval = stats_interval.as<int>();
+    }
+
+    if (delta)
+    {
+        _delta_publishing = delta.as<bool>();
+    }
 
     for (cvi = urls.begin(); cvi != urls.end(); ++cvi)
     {
@@ -358,8 +511,8 @@ void KeymasterServer::KmImpl::setup_urls()
         }
     }
 
-    // If an inproc URL is not specified, generate one just for the
-    // state task, so that the heartbeat_task can use it.
+    // If an inproc URL is not specified, generate one for the state
+    // task, so that clients in the process can always use one.
     if (!any_of(_state_service_urls.begin(), _state_service_urls.end(),
                 [](string i){return i.find("inproc") != string::npos;}))
     {
@@ -367,6 +520,134 @@ void KeymasterServer::KmImpl::setup_urls()
     }
 }
 
+/**
+ * Sets up the process's ZMQ context (see ZMQContext::configure()) from
+ * the configuration's optional 'Keymaster.zmq_context' section:
+ *
+ *     Keymaster:
+ *       zmq_context:
+ *         io_threads: 4            # ZMQ I/O threads, default 1
+ *         cpu_affinity: [2, 3]     # CPUs for the I/O threads
+ *
+ * This only takes effect if the KeymasterServer is created before
+ * anything else in the process uses ZMQ.
+ *
+ * @param config: The Keymaster's configuration.
+ *
+ */
+
+void KeymasterServer::KmImpl::setup_zmq_context(YAML::Node config)
+{
+    YAML::Node zc = config["Keymaster"]["zmq_context"];
+
+    if (!zc)
+    {
+        return;
+    }
+
+    int io_threads = zc["io_threads"] ? zc["io_threads"].as<int>() : 1;
+    vector<int> cpus;
+
+    if (zc["cpu_affinity"])
+    {
+        cpus = zc["cpu_affinity"].as<vector<int> >();
+    }
+
+    if (!ZMQContext::configure(io_threads, cpus))
+    {
+        cerr << Time::isoDateTime(Time::getUTC())
+             << " -- KeymasterServer: ZMQ context already in use; "
+             << "'Keymaster.zmq_context' settings ignored." << endl;
+    }
+}
+
+/**
+ * Sets up the optional journal, which keeps the store on disk across
+ * restarts (see KeymasterJournal), from the configuration's
+ * 'Keymaster.journal' section:
+ *
+ *     Keymaster:
+ *       journal:
+ *         path: /var/run/matrix/keymaster  # files: <path>.journal, <path>.snapshot
+ *         sync: periodic                   # always, periodic or never
+ *         sync_interval_ms: 100            # for 'periodic'
+ *         snapshot_interval: 10000         # changes between snapshots
+ *
+ * If a snapshot exists the store is restored from it and the
+ * journal, and the configuration file's keys are not used: remove the
+ * journal files to start afresh from the configuration file. The one
+ * exception is the 'Keymaster' section, the server's own settings,
+ * which are always taken from the file (see `setup_urls()`): the
+ * file's section replaces the restored one, so that what clients read
+ * there (e.g. 'Keymaster.delta_publishing') is what the server does.
+ *
+ * @param config: The Keymaster's configuration.
+ *
+ */
+
+void KeymasterServer::KmImpl::setup_journal(YAML::Node config)
+{
+    YAML::Node jc = config["Keymaster"]["journal"];
+
+    if (!jc || !jc["path"])
+    {
+        return;
+    }
+
+    KeymasterJournal::sync_policy sync = KeymasterJournal::SYNC_PERIODIC;
+    int sync_interval_ms = 100;
+    uint64_t snapshot_interval = 10000;
+
+    if (jc["sync"])
+    {
+        sync = KeymasterJournal::policy(jc["sync"].as<string>());
+    }
+
+    if (jc["sync_interval_ms"])
+    {
+        sync_interval_ms = jc["sync_interval_ms"].as<int>();
+    }
+
+    if (jc["snapshot_interval"])
+    {
+        snapshot_interval = jc["snapshot_interval"].as<uint64_t>();
+    }
+
+    _journal.reset(new KeymasterJournal(jc["path"].as<string>(), sync,
+                                        sync_interval_ms, snapshot_interval));
+
+    if (_journal->restore(_store))
+    {
+        cout << "KeymasterServer: store restored from " << jc["path"].as<string>()
+             << ", version " << _store.version() << endl;
+
+        vector<KeymasterStore::change> c = {{"Keymaster", YAML::Clone(config["Keymaster"]), true, false}};
+        vector<string> results;
+
+        if (_store.apply(c, results))
+        {
+            journal(c);
+        }
+    }
+}
+
+/**
+ * Records changes made to the store in the journal, if there is
+ * one. Must be called with '_write_lock' held, right after the
+ * changes are made.
+ *
+ * @param changes: the changes.
+ *
+ */
+
+void KeymasterServer::KmImpl::journal(const vector<KeymasterStore::change> &changes)
+{
+    if (_journal)
+    {
+        _journal->append(changes, _store);
+    }
+}
+
 /**
  * Checks to see if TCP transport is required, by examining the state
  * service URLs (publisher service URLs will mirror these)
@@ -449,7 +730,9 @@ void KeymasterServer::KmImpl::server_task()
 
 {
     data_package dp;
-    zmq::socket_t data_publisher(ZMQContext::Instance()->get_context(), ZMQ_PUB);
+    // An XPUB, so that the subscriptions can be counted (see
+    // `read_subscriptions()`); it publishes as a PUB does.
+    zmq::socket_t data_publisher(ZMQContext::Instance()->get_context(), ZMQ_XPUB);
     string tcp_url;
 
     try
@@ -473,12 +756,44 @@ void KeymasterServer::KmImpl::server_task()
     // allow more secure recovery.
     Time::thread_delay(2000000000);
 
-    while (_data_queue.get(dp))
+    while (_running)
     {
         try
         {
-            z_send(data_publisher, dp.key, ZMQ_SNDMORE);
-            z_send(data_publisher, dp.val, 0);
+            // A timed wait, so that keys that overflowed the queue
+            // (see `publish()`) just as it emptied are not left until
+            // the next publication.
+            if (!_data_queue.timed_get(dp, 100000000))
+            {
+                publish_overflow(data_publisher);
+                read_subscriptions(data_publisher);
+                continue;
+            }
+
+            if (dp.delta.empty())
+            {
+                z_send(data_publisher, dp.key, ZMQ_SNDMORE);
+                z_send(data_publisher, dp.val, 0);
+            }
+            else
+            {
+                z_send(data_publisher, string(DELTA_TOPIC), ZMQ_SNDMORE);
+
+                for (size_t i = 0; i < dp.delta.size(); ++i)
+                {
+                    z_send(data_publisher, dp.delta[i], i + 1 < dp.delta.size() ? ZMQ_SNDMORE : 0);
+                }
+            }
+
+            _stats.publications.fetch_add(1, memory_order_relaxed);
+            _stats.publish_latency.record(Time::getUTC() - dp.queued);
+
+            if (_data_queue.size() == 0)
+            {
+                publish_overflow(data_publisher);
+            }
+
+            read_subscriptions(data_publisher);
         }
         catch (zmq::error_t &e)
         {
@@ -495,10 +810,37 @@ void KeymasterServer::KmImpl::server_task()
 }
 
 /**
- * This 0MQ server task implements a REPLY socket (of a REQ/REP pair),
- * whose function is to receive requests for cached data.  This is
- * useful for late joiners, especially for keys that don't change
- * frequently.
+ * Moves one complete (possibly multipart) message from one socket to
+ * another. Used to shuttle requests and replies between the
+ * state manager's ROUTER and DEALER sockets.
+ *
+ */
+
+static void forward_message(zmq::socket_t &from, zmq::socket_t &to)
+{
+    zmq::message_t msg;
+    int more;
+    size_t more_size = sizeof more;
+
+    do
+    {
+        from.recv(&msg);
+        from.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        to.send(msg, more ? ZMQ_SNDMORE : 0);
+    }
+    while (more);
+}
+
+/**
+ * This 0MQ server task receives requests for cached data, and requests
+ * to change it. This is useful for late joiners, especially for keys
+ * that don't change frequently.
+ *
+ * Clients connect REQ sockets to a ROUTER socket here. The requests
+ * are passed through a DEALER socket to a pool of worker threads (see
+ * `worker_task()`), whose number is set by the optional
+ * 'Keymaster.workers' configuration key, and the replies come back
+ * the same way.
  *
  */
 
@@ -506,14 +848,15 @@ void KeymasterServer::KmImpl::state_manager_task()
 
 {
     zmq::context_t &ctx = ZMQContext::Instance()->get_context();
-    zmq::socket_t state_sock(ctx, ZMQ_REP);
+    zmq::socket_t state_sock(ctx, ZMQ_ROUTER);
+    zmq::socket_t workers(ctx, ZMQ_DEALER);
     zmq::socket_t pipe(ctx, ZMQ_PAIR);  // mostly to tell this task to go away
-    unsigned int put_counter(0), clone_interval(1000);
 
     try
     {
         // control pipe
         pipe.bind(_state_task_url.c_str());
+        workers.bind(_worker_url.c_str());
     }
     catch (zmq::error_t &e)
     {
@@ -528,7 +871,16 @@ void KeymasterServer::KmImpl::state_manager_task()
     {
         // bind to all state server URLs
         bind_server(state_sock, _state_service_urls);
-        put_yaml_val(_root_node.front(), "KeymasterServer.URLS", _state_service_urls, true);
+        string r;
+        ThreadLock<Mutex> l(_write_lock);
+        l.lock();
+        YAML::Node urls(_state_service_urls);
+
+        if (_store.put("KeymasterServer.URLS", urls, true, r))
+        {
+            journal({{"KeymasterServer.URLS", urls, true, false}});
+        }
+
         publish("KeymasterServer.URLS");
     }
     catch (zmq::error_t &e)
@@ -544,10 +896,24 @@ void KeymasterServer::KmImpl::state_manager_task()
     }
 
 
-    yaml_result rs = put_yaml_val(_root_node.front(),
-                                  "Keymaster.URLS.AsConfigured.State", _state_service_urls, true);
-    yaml_result rp = put_yaml_val(_root_node.front(),
-                                  "Keymaster.URLS.AsConfigured.Pub", _publish_service_urls, true);
+    string r;
+    ThreadLock<Mutex> l(_write_lock);
+    l.lock();
+    vector<KeymasterStore::change> as_configured =
+        {
+            {"Keymaster.URLS.AsConfigured.State", YAML::Node(_state_service_urls), true, false},
+            {"Keymaster.URLS.AsConfigured.Pub", YAML::Node(_publish_service_urls), true, false}
+        };
+    vector<string> rv;
+    bool rs, rp;
+
+    rs = rp = _store.apply(as_configured, rv);
+
+    if (rs)
+    {
+        journal(as_configured);
+    }
+
     ostringstream state;
     ostringstream pub;
     mxutils::output_vector(_state_service_urls, state);
@@ -556,8 +922,9 @@ void KeymasterServer::KmImpl::state_manager_task()
     cout << "Keymaster.URLS.AsConfigured.Pub:" << pub.str() << endl;
     publish("Keymaster.URLS.AsConfigured.State", true);
     publish("Keymaster.URLS.AsConfigured.Pub", true);
+    l.unlock();
 
-    if (! (rs.result && rp.result))
+    if (! (rs && rp))
     {
         cerr << Time::isoDateTime(Time::getUTC())
              << " -- Error storing configured URLs into the root node." << endl
@@ -565,29 +932,43 @@ void KeymasterServer::KmImpl::state_manager_task()
         return;
     }
 
+    _workers_run = true;
+
+    for (int i = 0; i < _worker_count; ++i)
+    {
+        shared_ptr<Thread<KmImpl> > t(new Thread<KmImpl>(this, &KeymasterServer::KmImpl::worker_task));
+
+        if (t->start() != 0)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- State manager thread: unable to start worker " << i << endl;
+            break;
+        }
+
+        _worker_threads.push_back(t);
+    }
+
     zmq::pollitem_t items [] =
         {
 #if ZMQ_VERSION_MAJOR > 3
             { (void *)pipe, 0, ZMQ_POLLIN, 0 },
-            { (void *)state_sock, 0, ZMQ_POLLIN, 0 }
+            { (void *)state_sock, 0, ZMQ_POLLIN, 0 },
+            { (void *)workers, 0, ZMQ_POLLIN, 0 }
 #else
             { pipe, 0, ZMQ_POLLIN, 0 },
-            { state_sock, 0, ZMQ_POLLIN, 0 }
+            { state_sock, 0, ZMQ_POLLIN, 0 },
+            { workers, 0, ZMQ_POLLIN, 0 }
 #endif
         };
 
     _state_manager_thread_ready.signal(true); // allow 'run()' to move
                                               // on.
 
-    if (_clone_interval != 0)
-    {
-        clone_interval = _clone_interval;
-    }
     while (1)
     {
         try
         {
-            zmq::poll(&items [0], 2, -1);
+            zmq::poll(&items [0], 3, -1);
 
             if (items[0].revents & ZMQ_POLLIN)
             {
@@ -600,143 +981,16 @@ void KeymasterServer::KmImpl::state_manager_task()
                 }
             }
 
+            // requests from clients go to the workers...
             if (items[1].revents & ZMQ_POLLIN)
             {
-                string key;
-                vector<string> frame;
-
-                z_recv(state_sock, key);
-
-                // Determine the request.  Currently requests may
-                // be either a "ping" (just to see if the service
-                // is alive); a "LIST" to get information on all
-                // samplers and parameters published.  If none of
-                // the above, the request is assumed to be a key
-                // to a published item.
-
-                if (key.size() == 4 && key == "ping")
-                {
-                    // read any remaining parts
-                    z_recv_multipart(state_sock, frame);
-
-                    // reply with something
-                    z_send(state_sock, "I'm not dead yet!", 0);
-                }
-                /////////////////// G E T ///////////////////
-                else if (key.size() == 3 && key == "GET")
-                {
-                    z_recv_multipart(state_sock, frame);
-
-                    if (!frame.empty())
-                    {
-                        string keychain = frame[0];
-                        ostringstream rval;
-
-                        if (keychain == "Root")
-                        {
-                            keychain = "";
-                        }
-
-                        yaml_result r = get_yaml_node(_root_node.front(), keychain);
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
-                }
-                /////////////////// P U T ///////////////////
-                else if (key.size() == 3 && key == "PUT")
-                {
-                    z_recv_multipart(state_sock, frame);
-
-                    if (frame.size() > 1)
-                    {
-                        string keychain = frame[0];
-
-                        if (keychain == "Root")
-                        {
-                            keychain = "";
-                        }
-
-                        string yaml_string = frame[1];
-                        bool create = false;
-
-                        if (frame.size() > 2 && frame[2] == "create")
-                        {
-                            create = true;
-                        }
-
-                        yaml_result r;
-                        ostringstream rval;
-                        YAML::Node n = YAML::Load(yaml_string);
-
-                        r = put_yaml_node(_root_node.front(), keychain, n, create);
-
-                        if (r.result)
-                        {
-                            publish(keychain);
-                        }
-
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
-
-                        // What follows is here to prevent undue
-                        // memory usage. yaml-cpp has an unbounded
-                        // memory use problem (see
-                        // https://github.com/jbeder/yaml-cpp/issues/232
-                        // ). Cloning the node and dropping the
-                        // original one flushes out the memory. We do
-                        // it at every nth put--as specified by
-                        // `clone_interval`--where n is large enough
-                        // not to impact performance but small enough
-                        // to ensure no runaway memory use.
-
-                        if ((++put_counter % clone_interval) == 0)
-                        {
-                            _root_node.push_front(YAML::Clone(_root_node.front()));
-                            _root_node.pop_back();
-                        }
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain and value expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
-                }
-                /////////////////// D E L ///////////////////
-                else if (key.size() == 3 && key == "DEL")
-                {
-                    z_recv_multipart(state_sock, frame);
-
-                    if (!frame.empty())
-                    {
-                        string keychain = frame[0];
-                        yaml_result r = delete_yaml_node(_root_node.front(), keychain);
-                        ostringstream rval;
-                        rval << r;
-                        z_send(state_sock, rval.str(), 0);
+                forward_message(state_sock, workers);
+            }
 
-                        if (r.result)
-                        {
-                            publish(keychain, true);
-                        }
-                    }
-                    else
-                    {
-                        string msg("ERROR: Keychain expected, but not received!");
-                        z_send(state_sock, msg, 0);
-                    }
-                }
-                else
-                {
-                    z_recv_multipart(state_sock, frame);
-                    ostringstream msg;
-                    msg << "Unknown request '" << key;
-                    z_send(state_sock, msg.str(), 0);
-                }
+            // ...and their replies go back.
+            if (items[2].revents & ZMQ_POLLIN)
+            {
+                forward_message(workers, state_sock);
             }
         }
         catch (zmq::error_t &e)
@@ -746,474 +1000,1886 @@ void KeymasterServer::KmImpl::state_manager_task()
         }
     }
 
+    _workers_run = false;
+
+    for (auto &t : _worker_threads)
+    {
+        t->stop_without_cancel();
+    }
+
+    _worker_threads.clear();
+
     int zero = 0;
     state_sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
     state_sock.close();
+    workers.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    workers.close();
 }
 
 /**
- * KeymasterServer::KmImpl::heartbeat_task() will increment an uptime
- * counter that will also serve as the Keymaster's heartbeat for any
- * client that subscribes to it. This will give clients the means to
- * detect if the Keymaster server goes away.
+ * A state manager worker. Any number of these may run at once, each
+ * taking requests from the state manager's DEALER socket via its own
+ * REP socket. GETs read the store without locking and so run
+ * concurrently; PUTs and DELs are serialized by '_write_lock'.
  *
  */
 
-void KeymasterServer::KmImpl::heartbeat_task()
+void KeymasterServer::KmImpl::worker_task()
 {
     zmq::context_t &ctx = ZMQContext::Instance()->get_context();
-    zmq::socket_t sock(ctx, ZMQ_REQ);
-    string url, response;
-    string cmd("PUT"), key("Keymaster.heartbeat");
-    Time::Time_t one_sec(1000000000L);
-    Time::Time_t wake_time = Time::getUTC() + one_sec;
+    zmq::socket_t sock(ctx, ZMQ_REP);
+
+    try
+    {
+        sock.connect(_worker_url.c_str());
+    }
+    catch (zmq::error_t &e)
+    {
+        cerr << Time::isoDateTime(Time::getUTC())
+             << " -- Error in state manager worker: " << e.what() << endl;
+        return;
+    }
 
-    auto it = find_if(_state_service_urls.begin(), _state_service_urls.end(),
-                      [](string i){return i.find("inproc") != string::npos;});
+    zmq::pollitem_t items [] =
+        {
+#if ZMQ_VERSION_MAJOR > 3
+            { (void *)sock, 0, ZMQ_POLLIN, 0 }
+#else
+            { sock, 0, ZMQ_POLLIN, 0 }
+#endif
+        };
 
-    if (it != _state_service_urls.end())
+    // time out every 100 mS to check '_workers_run'
+    while (_workers_run)
     {
-        url = *it;
-        sock.connect(url.c_str());
+        try
+        {
+            zmq::poll(&items [0], 1, 100);
 
-        while (_running)
+            if (items[0].revents & ZMQ_POLLIN)
+            {
+                handle_request(sock);
+            }
+        }
+        catch (zmq::error_t &e)
         {
-            Time::thread_sleep_until(wake_time);
-            Time::Time_t t = wake_time;
-            wake_time += one_sec;
-            string val = to_string(t);
-            string flag("create");
-            z_send(sock, cmd, ZMQ_SNDMORE, KM_TIMEOUT);
-            z_send(sock, key, ZMQ_SNDMORE, KM_TIMEOUT);
-            z_send(sock, val, ZMQ_SNDMORE, KM_TIMEOUT);
-            z_send(sock, flag, 0, KM_TIMEOUT);
-            z_recv(sock, response, KM_TIMEOUT);
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- State manager worker: " << e.what() << endl;
         }
     }
+
+    int zero = 0;
+    sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    sock.close();
 }
 
 /**
- * Publish data. Whenever a node is modified, we need to of
- * course publish that node. But we also need to publish
- * upstream nodes, because someone may have subscribed to them,
- * and a change to this key means a change to all upstream
- * keys. So if the node is "foo.bar.baz", we publish "foo",
- * "foo.bar", and "foo.bar.baz"
- *
- * @param key: the data key
+ * Services one request on a worker's REP socket, and counts it, with
+ * the time it took, in the statistics.
  *
- * @return true if the data was succesfuly placed in the publication
- * queue, false otherwise.
+ * @param state_sock: The worker's socket.
  *
  */
 
-bool KeymasterServer::KmImpl::publish(std::string key, bool block)
+void KeymasterServer::KmImpl::handle_request(zmq::socket_t &state_sock)
 {
-    bool rval = true;
+    string key;
 
-    // Publish "Root" if there is no key
-    try
-    {
-        data_package dp = {key, ""};
-        YAML::Node node = _root_node.front();
+    z_recv(state_sock, key);
+    Time::Time_t start = Time::getUTC();
+    serve_request(state_sock, key);
+    _stats.latency[KmStats::index(key)].record(Time::getUTC() - start);
+}
+
+/**
+ * Serves a request.  Currently requests may be either a "ping" (just
+ * to see if the service is alive); a "GET", "PUT" or "DEL"; "MGET" or
+ * "MPUT"; "SNAP"; "STATS"; or "SYNC".
+ *
+ * @param state_sock: The worker's socket.
+ *
+ * @param key: The request's command.
+ *
+ */
+
+void KeymasterServer::KmImpl::serve_request(zmq::socket_t &state_sock, const string &key)
+{
+    vector<string> frame;
+
+    if (key.size() == 4 && key == "ping")
+    {
+        // read any remaining parts
+        z_recv_multipart(state_sock, frame);
+
+        // reply with something
+        z_send(state_sock, "I'm not dead yet!", 0);
+    }
+    /////////////////// G E T ///////////////////
+    else if (key.size() == 3 && key == "GET")
+    {
+        z_recv_multipart(state_sock, frame);
 
-        if (dp.key.empty())
+        if (!frame.empty())
         {
-            ostringstream yr;
-            yr << node;
-            dp.key = "Root";
-            dp.val = yr.str();
+            string keychain = frame[0];
+            string rval;
+
+            if (keychain == "Root")
+            {
+                keychain = "";
+            }
+
+            _store.get(keychain, rval);
+            z_send(state_sock, rval, 0);
         }
         else
         {
-            vector<string> keys;
-            boost::split(keys, dp.key, boost::is_any_of("."));
+            string msg("ERROR: Keychain expected, but not received!");
+            z_send(state_sock, msg, 0);
+        }
+    }
+    /////////////////// P U T ///////////////////
+    else if (key.size() == 3 && key == "PUT")
+    {
+        z_recv_multipart(state_sock, frame);
+
+        if (frame.size() > 1)
+        {
+            string keychain = frame[0];
 
-            // Publish with keys
-            for (size_t i = 1; i < keys.size() + 1; ++i)
+            if (keychain == "Root")
             {
-                string key = boost::algorithm::join(vector<string>(keys.begin(), keys.begin() + i), ".");
-                yaml_result r = get_yaml_node(node, key);
+                keychain = "";
+            }
 
-                if (r.result == true)
-                {
-                    ostringstream yr;
-                    // we just need the node that goes with the key.
-                    yr << r.node;
-                    dp.key = key;
-                    dp.val = yr.str();
+            string yaml_string = frame[1];
+            bool create = false;
 
-                    if (block)
-                    {
-                        _data_queue.put(dp);
-                    }
-                    else
+            if (frame.size() > 2 && frame[2] == "create")
+            {
+                create = true;
+            }
+
+            string rval;
+            YAML::Node n = YAML::Load(yaml_string);
+            ThreadLock<Mutex> l(_write_lock);
+
+            l.lock();
+
+            if (_store.put(keychain, n, create, rval))
+            {
+                journal({{keychain, n, create, false}});
+                publish(keychain);
+            }
+
+            l.unlock();
+            z_send(state_sock, rval, 0);
+        }
+        else
+        {
+            string msg("ERROR: Keychain and value expected, but not received!");
+            z_send(state_sock, msg, 0);
+        }
+    }
+    /////////////////// D E L ///////////////////
+    else if (key.size() == 3 && key == "DEL")
+    {
+        z_recv_multipart(state_sock, frame);
+
+        if (!frame.empty())
+        {
+            string keychain = frame[0];
+            string rval;
+            ThreadLock<Mutex> l(_write_lock);
+
+            l.lock();
+
+            if (_store.del(keychain, rval))
+            {
+                journal({{keychain, YAML::Node(), false, true}});
+                publish(keychain, true, true);
+            }
+
+            l.unlock();
+            z_send(state_sock, rval, 0);
+        }
+        else
+        {
+            string msg("ERROR: Keychain expected, but not received!");
+            z_send(state_sock, msg, 0);
+        }
+    }
+    /////////////////// M G E T ///////////////////
+    else if (key.size() == 4 && key == "MGET")
+    {
+        // Any number of keys; a GET reply for each, one per frame.
+        z_recv_multipart(state_sock, frame);
+
+        if (!frame.empty())
+        {
+            for (size_t i = 0; i < frame.size(); ++i)
+            {
+                string rval;
+                string keychain = frame[i] == "Root" ? "" : frame[i];
+
+                _store.get(keychain, rval);
+                z_send(state_sock, rval, i + 1 < frame.size() ? ZMQ_SNDMORE : 0);
+            }
+        }
+        else
+        {
+            string msg("ERROR: Keychains expected, but not received!");
+            z_send(state_sock, msg, 0);
+        }
+    }
+    /////////////////// M P U T ///////////////////
+    else if (key.size() == 4 && key == "MPUT")
+    {
+        // A transaction: any number of (keychain, value, flag)
+        // triples, the flag being "create" or empty for a PUT, or
+        // "delete" for a DEL, whose value is ignored. Either all of
+        // them are applied or none are; a PUT or DEL reply for each,
+        // one per frame.
+        z_recv_multipart(state_sock, frame);
+
+        if (!frame.empty() && frame.size() % 3 == 0)
+        {
+            vector<KeymasterStore::change> changes;
+            vector<string> rvals;
+            string err;
+
+            for (size_t i = 0; i < frame.size(); i += 3)
+            {
+                KeymasterStore::change c;
+                c.keychain = frame[i] == "Root" ? "" : frame[i];
+                c.create = frame[i + 2] == "create";
+                c.del = frame[i + 2] == "delete";
+
+                try
+                {
+                    if (!c.del)
                     {
-                        rval = rval and _data_queue.try_put(dp);
+                        c.val = YAML::Load(frame[i + 1]);
                     }
                 }
+                catch (YAML::Exception &e)
+                {
+                    err = frame[i] + ": " + e.what();
+                }
+
+                changes.push_back(c);
+            }
+
+            if (err.empty())
+            {
+                ThreadLock<Mutex> l(_write_lock);
+
+                l.lock();
+
+                if (_store.apply(changes, rvals))
+                {
+                    journal(changes);
+                    publish(changes);
+                }
+
+                l.unlock();
+            }
+            else
+            {
+                for (auto i = changes.begin(); i != changes.end(); ++i)
+                {
+                    ostringstream r;
+                    r << yaml_result(false, YAML::Node(), i->keychain,
+                                     "Transaction aborted: " + err);
+                    rvals.push_back(r.str());
+                }
+            }
+
+            for (size_t i = 0; i < rvals.size(); ++i)
+            {
+                z_send(state_sock, rvals[i], i + 1 < rvals.size() ? ZMQ_SNDMORE : 0);
             }
         }
+        else
+        {
+            string msg("ERROR: Keychain, value and flag triples expected, but not received!");
+            z_send(state_sock, msg, 0);
+        }
     }
-    catch (YAML::Exception &e)
+    /////////////////// S N A P ///////////////////
+    else if (key.size() == 4 && key == "SNAP")
     {
-        cerr << Time::isoDateTime(Time::getUTC())
-             << " -- YAML exception in publish: " << e.what() << endl;
-        return false;
+        // The whole store, the sequence number of the last change in
+        // it and the server's epoch, for clients that mirror the
+        // store using delta publications.
+        string text;
+        uint64_t seq;
+
+        z_recv_multipart(state_sock, frame);
+        _store.text("", text, &seq);
+        z_send(state_sock, to_string(seq), ZMQ_SNDMORE);
+        z_send(state_sock, _epoch, ZMQ_SNDMORE);
+        z_send(state_sock, text, 0);
     }
+    /////////////////// S T A T S ///////////////////
+    else if (key.size() == 5 && key == "STATS")
+    {
+        // The statistics, as a GET of 'Keymaster.stats' would give
+        // them, but current.
+        ostringstream r;
 
-    return rval;
+        z_recv_multipart(state_sock, frame);
+        r << yaml_result(true, stats(), "Keymaster.stats");
+        z_send(state_sock, r.str(), 0);
+    }
+    /////////////////// S Y N C ///////////////////
+    else if (key.size() == 4 && key == "SYNC")
+    {
+        // Publishes an empty message on the given SYNC_TOPIC topic,
+        // so that the client can tell when its subscriptions have
+        // reached the publisher. Dropped if the publication queue is
+        // full; the client asks again.
+        ostringstream r;
+
+        z_recv_multipart(state_sock, frame);
+
+        if (!frame.empty() && frame[0].compare(0, strlen(SYNC_TOPIC), SYNC_TOPIC) == 0)
+        {
+            data_package dp;
+
+            dp.key = frame[0];
+            dp.queued = Time::getUTC();
+            r << yaml_result(_data_queue.try_put(dp), YAML::Node(), frame[0]);
+        }
+        else
+        {
+            r << yaml_result(false, YAML::Node(), "", "SYNC: a " SYNC_TOPIC " topic is expected");
+        }
+
+        z_send(state_sock, r.str(), 0);
+    }
+    else
+    {
+        z_recv_multipart(state_sock, frame);
+        ostringstream msg;
+        msg << "Unknown request '" << key;
+        z_send(state_sock, msg.str(), 0);
+    }
 }
 
 /**
- * \class KeymasterServer
- *
- * This is a class that provides a 0MQ publishing facility. KeymasterServer
- * both publishes data as a ZMQ PUB, but also provides a REQ/REP service.
- *
- * The KeymasterServer should be one of the first objects created in the
- * main program entry point:
- *
- *     int main(...)
- *     {
- *         KeymasterServer *kms;
- *         kms = new KeymasterServer("config.yaml");
- *
- *         if (!kms->run())
- *         {
- *             return 1;
- *         }
+ * KeymasterServer::KmImpl::heartbeat_task() will increment an uptime
+ * counter that will also serve as the Keymaster's heartbeat for any
+ * client that subscribes to it. This will give clients the means to
+ * detect if the Keymaster server goes away.
  *
- *         ...
+ */
+
+void KeymasterServer::KmImpl::heartbeat_task()
+{
+    Time::Time_t one_sec(1000000000L);
+    Time::Time_t wake_time = Time::getUTC() + one_sec;
+    int stats_countdown = _stats_interval;
+
+    while (_running)
+    {
+        Time::thread_sleep_until(wake_time);
+        Time::Time_t t = wake_time;
+        wake_time += one_sec;
+        internal_put("Keymaster.heartbeat", YAML::Node(t));
+
+        // and the statistics, every '_stats_interval' heartbeats
+        if (_stats_interval > 0 && --stats_countdown == 0)
+        {
+            stats_countdown = _stats_interval;
+            internal_put("Keymaster.stats", stats());
+        }
+    }
+}
+
+/**
+ * Puts a value the KeymasterServer keeps up itself, as the heartbeat
+ * and the statistics. It is published like any other, but is not a
+ * request, so not counted in the statistics, and is not journaled:
+ * it would be stale on a restart anyway, and at once a second would
+ * soon be most of the journal.
  *
- *         return 0;
- *     }
+ * @param keychain: The key, created if need be.
  *
- * The Keymaster now is ready to serve clients. The initial state of the
- * KeymasterServer is set by the file 'config.yaml'.
+ * @param n: The value.
  *
  */
 
+void KeymasterServer::KmImpl::internal_put(const string &keychain, YAML::Node n)
+{
+    string rval;
+    ThreadLock<Mutex> l(_write_lock);
+
+    l.lock();
+
+    if (_store.put(keychain, n, true, rval))
+    {
+        publish(keychain);
+    }
+}
+
 /**
- * KeymasterServer constructor.  Constructs a KeymasterServer from a
- * valid YAML encoded configuration file.
- *
- * @param configfile: A YAML configuration file which sets the
- * Keymaster's data store to an initial state.
+ * The KeymasterServer's load statistics, as published every
+ * 'Keymaster.stats_interval' seconds (default 10; 0 for never) under
+ * 'Keymaster.stats', and returned by the "STATS" request:
+ *
+ *     uptime: 86400.2             # seconds
+ *     requests:                   # for each command
+ *       GET:
+ *         count: 1234567          # since startup
+ *         rate: 25.3              # per second, since the last report
+ *         mean: 21340.5           # service time, in ns
+ *         max: 1048576
+ *         p50: 18432
+ *         p90: 30720
+ *         p99: 61440
+ *         p999: 245760
+ *       PUT: ...
+ *     publications:
+ *       sent: 2345678             # messages sent
+ *       overflows: 0              # not queued for lack of room
+ *       queue_depth: 0            # now
+ *       max_queue_depth: 17       # since startup
+ *       latency: {count: ..., ...}  # queued to sent, in ns
+ *     subscribed_keys: 42         # distinct keys subscribed to
+ *
+ * The subscriptions are counted as the publisher's socket reports
+ * them, which is once per key however many clients subscribe to it.
  *
  */
 
-KeymasterServer::KeymasterServer(std::string configfile)
+YAML::Node KeymasterServer::KmImpl::stats()
 {
-    YAML::Node config;
+    YAML::Node n;
+    YAML::Node requests;
+    YAML::Node pubs;
+    Time::Time_t now = Time::getUTC();
+    ThreadLock<Mutex> l(_stats.rate_lock);
 
-    try
+    l.lock();
+    double interval = (now - _stats.last_time) / 1e9;
+    _stats.last_time = now;
+
+    for (int i = 0; i < KmStats::N_COMMANDS; ++i)
     {
-        config = YAML::LoadFile(configfile);
+        YAML::Node c = _stats.latency[i].to_yaml();
+        uint64_t count = _stats.latency[i].count();
+
+        c["rate"] = interval > 0 ? (count - _stats.last_count[i]) / interval : 0.0;
+        _stats.last_count[i] = count;
+        requests[KmStats::names[i]] = c;
     }
-    catch (YAML::BadFile &e)
+
+    l.unlock();
+
+    pubs["sent"] = _stats.publications.load();
+    pubs["overflows"] = _stats.overflows.load();
+    pubs["queue_depth"] = _data_queue.size();
+    pubs["max_queue_depth"] = _stats.max_queue_depth.load();
+    pubs["latency"] = _stats.publish_latency.to_yaml();
+
+    n["uptime"] = (now - _stats.start) / 1e9;
+    n["requests"] = requests;
+    n["publications"] = pubs;
+    n["subscribed_keys"] = _stats.subscribed_keys.load();
+    return n;
+}
+
+/**
+ * Keeps the largest depth of the publication queue.
+ *
+ */
+
+void KeymasterServer::KmImpl::note_queue_depth()
+{
+    uint64_t depth = _data_queue.size();
+    uint64_t m = _stats.max_queue_depth.load(memory_order_relaxed);
+
+    while (depth > m && !_stats.max_queue_depth.compare_exchange_weak(m, depth))
     {
-        ostringstream msg;
-        msg << "KeymasterServer: Could not open config file "
-            << configfile;
-        throw(runtime_error(msg.str()));
     }
+}
 
-    _impl.reset(new KeymasterServer::KmImpl(config));
+/**
+ * Reads the (un)subscription messages the publisher's XPUB socket
+ * passes up, to count the keys subscribed to. The socket passes a key's
+ * first subscription and its last unsubscription, including those
+ * made by a subscriber going away, so the count is of distinct keys.
+ *
+ * @param data_publisher: the publisher's socket.
+ *
+ */
+
+void KeymasterServer::KmImpl::read_subscriptions(zmq::socket_t &data_publisher)
+{
+    zmq::message_t msg;
+
+    while (data_publisher.recv(&msg, ZMQ_DONTWAIT))
+    {
+        if (msg.size() > 0)
+        {
+            char c = *static_cast<const char *>(msg.data());
+
+            if (c == 1)
+            {
+                ++_stats.subscribed_keys;
+            }
+            else if (c == 0)
+            {
+                --_stats.subscribed_keys;
+            }
+        }
+    }
 }
 
 /**
- * KeymasterServer constructor.  Constructs a KeymasterServer from a
- * valid YAML::Node.
+ * Publish data. Whenever a node is modified, we need to of
+ * course publish that node. But we also need to publish
+ * upstream nodes, because someone may have subscribed to them,
+ * and a change to this key means a change to all upstream
+ * keys. So if the node is "foo.bar.baz", we publish "foo",
+ * "foo.bar", and "foo.bar.baz"
  *
- * @param n: A YAML::Node containing the initial configuration for the
- * Keymaster server.
+ * If the optional 'Keymaster.delta_publishing' configuration key is
+ * true, only the change itself is published instead: one message on
+ * the DELTA_TOPIC topic, with the store's sequence number, the
+ * server's epoch, "PUT" or "DEL", the key, and the new value.
+ * Keymaster clients keep a mirror of the store up to date with these,
+ * and make the ancestors' values for their subscribers from it. A
+ * client that sees a gap in the sequence numbers, or a new epoch (the
+ * server was restarted, and its sequence numbers started over), gets
+ * a fresh copy of the store with a "SNAP" request.
+ *
+ * Must be called with '_write_lock' held.
+ *
+ * @param key: the data key
+ *
+ * @param block: if true, waits for room in the publication queue.
+ *
+ * @param deleted: true if the key was deleted.
+ *
+ * @return true if the data was succesfuly placed in the publication
+ * queue, false otherwise.
  *
  */
 
-KeymasterServer::KeymasterServer(YAML::Node n)
+bool KeymasterServer::KmImpl::publish(std::string key, bool block, bool deleted)
 {
-    _impl.reset(new KeymasterServer::KmImpl(n));
+    KeymasterStore::change c;
+
+    c.keychain = key == "Root" ? "" : key;
+    c.create = false;
+    c.del = deleted;
+    return publish(vector<KeymasterStore::change>(1, c), block);
 }
 
 /**
- * Destructor, signals the server thread that we're done, waiting for it
- * to exit on its own.
+ * Publishes the changes made by a transaction (see
+ * `KeymasterStore::apply()`). Every key changed, or above a key
+ * changed, is published once, with its value after the whole
+ * transaction, however many of the changes it is affected by.
+ *
+ * With delta publishing the whole transaction is one message, under
+ * the one sequence number of the transaction: the sequence number,
+ * the server's epoch, then "PUT" or "DEL", the key, and the value,
+ * for each change. The
+ * value of a PUT is that of its key once the transaction is done; a
+ * PUT whose key a later change deleted is left out, the DEL taking
+ * care of it.
+ *
+ * Must be called with '_write_lock' held.
+ *
+ * @param changes: the changes, in the order they were applied. The
+ * root is the empty keychain.
+ *
+ * @param block: if true, waits for room in the publication queue.
+ *
+ * @return true if the data was succesfuly placed in the publication
+ * queue, false otherwise.
  *
  */
 
-KeymasterServer::~KeymasterServer()
+bool KeymasterServer::KmImpl::publish(const vector<KeymasterStore::change> &changes, bool block)
+{
+    bool rval = true;
+    vector<string> keys;
+    set<string> seen;
+
+    if (_delta_publishing)
+    {
+        data_package dp;
+
+        dp.queued = Time::getUTC();
+        dp.delta.push_back(to_string(_store.version()));
+        dp.delta.push_back(_epoch);
+
+        for (auto c = changes.begin(); c != changes.end(); ++c)
+        {
+            string val;
+
+            if (!c->del && !_store.text(c->keychain, val))
+            {
+                continue;
+            }
+
+            dp.delta.push_back(c->del ? "DEL" : "PUT");
+            dp.delta.push_back(c->keychain);
+            dp.delta.push_back(val);
+        }
+
+        if (block)
+        {
+            _data_queue.put(dp);
+        }
+        else if (!_data_queue.try_put(dp))
+        {
+            // the clients will see the gap, and resynchronize.
+            _stats.overflows.fetch_add(1, memory_order_relaxed);
+            return false;
+        }
+
+        note_queue_depth();
+        return true;
+    }
+
+    for (auto c = changes.begin(); c != changes.end(); ++c)
+    {
+        // Publish "Root" if there is no key
+        if (c->keychain.empty())
+        {
+            if (seen.insert("Root").second)
+            {
+                keys.push_back("Root");
+            }
+
+            continue;
+        }
+
+        vector<string> k;
+        boost::split(k, c->keychain, boost::is_any_of("."));
+
+        for (size_t i = 1; i < k.size() + 1; ++i)
+        {
+            string s = boost::algorithm::join(vector<string>(k.begin(), k.begin() + i), ".");
+
+            if (seen.insert(s).second)
+            {
+                keys.push_back(s);
+            }
+        }
+    }
+
+    // The store keeps each node's text, so publishing the unchanged
+    // nodes is just a copy, and the changed ones are put together
+    // from their children's text.
+    for (size_t i = 0; i < keys.size(); ++i)
+    {
+        data_package dp;
+        dp.key = keys[i];
+        dp.queued = Time::getUTC();
+
+        if (_store.text(dp.key == "Root" ? "" : dp.key, dp.val))
+        {
+            if (block)
+            {
+                _data_queue.put(dp);
+            }
+            else if (!_data_queue.try_put(dp))
+            {
+                // No room: remember the key instead. It is published
+                // with its latest value once the queue is empty, so
+                // however many changes to it overflow, subscribers
+                // get the last one.
+                ThreadLock<Mutex> l(_overflow_lock);
+                l.lock();
+                _overflow_keys.insert(dp.key);
+                _stats.overflows.fetch_add(1, memory_order_relaxed);
+                rval = false;
+            }
+        }
+    }
+
+    note_queue_depth();
+    return rval;
+}
+
+/**
+ * Publishes the keys that did not fit in the publication queue, with
+ * their current values. Called by the publisher thread when the
+ * queue is empty, so that these come after everything that was
+ * queued before or since they overflowed; and when it has been empty
+ * for a while, for keys that overflowed just as it emptied.
+ *
+ * @param data_publisher: the publishing socket.
+ *
+ */
+
+void KeymasterServer::KmImpl::publish_overflow(zmq::socket_t &data_publisher)
+{
+    set<string> keys;
+    ThreadLock<Mutex> l(_overflow_lock);
+
+    l.lock();
+    keys.swap(_overflow_keys);
+    l.unlock();
+
+    for (auto i = keys.begin(); i != keys.end(); ++i)
+    {
+        string val;
+
+        if (_store.text(*i == "Root" ? "" : *i, val))
+        {
+            z_send(data_publisher, *i, ZMQ_SNDMORE);
+            z_send(data_publisher, val, 0);
+            _stats.publications.fetch_add(1, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * \class KeymasterServer
+ *
+ * This is a class that provides a 0MQ publishing facility. KeymasterServer
+ * both publishes data as a ZMQ PUB, but also provides a REQ/REP service.
+ *
+ * The KeymasterServer should be one of the first objects created in the
+ * main program entry point:
+ *
+ *     int main(...)
+ *     {
+ *         KeymasterServer *kms;
+ *         kms = new KeymasterServer("config.yaml");
+ *
+ *         if (!kms->run())
+ *         {
+ *             return 1;
+ *         }
+ *
+ *         ...
+ *
+ *         return 0;
+ *     }
+ *
+ * The Keymaster now is ready to serve clients. The initial state of the
+ * KeymasterServer is set by the file 'config.yaml'.
+ *
+ */
+
+/**
+ * KeymasterServer constructor.  Constructs a KeymasterServer from a
+ * valid YAML encoded configuration file.
+ *
+ * @param configfile: A YAML configuration file which sets the
+ * Keymaster's data store to an initial state.
+ *
+ */
+
+KeymasterServer::KeymasterServer(std::string configfile)
+{
+    YAML::Node config;
+
+    try
+    {
+        config = YAML::LoadFile(configfile);
+    }
+    catch (YAML::BadFile &e)
+    {
+        ostringstream msg;
+        msg << "KeymasterServer: Could not open config file "
+            << configfile;
+        throw(runtime_error(msg.str()));
+    }
+
+    _impl.reset(new KeymasterServer::KmImpl(config));
+}
+
+/**
+ * KeymasterServer constructor.  Constructs a KeymasterServer from a
+ * valid YAML::Node.
+ *
+ * @param n: A YAML::Node containing the initial configuration for the
+ * Keymaster server.
+ *
+ */
+
+KeymasterServer::KeymasterServer(YAML::Node n)
+{
+    _impl.reset(new KeymasterServer::KmImpl(n));
+}
+
+/**
+ * Destructor, signals the server thread that we're done, waiting for it
+ * to exit on its own.
+ *
+ */
+
+KeymasterServer::~KeymasterServer()
+
+{
+    _impl.reset();
+}
+
+/**
+ * Starts the KeymasterServer running.
+ *
+ * @return true if the threads were started, false otherwise.
+ */
+
+void KeymasterServer::run()
+{
+    _impl->run();
+}
+
+/**
+ * Terminates the KeymasterServer threads. This function will block
+ * until the threads are done.
+ *
+ */
+
+void KeymasterServer::terminate()
+{
+    _impl->terminate();
+}
+
+/****************************************************************//**
+ * \class Keymaster
+ *
+ * The Keymaster class is a client to the keymaster service,
+ * encapsulating and hiding the details of the connection.
+ *
+ * Example usage:
+ *
+ *      Keymaster km("inproc://matrix.keymaster");
+ *      string key = "foo.Transports";
+ *      vector<string> transports = km.get_as<vector<string> >(key)
+ *
+ *******************************************************************/
+
+/**
+ * KmAsync is the Keymaster client's asynchronous request channel. Its
+ * thread owns a DEALER socket connected to the KeymasterServer, so
+ * any number of requests may be outstanding at once. Each request is
+ * sent with an id frame ahead of the empty delimiter frame; the
+ * server's REP workers treat it as part of the envelope and return it
+ * with the reply, which is how replies, which may come back in any
+ * order, are matched to their requests. Requests are handed to the
+ * thread through a queue, and an eventfd wakes it up.
+ *
+ */
+
+struct Keymaster::KmAsync
+{
+    KmAsync(std::string url);
+    ~KmAsync();
+
+    std::future<yaml_result> call(std::vector<std::string> frames);
+    void io_task();
+
+    typedef std::shared_ptr<std::promise<yaml_result> > promise_ptr;
+
+    struct request
+    {
+        uint64_t id;
+        std::vector<std::string> frames;
+        promise_ptr result;
+    };
+
+    struct pending
+    {
+        promise_ptr result;
+        Time::Time_t deadline;
+    };
+
+    std::string _url;
+    Thread<KmAsync> _thread;
+    TCondition<bool> _thread_ready;
+    std::atomic<bool> _run;
+    int _efd;
+    Mutex _lock;
+    std::vector<request> _queue;
+    uint64_t _next_id;
+};
+
+Keymaster::KmAsync::KmAsync(std::string url)
+    :
+    _url(url),
+    _thread(this, &Keymaster::KmAsync::io_task),
+    _thread_ready(false),
+    _run(true),
+    _efd(eventfd(0, EFD_NONBLOCK)),
+    _next_id(0)
+{
+    if (_efd < 0)
+    {
+        throw KeymasterException(string("Keymaster: unable to create eventfd: ") + strerror(errno));
+    }
+
+    if (_thread.start() != 0 || !_thread_ready.wait(true, 1000000))
+    {
+        close(_efd);
+        throw KeymasterException("Keymaster: unable to start the asynchronous request thread");
+    }
+}
+
+Keymaster::KmAsync::~KmAsync()
+{
+    uint64_t one = 1;
+
+    _run = false;
+
+    if (write(_efd, &one, sizeof one) < 0)
+    {
+        // the thread will still see '_run' at its next poll timeout.
+    }
+
+    _thread.stop_without_cancel();
+    close(_efd);
+}
+
+/**
+ * Queues a request for the thread to send.
+ *
+ * @param frames: the request's frames, command first.
+ *
+ * @return a future for the reply.
+ *
+ */
+
+std::future<yaml_result> Keymaster::KmAsync::call(std::vector<std::string> frames)
+{
+    request r = {0, frames, promise_ptr(new std::promise<yaml_result>())};
+    std::future<yaml_result> f = r.result->get_future();
+    uint64_t one = 1;
+    ThreadLock<Mutex> l(_lock);
+
+    l.lock();
+    r.id = _next_id++;
+    _queue.push_back(r);
+    l.unlock();
+
+    if (write(_efd, &one, sizeof one) < 0)
+    {
+        // the counter is at its limit, so the thread is awake anyway.
+    }
+
+    return f;
+}
+
+/**
+ * The asynchronous request thread. Sends queued requests, hands
+ * replies to their futures, and fails requests that have gone
+ * unanswered for KM_TIMEOUT mS.
+ *
+ */
+
+void Keymaster::KmAsync::io_task()
+{
+    zmq::socket_t sock(ZMQContext::Instance()->get_context(), ZMQ_DEALER);
+    map<uint64_t, pending> outstanding;
+    const Time::Time_t timeout = KM_TIMEOUT * 1000000LL;
+
+    sock.connect(_url.c_str());
+    _thread_ready.signal(true);
+
+    zmq::pollitem_t items [] =
+        {
+#if ZMQ_VERSION_MAJOR > 3
+            { (void *)sock, 0, ZMQ_POLLIN, 0 },
+#else
+            { sock, 0, ZMQ_POLLIN, 0 },
+#endif
+            { NULL, _efd, ZMQ_POLLIN, 0 }
+        };
+
+    while (_run)
+    {
+        try
+        {
+            zmq::poll(&items[0], 2, 100);
+
+            if (items[1].revents & ZMQ_POLLIN)
+            {
+                uint64_t n;
+
+                if (read(_efd, &n, sizeof n) < 0)
+                {
+                    // spurious wakeup
+                }
+            }
+
+            vector<request> q;
+            ThreadLock<Mutex> l(_lock);
+            l.lock();
+            q.swap(_queue);
+            l.unlock();
+
+            for (auto r = q.begin(); r != q.end(); ++r)
+            {
+                pending p = {r->result, Time::getUTC() + timeout};
+                outstanding[r->id] = p;
+                z_send(sock, r->id, ZMQ_SNDMORE);
+                z_send(sock, string(), ZMQ_SNDMORE);
+
+                for (size_t i = 0; i < r->frames.size(); ++i)
+                {
+                    z_send(sock, r->frames[i], i + 1 < r->frames.size() ? ZMQ_SNDMORE : 0);
+                }
+            }
+
+            zmq::message_t id_frame;
+
+            while (sock.recv(&id_frame, ZMQ_DONTWAIT))
+            {
+                // the id, then the delimiter and the reply
+                vector<string> frames;
+                uint64_t id = 0;
+                z_recv_multipart(sock, frames);
+
+                if (id_frame.size() != sizeof id || frames.size() != 2)
+                {
+                    continue;
+                }
+
+                memcpy(&id, id_frame.data(), sizeof id);
+                auto p = outstanding.find(id);
+
+                if (p != outstanding.end())
+                {
+                    yaml_result yr;
+
+                    try
+                    {
+                        yr.from_yaml_node(YAML::Load(frames[1]));
+                    }
+                    catch (YAML::Exception &e)
+                    {
+                        yr = yaml_result(false, YAML::Node(), "", e.what());
+                    }
+
+                    p->second.result->set_value(yr);
+                    outstanding.erase(p);
+                }
+            }
+
+            Time::Time_t now = Time::getUTC();
+
+            for (auto p = outstanding.begin(); p != outstanding.end();)
+            {
+                if (p->second.deadline < now)
+                {
+                    p->second.result->set_value(
+                        yaml_result(false, YAML::Node(), "", "Keymaster: request timed out"));
+                    p = outstanding.erase(p);
+                }
+                else
+                {
+                    ++p;
+                }
+            }
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- Keymaster asynchronous request thread: " << e.what() << endl;
+        }
+    }
+
+    for (auto p = outstanding.begin(); p != outstanding.end(); ++p)
+    {
+        p->second.result->set_value(
+            yaml_result(false, YAML::Node(), "", "Keymaster: client closed"));
+    }
+
+    for (auto r = _queue.begin(); r != _queue.end(); ++r)
+    {
+        r->result->set_value(yaml_result(false, YAML::Node(), "", "Keymaster: client closed"));
+    }
+
+    int zero = 0;
+    sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    sock.close();
+}
+
+/**
+ * The Keymaster client constructor makes a connection to the specified
+ * Keymaster service URL. Will throw a KeymasterException if it is
+ * unable to make the connection.
+ *
+ * @param keymaster_url: The url for the keymaster service
+ *
+ */
+
+Keymaster::Keymaster(string keymaster_url, bool /* shared */)
+    :
+    _km_url(keymaster_url),
+    _pipe_url(string("inproc://") + gen_random_string(20)),
+    _subscriber_thread(this, &Keymaster::_subscriber_task),
+    _subscriber_thread_ready(false),
+    _put_thread(this, &Keymaster::_put_task),
+    _put_thread_ready(false),
+    _put_thread_run(false),
+    _delta(false),
+    _mirror_seq(0),
+    _caching(false)
+{
+}
+
+/**
+ * The destructor will close the connection to the keymaster service.
+ *
+ */
+
+Keymaster::~Keymaster()
+{
+    int zero = 0;
+
+    if (_subscriber_thread.running())
+    {
+        zmq::socket_t ctrl(ZMQContext::Instance()->get_context(), ZMQ_REQ);
+        ctrl.connect(_pipe_url.c_str());
+        z_send(ctrl, QUIT, 0);
+        int rval;
+        z_recv(ctrl, rval);
+        _subscriber_thread.stop_without_cancel();
+    }
+
+    if (_km_.get())
+    {
+        ThreadLock<Mutex> lck(_shared_lock);
+        _km_->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+        _km_->close();
+    }
+
+    if (_put_thread.running())
+    {
+        _put_thread_run = false;
+        _put_thread.stop_without_cancel();
+    }
+
+    _async.reset();
+}
+
+/**
+ * RPC call to the Keymaster. Makes this call atomic, so that multiple
+ * threads may use one Keymaster client without interrupting the
+ * REQ/REPL pairs.
+ *
+ * @param cmd: One of the commands recognized by the Keymaster Server:
+ * GET, PUT, DEL.
+ *
+ * @param key: A key to a YAML node. In form "key1.key2.key3" which
+ * represents a hierarchy of YAML nodes on the Keymaster.
+ *
+ * @param val: A new value for the node pointet to by 'key'.
+ *
+ * @param flag: A flag regulating the operation of PUT: if 'create'
+ * PUT will create a new node at the specified key if one doesn't
+ * already exist. If "", it will return an error if the key does not exist.
+ *
+ */
+
+yaml_result Keymaster::_call_keymaster(string cmd, string key, string val, string flag)
+{
+    string response;
+    yaml_result yr;
+    int pre_cancel_state;
+    ThreadLock<Mutex> lck(_shared_lock);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &pre_cancel_state);
+    ResourceLock canceler([pre_cancel_state]() { pthread_setcancelstate(pre_cancel_state, nullptr); });
+    ostringstream msg;
+
+    try
+    {
+        msg << "Keymaster: Failed to " << cmd << " key '" << key;
+
+        lck.lock();
+        shared_ptr<zmq::socket_t> km = _keymaster_socket();
+        // always send a command
+        z_send(*km, cmd, ZMQ_SNDMORE, KM_TIMEOUT);
+        // always send a key
+        z_send(*km, key, val.empty() ? 0: ZMQ_SNDMORE, KM_TIMEOUT);
+
+        if (!val.empty())
+        {
+            z_send(*km, val, flag.empty() ? 0 : ZMQ_SNDMORE, KM_TIMEOUT);
+        }
+
+        if (!flag.empty())
+        {
+            z_send(*km, flag, 0, KM_TIMEOUT);
+        }
+
+        // use a reasonable time-out, in case Keymaster is gone.
+        z_recv(*km, response, KM_TIMEOUT);
+
+        yr.from_yaml_node(YAML::Load(response));
+        _r = yr;
+        return yr;
+    }
+    catch (YAML::Exception &e)
+    {
+        msg << e.what();
+        yr.err = msg.str();
+        yr.result = false;
+        _r = yr;
+        return yr;
+    }
+    catch (MatrixException &e)
+    {
+        _handle_keymaster_server_exception();
+        msg << e.what();
+        yr.err = msg.str();
+        yr.result = false;
+        _r = yr;
+        return yr;
+    }
+    catch (zmq::error_t &e)
+    {
+        msg << e.what();
+        yr.err = msg.str();
+        yr.result = false;
+        _r = yr;
+        return yr;
+    }
+    catch (std::exception &e)
+    {
+        msg << e.what();
+        yr.err = msg.str();
+        yr.result = false;
+        _r = yr;
+        return yr;
+    }
+
+}
+
+/**
+ * Closes the socket to deal with problems such as the Keymaster
+ * server disappearing. Since the socket is a ZMQ_REQ socket, sending
+ * without being able to receive puts the socket into a state in which
+ * it cannot resend. The shared pointer is reset, so that the
+ * companion function `_keymaster_socket()` knows to create a new one
+ * and reconnect.
+ *
+ */
+
+void Keymaster::_handle_keymaster_server_exception()
+{
+    int zero = 0;
+
+    _km_->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+    _km_->close();
+    _km_.reset();
+}
+
+/**
+ * Attempts to return a valid zmq::socket_t connected to the keymaster
+ * server. If the function is unable to connect the socket it throws a
+ * zmq::error_t. This handles the potential case of the keymaster
+ * going away before this client does. In that case,
+ * `_handle_keymaster_server_exception()` closes the socket and resets
+ * the shared pointer prior to `get()`, `put()` and `del()` throwing
+ * an exception. Instead of using the `_km_` shared pointer directly,
+ * `get()`, `put()` and `del()` all call this function to obtain a
+ * share of this pointer to the socket; if it was previously closed
+ * and reset, this will construct a new one and attempt to reconnect
+ * it.
+ *
+ * @return std::shared_ptr<zmq::socket_t>, which will point to a
+ * socket connected to the Keymaster server.
+ *
+ */
+
+shared_ptr<zmq::socket_t> Keymaster::_keymaster_socket()
+{
+    if (_km_.get())
+    {
+        return _km_;
+    }
+
+    _km_.reset(new zmq::socket_t(ZMQContext::Instance()->get_context(), ZMQ_REQ));
+    _km_->connect(_km_url.c_str());
+    return _km_;
+}
+
+/**
+ * Returns a YAML::Node corresponding to the keychain 'key'.
+ *
+ * example:
+ *
+ *      Keymaster km("inproc://keymaster");
+ *      YAML::Node n = km.get("components.nettask.source.URLs");
+ *
+ * @param key: The keychain. Keychains are a sequence of keys separated
+ * by periods (".") which will specify a path to a value in the
+ * keystore.
+ *
+ * @return A YAML::Node corresponding to the keychain.
+ *
+ */
+
+YAML::Node Keymaster::get(std::string key)
+{
+    yaml_result yr;
+
+    if (!get(key, yr))
+    {
+        throw KeymasterException(yr.err);
+    }
+
+    return yr.node;
+}
+
+bool Keymaster::get(std::string key, yaml_result &yr)
+{
+    string cmd("GET");
+    uint64_t gen = 0;
+    bool cache = false;
+
+    if (_caching && !key.empty() && key != "Root")
+    {
+        if (_cache_get(key, yr))
+        {
+            return yr.result;
+        }
+
+        cache = _cache_watch(key, gen);
+    }
+
+    yr = _call_keymaster(cmd, key);
+
+    if (cache && yr.result)
+    {
+        _cache_add(key, yr.node, gen);
+    }
+
+    return yr.result;
+}
+
+/**
+ * Asynchronous versions of `get()` and `put()`. The request is sent
+ * at once, by another thread, and the calling thread can carry on
+ * and make more requests; the KeymasterServer's workers may serve
+ * them in parallel. The result is had from the returned future.
+ *
+ * example:
+ *
+ *      Keymaster km("inproc://keymaster");
+ *      vector<future<yaml_result> > f;
+ *
+ *      for (auto c : components)
+ *      {
+ *          f.push_back(km.put_async("components." + c + ".active", true));
+ *      }
+ *
+ *      for (auto &i : f)
+ *      {
+ *          yaml_result r = i.get();
+ *          ...
+ *      }
+ *
+ * A request that is not answered within the usual time-out gets a
+ * failed yaml_result. These calls do not use the read cache.
+ *
+ * @param key: The keychain.
+ *
+ * @return a future for the yaml_result.
+ *
+ */
+
+std::future<yaml_result> Keymaster::get_async(std::string key)
+{
+    vector<string> frames = {"GET", key};
+    ThreadLock<Mutex> lck(_shared_lock);
+
+    lck.lock();
+
+    if (!_async)
+    {
+        _async.reset(new KmAsync(_km_url));
+    }
+
+    shared_ptr<KmAsync> a = _async;
+    lck.unlock();
+    return a->call(frames);
+}
 
+std::future<yaml_result> Keymaster::put_async(std::string key, YAML::Node n, bool create)
 {
-    _impl.reset();
-}
+    ostringstream val;
+    val << n;
+    vector<string> frames = {"PUT", key, val.str()};
 
-/**
- * Starts the KeymasterServer running.
- *
- * @return true if the threads were started, false otherwise.
- */
+    if (create)
+    {
+        frames.push_back("create");
+    }
 
-void KeymasterServer::run()
-{
-    _impl->run();
+    ThreadLock<Mutex> lck(_shared_lock);
+    lck.lock();
+
+    if (!_async)
+    {
+        _async.reset(new KmAsync(_km_url));
+    }
+
+    shared_ptr<KmAsync> a = _async;
+    lck.unlock();
+    return a->call(frames);
 }
 
 /**
- * Terminates the KeymasterServer threads. This function will block
- * until the threads are done.
+ * Gets several keys in one request.
+ *
+ * @param keys: The keychains.
+ *
+ * @return a yaml_result for each key, as `get()` would give.
  *
  */
 
-void KeymasterServer::terminate()
+vector<yaml_result> Keymaster::multi_get(vector<string> keys)
 {
-    _impl->terminate();
+    return _call_keymaster_multi("MGET", keys, keys.size());
 }
 
-/****************************************************************//**
- * \class Keymaster
- *
- * The Keymaster class is a client to the keymaster service,
- * encapsulating and hiding the details of the connection.
- *
- * Example usage:
+/**
+ * Puts several values in one request, as one transaction (see
+ * `transaction()`).
  *
- *      Keymaster km("inproc://matrix.keymaster");
- *      string key = "foo.Transports";
- *      vector<string> transports = km.get_as<vector<string> >(key)
+ * @param vals: The keychains and their new values.
  *
- *******************************************************************/
-
-/**
- * The Keymaster client constructor makes a connection to the specified
- * Keymaster service URL. Will throw a KeymasterException if it is
- * unable to make the connection.
+ * @param create: If true, missing keys are created.
  *
- * @param keymaster_url: The url for the keymaster service
+ * @return a yaml_result for each key, as `put()` would give.
  *
  */
 
-Keymaster::Keymaster(string keymaster_url, bool /* shared */)
-    :
-    _km_url(keymaster_url),
-    _pipe_url(string("inproc://") + gen_random_string(20)),
-    _subscriber_thread(this, &Keymaster::_subscriber_task),
-    _subscriber_thread_ready(false),
-    _put_thread(this, &Keymaster::_put_task),
-    _put_thread_ready(false),
-    _put_thread_run(false)
+vector<yaml_result> Keymaster::multi_put(vector<pair<string, YAML::Node> > vals, bool create)
 {
+    vector<KeymasterStore::change> changes;
+
+    for (auto i = vals.begin(); i != vals.end(); ++i)
+    {
+        KeymasterStore::change c = {i->first, i->second, create, false};
+        changes.push_back(c);
+    }
+
+    return transaction(changes);
 }
 
 /**
- * The destructor will close the connection to the keymaster service.
+ * Makes several puts and deletions in one request, as one
+ * transaction: the KeymasterServer applies all of them, in order, or
+ * none of them if any one fails. Subscribers see a single update,
+ * with every key affected by the transaction published once, after
+ * all the changes are made.
+ *
+ *     vector<KeymasterStore::change> c = {
+ *         {"components.nco.active", YAML::Node(true), false, false},
+ *         {"components.nco.mode", YAML::Node("default"), false, false},
+ *         {"components.old_nco", YAML::Node(), false, true}
+ *     };
+ *
+ *     km.transaction(c);
+ *
+ * @param changes: The changes. The value and `create` flag of a
+ * deletion are ignored.
+ *
+ * @return a yaml_result for each change, as `put()` or `del()` would
+ * give. If the transaction failed, all of them are failures, the
+ * failed change's giving the reason.
  *
  */
 
-Keymaster::~Keymaster()
+vector<yaml_result> Keymaster::transaction(const vector<KeymasterStore::change> &changes)
 {
-    int zero = 0;
+    vector<string> frames;
 
-    if (_subscriber_thread.running())
+    for (auto i = changes.begin(); i != changes.end(); ++i)
     {
-        zmq::socket_t ctrl(ZMQContext::Instance()->get_context(), ZMQ_REQ);
-        ctrl.connect(_pipe_url.c_str());
-        z_send(ctrl, QUIT, 0);
-        int rval;
-        z_recv(ctrl, rval);
-        _subscriber_thread.stop_without_cancel();
-    }
+        ostringstream val;
 
-    if (_km_.get())
-    {
-        ThreadLock<Mutex> lck(_shared_lock);
-        _km_->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
-        _km_->close();
-    }
+        if (!i->del)
+        {
+            val << i->val;
+        }
 
-    if (_put_thread.running())
-    {
-        _put_thread_run = false;
-        _put_thread.stop_without_cancel();
+        frames.push_back(i->keychain);
+        frames.push_back(val.str());
+        frames.push_back(i->del ? "delete" : (i->create ? "create" : ""));
     }
+
+    return _call_keymaster_multi("MPUT", frames, changes.size());
 }
 
 /**
- * RPC call to the Keymaster. Makes this call atomic, so that multiple
- * threads may use one Keymaster client without interrupting the
- * REQ/REPL pairs.
+ * Fetches the KeymasterServer's current load statistics: request
+ * rates and service times by command, publication counts and latency,
+ * and the publication queue's depth. See `KmImpl::stats()` for the
+ * layout. The same statistics are published periodically under
+ * 'Keymaster.stats'.
  *
- * @param cmd: One of the commands recognized by the Keymaster Server:
- * GET, PUT, DEL.
+ * @return A yaml_result, whose 'node' holds the statistics.
  *
- * @param key: A key to a YAML node. In form "key1.key2.key3" which
- * represents a hierarchy of YAML nodes on the Keymaster.
+ */
+
+yaml_result Keymaster::stats()
+{
+    return _call_keymaster("STATS", "");
+}
+
+/**
+ * Like `_call_keymaster()`, for requests with many replies, as
+ * "MGET" and "MPUT".
  *
- * @param val: A new value for the node pointet to by 'key'.
+ * @param cmd: The command.
  *
- * @param flag: A flag regulating the operation of PUT: if 'create'
- * PUT will create a new node at the specified key if one doesn't
- * already exist. If "", it will return an error if the key does not exist.
+ * @param frames: The request frames following the command.
+ *
+ * @param replies: The number of replies expected.
+ *
+ * @return the replies. If the request fails, each is a failed
+ * yaml_result with the error.
  *
  */
 
-yaml_result Keymaster::_call_keymaster(string cmd, string key, string val, string flag)
+vector<yaml_result> Keymaster::_call_keymaster_multi(string cmd, vector<string> &frames,
+                                                     size_t replies)
 {
-    string response;
-    yaml_result yr;
-    int pre_cancel_state;
+    vector<string> response;
+    vector<yaml_result> yrs;
     ThreadLock<Mutex> lck(_shared_lock);
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &pre_cancel_state);
-    ResourceLock canceler([pre_cancel_state]() { pthread_setcancelstate(pre_cancel_state, nullptr); });
-    ostringstream msg;
+    string err;
 
-    try
+    if (frames.empty())
     {
-        msg << "Keymaster: Failed to " << cmd << " key '" << key;
+        return yrs;
+    }
 
+    try
+    {
         lck.lock();
         shared_ptr<zmq::socket_t> km = _keymaster_socket();
-        // always send a command
         z_send(*km, cmd, ZMQ_SNDMORE, KM_TIMEOUT);
-        // always send a key
-        z_send(*km, key, val.empty() ? 0: ZMQ_SNDMORE, KM_TIMEOUT);
 
-        if (!val.empty())
+        for (size_t i = 0; i < frames.size(); ++i)
         {
-            z_send(*km, val, flag.empty() ? 0 : ZMQ_SNDMORE, KM_TIMEOUT);
+            z_send(*km, frames[i], i + 1 < frames.size() ? ZMQ_SNDMORE : 0, KM_TIMEOUT);
         }
 
-        if (!flag.empty())
+        string first;
+        z_recv(*km, first, KM_TIMEOUT);
+        z_recv_multipart(*km, response);
+        response.insert(response.begin(), first);
+
+        if (response.size() != replies)
         {
-            z_send(*km, flag, 0, KM_TIMEOUT);
+            err = "Keymaster: " + cmd + ": " + first;
         }
+        else
+        {
+            for (auto i = response.begin(); i != response.end(); ++i)
+            {
+                yrs.push_back(yaml_result(YAML::Load(*i)));
+            }
 
-        // use a reasonable time-out, in case Keymaster is gone.
-        z_recv(*km, response, KM_TIMEOUT);
-
-        yr.from_yaml_node(YAML::Load(response));
-        _r = yr;
-        return yr;
+            _r = yrs.back();
+            return yrs;
+        }
     }
     catch (YAML::Exception &e)
     {
-        msg << e.what();
-        yr.err = msg.str();
-        yr.result = false;
-        _r = yr;
-        return yr;
+        err = "Keymaster: " + cmd + ": " + e.what();
     }
     catch (MatrixException &e)
     {
         _handle_keymaster_server_exception();
-        msg << e.what();
-        yr.err = msg.str();
-        yr.result = false;
-        _r = yr;
-        return yr;
+        err = "Keymaster: " + cmd + ": " + e.what();
     }
     catch (zmq::error_t &e)
     {
-        msg << e.what();
-        yr.err = msg.str();
-        yr.result = false;
-        _r = yr;
-        return yr;
+        err = "Keymaster: " + cmd + ": " + e.what();
     }
-    catch (std::exception &e)
+
+    yrs.assign(replies, yaml_result(false, YAML::Node(), "", err));
+    _r = yrs.back();
+    return yrs;
+}
+
+/**
+ * Turns the client's read cache on or off. It is off by default.
+ *
+ * With the cache on, the value of a key that has been read is kept,
+ * and subsequent `get()`s of it or of any key below it are answered
+ * from memory instead of by the KeymasterServer. The client
+ * subscribes to the top level key of everything it caches, and keeps
+ * the cached values current from the publications; until that
+ * subscription is known to be in effect (which takes a "SYNC"
+ * round trip, see `_cache_watch()`) the KeymasterServer is asked. If the
+ * KeymasterServer uses delta publishing the client's mirror of the
+ * whole store is used instead, so that every `get()` is answered
+ * from memory.
+ *
+ * Since the publications arrive asynchronously, a `get()` that
+ * follows a change made elsewhere may briefly return the previous
+ * value. Clients that must see their own or others' latest changes
+ * should not use the cache.
+ *
+ * @param enable: true to turn the cache on, false to turn it off and
+ * drop its contents.
+ *
+ */
+
+void Keymaster::enable_cache(bool enable)
+{
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
+
+    if (enable && !_cache)
     {
-        msg << e.what();
-        yr.err = msg.str();
-        yr.result = false;
-        _r = yr;
-        return yr;
+        _cache.reset(new KeymasterStore());
+    }
+    else if (!enable)
+    {
+        _cache.reset();
+        _cached_keys.clear();
     }
 
+    _caching = enable;
 }
 
 /**
- * Closes the socket to deal with problems such as the Keymaster
- * server disappearing. Since the socket is a ZMQ_REQ socket, sending
- * without being able to receive puts the socket into a state in which
- * it cannot resend. The shared pointer is reset, so that the
- * companion function `_keymaster_socket()` knows to create a new one
- * and reconnect.
+ * Returns a Keymaster client for the given URL that is shared by all
+ * its users in the process, creating it if need be. Its cache is
+ * turned on if the KeymasterServer's configuration has
+ * 'Keymaster.client_cache: true'. This is meant for the library's
+ * own short lookups, such as those made when connecting a DataSink,
+ * that would otherwise each make a client and a connection for one
+ * or two `get()`s.
+ *
+ * @param keymaster_url: The url for the keymaster service
+ *
+ * @return The shared client.
  *
  */
 
-void Keymaster::_handle_keymaster_server_exception()
+shared_ptr<Keymaster> Keymaster::shared_client(string keymaster_url)
 {
-    int zero = 0;
+    static Mutex clients_lock;
+    static map<string, shared_ptr<Keymaster> > clients;
+    ThreadLock<Mutex> l(clients_lock);
+    l.lock();
 
-    _km_->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
-    _km_->close();
-    _km_.reset();
+    shared_ptr<Keymaster> &km = clients[keymaster_url];
+
+    if (!km)
+    {
+        yaml_result yr;
+        km.reset(new Keymaster(keymaster_url));
+
+        if (km->get("Keymaster.client_cache", yr) && yr.node.as<bool>(false))
+        {
+            km->enable_cache();
+        }
+    }
+
+    return km;
 }
 
 /**
- * Attempts to return a valid zmq::socket_t connected to the keymaster
- * server. If the function is unable to connect the socket it throws a
- * zmq::error_t. This handles the potential case of the keymaster
- * going away before this client does. In that case,
- * `_handle_keymaster_server_exception()` closes the socket and resets
- * the shared pointer prior to `get()`, `put()` and `del()` throwing
- * an exception. Instead of using the `_km_` shared pointer directly,
- * `get()`, `put()` and `del()` all call this function to obtain a
- * share of this pointer to the socket; if it was previously closed
- * and reset, this will construct a new one and attempt to reconnect
- * it.
+ * Answers a `get()` from the cache, if possible.
  *
- * @return std::shared_ptr<zmq::socket_t>, which will point to a
- * socket connected to the Keymaster server.
+ * @param key: the key.
+ *
+ * @param yr: set to the result, if answered.
+ *
+ * @return true if answered, false if the KeymasterServer must be
+ * asked.
+ *
+ */
+
+bool Keymaster::_cache_get(const string &key, yaml_result &yr)
+{
+    string text;
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
+
+    if (_mirror)
+    {
+        // the mirror is complete, so its failures are also answers.
+        shared_ptr<KeymasterStore> m = _mirror;
+        l.unlock();
+        m->get(key, text);
+    }
+    else
+    {
+        // Only keys at or below a cached key can be answered, and
+        // only successfully: for a missing key the KeymasterServer
+        // would return the last good node in full, which the cache
+        // may not have.
+        bool cached = false;
+
+        for (size_t i = key.find('.'); !cached; i = key.find('.', i + 1))
+        {
+            cached = _cached_keys.count(key.substr(0, i)) > 0;
+
+            if (i == string::npos)
+            {
+                break;
+            }
+        }
+
+        if (!cached || !_cache || !_cache->get(key, text))
+        {
+            return false;
+        }
+
+        l.unlock();
+    }
+
+    yr.from_yaml_node(YAML::Load(text));
+    ThreadLock<Mutex> lck(_shared_lock);
+    lck.lock();
+    _r = yr;
+    return true;
+}
+
+/**
+ * Prepares to cache a key: makes sure the subscriber thread is
+ * subscribed to the key's top level key, so that later changes to it
+ * will be seen, and returns that top level key's count of
+ * publications so far. If a publication arrives while the key is
+ * being fetched the count will change, and the fetched value, which
+ * may be the older one, is not cached (see `_cache_add()`).
+ *
+ * A ZMQ subscription takes effect some time after it is made, and a
+ * change published meanwhile would never reach the cache. So nothing
+ * is cached under the top level key until the subscription is known
+ * to be in effect: the subscriber thread also subscribes to a
+ * SYNC_TOPIC topic of its own, which the KeymasterServer is asked
+ * (with a "SYNC" request) to publish to. Until that publication
+ * arrives each `get()` asks again, since an earlier one may have been
+ * published too soon, and is answered by the KeymasterServer.
+ *
+ * @param key: the key.
+ *
+ * @param gen: set to the top level key's count of publications.
+ *
+ * @return true if the fetched value should be cached, false otherwise.
+ *
+ */
+
+bool Keymaster::_cache_watch(const string &key, uint64_t &gen)
+{
+    try
+    {
+        _run();
+    }
+    catch (KeymasterException &e)
+    {
+        return false;
+    }
+
+    if (_delta)
+    {
+        // The mirror will answer, once it is loaded.
+        return false;
+    }
+
+    string top = key.substr(0, key.find('.'));
+    zmq::socket_t pipe(ZMQContext::Instance()->get_context(), ZMQ_REQ);
+    pipe.connect(_pipe_url.c_str());
+    z_send(pipe, WATCH, ZMQ_SNDMORE);
+    z_send(pipe, top, 0);
+    string sync;
+    z_recv(pipe, sync);
+
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
+
+    if (!_cache_live.count(top))
+    {
+        l.unlock();
+
+        if (!sync.empty())
+        {
+            _call_keymaster("SYNC", sync);
+        }
+
+        return false;
+    }
+
+    gen = _cache_gen[top];
+    return (bool)_cache;
+}
+
+/**
+ * Adds a fetched value to the cache, unless its top level key has
+ * been published since `_cache_watch()`.
  *
  */
 
-shared_ptr<zmq::socket_t> Keymaster::_keymaster_socket()
+void Keymaster::_cache_add(const string &key, YAML::Node n, uint64_t gen)
 {
-    if (_km_.get())
+    string r;
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
+
+    if (_cache && _cache_gen[key.substr(0, key.find('.'))] == gen
+        && _cache->put(key, n, true, r))
     {
-        return _km_;
+        _cached_keys.insert(key);
     }
-
-    _km_.reset(new zmq::socket_t(ZMQContext::Instance()->get_context(), ZMQ_REQ));
-    _km_->connect(_km_url.c_str());
-    return _km_;
 }
 
 /**
- * Returns a YAML::Node corresponding to the keychain 'key'.
- *
- * example:
- *
- *      Keymaster km("inproc://keymaster");
- *      YAML::Node n = km.get("components.nettask.source.URLs");
+ * Updates the cache from a publication. A publication of a cached
+ * key, or of a key above or below one, is the new value of that key,
+ * and so is put in the cache.
  *
- * @param key: The keychain. Keychains are a sequence of keys separated
- * by periods (".") which will specify a path to a value in the
- * keystore.
+ * @param key: the published key.
  *
- * @return A YAML::Node corresponding to the keychain.
+ * @param val: the published value.
  *
  */
 
-YAML::Node Keymaster::get(std::string key)
+void Keymaster::_cache_publication(const string &key, const string &val)
 {
-    yaml_result yr;
+    string r;
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
 
-    if (!get(key, yr))
+    if (!_cache)
     {
-        throw KeymasterException(yr.err);
+        return;
     }
 
-    return yr.node;
-}
+    if (key == "Root")
+    {
+        _cache.reset(new KeymasterStore());
+        _cached_keys.clear();
+        return;
+    }
 
-bool Keymaster::get(std::string key, yaml_result &yr)
-{
-    string cmd("GET");
+    ++_cache_gen[key.substr(0, key.find('.'))];
 
-    yr = _call_keymaster(cmd, key);
-    return yr.result;
+    for (auto i = _cached_keys.begin(); i != _cached_keys.end(); ++i)
+    {
+        const string &k = *i;
+        const string &shorter = k.size() < key.size() ? k : key;
+        const string &longer = k.size() < key.size() ? key : k;
+
+        if (k == key || (longer.compare(0, shorter.size(), shorter) == 0
+                         && longer[shorter.size()] == '.'))
+        {
+            _cache->put(key, YAML::Load(val), true, r);
+            break;
+        }
+    }
 }
 
 /**
@@ -1353,6 +3019,14 @@ bool Keymaster::del(std::string key)
  * keymaster. NOTE: The function does not assume ownership of this
  * object! This should be managed by the thread calling this function.
  *
+ * @param min_interval_ms: If not 0, the least time, in milliseconds,
+ * between two calls of 'f'. Updates that arrive sooner are conflated:
+ * 'f' is called once the interval is up, with the latest value only,
+ * as it is with the latest of the updates that arrived while the
+ * previous call was in progress. This keeps a slow subscriber to a
+ * fast-changing key from falling ever further behind. By default
+ * every update is given to 'f'.
+ *
  * @return: true if all went well. false means that the subscription
  * failed, which could happen if the keymaster is not running, so the
  * subscription thread could not be started (the subscription thread
@@ -1360,7 +3034,7 @@ bool Keymaster::del(std::string key)
  *
  */
 
-bool Keymaster::subscribe(string key, KeymasterCallbackBase *f)
+bool Keymaster::subscribe(string key, KeymasterCallbackBase *f, int min_interval_ms)
 {
     // first start the subscriber thread. If it's already running this
     // won't do anything.
@@ -1385,7 +3059,8 @@ bool Keymaster::subscribe(string key, KeymasterCallbackBase *f)
     pipe.connect(_pipe_url.c_str());
     z_send(pipe, SUBSCRIBE, ZMQ_SNDMORE);
     z_send(pipe, key, ZMQ_SNDMORE);
-    z_send(pipe, f, 0);
+    z_send(pipe, f, ZMQ_SNDMORE);
+    z_send(pipe, min_interval_ms, 0);
     int rval;
     z_recv(pipe, rval);
     return rval ? true : false;
@@ -1445,13 +3120,24 @@ void Keymaster::_run()
     {
         for (int i = 0; i < 10; ++i)
         {
-            // get the keymaster publishing URLs:
+            // get the keymaster publishing URLs. (Not via `get()`,
+            // which may be caching, and so need this thread.)
             try
             {
-                _km_pub_urls = get_as<vector<string> >("Keymaster.URLS.AsConfigured.Pub");
+                yaml_result yr = _call_keymaster("GET", "Keymaster.URLS.AsConfigured.Pub");
+
+                if (!yr.result)
+                {
+                    throw KeymasterException(yr.err);
+                }
+
+                _km_pub_urls = yr.node.as<vector<string> >();
                 ostringstream pubs;
                 mxutils::output_vector(_km_pub_urls, pubs);
                 cout << "Keymaster.URLS.AsConfigured.Pub:" << pubs.str() << endl;
+                // and how it publishes
+                yr = _call_keymaster("GET", "Keymaster.delta_publishing");
+                _delta = yr.result && yr.node.as<bool>(false);
                 break;
             }
             catch (KeymasterException &e)
@@ -1519,6 +3205,12 @@ void Keymaster::_subscriber_task()
     {
         sub_sock.connect(the_url.c_str());
         pipe.bind(_pipe_url.c_str());
+
+        if (_delta)
+        {
+            // all changes, to keep the mirror current
+            sub_sock.setsockopt(ZMQ_SUBSCRIBE, DELTA_TOPIC, strlen(DELTA_TOPIC));
+        }
     }
     catch (zmq::error_t &e)
     {
@@ -1530,6 +3222,24 @@ void Keymaster::_subscriber_task()
 
     _subscriber_thread_ready.signal(true);
 
+    // Top level keys subscribed to for the cache (see `get()`), and
+    // the SYNC_TOPIC topics of those not yet known to be in effect.
+    set<string> watched;
+    map<string, string> syncing;
+
+    if (_delta)
+    {
+        try
+        {
+            _load_mirror();
+        }
+        catch (YAML::Exception &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- Keymaster subscriber task: " << e.what() << endl;
+        }
+    }
+
     // we're going to poll. We will be waiting for subscription requests
     // (via 'pipe'), and for subscription data (via 'sub_sock').
     zmq::pollitem_t items [] =
@@ -1544,11 +3254,14 @@ void Keymaster::_subscriber_task()
 #endif
         };
 
+    // -1, or the time to the next rate-limited callback (in ms)
+    long timeout = -1;
+
     while (1)
     {
         try
         {
-            zmq::poll(&items[0], 2, -1);
+            zmq::poll(&items[0], 2, timeout);
 
             if (items[0].revents & ZMQ_POLLIN) // the control pipe
             {
@@ -1559,8 +3272,10 @@ void Keymaster::_subscriber_task()
                 {
                     string key;
                     KeymasterCallbackBase *f_ptr;
+                    int interval;
                     z_recv(pipe, key);
                     z_recv(pipe, f_ptr);
+                    z_recv(pipe, interval);
 
                     // Publisher publishes this as 'Root'. A
                     // subscription with an empty key subscribes to all keys.
@@ -1570,7 +3285,15 @@ void Keymaster::_subscriber_task()
                     }
 
                     _callbacks[key] = f_ptr;
-                    sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
+                    Notification n = {interval > 0 ? (uint64_t)interval * 1000000 : 0,
+                                      0, false, ""};
+                    _notifications[key] = n;
+
+                    if (!_delta)
+                    {
+                        sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
+                    }
+
                     z_send(pipe, 1, 0);
                 }
                 else if (msg == UNSUBSCRIBE)
@@ -1583,15 +3306,50 @@ void Keymaster::_subscriber_task()
                         key = "Root";
                     }
 
-                    sub_sock.setsockopt(ZMQ_UNSUBSCRIBE, key.c_str(), key.length());
+                    if (!_delta)
+                    {
+                        sub_sock.setsockopt(ZMQ_UNSUBSCRIBE, key.c_str(), key.length());
+                    }
 
                     if (_callbacks.find(key) != _callbacks.end())
                     {
                         _callbacks.erase(key);
                     }
 
+                    _notifications.erase(key);
+
                     z_send(pipe, 1, 0);
                 }
+                else if (msg == WATCH)
+                {
+                    string key, sync;
+                    z_recv(pipe, key);
+
+                    if (watched.insert(key).second)
+                    {
+                        // Subscriptions reach the publisher in the
+                        // order they are made, so once a publication
+                        // on 'sync' arrives, the one to 'key' is in
+                        // effect too (see `_cache_watch()`).
+                        sync = string(SYNC_TOPIC) + gen_random_string(20);
+                        sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
+                        sub_sock.setsockopt(ZMQ_SUBSCRIBE, sync.c_str(), sync.length());
+                        syncing[sync] = key;
+                    }
+                    else
+                    {
+                        for (auto i = syncing.begin(); i != syncing.end(); ++i)
+                        {
+                            if (i->second == key)
+                            {
+                                sync = i->first;
+                                break;
+                            }
+                        }
+                    }
+
+                    z_send(pipe, sync, 0);
+                }
                 else if (msg == QUIT)
                 {
                     z_send(pipe, 0, 0);
@@ -1599,24 +3357,52 @@ void Keymaster::_subscriber_task()
                 }
             }
 
-            // The subscribed data is handled here
+            // The subscribed data is handled here. Everything that
+            // is waiting is read before the rate-limited callbacks
+            // are called, so that a key published several times
+            // meanwhile only gets to its subscriber once, with the
+            // latest value.
             if (items[1].revents & ZMQ_POLLIN)
             {
-                string key;
-                vector<string> val;
-                z_recv(sub_sock, key);
-                z_recv_multipart(sub_sock, val);
+                int events = ZMQ_POLLIN;
+                size_t events_size = sizeof events;
 
-                if (!val.empty())
+                for (int i = 0; i < MAX_CONFLATED && (events & ZMQ_POLLIN); ++i)
                 {
-                    map<string, KeymasterCallbackBase *>::const_iterator mci;
-                    mci = _callbacks.find(key);
+                    string key;
+                    vector<string> val;
+                    z_recv(sub_sock, key);
+                    z_recv_multipart(sub_sock, val);
+
+                    if (key == DELTA_TOPIC)
+                    {
+                        _handle_delta(val);
+                    }
+                    else if (key.compare(0, strlen(SYNC_TOPIC), SYNC_TOPIC) == 0)
+                    {
+                        auto s = syncing.find(key);
 
-                    if (mci != _callbacks.end())
+                        if (s != syncing.end())
+                        {
+                            ThreadLock<Mutex> l(_cache_lock);
+                            l.lock();
+                            _cache_live.insert(s->second);
+                            l.unlock();
+                            sub_sock.setsockopt(ZMQ_UNSUBSCRIBE, key.c_str(), key.length());
+                            syncing.erase(s);
+                        }
+                    }
+                    else if (!val.empty())
                     {
-                        YAML::Node n = YAML::Load(val[0]);
-                        mci->second->exec(mci->first, n);
+                        if (_caching)
+                        {
+                            _cache_publication(key, val[0]);
+                        }
+
+                        _notify(key, val[0]);
                     }
+
+                    sub_sock.getsockopt(ZMQ_EVENTS, &events, &events_size);
                 }
             }
         }
@@ -1631,6 +3417,8 @@ void Keymaster::_subscriber_task()
             cerr << Time::isoDateTime(Time::getUTC())
                  << " -- Keymaster subscriber task: " << e.what() << endl;
         }
+
+        timeout = _deliver_notifications();
     }
 
     int zero = 0;
@@ -1641,6 +3429,297 @@ void Keymaster::_subscriber_task()
     sub_sock.close();
 }
 
+/**
+ * Applies a delta publication to the mirror of the KeymasterServer's
+ * store, and calls the callbacks of the keys it changed. A change to
+ * "foo.bar.baz" changes "foo" and "foo.bar" too, so as with full
+ * publications subscribers to any of the three are called, with
+ * values taken from the mirror. A publication may carry all the
+ * changes of a transaction; they are applied to the mirror as one,
+ * and each subscriber is called once. If the sequence number shows
+ * that changes were missed, or the epoch that the server was
+ * restarted (its sequence numbers start over, so would otherwise look
+ * like changes already applied), or if there is no mirror yet, or the
+ * changes don't apply, the mirror is replaced by a snapshot of the
+ * store and all subscribers are called.
+ *
+ * @param frames: The frames following the topic: the sequence number,
+ * the server's epoch, then "PUT" or "DEL", key, and value for each
+ * change.
+ *
+ */
+
+void Keymaster::_handle_delta(vector<string> &frames)
+{
+    if (frames.size() < 2 || frames.size() % 3 != 2)
+    {
+        return;
+    }
+
+    uint64_t seq = strtoull(frames[0].c_str(), NULL, 10);
+    const string &epoch = frames[1];
+
+    if (_mirror && epoch == _mirror_epoch && seq <= _mirror_seq)
+    {
+        // already in the mirror
+        return;
+    }
+
+    if (!_mirror || epoch != _mirror_epoch || seq != _mirror_seq + 1)
+    {
+        // If this fails, try again on the next delta.
+        if (!_load_mirror() || epoch != _mirror_epoch || seq != _mirror_seq + 1)
+        {
+            return;
+        }
+    }
+
+    vector<KeymasterStore::change> changes;
+    vector<string> r;
+
+    for (size_t i = 2; i < frames.size(); i += 3)
+    {
+        KeymasterStore::change c;
+        c.keychain = frames[i + 1];
+        c.create = true;
+        c.del = frames[i] == "DEL";
+
+        if (!c.del)
+        {
+            c.val = YAML::Load(frames[i + 2]);
+        }
+
+        changes.push_back(c);
+    }
+
+    if (!_mirror->apply(changes, r))
+    {
+        _load_mirror();
+        return;
+    }
+
+    _mirror_seq = seq;
+
+    for (auto i = _callbacks.begin(); i != _callbacks.end(); ++i)
+    {
+        const string &k = i->first;
+
+        for (auto c = changes.begin(); c != changes.end(); ++c)
+        {
+            const string &key = c->keychain;
+
+            if ((k == "Root" && key.empty())
+                || (k == key)
+                || (key.size() > k.size() && key[k.size()] == '.'
+                    && key.compare(0, k.size(), k) == 0))
+            {
+                _dispatch(k);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * (Re)loads the mirror of the KeymasterServer's store from a
+ * snapshot, and calls all subscribers, whose values may have changed
+ * since they were last called.
+ *
+ * @return true if the mirror was loaded, false if no snapshot could
+ * be had, in which case there is no mirror.
+ *
+ */
+
+bool Keymaster::_load_mirror()
+{
+    uint64_t seq = 0;
+    string epoch, text;
+    shared_ptr<KeymasterStore> m;
+
+    if (_get_snapshot(seq, epoch, text))
+    {
+        m.reset(new KeymasterStore(YAML::Load(text)));
+    }
+
+    // '_mirror' is only changed by this thread, but may be read by
+    // others (see `_cache_get()`).
+    ThreadLock<Mutex> l(_cache_lock);
+    l.lock();
+    _mirror = m;
+    _mirror_seq = seq;
+    _mirror_epoch = epoch;
+    l.unlock();
+
+    if (!m)
+    {
+        return false;
+    }
+
+    for (auto i = _callbacks.begin(); i != _callbacks.end(); ++i)
+    {
+        _dispatch(i->first);
+    }
+
+    return true;
+}
+
+/**
+ * Notifies a subscriber of the key's value in the mirror, if it has
+ * one.
+ *
+ * @param key: the subscribed key.
+ *
+ */
+
+void Keymaster::_dispatch(const string &key)
+{
+    string text;
+
+    if (_mirror->text(key == "Root" ? "" : key, text))
+    {
+        _notify(key, text);
+    }
+}
+
+/**
+ * Gives a new value of a subscribed key to its callback. If the
+ * subscription has a minimum interval, the value is only recorded,
+ * replacing any value not yet given to the callback, and the callback
+ * is called by `_deliver_notifications()`.
+ *
+ * @param key: the subscribed key.
+ *
+ * @param text: the value's YAML text.
+ *
+ */
+
+void Keymaster::_notify(const string &key, const string &text)
+{
+    auto i = _notifications.find(key);
+
+    if (i == _notifications.end())
+    {
+        return;
+    }
+
+    if (i->second.interval)
+    {
+        i->second.text = text;
+        i->second.pending = true;
+        return;
+    }
+
+    auto cb = _callbacks.find(key);
+
+    if (cb != _callbacks.end())
+    {
+        cb->second->exec(key, YAML::Load(text));
+    }
+}
+
+/**
+ * Calls the callbacks of the subscriptions with a new value, unless
+ * they were called less than their minimum interval ago.
+ *
+ * @return the time, in milliseconds, until the next of the
+ * callbacks that were held back is due, or -1 if there are none.
+ *
+ */
+
+int Keymaster::_deliver_notifications()
+{
+    Time::Time_t now = Time::getUTC();
+    Time::Time_t wait = 0;
+
+    for (auto i = _notifications.begin(); i != _notifications.end(); ++i)
+    {
+        Notification &n = i->second;
+
+        if (!n.pending)
+        {
+            continue;
+        }
+
+        if (n.next > now)
+        {
+            if (wait == 0 || n.next - now < wait)
+            {
+                wait = n.next - now;
+            }
+
+            continue;
+        }
+
+        auto cb = _callbacks.find(i->first);
+        string text;
+
+        n.pending = false;
+        n.next = now + n.interval;
+        text.swap(n.text);
+
+        if (cb != _callbacks.end())
+        {
+            try
+            {
+                cb->second->exec(i->first, YAML::Load(text));
+            }
+            catch (YAML::Exception &e)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- Keymaster subscriber task: " << i->first << ": "
+                     << e.what() << endl;
+            }
+        }
+    }
+
+    return wait ? wait / 1000000 + 1 : -1;
+}
+
+/**
+ * Obtains a snapshot of the KeymasterServer's whole store, with the
+ * sequence number of the last change in it and the server's epoch.
+ *
+ * @param seq: set to the snapshot's sequence number.
+ *
+ * @param epoch: set to the server's epoch.
+ *
+ * @param text: set to the snapshot's YAML text.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+bool Keymaster::_get_snapshot(uint64_t &seq, string &epoch, string &text)
+{
+    string s;
+    ThreadLock<Mutex> lck(_shared_lock);
+
+    try
+    {
+        lck.lock();
+        shared_ptr<zmq::socket_t> km = _keymaster_socket();
+        z_send(*km, string("SNAP"), 0, KM_TIMEOUT);
+        z_recv(*km, s, KM_TIMEOUT);
+        z_recv(*km, epoch, KM_TIMEOUT);
+        z_recv(*km, text, KM_TIMEOUT);
+        seq = stoull(s);
+        return true;
+    }
+    catch (MatrixException &e)
+    {
+        _handle_keymaster_server_exception();
+        cerr << Time::isoDateTime(Time::getUTC())
+             << " -- Keymaster: unable to get a snapshot: " << e.what() << endl;
+    }
+    catch (std::exception &e)
+    {
+        cerr << Time::isoDateTime(Time::getUTC())
+             << " -- Keymaster: unable to get a snapshot: " << e.what() << endl;
+    }
+
+    return false;
+}
+
 /**
  * Starts the deferred put thread, if it is not already running.
  *
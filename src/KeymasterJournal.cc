@@ -0,0 +1,492 @@
+/*******************************************************************
+ *  KeymasterJournal.cc - Persistence for the Keymaster's store.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/KeymasterJournal.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/matrix_util.h"
+#include "matrix/Time.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+namespace matrix
+{
+/**
+ * Writes all of a string to a file, retrying partial writes.
+ *
+ * @return true on success, false otherwise, with 'errno' set.
+ *
+ */
+
+    static bool write_all(int fd, const string &s)
+    {
+        const char *p = s.data();
+        size_t left = s.size();
+
+        while (left)
+        {
+            ssize_t n = write(fd, p, left);
+
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return false;
+            }
+
+            p += n;
+            left -= n;
+        }
+
+        return true;
+    }
+
+/**
+ * Reads a journal header line starting at 'pos', and moves 'pos' past
+ * it.
+ *
+ * @return false if there is no complete line.
+ *
+ */
+
+    static bool next_line(const string &data, size_t &pos, string &line)
+    {
+        size_t nl = data.find('\n', pos);
+
+        if (nl == string::npos)
+        {
+            return false;
+        }
+
+        line = data.substr(pos, nl - pos);
+        pos = nl + 1;
+        return true;
+    }
+
+/**
+ * Reads 'n' bytes of journal data, which must be followed by a
+ * newline, starting at 'pos', and moves 'pos' past them.
+ *
+ * @return false if the data is incomplete.
+ *
+ */
+
+    static bool next_bytes(const string &data, size_t &pos, size_t n, string &s)
+    {
+        if (data.size() - pos < n + 1 || data[pos + n] != '\n')
+        {
+            return false;
+        }
+
+        s = data.substr(pos, n);
+        pos += n + 1;
+        return true;
+    }
+
+/**
+ * Opens (or creates) a journal. The store is not read until
+ * `restore()` is called.
+ *
+ * @param path: the path and base name of the journal files.
+ *
+ * @param sync: when the journal is written to disk.
+ *
+ * @param sync_interval_ms: the interval for SYNC_PERIODIC.
+ *
+ * @param snapshot_interval: the number of changes journaled between
+ * snapshots.
+ *
+ */
+
+    KeymasterJournal::KeymasterJournal(string path, sync_policy sync,
+                                       int sync_interval_ms, uint64_t snapshot_interval)
+        : _path(path),
+          _sync(sync),
+          _sync_interval_ms(max(sync_interval_ms, 1)),
+          _snapshot_interval(max(snapshot_interval, (uint64_t)1)),
+          _entries(0),
+          _fd(-1),
+          _dirty(false),
+          _sync_thread(this, &KeymasterJournal::_sync_task),
+          _quit(false)
+    {
+        string journal = _path + ".journal";
+
+        _fd = open(journal.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+        if (_fd == -1)
+        {
+            throw MatrixException("KeymasterJournal", journal + ": " + strerror(errno));
+        }
+
+        if (_sync == SYNC_PERIODIC && _sync_thread.start("km_journal") != 0)
+        {
+            close(_fd);
+            throw MatrixException("KeymasterJournal", "unable to start sync thread");
+        }
+    }
+
+    KeymasterJournal::~KeymasterJournal()
+    {
+        if (_sync_thread.running())
+        {
+            _quit.signal(true);
+            _sync_thread.stop_without_cancel();
+        }
+
+        sync();
+        close(_fd);
+    }
+
+/**
+ * Translates the name of a sync policy, as given in the
+ * configuration: "always", "periodic" or "never".
+ *
+ * @param name: the name.
+ *
+ * @return the policy. Unknown names give SYNC_PERIODIC.
+ *
+ */
+
+    KeymasterJournal::sync_policy KeymasterJournal::policy(string name)
+    {
+        if (name == "always")
+        {
+            return SYNC_ALWAYS;
+        }
+
+        if (name == "never")
+        {
+            return SYNC_NEVER;
+        }
+
+        return SYNC_PERIODIC;
+    }
+
+/**
+ * Restores a store from the snapshot and the journal. If there is no
+ * snapshot yet, the store is left as it is, and a snapshot of it made
+ * to start the journal from. If the snapshot can't be read it is
+ * renamed `<path>.snapshot.bad`, and the same is done.
+ *
+ * @param store: the store, normally as loaded from the configuration
+ * file.
+ *
+ * @return true if the store was restored, false if it was left as it
+ * was.
+ *
+ */
+
+    bool KeymasterJournal::restore(KeymasterStore &store)
+    {
+        string snap = _path + ".snapshot";
+        ifstream in(snap.c_str(), ios::in | ios::binary);
+
+        if (in)
+        {
+            try
+            {
+                string line;
+                stringstream text;
+
+                getline(in, line);
+                text << in.rdbuf();
+                uint64_t version = strtoull(line.c_str(), NULL, 10);
+                store.load(YAML::Load(text.str()), version);
+                return _replay(store, version);
+            }
+            catch (YAML::Exception &e)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- KeymasterJournal: " << snap << ": " << e.what()
+                     << "; starting from the configuration." << endl;
+                rename(snap.c_str(), (snap + ".bad").c_str());
+            }
+        }
+
+        snapshot(store);
+        return false;
+    }
+
+/**
+ * Applies the transactions in the journal that are newer than the
+ * snapshot to the store. An incomplete transaction at the end of the
+ * journal, as a crash may leave, is dropped.
+ *
+ * @param store: the store, loaded from the snapshot.
+ *
+ * @param version: the snapshot's version.
+ *
+ * @return true.
+ *
+ */
+
+    bool KeymasterJournal::_replay(KeymasterStore &store, uint64_t version)
+    {
+        string journal = _path + ".journal";
+        ifstream in(journal.c_str(), ios::in | ios::binary);
+        stringstream buf;
+        string data;
+        size_t pos = 0;
+        size_t good = 0;
+
+        buf << in.rdbuf();
+        data = buf.str();
+
+        while (pos < data.size())
+        {
+            vector<KeymasterStore::change> changes;
+            vector<string> results;
+            string line, op;
+            uint64_t v = 0;
+            size_t count = 0;
+            bool complete = next_line(data, pos, line);
+            istringstream hdr(line);
+
+            complete = complete && (hdr >> op >> v >> count) && op == "T";
+
+            for (size_t i = 0; complete && i < count; ++i)
+            {
+                KeymasterStore::change c;
+                istringstream rec;
+                size_t keylen = 0, vallen = 0;
+                int create = 0;
+                string bytes;
+
+                complete = next_line(data, pos, line);
+                rec.str(line);
+                rec >> op;
+                c.del = op == "D";
+                c.create = false;
+
+                if (c.del)
+                {
+                    complete = complete && (rec >> keylen)
+                        && next_bytes(data, pos, keylen, c.keychain);
+                }
+                else
+                {
+                    complete = complete && op == "P" && (rec >> create >> keylen >> vallen)
+                        && next_bytes(data, pos, keylen + vallen, bytes);
+
+                    if (complete)
+                    {
+                        c.keychain = bytes.substr(0, keylen);
+                        c.val = YAML::Load(bytes.substr(keylen));
+                        c.create = create != 0;
+                    }
+                }
+
+                changes.push_back(c);
+            }
+
+            if (!complete)
+            {
+                break;
+            }
+
+            good = pos;
+            ++_entries;
+
+            if (v > version && !store.apply(changes, results))
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- KeymasterJournal: transaction " << v << " did not apply" << endl;
+            }
+        }
+
+        if (good < data.size())
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- KeymasterJournal: " << journal << ": dropping "
+                 << data.size() - good << " bytes of incomplete transaction" << endl;
+
+            if (ftruncate(_fd, good) != 0)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- KeymasterJournal: " << journal << ": " << strerror(errno) << endl;
+            }
+        }
+
+        return true;
+    }
+
+/**
+ * Records a transaction that has been applied to the store. Must be
+ * called once the changes have been made, and before any other change
+ * is, so that the store's version is that of the transaction.
+ *
+ * @param changes: the changes, as given to the store.
+ *
+ * @param store: the store. A snapshot of it is made every
+ * 'snapshot_interval' transactions.
+ *
+ */
+
+    void KeymasterJournal::append(const vector<KeymasterStore::change> &changes,
+                                  const KeymasterStore &store)
+    {
+        ostringstream rec;
+
+        rec << "T " << store.version() << " " << changes.size() << "\n";
+
+        for (auto c = changes.begin(); c != changes.end(); ++c)
+        {
+            if (c->del)
+            {
+                rec << "D " << c->keychain.size() << "\n" << c->keychain << "\n";
+            }
+            else
+            {
+                ostringstream val;
+                val << c->val;
+                string v = val.str();
+                rec << "P " << (c->create ? 1 : 0) << " " << c->keychain.size()
+                    << " " << v.size() << "\n" << c->keychain << v << "\n";
+            }
+        }
+
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+
+        if (!write_all(_fd, rec.str()))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- KeymasterJournal: " << _path << ".journal: " << strerror(errno) << endl;
+        }
+
+        _dirty = true;
+
+        if (_sync == SYNC_ALWAYS)
+        {
+            fdatasync(_fd);
+            _dirty = false;
+        }
+
+        bool compact = ++_entries >= _snapshot_interval;
+        l.unlock();
+
+        if (compact)
+        {
+            snapshot(store);
+        }
+    }
+
+/**
+ * Writes a snapshot of the store and empties the journal. The
+ * snapshot is written to a temporary file which then replaces the
+ * old one, so that there always is a complete snapshot on disk.
+ * Transactions journaled after the store's text was taken, but
+ * before the journal was emptied, are older than the snapshot, and
+ * would be ignored by `restore()` anyway.
+ *
+ * @param store: the store.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool KeymasterJournal::snapshot(const KeymasterStore &store)
+    {
+        string snap = _path + ".snapshot";
+        string tmp = snap + ".tmp";
+        string text;
+        uint64_t version;
+        ThreadLock<Mutex> l(_lock);
+
+        l.lock();
+        store.text("", text, &version);
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool ok = fd != -1
+            && write_all(fd, to_string(version) + "\n")
+            && write_all(fd, text)
+            && fsync(fd) == 0;
+
+        if (fd != -1 && close(fd) != 0)
+        {
+            ok = false;
+        }
+
+        if (!ok || rename(tmp.c_str(), snap.c_str()) != 0)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- KeymasterJournal: " << snap << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        if (ftruncate(_fd, 0) != 0)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- KeymasterJournal: " << _path << ".journal: " << strerror(errno) << endl;
+        }
+
+        _entries = 0;
+        _dirty = false;
+        return true;
+    }
+
+/**
+ * Writes what has been journaled so far to disk.
+ *
+ */
+
+    void KeymasterJournal::sync()
+    {
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+        bool dirty = _dirty;
+        _dirty = false;
+        l.unlock();
+
+        // Outside the lock, so as not to hold up `append()`.
+        if (dirty)
+        {
+            fdatasync(_fd);
+        }
+    }
+
+    void KeymasterJournal::_sync_task()
+    {
+        while (!_quit.wait(true, _sync_interval_ms * 1000))
+        {
+            sync();
+        }
+    }
+}
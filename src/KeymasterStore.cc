@@ -0,0 +1,756 @@
+/*******************************************************************
+ *  KeymasterStore.cc - The Keymaster's key/value tree.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/KeymasterStore.h"
+#include "matrix/ThreadLock.h"
+
+#include <boost/algorithm/string.hpp>
+
+using namespace std;
+
+namespace matrix
+{
+/**
+ * Formats a Keymaster reply. The text is that of a
+ * mxutils::yaml_result with the given fields, so that a client may
+ * load it with `yaml_result::from_yaml_node()`.
+ *
+ * @param result: the result of the operation.
+ *
+ * @param key: the last good key.
+ *
+ * @param err: the error message, if any.
+ *
+ * @param node_text: the serialized last good node.
+ *
+ * @return the reply text.
+ *
+ */
+
+    static string result_text(bool result, const string &key,
+                              const string &err, const string &node_text)
+    {
+        string s;
+
+        s.reserve(node_text.size() + key.size() + err.size() + 48);
+        s += "\nresult: ";
+        s += result ? "true" : "false";
+        s += "\nkey: ";
+        s += KeymasterStore::node::emit_scalar(key);
+        s += "\nerr: ";
+        s += KeymasterStore::node::emit_scalar(err);
+        s += "\nnode: ";
+        s += node_text;
+        s += "\n";
+        return s;
+    }
+
+/**
+ * Joins the first `n` keys of a keychain.
+ *
+ */
+
+    static string join_keys(const vector<string> &keys, size_t n)
+    {
+        return boost::algorithm::join(vector<string>(keys.begin(), keys.begin() + n), ".");
+    }
+
+/**
+ * Follows `keys` down from `root`, pushing each node found onto
+ * `path`, which ends up with the root and then one node per key
+ * found.
+ *
+ * @return the number of keys found.
+ *
+ */
+
+    static size_t walk(KeymasterStore::node_ptr root, const vector<string> &keys,
+                       vector<KeymasterStore::node_ptr> &path)
+    {
+        path.push_back(root);
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            KeymasterStore::node_ptr next = path.back()->find(keys[i]);
+
+            if (!next)
+            {
+                return i;
+            }
+
+            path.push_back(next);
+        }
+
+        return keys.size();
+    }
+
+/**
+ * Replaces the nodes on `path` from depth `depth` up to the root with
+ * copies that lead to `n` instead, and returns the new root.
+ *
+ */
+
+    static KeymasterStore::node_ptr rebuild(const vector<string> &keys,
+                                            const vector<KeymasterStore::node_ptr> &path,
+                                            size_t depth,
+                                            KeymasterStore::node_ptr n)
+    {
+        for (size_t j = depth; j-- > 0;)
+        {
+            n = path[j]->with_child(keys[j], n);
+        }
+
+        return n;
+    }
+
+/**
+ * Sets the value of a keychain in the tree rooted at `root`, which
+ * is replaced by the root of the new tree on success. See
+ * `KeymasterStore::put()`.
+ *
+ */
+
+    static bool put_node(KeymasterStore::node_ptr &root, const string &keychain,
+                         KeymasterStore::node_ptr v, bool create, string &result)
+    {
+        typedef KeymasterStore::node node;
+
+        if (keychain.empty())
+        {
+            root = v;
+            result = result_text(true, "", "", v->serialized());
+            return true;
+        }
+
+        vector<string> keys;
+        vector<KeymasterStore::node_ptr> path;
+        boost::split(keys, keychain, boost::is_any_of("."));
+        size_t found = walk(root, keys, path);
+        KeymasterStore::node_ptr n = v;
+
+        if (found < keys.size())
+        {
+            node::node_type t = path.back()->type;
+
+            if (!create || t == node::SCALAR || t == node::SEQUENCE)
+            {
+                result = result_text(false, join_keys(keys, found),
+                                     "No such key: " + keys[found], path.back()->serialized());
+                return false;
+            }
+
+            // new maps for the missing keys below the last node found
+            for (size_t k = keys.size() - 1; k > found; --k)
+            {
+                n = make_shared<node>(node::MAP)->with_child(keys[k], n);
+            }
+
+            ++found;
+        }
+
+        root = rebuild(keys, path, found, n);
+        result = result_text(true, keychain, "", v->serialized());
+        return true;
+    }
+
+/**
+ * Deletes a keychain from the tree rooted at `root`, which is
+ * replaced by the root of the new tree on success. See
+ * `KeymasterStore::del()`.
+ *
+ */
+
+    static bool del_node(KeymasterStore::node_ptr &root, const string &keychain,
+                         string &result)
+    {
+        vector<string> keys;
+        vector<KeymasterStore::node_ptr> path;
+        boost::split(keys, keychain, boost::is_any_of("."));
+        size_t found = walk(root, keys, path);
+
+        if (found < keys.size())
+        {
+            result = result_text(false, join_keys(keys, found),
+                                 "No such key: " + keys[found], path.back()->serialized());
+            return false;
+        }
+
+        size_t parent = keys.size() - 1;
+        KeymasterStore::node_ptr n = path[parent]->without_child(keys[parent]);
+        root = rebuild(keys, path, parent, n);
+        result = result_text(true, join_keys(keys, parent), "", n->serialized());
+        return true;
+    }
+
+/**
+ * Constructs a store with the contents of a YAML::Node.
+ *
+ * @param root: The initial contents of the store.
+ *
+ */
+
+    KeymasterStore::KeymasterStore(YAML::Node root)
+        : _root(node::from_yaml(root)),
+          _version(0)
+    {
+    }
+
+    KeymasterStore::node_ptr KeymasterStore::_get_root(uint64_t *version) const
+    {
+        ThreadLock<Mutex> l(_root_lock);
+        l.lock();
+
+        if (version)
+        {
+            *version = _version;
+        }
+
+        return _root;
+    }
+
+    void KeymasterStore::_set_root(node_ptr root)
+    {
+        ThreadLock<Mutex> l(_root_lock);
+        l.lock();
+        _root.swap(root);
+        ++_version;
+        l.unlock();
+        // the old root, in 'root', is released here, outside the lock.
+    }
+
+/**
+ * Replaces the contents of the store, as when restoring it from a
+ * copy saved earlier.
+ *
+ * @param root: The new contents of the store.
+ *
+ * @param version: The store's new version number.
+ *
+ */
+
+    void KeymasterStore::load(YAML::Node root, uint64_t version)
+    {
+        node_ptr r = node::from_yaml(root);
+        ThreadLock<Mutex> l(_write_lock);
+        l.lock();
+        ThreadLock<Mutex> rl(_root_lock);
+        rl.lock();
+        _root.swap(r);
+        _version = version;
+        // the old root, in 'r', is released after the locks.
+    }
+
+/**
+ * Looks up a keychain.
+ *
+ * @param keychain: the period-separated keys of the node. An empty
+ * keychain is the root.
+ *
+ * @param result: The yaml_result text: on success, that of the node;
+ * on failure, that of the last good node and its keychain.
+ *
+ * @return true if the keychain exists, false otherwise.
+ *
+ */
+
+    bool KeymasterStore::get(string keychain, string &result) const
+    {
+        node_ptr root = _get_root();
+
+        if (keychain.empty())
+        {
+            result = result_text(true, "", "", root->serialized());
+            return true;
+        }
+
+        vector<string> keys;
+        vector<node_ptr> path;
+        boost::split(keys, keychain, boost::is_any_of("."));
+        size_t found = walk(root, keys, path);
+
+        if (found == keys.size())
+        {
+            result = result_text(true, keychain, "", path.back()->serialized());
+            return true;
+        }
+
+        result = result_text(false, join_keys(keys, found),
+                             "No such key: " + keys[found], path.back()->serialized());
+        return false;
+    }
+
+/**
+ * Sets the value of a keychain, optionally creating it and any of its
+ * parents that do not exist.
+ *
+ * @param keychain: the period-separated keys of the node. An empty
+ * keychain replaces the whole store.
+ *
+ * @param val: The new value.
+ *
+ * @param create: if true, missing keys are created, otherwise the
+ * put fails if any key in the chain is missing.
+ *
+ * @param result: The yaml_result text: on success, that of the new
+ * value; on failure, that of the last good node and its keychain.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool KeymasterStore::put(string keychain, YAML::Node val, bool create, string &result)
+    {
+        node_ptr v = node::from_yaml(val);
+        ThreadLock<Mutex> l(_write_lock);
+        l.lock();
+        node_ptr root = _get_root();
+
+        if (put_node(root, keychain, v, create, result))
+        {
+            _set_root(root);
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Deletes a keychain and its value.
+ *
+ * @param keychain: the period-separated keys of the node to delete.
+ *
+ * @param result: The yaml_result text: on success, that of the
+ * deleted node's parent and its keychain; on failure, that of the
+ * last good node and its keychain.
+ *
+ * @return true on success, false otherwise.
+ *
+ */
+
+    bool KeymasterStore::del(string keychain, string &result)
+    {
+        ThreadLock<Mutex> l(_write_lock);
+        l.lock();
+        node_ptr root = _get_root();
+
+        if (del_node(root, keychain, result))
+        {
+            _set_root(root);
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Applies several PUT and DEL operations as one transaction. The
+ * changes are made in order, each seeing the ones before it, to a
+ * private version of the tree that is made current only if all of
+ * them succeed: readers see either none of the changes or all of
+ * them, and the version number advances once for the lot.
+ *
+ * @param changes: the operations to apply.
+ *
+ * @param results: Receives one yaml_result text per change, as `put()`
+ * or `del()` would give it. If the transaction fails, the result of
+ * the change that failed says why, and that of every other change
+ * says that it was not applied.
+ *
+ * @return true if all the changes were made, false if none were.
+ *
+ */
+
+    bool KeymasterStore::apply(const vector<change> &changes, vector<string> &results)
+    {
+        vector<node_ptr> vals;
+
+        // convert the values before taking the lock.
+        for (auto &c : changes)
+        {
+            vals.push_back(c.del ? node_ptr() : node::from_yaml(c.val));
+        }
+
+        ThreadLock<Mutex> l(_write_lock);
+        l.lock();
+        node_ptr root = _get_root();
+        size_t failed = changes.size();
+
+        results.assign(changes.size(), string());
+
+        for (size_t i = 0; i < changes.size() && failed == changes.size(); ++i)
+        {
+            const change &c = changes[i];
+            bool rval = c.del ? del_node(root, c.keychain, results[i])
+                : put_node(root, c.keychain, vals[i], c.create, results[i]);
+
+            if (!rval)
+            {
+                failed = i;
+            }
+        }
+
+        if (failed < changes.size())
+        {
+            string err = "Transaction aborted: " + changes[failed].keychain + " failed";
+
+            for (size_t i = 0; i < changes.size(); ++i)
+            {
+                if (i != failed)
+                {
+                    results[i] = result_text(false, changes[i].keychain, err, "~");
+                }
+            }
+
+            return false;
+        }
+
+        if (!changes.empty())
+        {
+            _set_root(root);
+        }
+
+        return true;
+    }
+
+/**
+ * Obtains the serialized value of a keychain, as published to
+ * subscribers.
+ *
+ * @param keychain: the period-separated keys of the node. An empty
+ * keychain is the root.
+ *
+ * @param val: The value's YAML text.
+ *
+ * @param version: If given, is set to the version of the store the
+ * text was taken from.
+ *
+ * @return true if the keychain exists, false otherwise.
+ *
+ */
+
+    bool KeymasterStore::text(string keychain, string &val, uint64_t *version) const
+    {
+        vector<string> keys;
+        vector<node_ptr> path;
+        node_ptr root = _get_root(version);
+
+        if (!keychain.empty())
+        {
+            boost::split(keys, keychain, boost::is_any_of("."));
+        }
+
+        if (walk(root, keys, path) < keys.size())
+        {
+            return false;
+        }
+
+        val = path.back()->serialized();
+        return true;
+    }
+
+/**
+ * Returns the store's version, the number of changes made to it.
+ *
+ */
+
+    uint64_t KeymasterStore::version() const
+    {
+        uint64_t v;
+        _get_root(&v);
+        return v;
+    }
+
+/**
+ * \struct KeymasterStore::node
+ *
+ */
+
+    KeymasterStore::node::node(node_type t)
+        : type(t),
+          _text(nullptr)
+    {
+    }
+
+/**
+ * Copies a node, except for its serialized text: the copy is made to
+ * be changed.
+ *
+ */
+
+    KeymasterStore::node::node(const node &n)
+        : type(n.type),
+          scalar(n.scalar),
+          keys(n.keys),
+          key_text(n.key_text),
+          children(n.children),
+          _text(nullptr)
+    {
+    }
+
+    KeymasterStore::node::~node()
+    {
+        delete _text.load();
+    }
+
+/**
+ * Converts a YAML::Node into a store node.
+ *
+ */
+
+    KeymasterStore::node_ptr KeymasterStore::node::from_yaml(const YAML::Node &n)
+    {
+        shared_ptr<node> p;
+
+        switch (n.Type())
+        {
+        case YAML::NodeType::Scalar:
+            p = make_shared<node>(SCALAR);
+            p->scalar = n.Scalar();
+            break;
+
+        case YAML::NodeType::Sequence:
+            p = make_shared<node>(SEQUENCE);
+            p->children.reserve(n.size());
+
+            for (YAML::const_iterator i = n.begin(); i != n.end(); ++i)
+            {
+                p->children.push_back(from_yaml(*i));
+            }
+
+            break;
+
+        case YAML::NodeType::Map:
+            p = make_shared<node>(MAP);
+            p->keys.reserve(n.size());
+            p->key_text.reserve(n.size());
+            p->children.reserve(n.size());
+
+            for (YAML::const_iterator i = n.begin(); i != n.end(); ++i)
+            {
+                p->keys.push_back(i->first.Scalar());
+                p->key_text.push_back(emit_scalar(p->keys.back()));
+                p->children.push_back(from_yaml(i->second));
+            }
+
+            break;
+
+        default:
+            p = make_shared<node>(NUL);
+            break;
+        }
+
+        return p;
+    }
+
+/**
+ * Renders a scalar as YAML text, quoted as needed for use in a flow
+ * collection.
+ *
+ */
+
+    string KeymasterStore::node::emit_scalar(const string &s)
+    {
+        YAML::Emitter e;
+
+        e << YAML::Flow << YAML::BeginSeq << s << YAML::EndSeq;
+        // strip the enclosing '[' and ']'
+        string t(e.c_str());
+        return t.substr(1, t.size() - 2);
+    }
+
+/**
+ * Returns the position of `key` in a map's `keys`, or of the element
+ * `key` of a sequence, or -1 if there is none.
+ *
+ */
+
+    int KeymasterStore::node::_index(const string &key) const
+    {
+        if (type == MAP)
+        {
+            for (size_t i = 0; i < keys.size(); ++i)
+            {
+                if (keys[i] == key)
+                {
+                    return i;
+                }
+            }
+        }
+        else if (type == SEQUENCE && !key.empty() && key.size() < 10
+                 && key.find_first_not_of("0123456789") == string::npos)
+        {
+            size_t i = stoul(key);
+
+            if (i < children.size())
+            {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+/**
+ * Looks up a child.
+ *
+ * @param key: a map key, or a sequence index.
+ *
+ * @return the child, or an empty pointer if there is none.
+ *
+ */
+
+    KeymasterStore::node_ptr KeymasterStore::node::find(const string &key) const
+    {
+        int i = _index(key);
+        return i < 0 ? node_ptr() : children[i];
+    }
+
+/**
+ * Returns a copy of this node in which `key` is `child`, replacing or
+ * adding it as needed. A null node becomes a map.
+ *
+ */
+
+    KeymasterStore::node_ptr KeymasterStore::node::with_child(const string &key, node_ptr child) const
+    {
+        shared_ptr<node> p = make_shared<node>(*this);
+        int i = _index(key);
+
+        if (i >= 0)
+        {
+            p->children[i] = child;
+        }
+        else
+        {
+            p->type = MAP;
+            p->scalar.clear();
+            p->keys.push_back(key);
+            p->key_text.push_back(emit_scalar(key));
+            p->children.push_back(child);
+        }
+
+        return p;
+    }
+
+/**
+ * Returns a copy of this node without `key`.
+ *
+ */
+
+    KeymasterStore::node_ptr KeymasterStore::node::without_child(const string &key) const
+    {
+        shared_ptr<node> p = make_shared<node>(*this);
+        int i = _index(key);
+
+        if (i >= 0)
+        {
+            p->children.erase(p->children.begin() + i);
+
+            if (type == MAP)
+            {
+                p->keys.erase(p->keys.begin() + i);
+                p->key_text.erase(p->key_text.begin() + i);
+            }
+        }
+
+        return p;
+    }
+
+/**
+ * Returns the node as YAML flow style text. The text is made the
+ * first time it is needed; as the node is immutable it never goes
+ * stale. Several threads may race to make it, in which case the first
+ * one's is kept.
+ *
+ */
+
+    const string &KeymasterStore::node::serialized() const
+    {
+        const string *t = _text.load(std::memory_order_acquire);
+
+        if (t)
+        {
+            return *t;
+        }
+
+        string *s = new string();
+
+        switch (type)
+        {
+        case SCALAR:
+            *s = emit_scalar(scalar);
+            break;
+
+        case SEQUENCE:
+            *s += "[";
+
+            for (size_t i = 0; i < children.size(); ++i)
+            {
+                if (i)
+                {
+                    *s += ", ";
+                }
+
+                *s += children[i]->serialized();
+            }
+
+            *s += "]";
+            break;
+
+        case MAP:
+            *s += "{";
+
+            for (size_t i = 0; i < children.size(); ++i)
+            {
+                if (i)
+                {
+                    *s += ", ";
+                }
+
+                *s += key_text[i];
+                *s += ": ";
+                *s += children[i]->serialized();
+            }
+
+            *s += "}";
+            break;
+
+        default:
+            *s = "~";
+            break;
+        }
+
+        if (!_text.compare_exchange_strong(t, s, std::memory_order_acq_rel))
+        {
+            delete s;
+            return *t;
+        }
+
+        return *s;
+    }
+
+}
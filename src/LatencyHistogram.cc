@@ -0,0 +1,167 @@
+/*******************************************************************
+ *  LatencyHistogram.cc - A lock-free histogram of durations.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/LatencyHistogram.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace matrix
+{
+    LatencyHistogram::LatencyHistogram()
+    {
+        reset();
+    }
+
+/**
+ * Clears the histogram. Values recorded while this is going on may or
+ * may not be kept.
+ *
+ */
+
+    void LatencyHistogram::reset()
+    {
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            _buckets[i].store(0, memory_order_relaxed);
+        }
+
+        _count.store(0, memory_order_relaxed);
+        _sum.store(0, memory_order_relaxed);
+        _max.store(0, memory_order_relaxed);
+    }
+
+/**
+ * The smallest duration counted in a bucket.
+ *
+ */
+
+    uint64_t LatencyHistogram::bucket_value(int b)
+    {
+        if (b < SUB_BUCKETS)
+        {
+            return b;
+        }
+
+        int e = b / SUB_BUCKETS + SUB_BITS - 1;
+        uint64_t sub = b % SUB_BUCKETS;
+        return (SUB_BUCKETS + sub) << (e - SUB_BITS);
+    }
+
+    uint64_t LatencyHistogram::count() const
+    {
+        return _count.load(memory_order_relaxed);
+    }
+
+    uint64_t LatencyHistogram::max() const
+    {
+        return _max.load(memory_order_relaxed);
+    }
+
+    double LatencyHistogram::mean() const
+    {
+        uint64_t n = count();
+        return n ? (double)_sum.load(memory_order_relaxed) / n : 0.0;
+    }
+
+/**
+ * Estimates a percentile of the durations recorded.
+ *
+ * @param p: the percentile, 0 to 100.
+ *
+ * @return the middle of the bucket the percentile falls in, or the
+ * largest value recorded if that is smaller or the percentile is the
+ * last one. 0 if nothing was recorded.
+ *
+ */
+
+    uint64_t LatencyHistogram::percentile(double p) const
+    {
+        uint64_t total = 0;
+        uint64_t counts[BUCKETS];
+
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            counts[i] = _buckets[i].load(memory_order_relaxed);
+            total += counts[i];
+        }
+
+        if (total == 0)
+        {
+            return 0;
+        }
+
+        uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+        uint64_t seen = 0;
+
+        if (rank >= total)
+        {
+            return max();
+        }
+
+        rank = rank < 1 ? 1 : rank;
+
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+
+            if (seen >= rank)
+            {
+                uint64_t lo = bucket_value(i);
+                uint64_t mid = lo + (bucket_value(i + 1) - lo) / 2;
+                return std::min(mid, max());
+            }
+        }
+
+        return max();
+    }
+
+/**
+ * A summary of the histogram, for publication:
+ *
+ *     {count: 1234, mean: 5321.2, max: 90112, p50: 4864, p90: 7168,
+ *      p99: 11264, p999: 40960}
+ *
+ * Durations are in nanoseconds.
+ *
+ */
+
+    YAML::Node LatencyHistogram::to_yaml() const
+    {
+        YAML::Node n;
+
+        n["count"] = count();
+        n["mean"] = mean();
+        n["max"] = max();
+        n["p50"] = percentile(50.0);
+        n["p90"] = percentile(90.0);
+        n["p99"] = percentile(99.0);
+        n["p999"] = percentile(99.9);
+        return n;
+    }
+}
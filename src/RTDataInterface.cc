@@ -32,6 +32,9 @@
 #include "matrix/ThreadLock.h"
 
 #include <string>
+#include <atomic>
+
+#include <sched.h>
 
 using namespace std;
 using namespace mxutils;
@@ -67,26 +70,58 @@ namespace matrix
 /**
  * \class Impl is the private implementation of the RTTransportServer class
  *
+ * Publishing is the hot path, and takes no lock. Each data key is
+ * interned to a small integer handle (see `intern()`), and the
+ * subscribers are kept in an immutable `dispatch_table` indexed by
+ * handle. `publish()` just loads the current table and walks the
+ * subscribers for its handle. Subscribing or unsubscribing, which is
+ * rare, builds a new table under '_client_mutex', swaps it in, waits
+ * for all publishers that might still be using the old one to finish
+ * (`synchronize()`), and then deletes the old one. Thus once
+ * `unsubscribe()` returns, the callback will not be called again.
+ *
+ * Publishers announce themselves by bumping one of two counters,
+ * chosen by the low bit of '_epoch', for the duration of a
+ * publish. `synchronize()` flips the epoch and waits for the counter
+ * that was in use to drain, twice, so that it waits for both; the
+ * flip lets new publishers move to the other counter, so a steady
+ * stream of them cannot hold up the writer.
+ *
  */
 
     struct RTTransportServer::Impl
     {
+        // subscribers, indexed by key handle
+        typedef vector<vector<DataCallbackBase *> > dispatch_table;
+
         Impl(string urn);
         ~Impl();
 
-        bool publish(string key, string data);
-        bool publish(string key, void const *data, size_t sze);
+        key_handle_t intern(string key);
+        key_handle_t find(string key);
+        bool publish(key_handle_t h, const string &key, void const *data, size_t sze);
+        bool publish_batch(key_handle_t h, const string &key, void const *data,
+                           size_t sze, size_t n);
         string get_urn();
         bool subscribe(string key, DataCallbackBase *cb);
         bool unsubscribe(string key, DataCallbackBase *cb);
 
+        key_handle_t _intern(string key);
+        void _update_table();
+        void _synchronize();
+
         // This is how the server knows who its subscribers are. The
-        // first template arg is a key, which is in the form
-        // "component.data". So if component 'cat' emits data 'meow', the
-        // key would be "cat.meow". This class needs some way to
-        // populate this map. This is done via the 'subscribe' method.
+        // key is in the form "component.data". So if component 'cat'
+        // emits data 'meow', the key would be "cat.meow". This is
+        // populated via the 'subscribe' method, and is the master
+        // copy from which the dispatch tables are built.
         Mutex _client_mutex;
-        multimap<string, DataCallbackBase *> _clients;
+        map<string, key_handle_t> _handles;
+        multimap<key_handle_t, DataCallbackBase *> _clients;
+
+        std::atomic<const dispatch_table *> _table;
+        std::atomic<unsigned> _epoch;
+        std::atomic<long> _publishers[2];
         string _urn;
     };
 
@@ -97,7 +132,11 @@ namespace matrix
  *
  */
     RTTransportServer::Impl::Impl(string urn)
+        : _table(new dispatch_table()),
+          _epoch(0)
     {
+        _publishers[0] = 0;
+        _publishers[1] = 0;
         _urn = urn + "://" + gen_random_string(20);
     }
 
@@ -108,33 +147,72 @@ namespace matrix
 
     RTTransportServer::Impl::~Impl()
     {
+        delete _table.load();
     }
 
 /**
- * Published data by key, as a std::string.
+ * Returns the handle for 'key', assigning the next free one if the
+ * key hasn't been seen before. Handles are never reused.
  *
  * @param key: The data key
  *
- * @return returns `true` if pub succeeded, `false` otherwise.
+ * @return The key's handle.
  *
  */
 
-    bool RTTransportServer::Impl::publish(string key, string data)
+    TransportServer::key_handle_t RTTransportServer::Impl::intern(string key)
+    {
+        ThreadLock<Mutex> l(_client_mutex);
+
+        l.lock();
+        return _intern(key);
+    }
+
+    TransportServer::key_handle_t RTTransportServer::Impl::_intern(string key)
     {
-        return publish(key, data.data(), data.size());
+        map<string, key_handle_t>::iterator i = _handles.find(key);
+
+        if (i == _handles.end())
+        {
+            i = _handles.insert(make_pair(key, (key_handle_t)_handles.size())).first;
+        }
+
+        return i->second;
     }
 
 /**
- * Publishes data by key, void * and size. Data from DataSinks are
- * published with a key that corresponds to the source component and
- * data, with the format 'source.data', where 'source' is the source
- * component's name, and 'data' is the named data stream. Each data
- * stream 'source.data' may have multiple clients. RTTransportServer,
- * like ZMQ based transports, may publish the same data to multiple
- * clients.
+ * Looks up the handle for 'key' without interning it. Used by the
+ * publish-by-key interface.
  *
  * @param key: The data key
  *
+ * @return The handle, or NO_HANDLE if nobody has used the key.
+ *
+ */
+
+    TransportServer::key_handle_t RTTransportServer::Impl::find(string key)
+    {
+        ThreadLock<Mutex> l(_client_mutex);
+        map<string, key_handle_t>::const_iterator i;
+
+        l.lock();
+        i = _handles.find(key);
+        return i == _handles.end() ? NO_HANDLE : i->second;
+    }
+
+/**
+ * Publishes data by key handle, void * and size. Data from DataSinks
+ * are published with a key that corresponds to the source component
+ * and data, with the format 'source.data', where 'source' is the
+ * source component's name, and 'data' is the named data
+ * stream. Each data stream 'source.data' may have multiple
+ * clients. RTTransportServer, like ZMQ based transports, may
+ * publish the same data to multiple clients.
+ *
+ * @param h: The key's handle, from `intern()`
+ *
+ * @param key: The data key, passed on to the subscribers
+ *
  * @param data: A pointer to the data
  *
  * @param sze: The size of the data buffer pointed to by 'data'
@@ -144,26 +222,110 @@ namespace matrix
  *
  */
 
-    bool RTTransportServer::Impl::publish(string key, void const *data, size_t sze)
+    bool RTTransportServer::Impl::publish(key_handle_t h, const string &key,
+                                          void const *data, size_t sze)
     {
         bool rval = false;
-        multimap<string, DataCallbackBase *>::iterator client;
-        ThreadLock<Mutex> l(_client_mutex);
+        unsigned e = _epoch.load() & 1;
 
-        l.lock();
+        _publishers[e].fetch_add(1);
+        const dispatch_table *t = _table.load();
+
+        if (h >= 0 && (size_t)h < t->size())
+        {
+            for (DataCallbackBase *cb : (*t)[h])
+            {
+                cb->exec(key, (void *)data, sze);
+                rval = true;
+            }
+        }
 
-        // Find all clients subscribed to the data represented by 'key'.
-        for (client = _clients.equal_range(key).first;
-             client != _clients.equal_range(key).second; ++client)
+        _publishers[e].fetch_sub(1);
+        return rval;
+    }
+
+/**
+ * Publishes a batch of 'n' elements of 'sze' bytes by key handle.
+ * Each subscriber gets the whole batch in one callback (`exec_n()`).
+ *
+ * @param h: The key's handle, from `intern()`
+ *
+ * @param key: The data key
+ *
+ * @param data: A pointer to the first element
+ *
+ * @param sze: The size of each element
+ *
+ * @param n: The number of elements
+ *
+ * @return true if publish succeeded, false otherwise. The call will
+ * fail if there is no subscriber.
+ *
+ */
+
+    bool RTTransportServer::Impl::publish_batch(key_handle_t h, const string &key,
+                                                void const *data, size_t sze, size_t n)
+    {
+        bool rval = false;
+        unsigned e = _epoch.load() & 1;
+
+        _publishers[e].fetch_add(1);
+        const dispatch_table *t = _table.load();
+
+        if (h >= 0 && (size_t)h < t->size())
         {
-            // call their callbacks with the data.
-            client->second->exec(key, (void *)data, sze);
-            rval = true;
+            for (DataCallbackBase *cb : (*t)[h])
+            {
+                cb->exec_n(key, (void *)data, sze, n);
+                rval = true;
+            }
         }
 
+        _publishers[e].fetch_sub(1);
         return rval;
     }
 
+/**
+ * Builds a new dispatch table from '_clients' and swaps it in,
+ * deleting the old one once no publisher can be using it. Must be
+ * called with '_client_mutex' held.
+ *
+ */
+
+    void RTTransportServer::Impl::_update_table()
+    {
+        dispatch_table *t = new dispatch_table(_handles.size());
+        multimap<key_handle_t, DataCallbackBase *>::const_iterator client;
+
+        for (client = _clients.begin(); client != _clients.end(); ++client)
+        {
+            (*t)[client->first].push_back(client->second);
+        }
+
+        const dispatch_table *old = _table.exchange(t);
+        _synchronize();
+        delete old;
+    }
+
+/**
+ * Waits until every publish that started before the call has
+ * finished. Must be called with '_client_mutex' held.
+ *
+ */
+
+    void RTTransportServer::Impl::_synchronize()
+    {
+        for (int i = 0; i < 2; ++i)
+        {
+            unsigned e = _epoch.fetch_add(1) & 1;
+
+            while (_publishers[e].load() != 0)
+            {
+                sched_yield();
+            }
+        }
+    }
+
 /**
  * Returns the as-configured urn.
  *
@@ -201,7 +363,8 @@ namespace matrix
         ThreadLock<Mutex> l(_client_mutex);
 
         l.lock();
-        _clients.insert(make_pair(key, cb));
+        _clients.insert(make_pair(_intern(key), cb));
+        _update_table();
         return true;
     }
 
@@ -213,8 +376,8 @@ namespace matrix
  *
  * @param key: The data key.
  *
- * @param cb: The callback functor pointer. This should match the one
- * in the 'clients' map, otherwise the function will not succeed.
+ * @param cb: The callback functor pointer. Currently ignored; see
+ * below.
  *
  * @return true if the unsubscribe succeeds, false otherwise. Failure
  * means that the client was not already subscribed.
@@ -223,25 +386,21 @@ namespace matrix
 
     bool RTTransportServer::Impl::unsubscribe(string key, DataCallbackBase *)
     {
-        bool rval = false;
-        multimap<string, DataCallbackBase *>::iterator client;
         ThreadLock<Mutex> l(_client_mutex);
+        map<string, key_handle_t>::const_iterator h;
 
         l.lock();
 
-        // Many clients may be registered for this data under
-        // 'key'. Look for an exact match of key, cb:
         // Note: We delete all clients for a given key with the rtproc
         // transport because the unsubscribe call here only is
         // called once due to reference counting on the TC. -- JJB
-        for (client = _clients.equal_range(key).first;
-             client != _clients.equal_range(key).second; ++client)
+        if ((h = _handles.find(key)) == _handles.end() || _clients.erase(h->second) == 0)
         {
-            _clients.erase(client);
-            rval = true;
+            return false;
         }
 
-        return rval;
+        _update_table();
+        return true;
     }
 
 /**
@@ -318,7 +477,9 @@ namespace matrix
     }
 
 /**
- * This private function provides the TransportServer 'publish()' functionality.
+ * This private function provides the TransportServer 'publish()'
+ * functionality. Publishing by key requires a lookup under a lock;
+ * DataSources use the interned interface below instead.
  *
  * @param key: The data key.
  *
@@ -333,7 +494,7 @@ namespace matrix
 
     bool RTTransportServer::_publish(string key, const void *data, size_t size_of_data)
     {
-        return _impl->publish(key, data, size_of_data);
+        return _impl->publish(_impl->find(key), key, data, size_of_data);
     }
 
 /**
@@ -349,7 +510,64 @@ namespace matrix
  */
     bool RTTransportServer::_publish(string key, string data)
     {
-        return _impl->publish(key, data);
+        return _impl->publish(_impl->find(key), key, data.data(), data.size());
+    }
+
+/**
+ * This private function provides the TransportServer
+ * 'publish_batch()' functionality.
+ *
+ * @param key: The data key.
+ *
+ * @param data: A pointer to the first element to publish.
+ *
+ * @param size_of_element: The size of each element in bytes.
+ *
+ * @param count: The number of elements.
+ *
+ * @return true on success, false otherwise. Failure simply indicates
+ * that there is no client subscribed for this data.
+ *
+ */
+
+    bool RTTransportServer::_publish_batch(string key, const void *data,
+                                           size_t size_of_element, size_t count)
+    {
+        return _impl->publish_batch(_impl->find(key), key, data, size_of_element, count);
+    }
+
+    TransportServer::key_handle_t RTTransportServer::_intern(string key)
+    {
+        return _impl->intern(key);
+    }
+
+/**
+ * Lock free publish by key handle. This is what a DataSource uses.
+ *
+ * @param h: The handle returned by `intern(key)`.
+ *
+ * @param key: The data key.
+ *
+ * @param data: A pointer to the data buffer to publish
+ *
+ * @param size_of_data: The size of the 'data' buffer in bytes.
+ *
+ * @return true on success, false otherwise. Failure simply indicates
+ * that there is no client subscribed for this data.
+ *
+ */
+
+    bool RTTransportServer::_publish_interned(key_handle_t h, const string &key,
+                                              const void *data, size_t size_of_data)
+    {
+        return _impl->publish(h, key, data, size_of_data);
+    }
+
+    bool RTTransportServer::_publish_batch_interned(key_handle_t h, const string &key,
+                                                    const void *data, size_t size_of_element,
+                                                    size_t count)
+    {
+        return _impl->publish_batch(h, key, data, size_of_element, count);
     }
 
 
@@ -371,17 +589,18 @@ namespace matrix
  */
 
     RTTransportClient::RTTransportClient(string urn)
-        : TransportClient(urn)
+        : TransportClient(urn),
+          _cb(NULL)
     {
     }
 
 
     RTTransportClient::~RTTransportClient()
     {
-        _unsubscribe(_key, _cb);
+        _unsubscribe(_key);
     }
 
-    bool RTTransportClient::_connect(string)
+    bool RTTransportClient::_connect()
     {
         bool rval = false;
 
@@ -399,7 +618,7 @@ namespace matrix
 
         if (!_key.empty() && _cb != NULL)
         {
-            rval = _unsubscribe(_key, _cb);
+            rval = _unsubscribe(_key);
         }
 
         return rval;
@@ -423,19 +642,18 @@ namespace matrix
         return rval;
     }
 
-    bool RTTransportClient::_unsubscribe(string key, DataCallbackBase *cb)
+    bool RTTransportClient::_unsubscribe(string key)
     {
         bool rval = false;
         std::map<std::string, RTTransportServer *>::iterator server;
 
         _key = key;
-        _cb = cb;
 
         if ((server = RTTransportServer::_rttransports.find(_urn))
             != RTTransportServer::_rttransports.end())
         {
             // got the RTTransportServer...
-            rval = server->second->_unsubscribe(key, cb);
+            rval = server->second->_unsubscribe(key, _cb);
         }
 
         return rval;
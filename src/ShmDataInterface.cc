@@ -0,0 +1,784 @@
+/*******************************************************************
+ *  ShmDataInterface.cc - Implementation of a shared memory transport.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/ShmDataInterface.h"
+#include "matrix/zmq_util.h"
+#include "matrix/Keymaster.h"
+#include "matrix/Mutex.h"
+#include "matrix/ThreadLock.h"
+#include "matrix/Thread.h"
+#include "matrix/Time.h"
+
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+using namespace std;
+using namespace mxutils;
+
+namespace
+{
+    const uint32_t SHM_MAGIC = 0x4853584d; // "MXSH"
+    const uint32_t SHM_VERSION = 1;
+    const uint32_t SHM_WRAP = 0xffffffff;
+    const size_t SHM_DEFAULT_SIZE = 4 * 1024 * 1024;
+    const size_t SHM_MIN_SIZE = 64 * 1024;
+
+    // The segment starts with this header. The ring proper starts at
+    // SHM_DATA_OFFSET. Positions ('write_pos', 'oldest_pos', a
+    // reader's cursor) are byte counts that only ever increase; the
+    // physical offset of a position is 'pos % capacity'. The ring
+    // holds the messages in [oldest_pos, write_pos).
+    struct shm_header
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t capacity;
+        std::atomic<uint64_t> write_pos;
+        std::atomic<uint64_t> oldest_pos;
+        std::atomic<uint32_t> signal;   // futex word, bumped on every publish
+        std::atomic<uint32_t> waiters;  // readers sleeping on 'signal'
+    };
+
+    const size_t SHM_DATA_OFFSET = 128;
+    static_assert(sizeof(shm_header) <= SHM_DATA_OFFSET, "shm_header too large");
+
+    // Each message is a record header followed by the key and the
+    // data, padded to 8 bytes. Records never straddle the end of the
+    // ring: if one doesn't fit, the writer leaves a SHM_WRAP record
+    // (or, if there isn't even room for that, nothing) and starts
+    // over at offset 0. 'count' is 0 for a plain message, or the
+    // number of elements in a batch.
+    struct shm_record
+    {
+        uint64_t pos;
+        uint32_t key_len;
+        uint32_t count;
+        uint64_t data_len;
+    };
+
+    inline uint64_t record_size(uint64_t key_len, uint64_t data_len)
+    {
+        return (sizeof(shm_record) + key_len + data_len + 7) & ~(uint64_t)7;
+    }
+
+    inline long futex_wait(std::atomic<uint32_t> *addr, uint32_t val, const timespec *to)
+    {
+        // not FUTEX_WAIT_PRIVATE: the word is shared between processes.
+        return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, val, to, NULL, 0);
+    }
+
+    inline long futex_wake(std::atomic<uint32_t> *addr)
+    {
+        return syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+
+    // "shm://matrix.XXX" -> "/matrix.XXX", the shm_open() name.
+    string shm_name(string urn)
+    {
+        size_t p = urn.find("://");
+        return "/" + (p == string::npos ? urn : urn.substr(p + 3));
+    }
+}
+
+namespace matrix
+{
+/**
+ * Creates a ShmTransportServer, returning a TransportServer pointer to
+ * it. This is a static function that can be used by
+ * TransportServer::create() to create this type of object based
+ * solely on the transports provided to create(). The caller of
+ * TransportServer::create() thus needs no specific knowledge of
+ * ShmTransportServer.
+ *
+ * @param km_urn: the URN to the keymaster.
+ *
+ * @param key: The key to query the keymaster. This key should point to
+ * a YAML node that contains information about the data source. One of
+ * the sub-keys of this node must be a key 'Specified', which returns a
+ * vector of transports required for this data source.
+ *
+ * @return A TransportServer * pointing to the created ShmTransportServer.
+ *
+ */
+
+    TransportServer *ShmTransportServer::factory(string km_url, string key)
+    {
+        TransportServer *ds = new ShmTransportServer(km_url, key);
+        return ds;
+    }
+
+/**
+ * \class Impl is the private implementation of the ShmTransportServer class
+ *
+ */
+
+    struct ShmTransportServer::Impl
+    {
+        Impl(string urn, size_t size);
+        ~Impl();
+
+        bool publish(string key, void const *data, size_t sze, size_t n);
+        string get_urn();
+
+        uint64_t next_record(uint64_t pos);
+        void make_room(uint64_t end);
+
+        Mutex _writer_lock;
+        string _urn;
+        string _name;
+        size_t _map_size;
+        shm_header *_hdr;
+        char *_ring;
+    };
+
+/**
+ * Creates the shared memory segment and initializes the ring.
+ *
+ * @param urn: The specified URN for this transport. If only "shm" is
+ * given, a random segment name is generated.
+ *
+ * @param size: The size of the ring, in bytes.
+ *
+ */
+
+    ShmTransportServer::Impl::Impl(string urn, size_t size)
+        : _map_size(0),
+          _hdr(NULL),
+          _ring(NULL)
+    {
+        bool ephemeral = urn.find("://") == string::npos;
+        int fd = -1;
+
+        size = max(size, SHM_MIN_SIZE) & ~(size_t)7;
+        _map_size = SHM_DATA_OFFSET + size;
+
+        // An ephemeral name that collides with an existing segment
+        // (perhaps left behind by a crashed process) is simply
+        // replaced by another.
+        for (int i = 0; i < 10; ++i)
+        {
+            _urn = ephemeral ? "shm://matrix." + gen_random_string(20) : urn;
+            _name = shm_name(_urn);
+            fd = shm_open(_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+
+            if (fd != -1 || errno != EEXIST || !ephemeral)
+            {
+                break;
+            }
+        }
+
+        if (fd == -1)
+        {
+            throw CreationError(_urn + ": shm_open(): " + strerror(errno));
+        }
+
+        void *p = MAP_FAILED;
+
+        if (ftruncate(fd, _map_size) == 0)
+        {
+            p = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        int err = errno;
+        close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            shm_unlink(_name.c_str());
+            throw CreationError(_urn + ": cannot map segment: " + strerror(err));
+        }
+
+        // the segment comes up zero filled, which is a valid empty ring.
+        _hdr = (shm_header *)p;
+        _ring = (char *)p + SHM_DATA_OFFSET;
+        _hdr->capacity = size;
+        _hdr->version = SHM_VERSION;
+        atomic_thread_fence(memory_order_release);
+        _hdr->magic = SHM_MAGIC;
+    }
+
+/**
+ * Unmaps and unlinks the segment. Readers that still have it mapped
+ * keep their mapping; they simply see no more data.
+ *
+ */
+
+    ShmTransportServer::Impl::~Impl()
+    {
+        if (_hdr)
+        {
+            munmap(_hdr, _map_size);
+            shm_unlink(_name.c_str());
+        }
+    }
+
+/**
+ * Returns the position of the record following the one at 'pos'.
+ *
+ */
+
+    uint64_t ShmTransportServer::Impl::next_record(uint64_t pos)
+    {
+        uint64_t cap = _hdr->capacity;
+        uint64_t off = pos % cap;
+        shm_record r;
+
+        if (cap - off < sizeof r)
+        {
+            return pos + cap - off;
+        }
+
+        memcpy(&r, _ring + off, sizeof r);
+
+        if (r.key_len == SHM_WRAP)
+        {
+            return pos + cap - off;
+        }
+
+        return pos + record_size(r.key_len, r.data_len);
+    }
+
+/**
+ * Retires the oldest records until the bytes up to 'end' may be
+ * written without overwriting a record still considered valid. The
+ * new 'oldest_pos' is made visible before any of those bytes are
+ * touched, so that a reader copying a record that is being
+ * overwritten will notice when it re-checks 'oldest_pos'.
+ *
+ */
+
+    void ShmTransportServer::Impl::make_room(uint64_t end)
+    {
+        uint64_t oldest = _hdr->oldest_pos.load(memory_order_relaxed);
+        uint64_t orig = oldest;
+
+        while (end - oldest > _hdr->capacity)
+        {
+            oldest = next_record(oldest);
+        }
+
+        if (oldest != orig)
+        {
+            _hdr->oldest_pos.store(oldest, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+        }
+    }
+
+/**
+ * Writes one message into the ring and wakes any sleeping readers.
+ *
+ * @param key: The data key
+ *
+ * @param data: A pointer to the data
+ *
+ * @param sze: The size of the data buffer pointed to by 'data'
+ *
+ * @param n: 0 for a single message, otherwise the number of
+ * elements in 'data'.
+ *
+ * @return true if the message was written, false if it is too
+ * large for the ring.
+ *
+ */
+
+    bool ShmTransportServer::Impl::publish(string key, void const *data, size_t sze, size_t n)
+    {
+        uint64_t cap = _hdr->capacity;
+        uint64_t len = record_size(key.size(), sze);
+
+        if (len > cap / 2)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ShmTransportServer " << _urn << ": message for " << key
+                 << " (" << sze << " bytes) exceeds half the ring size." << endl;
+            return false;
+        }
+
+        ThreadLock<Mutex> l(_writer_lock);
+        l.lock();
+
+        uint64_t pos = _hdr->write_pos.load(memory_order_relaxed);
+        uint64_t off = pos % cap;
+
+        if (cap - off < len)
+        {
+            make_room(pos + cap - off);
+
+            if (cap - off >= sizeof(shm_record))
+            {
+                shm_record w = {pos, SHM_WRAP, 0, 0};
+                memcpy(_ring + off, &w, sizeof w);
+            }
+
+            pos += cap - off;
+            off = 0;
+        }
+
+        make_room(pos + len);
+
+        shm_record r = {pos, (uint32_t)key.size(), (uint32_t)n, sze};
+        memcpy(_ring + off, &r, sizeof r);
+        memcpy(_ring + off + sizeof r, key.data(), key.size());
+        memcpy(_ring + off + sizeof r + key.size(), data, sze);
+
+        _hdr->write_pos.store(pos + len, memory_order_release);
+        _hdr->signal.fetch_add(1);
+
+        if (_hdr->waiters.load())
+        {
+            futex_wake(&_hdr->signal);
+        }
+
+        return true;
+    }
+
+/**
+ * Returns the as-configured urn.
+ *
+ * @return A std::string containing the configured URN.
+ *
+ */
+
+    string ShmTransportServer::Impl::get_urn()
+    {
+        return _urn;
+    }
+
+/**
+ * Constructor for the ShmTransportServer. Creates the shared memory
+ * ring and registers its URN with the Keymaster.
+ *
+ * @param keymaster_url: The keymaster URN.
+ *
+ * @param key: The data transport key that specifies the transport configuration.
+ *
+ */
+
+    ShmTransportServer::ShmTransportServer(string keymaster_url, string key)
+        : TransportServer(keymaster_url, key)
+    {
+        try
+        {
+            Keymaster km(_km_url);
+            yaml_result yr;
+            string urn;
+            size_t size = SHM_DEFAULT_SIZE;
+
+            urn = km.get_as<vector<string> >(_transport_key + ".Specified").front();
+
+            if (km.get(_transport_key + ".ShmSize", yr))
+            {
+                size = yr.node.as<size_t>();
+            }
+
+            // will throw CreationError if it fails.
+            _impl.reset(new Impl(urn, size));
+
+            vector<string> urns;
+            urns.push_back(_impl->get_urn());
+            km.put(_transport_key + ".AsConfigured", urns, true);
+        }
+        catch (KeymasterException &e)
+        {
+            throw CreationError(e.what());
+        }
+    }
+
+/**
+ * Destroys the ShmTransportServer object. This cleans up the
+ * Keymaster entry and removes the shared memory segment.
+ *
+ */
+
+    ShmTransportServer::~ShmTransportServer()
+    {
+        _impl.reset();
+
+        try
+        {
+            Keymaster km(_km_url);
+            km.del(_transport_key + ".AsConfigured");
+        }
+        catch (KeymasterException &e)
+        {
+            // Just making sure no exception is thrown from destructor.
+        }
+    }
+
+    bool ShmTransportServer::_publish(string key, const void *data, size_t size_of_data)
+    {
+        return _impl->publish(key, data, size_of_data, 0);
+    }
+
+    bool ShmTransportServer::_publish(string key, string data)
+    {
+        return _impl->publish(key, data.data(), data.size(), 0);
+    }
+
+    bool ShmTransportServer::_publish_batch(string key, const void *data,
+                                            size_t size_of_element, size_t count)
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+
+        return _impl->publish(key, data, size_of_element * count, count);
+    }
+
+/**********************************************************************
+ * Transport Client
+ **********************************************************************/
+
+    TransportClient *ShmTransportClient::factory(string urn)
+    {
+        return new ShmTransportClient(urn);
+    }
+
+    struct ShmTransportClient::Impl
+    {
+        Impl() :
+            _map_size(0),
+            _hdr(NULL),
+            _ring(NULL),
+            _read_pos(0),
+            _connected(false),
+            _quit(false),
+            _reader_thread(this, &ShmTransportClient::Impl::reader_task)
+        {}
+
+        ~Impl()
+        {
+            disconnect();
+        }
+
+        bool connect(std::string urn);
+        bool disconnect();
+        bool subscribe(std::string key, DataCallbackBase *cb);
+        bool unsubscribe(std::string key);
+
+        void reader_task();
+        void wait_for_data(uint64_t pos);
+
+        std::string _urn;
+        size_t _map_size;
+        shm_header *_hdr;
+        char *_ring;
+        uint64_t _read_pos;
+        bool _connected;
+        std::atomic<bool> _quit;
+        Thread<ShmTransportClient::Impl> _reader_thread;
+        Mutex _subscriber_lock;
+        DataCallbackTable _subscribers;
+    };
+
+/**
+ * Maps the server's ring and starts the reader thread. The reader
+ * starts at the current end of the ring, so only messages published
+ * after the connection are seen.
+ *
+ * @param urn: The server's "shm://" URN.
+ *
+ * @return true if connected, false otherwise.
+ *
+ */
+
+    bool ShmTransportClient::Impl::connect(string urn)
+    {
+        if (_connected)
+        {
+            return false;
+        }
+
+        _urn = urn;
+        string name = shm_name(urn);
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        struct stat st;
+
+        if (fd == -1)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ShmTransportClient for URN " << urn
+                 << ": shm_open(): " << strerror(errno) << endl;
+            return false;
+        }
+
+        void *p = MAP_FAILED;
+
+        if (fstat(fd, &st) == 0 && (size_t)st.st_size > SHM_DATA_OFFSET)
+        {
+            _map_size = st.st_size;
+            p = mmap(NULL, _map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (p == MAP_FAILED)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ShmTransportClient for URN " << urn
+                 << ": cannot map segment." << endl;
+            return false;
+        }
+
+        _hdr = (shm_header *)p;
+        _ring = (char *)p + SHM_DATA_OFFSET;
+
+        if (_hdr->magic != SHM_MAGIC || _hdr->version != SHM_VERSION
+            || _hdr->capacity != _map_size - SHM_DATA_OFFSET)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ShmTransportClient for URN " << urn
+                 << ": not a matrix shared memory ring." << endl;
+            munmap(_hdr, _map_size);
+            _hdr = NULL;
+            return false;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        _read_pos = _hdr->write_pos.load(memory_order_acquire);
+        _quit = false;
+
+        if (_reader_thread.start() != 0)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ShmTransportClient for URN " << urn
+                 << ": failure to start reader thread." << endl;
+            munmap(_hdr, _map_size);
+            _hdr = NULL;
+            return false;
+        }
+
+        _connected = true;
+        return true;
+    }
+
+    bool ShmTransportClient::Impl::disconnect()
+    {
+        if (_connected)
+        {
+            _quit = true;
+            futex_wake(&_hdr->signal);
+            _reader_thread.stop_without_cancel();
+            munmap(_hdr, _map_size);
+            _hdr = NULL;
+            _connected = false;
+            return true;
+        }
+
+        return false;
+    }
+
+/**
+ * Registers a callback for 'key'. Unlike 0MQ there is no filtering on
+ * the publishing side; the reader thread skips messages whose keys
+ * have no callback without copying their data.
+ *
+ */
+
+    bool ShmTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+    {
+        if (key.empty())
+        {
+            return false;
+        }
+
+        ThreadLock<Mutex> l(_subscriber_lock);
+        l.lock();
+        _subscribers.set(key, cb);
+        return true;
+    }
+
+    bool ShmTransportClient::Impl::unsubscribe(string key)
+    {
+        ThreadLock<Mutex> l(_subscriber_lock);
+        l.lock();
+        return _subscribers.erase(key);
+    }
+
+/**
+ * Sleeps on the ring's futex until the writer moves past 'pos', or
+ * 100 mS elapse (so that '_quit' is noticed).
+ *
+ */
+
+    void ShmTransportClient::Impl::wait_for_data(uint64_t pos)
+    {
+        // 'signal' must be read before 'write_pos': if the writer
+        // publishes in between, the futex call returns at once.
+        uint32_t sig = _hdr->signal.load();
+
+        if (_hdr->write_pos.load() != pos || _quit)
+        {
+            return;
+        }
+
+        timespec to = {0, 100000000};
+        _hdr->waiters.fetch_add(1);
+        futex_wait(&_hdr->signal, sig, &to);
+        _hdr->waiters.fetch_sub(1);
+    }
+
+/**
+ * The reader thread. Follows the ring with its own cursor. The
+ * writer does not wait for readers, so each record is copied out and
+ * then validated against 'oldest_pos': if the writer has overwritten
+ * it in the meantime the copy is discarded and the reader resumes at
+ * the oldest record still in the ring.
+ *
+ */
+
+    void ShmTransportClient::Impl::reader_task()
+    {
+        uint64_t cap = _hdr->capacity;
+        uint64_t pos = _read_pos;
+        string key;
+        vector<char> buf;
+
+        while (!_quit)
+        {
+            if (_hdr->write_pos.load(memory_order_acquire) == pos)
+            {
+                wait_for_data(pos);
+                continue;
+            }
+
+            uint64_t oldest = _hdr->oldest_pos.load(memory_order_acquire);
+
+            if (pos < oldest)
+            {
+                // overrun: messages between 'pos' and 'oldest' are lost.
+                pos = oldest;
+                continue;
+            }
+
+            uint64_t off = pos % cap;
+            shm_record r;
+
+            if (cap - off < sizeof r)
+            {
+                pos += cap - off;
+                continue;
+            }
+
+            memcpy(&r, _ring + off, sizeof r);
+
+            bool wrap = r.key_len == SHM_WRAP;
+            uint64_t len = wrap ? cap - off : record_size(r.key_len, r.data_len);
+            bool valid = r.pos == pos && (wrap || (len <= cap / 2 && off + len <= cap));
+            ThreadLock<Mutex> l(_subscriber_lock);
+            DataCallbackBase *f = NULL;
+
+            if (valid && !wrap)
+            {
+                key.assign(_ring + off + sizeof r, r.key_len);
+                l.lock();
+
+                if ((f = _subscribers.find(key.data(), key.size())) != NULL)
+                {
+                    buf.resize(r.data_len);
+                    memcpy(buf.data(), _ring + off + sizeof r + r.key_len, r.data_len);
+                }
+            }
+
+            atomic_thread_fence(memory_order_acquire);
+
+            if (_hdr->oldest_pos.load(memory_order_relaxed) > pos)
+            {
+                // overwritten while we were copying it.
+                continue;
+            }
+
+            if (!valid)
+            {
+                // can't happen unless someone else scribbled on the
+                // ring. Skip to the newest data.
+                pos = _hdr->write_pos.load(memory_order_acquire);
+                continue;
+            }
+
+            pos += len;
+
+            if (f)
+            {
+                if (r.count)
+                {
+                    f->exec_n(key, buf.data(), r.data_len / r.count, r.count);
+                }
+                else
+                {
+                    f->exec(key, buf.data(), r.data_len);
+                }
+            }
+        }
+    }
+
+    ShmTransportClient::ShmTransportClient(string urn)
+        : TransportClient(urn),
+          _impl(new Impl())
+    {
+    }
+
+    ShmTransportClient::~ShmTransportClient()
+    {
+        _impl->disconnect();
+    }
+
+    bool ShmTransportClient::_connect()
+    {
+        return _impl->connect(_urn);
+    }
+
+    bool ShmTransportClient::_disconnect()
+    {
+        return _impl->disconnect();
+    }
+
+    bool ShmTransportClient::_subscribe(string key, DataCallbackBase *cb)
+    {
+        return _impl->subscribe(key, cb);
+    }
+
+    bool ShmTransportClient::_unsubscribe(string key)
+    {
+        return _impl->unsubscribe(key);
+    }
+}
@@ -31,6 +31,9 @@
 
 #include "matrix/ZMQContext.h"
 #include "matrix/ThreadLock.h"
+#include "matrix/Time.h"
+
+#include <iostream>
 
 using namespace matrix;
 
@@ -38,6 +41,8 @@ namespace matrix
 {
     std::shared_ptr<ZMQContext> ZMQContext::_instance;
     Mutex ZMQContext::_instance_lock;
+    int ZMQContext::_io_threads = 1;
+    std::vector<int> ZMQContext::_cpu_affinity;
 
 /********************************************************************
  * ZMQContext::ZMQContext
@@ -48,13 +53,30 @@ namespace matrix
  *
  *******************************************************************/
 
-    ZMQContext::ZMQContext() : _context(1)
+    ZMQContext::ZMQContext() : _context(_io_threads)
     {
         timespec ts;
         unsigned int seed;
         clock_gettime(CLOCK_REALTIME, &ts);
         seed = static_cast<unsigned int>((ts.tv_sec * 1000000000LL + ts.tv_nsec) % 0x100000000);
         srandom(seed);
+
+        // the I/O threads only start with the first socket, so they
+        // may still be pinned here.
+        for (auto cpu : _cpu_affinity)
+        {
+#if defined(ZMQ_THREAD_AFFINITY_CPU_ADD)
+            if (zmq_ctx_set((void *)_context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu) != 0)
+            {
+                std::cerr << Time::isoDateTime(Time::getUTC())
+                          << " -- ZMQContext: cannot pin I/O threads to CPU " << cpu << std::endl;
+            }
+#else
+            std::cerr << Time::isoDateTime(Time::getUTC())
+                      << " -- ZMQContext: this ZMQ cannot pin I/O threads to CPU " << cpu
+                      << std::endl;
+#endif
+        }
     }
 
 /********************************************************************
@@ -110,6 +132,40 @@ namespace matrix
         l.unlock();
     }
 
+/********************************************************************
+ * ZMQContext::configure()
+ *
+ * Sets up the context before it is created: the number of ZMQ I/O
+ * threads, and the CPUs those threads may run on. This has no effect
+ * once the context exists, that is, once the process has created any
+ * ZMQ socket (through a Keymaster client, for instance), so it should
+ * be called early in main(). The KeymasterServer calls it with its
+ * configuration's 'Keymaster.zmq_context' settings.
+ *
+ * @param io_threads: The number of I/O threads, 1 by default.
+ * @param cpu_affinity: The CPUs for the I/O threads; empty for any.
+ *
+ * @return true if the settings will be used, false if the context
+ * already exists.
+ *
+ *******************************************************************/
+
+    bool ZMQContext::configure(int io_threads, std::vector<int> cpu_affinity)
+    {
+        ThreadLock<Mutex> l(_instance_lock);
+
+        l.lock();
+
+        if (_instance)
+        {
+            return false;
+        }
+
+        _io_threads = io_threads;
+        _cpu_affinity = cpu_affinity;
+        return true;
+    }
+
 /********************************************************************
  * ZMQContext::get_context();
  *
@@ -23,6 +23,7 @@
 
 #include "matrix/ZMQDataInterface.h"
 #include "matrix/RTDataInterface.h"
+#include "matrix/ShmDataInterface.h"
 #include "matrix/tsemfifo.h"
 #include "matrix/Thread.h"
 #include "matrix/ZMQContext.h"
@@ -34,12 +35,16 @@
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <unordered_map>
 
 #include <boost/regex.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <endian.h>
 
 
 using namespace std;
@@ -48,10 +53,85 @@ using namespace mxutils;
 
 #define SUBSCRIBE   1
 #define UNSUBSCRIBE 2
-#define QUIT        3
+#define CONNECT     3
+#define DISCONNECT  4
+#define ATTACH      5
+#define DETACH      6
+#define QUIT        7
 
 namespace matrix
 {
+    // A published message is three frames: [key, header, data]. The
+    // key frame is just the key, which subscriptions match. The
+    // header is 'wire_header::SIZE' bytes:
+    //
+    //   0-1    'm', 'x'
+    //   2      the header version, wire_header::VERSION
+    //   3      flags: wire_header::BATCH if 'data' is a batch
+    //   4-7    0
+    //   8-15   sequence number, counting the items published with
+    //          this key so far (a batch counts as 'count'), by which
+    //          subscribers detect lost messages
+    //   16-23  count: the number of items in 'data', 1 if not a batch
+    //   24-31  size: the size of each item
+    //
+    // all numbers big-endian. Before the header a message was just
+    // [key, data]; subscribers still take that, without loss
+    // detection. Subscribers from before the header do not know it
+    // (they would pass it on as data), so must be updated along with
+    // their publishers.
+    struct wire_header
+    {
+        enum
+        {
+            SIZE = 32,
+            VERSION = 1,
+            BATCH = 1
+        };
+
+        static void encode(unsigned char *buf, uint64_t seq, uint64_t count,
+                           uint64_t size, bool batch)
+        {
+            uint64_t v;
+
+            memset(buf, 0, SIZE);
+            buf[0] = 'm';
+            buf[1] = 'x';
+            buf[2] = VERSION;
+            buf[3] = batch ? BATCH : 0;
+            v = htobe64(seq);
+            memcpy(buf + 8, &v, sizeof v);
+            v = htobe64(count);
+            memcpy(buf + 16, &v, sizeof v);
+            v = htobe64(size);
+            memcpy(buf + 24, &v, sizeof v);
+        }
+
+        bool decode(const void *data, size_t len)
+        {
+            const unsigned char *buf = (const unsigned char *)data;
+            uint64_t v;
+
+            if (len != SIZE || buf[0] != 'm' || buf[1] != 'x' || buf[2] != VERSION)
+            {
+                return false;
+            }
+
+            batch = buf[3] & BATCH;
+            memcpy(&v, buf + 8, sizeof v);
+            seq = be64toh(v);
+            memcpy(&v, buf + 16, sizeof v);
+            count = be64toh(v);
+            memcpy(&v, buf + 24, sizeof v);
+            size = be64toh(v);
+            return true;
+        }
+
+        uint64_t seq;
+        uint64_t count;
+        uint64_t size;
+        bool batch;
+    };
 
 /**
  * Creates a ZMQTransportServer, returning a TransportServer pointer to it. This
@@ -90,7 +170,8 @@ namespace matrix
         {"tcp",      &ZMQTransportServer::factory},
         {"ipc",      &ZMQTransportServer::factory},
         {"inproc",   &ZMQTransportServer::factory},
-        {"rtinproc", &RTTransportServer::factory}
+        {"rtinproc", &RTTransportServer::factory},
+        {"shm",      &ShmTransportServer::factory}
     };
 
 /**
@@ -130,7 +211,8 @@ namespace matrix
         {"tcp",      &ZMQTransportClient::factory},
         {"ipc",      &ZMQTransportClient::factory},
         {"inproc",   &ZMQTransportClient::factory},
-        {"rtinproc", &RTTransportClient::factory}
+        {"rtinproc", &RTTransportClient::factory},
+        {"shm",      &ShmTransportClient::factory}
     };
 
 /**
@@ -140,18 +222,22 @@ namespace matrix
 
     struct ZMQTransportServer::PubImpl
     {
-        PubImpl(vector<string> urls);
+        PubImpl(vector<string> urls, YAML::Node options);
         ~PubImpl();
 
         bool publish(string key, string data);
         bool publish(string key, void const *data, size_t sze);
+        bool publish_batch(string key, void const *data, size_t sze, size_t n);
+        bool publish_shared(const string &key, shared_ptr<const void> data, size_t sze);
         vector<string> get_urls();
+        void send_key(const string &key, uint64_t count, uint64_t size, bool batch);
 
         string _hostname;
         vector<string> _publish_service_urls;
 
         zmq::context_t &_ctx;
         zmq::socket_t _pub_skt;
+        unordered_map<string, uint64_t> _sequence;
     };
 
 /**
@@ -162,14 +248,18 @@ namespace matrix
  * @param urns: The desired URNs, as a vector of strings. If
  * only the transport is given, ephemeral URLs will be generated.
  *
+ * @param options: The transport's socket options, if any (see
+ * `zmq_set_options()`).
+ *
  */
 
-    ZMQTransportServer::PubImpl::PubImpl(vector<string> urns)
+    ZMQTransportServer::PubImpl::PubImpl(vector<string> urns, YAML::Node options)
         :
         _ctx(ZMQContext::Instance()->get_context()),
         _pub_skt(_ctx, ZMQ_PUB)
 
     {
+        zmq_set_options(_pub_skt, options, true);
 
         // process the urns.
         _publish_service_urls.clear();
@@ -274,6 +364,33 @@ namespace matrix
         return _publish_service_urls;
     }
 
+/**
+ * Sends a message's key and header frames (see 'wire_header'). The
+ * key's sequence number then moves on by 'count'.
+ *
+ * @param key: The published key to the data.
+ *
+ * @param count: The number of items being sent, 1, or the number
+ * of elements for a batch.
+ *
+ * @param size: The size of each item.
+ *
+ * @param batch: true for a batch.
+ *
+ */
+
+    void ZMQTransportServer::PubImpl::send_key(const string &key, uint64_t count,
+                                               uint64_t size, bool batch)
+    {
+        uint64_t &seq = _sequence[key];
+        zmq::message_t hdr(wire_header::SIZE);
+
+        wire_header::encode((unsigned char *)hdr.data(), seq, count, size, batch);
+        seq += count;
+        z_send(_pub_skt, key, ZMQ_SNDMORE, 0);
+        _pub_skt.send(hdr, ZMQ_SNDMORE);
+    }
+
 /**
  * Publishes the data, as represented by a string.
  *
@@ -305,7 +422,7 @@ namespace matrix
 
         try
         {
-            z_send(_pub_skt, key, ZMQ_SNDMORE, 0);
+            send_key(key, 1, sze, false);
             z_send(_pub_skt, (const char *)data, sze, 0, 0);
         }
         catch (zmq::error_t &e)
@@ -319,6 +436,100 @@ namespace matrix
         return rval;
     }
 
+/**
+ * Releases the reference to a buffer given to ZMQ by
+ * `publish_shared()`, once ZMQ is done with it. Called by ZMQ, from
+ * whichever thread finishes with the message.
+ *
+ */
+
+    static void release_shared(void *, void *hint)
+    {
+        delete static_cast<shared_ptr<const void> *>(hint);
+    }
+
+/**
+ * Publishes the data without copying it: the data frame's message is
+ * made around the buffer itself (zmq_msg_init_data()), and holds a
+ * reference to it until ZMQ has sent it to every subscriber.
+ *
+ * @param key: The published key to the data.
+ *
+ * @param data: The buffer, which must not change until ZMQ releases it.
+ *
+ * @param sze: The size of the data.
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::publish_shared(const string &key, shared_ptr<const void> data,
+                                                     size_t sze)
+    {
+        bool rval = true;
+        shared_ptr<const void> *ref = new shared_ptr<const void>(data);
+
+        try
+        {
+            zmq::message_t msg;
+
+            try
+            {
+                msg.rebuild(const_cast<void *>(data.get()), sze, &release_shared, ref);
+            }
+            catch (...)
+            {
+                // not taken by ZMQ
+                delete ref;
+                throw;
+            }
+
+            send_key(key, 1, sze, false);
+            _pub_skt.send(msg, 0);
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQ exception in publisher: "
+                 << e.what() << endl;
+            rval = false;
+        }
+
+        return rval;
+    }
+
+/**
+ * Publishes a batch of 'n' elements of 'sze' bytes each, as one
+ * message whose header says so (see 'wire_header').
+ *
+ * @param key: The published key to the data.
+ *
+ * @param data: A void pointer to the first element
+ *
+ * @param sze: The size of each element
+ *
+ * @param n: The number of elements
+ *
+ */
+
+    bool ZMQTransportServer::PubImpl::publish_batch(string key, void const *data, size_t sze, size_t n)
+    {
+        bool rval = true;
+
+        try
+        {
+            send_key(key, n, sze, true);
+            z_send(_pub_skt, (const char *)data, sze * n, 0, 0);
+        }
+        catch (zmq::error_t &e)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQ exception in publisher: "
+                 << e.what() << endl;
+            rval = false;
+        }
+
+        return rval;
+    }
+
 
     ZMQTransportServer::ZMQTransportServer(string keymaster_url, string key)
         : TransportServer(keymaster_url, key)
@@ -327,10 +538,11 @@ namespace matrix
         {
             Keymaster km(_km_url);
             vector<string> urns;
-            urns = km.get_as<vector<string> >(_transport_key + ".Specified");
+            YAML::Node transport = km.get(_transport_key);
+            urns = transport["Specified"].as<vector<string> >();
 
             // will throw CreationError if it fails.
-            _impl.reset(new PubImpl(urns));
+            _impl.reset(new PubImpl(urns, transport["Options"]));
 
             // register the AsConfigured urns:
             urns = _impl->get_urls();
@@ -340,6 +552,10 @@ namespace matrix
         {
             throw CreationError(e.what());
         }
+        catch (YAML::Exception &e)
+        {
+            throw CreationError(_transport_key + ": " + e.what());
+        }
     }
 
     ZMQTransportServer::~ZMQTransportServer()
@@ -370,18 +586,108 @@ namespace matrix
         return _impl->publish(key, data);
     }
 
+    bool ZMQTransportServer::_publish_batch(string key, const void *data,
+                                            size_t size_of_element, size_t count)
+    {
+        return _impl->publish_batch(key, data, size_of_element, count);
+    }
+
+    bool ZMQTransportServer::_publish_shared(key_handle_t, const string &key,
+                                             shared_ptr<const void> data, size_t size_of_data)
+    {
+        return _impl->publish_shared(key, data, size_of_data);
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
 
+/**
+ * \class SubReactor
+ *
+ * Runs the SUB sockets of many ZMQTransportClients in one thread,
+ * polling them all in one `zmq::poll()` set. A ZMQ socket must only
+ * be used by one thread, so the clients never touch their sockets:
+ * connecting, subscribing, unsubscribing and disconnecting are
+ * commands, queued to the reactor and carried out by its thread,
+ * which wakes for them on an eventfd in the poll set. The caller
+ * waits for the command's result.
+ *
+ * The reactors form a process-wide pool, `reactor_threads` in size
+ * (1 by default; see `ZMQTransportClient::set_reactor_threads()`),
+ * created on first use. Clients are given to the reactors in turn.
+ * The pool's reactors are never deleted, as clients may outlive any
+ * static object; they close their sockets and stop when the ZMQ
+ * context is terminated, and refuse any command after that.
+ *
+ * The data callbacks run in the reactor's thread, so a callback that
+ * blocks (a DataSink with a BLOCK overflow policy and a full queue,
+ * for instance) would hold up every other client on that reactor. A
+ * client subscribing such a callback (see
+ * `DataCallbackBase::may_block()`) is therefore moved to a reactor
+ * of its own, which it keeps until it disconnects.
+ *
+ */
+
+    class SubReactor
+    {
+    public:
+
+        struct command
+        {
+            command(int o, ZMQTransportClient::Impl *c, string k = "",
+                    DataCallbackBase *f = 0)
+                : op(o), client(c), key(k), cb(f), result(0), done(false)
+            {}
+
+            int op;
+            ZMQTransportClient::Impl *client;
+            string key;
+            DataCallbackBase *cb;
+            int result;
+            TCondition<bool> done;
+        };
+
+        SubReactor();
+        ~SubReactor();
+
+        int request(command &cmd);
+
+        static SubReactor &assign();
+
+        static size_t reactor_threads;
+
+    private:
+
+        void _task();
+        void _execute(command &cmd);
+        void _close_all();
+
+        zmq::context_t &_ctx;
+        int _wakeup_fd;
+        bool _running;
+        bool _quit;
+        Mutex _queue_lock;
+        vector<command *> _queue;
+        vector<ZMQTransportClient::Impl *> _clients;
+        Thread<SubReactor> _thread;
+        TCondition<bool> _task_ready;
+    };
+
+    size_t SubReactor::reactor_threads = 1;
+
+/**
+ * The state of one ZMQTransportClient. All but '_connected' belongs
+ * to the client's SubReactor, and is only used by the reactor's
+ * thread.
+ *
+ */
+
     struct ZMQTransportClient::Impl
     {
         Impl() :
-            _pipe_urn("inproc://" + gen_random_string(20)),
-            _ctx(ZMQContext::Instance()->get_context()),
             _connected(false),
-            _sub_thread(this, &ZMQTransportClient::Impl::sub_task),
-            _task_ready(false)
+            _reactor(0)
         {}
 
         ~Impl()
@@ -393,221 +699,308 @@ namespace matrix
         bool disconnect();
         bool subscribe(std::string key, DataCallbackBase *cb);
         bool unsubscribe(std::string key);
+        bool receive();
+        bool use_own_reactor();
 
-        void sub_task();
-
-        std::string _pipe_urn;
         std::string _data_urn;
-        zmq::context_t &_ctx;
+        YAML::Node _options;
         bool _connected;
-        Thread<ZMQTransportClient::Impl> _sub_thread;
-        TCondition<bool> _task_ready;
-        std::map<std::string, DataCallbackBase *> _subscribers;
+        SubReactor *_reactor;
+        // a reactor for this client alone, if it has a callback that
+        // may block (see SubReactor)
+        std::unique_ptr<SubReactor> _own_reactor;
+        std::unique_ptr<zmq::socket_t> _sub_sock;
+        zmq::message_t _key_msg, _msg;
+        DataCallbackTable _subscribers;
     };
 
-    bool ZMQTransportClient::Impl::connect(string urn)
+    SubReactor::SubReactor()
+        : _ctx(ZMQContext::Instance()->get_context()),
+          _wakeup_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+          _running(false),
+          _quit(false),
+          _thread(this, &SubReactor::_task),
+          _task_ready(false)
     {
-        _data_urn = urn;
+        if (_wakeup_fd < 0)
+        {
+            throw MatrixException("SubReactor", "eventfd(): " + string(strerror(errno)));
+        }
 
-        if (!_connected)
+        if (_thread.start() == 0)
         {
-            if (_sub_thread.start() == 0)
-            {
-                if (_task_ready.wait(true, 100000000) == false)
-                {
-                    cerr << Time::isoDateTime(Time::getUTC())
-                         << " -- ZMQTransportClient for URN " << urn
-                         << ": subscriber thread aborted." << endl;
-                    return false;
-                }
+            _task_ready.wait(true);
+        }
+        else
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQTransportClient: failure to start subscriber reactor thread."
+                 << endl;
+        }
+    }
 
-                _connected = true;
-                return true;
-            }
-            else
+/**
+ * Stops the reactor's thread. Only a reactor of a single client's own
+ * is deleted, once the client is disconnected from it.
+ *
+ */
+
+    SubReactor::~SubReactor()
+    {
+        command cmd(QUIT, 0);
+
+        request(cmd);
+        _thread.stop_without_cancel();
+        close(_wakeup_fd);
+    }
+
+/**
+ * Returns the reactor a new client should use, creating the pool on
+ * first use.
+ *
+ */
+
+    SubReactor &SubReactor::assign()
+    {
+        static Mutex pool_lock;
+        static vector<SubReactor *> pool;
+        static size_t next = 0;
+        ThreadLock<Mutex> l(pool_lock);
+
+        l.lock();
+
+        if (pool.empty())
+        {
+            size_t n = reactor_threads ? reactor_threads : 1;
+
+            for (size_t i = 0; i < n; ++i)
             {
-                cerr << Time::isoDateTime(Time::getUTC())
-                     << " -- ZMQTransportClient for URN " << urn
-                     << ": failure to start susbcriber thread."
-                     << endl;
-                return false;
+                pool.push_back(new SubReactor());
             }
         }
 
-        return false;
+        return *pool[next++ % pool.size()];
     }
 
-    bool ZMQTransportClient::Impl::disconnect()
+/**
+ * Queues a command for the reactor's thread and waits for it to be
+ * carried out.
+ *
+ * @param cmd: The command.
+ *
+ * @return The command's result: non-zero on success, 0 if it failed
+ * or the reactor is no longer running.
+ *
+ */
+
+    int SubReactor::request(command &cmd)
     {
-        if (_connected)
+        ThreadLock<Mutex> l(_queue_lock);
+        uint64_t one = 1;
+
+        l.lock();
+
+        if (!_running)
         {
-            zmq::socket_t pipe(_ctx, ZMQ_REQ);
-            pipe.connect(_pipe_urn.c_str());
-            z_send(pipe, QUIT, 0);
-            int rval;
-            z_recv(pipe, rval);
-            _sub_thread.stop_without_cancel();
-            _connected = false;
-            return rval ? true : false;
+            return 0;
         }
 
-        return false;
+        _queue.push_back(&cmd);
+        l.unlock();
+
+        if (write(_wakeup_fd, &one, sizeof one) != sizeof one)
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- SubReactor: eventfd write: " << strerror(errno) << endl;
+        }
+
+        cmd.done.wait(true);
+        return cmd.result;
     }
 
-    bool ZMQTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+/**
+ * Carries out a command, in the reactor's thread.
+ *
+ */
+
+    void SubReactor::_execute(command &cmd)
     {
-        if (_connected)
+        ZMQTransportClient::Impl *c = cmd.client;
+
+        switch (cmd.op)
         {
-            zmq::socket_t pipe(_ctx, ZMQ_REQ);
-            pipe.connect(_pipe_urn.c_str());
-            z_send(pipe, SUBSCRIBE, ZMQ_SNDMORE);
-            z_send(pipe, key, ZMQ_SNDMORE);
-            z_send(pipe, cb, 0);
-            int rval;
-            z_recv(pipe, rval);
-            return rval ? true : false;
-        }
+        case CONNECT:
+            c->_sub_sock.reset(new zmq::socket_t(_ctx, ZMQ_SUB));
+            zmq_set_options(*c->_sub_sock, c->_options, false);
+            c->_sub_sock->connect(c->_data_urn.c_str());
+            _clients.push_back(c);
+            cmd.result = 1;
+            break;
+
+        case DISCONNECT:
+            _clients.erase(std::remove(_clients.begin(), _clients.end(), c), _clients.end());
+
+            if (c->_sub_sock)
+            {
+                int zero = 0;
+                c->_sub_sock->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+                c->_sub_sock->close();
+                c->_sub_sock.reset();
+            }
 
-        return false;
+            cmd.result = 1;
+            break;
+
+        case ATTACH:
+            // a connected client, moved here from another reactor.
+            _clients.push_back(c);
+            cmd.result = 1;
+            break;
+
+        case DETACH:
+            // leaving for another reactor, with its socket.
+            _clients.erase(std::remove(_clients.begin(), _clients.end(), c), _clients.end());
+            cmd.result = 1;
+            break;
+
+        case QUIT:
+            _quit = true;
+            cmd.result = 1;
+            break;
+
+        case SUBSCRIBE:
+            if (!cmd.key.empty())
+            {
+                c->_subscribers.set(cmd.key, cmd.cb);
+                c->_sub_sock->setsockopt(ZMQ_SUBSCRIBE, cmd.key.c_str(), cmd.key.length());
+                cmd.result = 1;
+            }
+
+            break;
+
+        case UNSUBSCRIBE:
+            if (!cmd.key.empty())
+            {
+                c->_sub_sock->setsockopt(ZMQ_UNSUBSCRIBE, cmd.key.c_str(), cmd.key.length());
+                c->_subscribers.erase(cmd.key);
+                cmd.result = 1;
+            }
+
+            break;
+        }
     }
 
-    bool ZMQTransportClient::Impl::unsubscribe(string key)
+/**
+ * Closes every client's socket, as the context is going away.
+ *
+ */
+
+    void SubReactor::_close_all()
     {
-        if (_connected)
+        for (auto c : _clients)
         {
-            zmq::socket_t pipe(_ctx, ZMQ_REQ);
-            pipe.connect(_pipe_urn.c_str());
-            z_send(pipe, UNSUBSCRIBE, ZMQ_SNDMORE);
-            z_send(pipe, key, 0);
-            int rval;
-            z_recv(pipe, rval);
-            return rval ? true : false;
+            int zero = 0;
+            c->_sub_sock->setsockopt(ZMQ_LINGER, &zero, sizeof zero);
+            c->_sub_sock->close();
+            c->_sub_sock.reset();
         }
 
-        return false;
+        _clients.clear();
     }
 
-    void ZMQTransportClient::Impl::sub_task()
+/**
+ * The reactor's thread. Polls the wake-up eventfd and every client's
+ * SUB socket. A readable socket has up to 'max_burst' messages
+ * received from it before the others are looked at again, which
+ * saves a poll per message under load without letting one busy
+ * source starve the rest.
+ *
+ */
+
+    void SubReactor::_task()
     {
-        zmq::socket_t sub_sock(_ctx, ZMQ_SUB);
-        zmq::socket_t pipe(_ctx, ZMQ_REP);
-        vector<string>::const_iterator cvi;
-        bool invalid_context = false;
+        const int max_burst = 64;
+        vector<zmq::pollitem_t> items;
+        vector<ZMQTransportClient::Impl *> polled;
+        vector<command *> cmds;
+
+        {
+            ThreadLock<Mutex> l(_queue_lock);
+            l.lock();
+            _running = true;
+        }
 
-        sub_sock.connect(_data_urn.c_str());
-        pipe.bind(_pipe_urn.c_str());
+        _task_ready.signal(true);
 
-        // we're going to poll. We will be waiting for subscription requests
-        // (via 'pipe'), and for subscription data (via 'sub_sock').
-        zmq::pollitem_t items [] =
+        while (1)
+        {
+            // the poll set: the wake-up eventfd, then the sockets.
+            items.clear();
+            items.push_back({0, _wakeup_fd, ZMQ_POLLIN, 0});
+            polled = _clients;
+
+            for (auto c : polled)
             {
 #if ZMQ_VERSION_MAJOR > 3
-                { (void *)pipe, 0, ZMQ_POLLIN, 0 },
-                { (void *)sub_sock, 0, ZMQ_POLLIN, 0 }
+                items.push_back({(void *)*c->_sub_sock, 0, ZMQ_POLLIN, 0});
 #else
-                { pipe, 0, ZMQ_POLLIN, 0 },
-                { sub_sock, 0, ZMQ_POLLIN, 0 }
+                items.push_back({*c->_sub_sock, 0, ZMQ_POLLIN, 0});
 #endif
-            };
-
-        _task_ready.signal(true);
+            }
 
-        while (1)
-        {
             try
             {
-                zmq::poll(&items[0], 2, -1);
+                zmq::poll(items.data(), items.size(), -1);
 
-                if (items[0].revents & ZMQ_POLLIN) // the control pipe
+                // the subscribed data, before any command might close
+                // a socket.
+                for (size_t i = 1; i < items.size(); ++i)
                 {
-                    int msg;
-                    z_recv(pipe, msg);
-
-                    if (msg == SUBSCRIBE)
+                    if (items[i].revents & ZMQ_POLLIN)
                     {
-                        string key;
-                        DataCallbackBase *f_ptr;
-                        z_recv(pipe, key);
-                        z_recv(pipe, f_ptr);
-
-                        if (key.empty())
+                        for (int n = 0; n < max_burst && polled[i - 1]->receive(); ++n)
                         {
-                            z_send(pipe, 0, 0);
                         }
-                        else
-                        {
-                            _subscribers[key] = f_ptr;
-                            sub_sock.setsockopt(ZMQ_SUBSCRIBE, key.c_str(), key.length());
-                            z_send(pipe, 1, 0);
-                        }
-                    }
-                    else if (msg == UNSUBSCRIBE)
-                    {
-                        string key;
-                        z_recv(pipe, key);
-
-                        if (key.empty())
-                        {
-                            z_send(pipe, 0, 0);
-                        }
-                        else
-                        {
-                            sub_sock.setsockopt(ZMQ_UNSUBSCRIBE, key.c_str(), key.length());
-
-                            if (_subscribers.find(key) != _subscribers.end())
-                            {
-                                _subscribers.erase(key);
-                            }
-
-                            z_send(pipe, 1, 0);
-                        }
-                    }
-                    else if (msg == QUIT)
-                    {
-                        z_send(pipe, 0, 0);
-                        break;
                     }
                 }
 
-                // The subscribed data is handled here
-                if (items[1].revents & ZMQ_POLLIN)
+                if (items[0].revents & ZMQ_POLLIN)
                 {
-                    string key;
-                    zmq::message_t msg; // the data
-                    int more;
-                    size_t more_size = sizeof(more);
-                    map<string, DataCallbackBase *>::const_iterator mci;
-                    DataCallbackBase *f = NULL;
-
-                    // get the key
-                    z_recv(sub_sock, key);
-                    mci = _subscribers.find(key);
-
-                    // get callback registered to this key
-                    if (mci != _subscribers.end())
+                    uint64_t count;
+                    ThreadLock<Mutex> l(_queue_lock);
+
+                    if (read(_wakeup_fd, &count, sizeof count) < 0 && errno != EAGAIN)
                     {
-                        f = mci->second;
+                        cerr << Time::isoDateTime(Time::getUTC())
+                             << " -- SubReactor: eventfd read: " << strerror(errno) << endl;
                     }
 
-                    // repeat for every possible frame containing
-                    // data. The use case is for just one data frame;
-                    // this will work for this, but if there are more
-                    // than one data frames it will also work. Every
-                    // subsequent data frame will call the same
-                    // callback however.
-                    sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+                    l.lock();
+                    cmds.swap(_queue);
+                    l.unlock();
 
-                    while (more)
+                    for (auto cmd : cmds)
                     {
-                        sub_sock.recv(&msg);
-
-                        // execute only if we found a callback.
-                        if (f)
+                        try
                         {
-                            f->exec(key, msg.data(), msg.size());
+                            _execute(*cmd);
+                        }
+                        catch (zmq::error_t &e)
+                        {
+                            cerr << Time::isoDateTime(Time::getUTC())
+                                 << " -- ZMQTransportClient subscriber reactor: "
+                                 << e.what() << endl
+                                 << "URN for this client: " << cmd->client->_data_urn << endl;
                         }
 
-                        sub_sock.getsockopt(ZMQ_RCVMORE, &more, &more_size);
+                        cmd->done.signal(true);
+                    }
+
+                    cmds.clear();
+
+                    if (_quit)
+                    {
+                        break;
                     }
                 }
             }
@@ -615,26 +1008,254 @@ namespace matrix
             {
                 string error = e.what();
                 cerr << Time::isoDateTime(Time::getUTC())
-                     << " -- ZMQTransportClient subscriber task: " << error << endl
-                     << "URN for this task: " << _data_urn << endl;
+                     << " -- ZMQTransportClient subscriber reactor: " << error << endl;
 
                 if (error.find("Context was terminated", 0) != string::npos)
                 {
-                    invalid_context = true;
                     break;
                 }
             }
         }
 
-        if (!invalid_context)
+        // no more commands will be taken. Any still queued fail.
+        ThreadLock<Mutex> l(_queue_lock);
+
+        l.lock();
+        _running = false;
+        cmds.swap(_queue);
+        l.unlock();
+
+        for (auto cmd : cmds)
         {
-            int zero = 0;
-            pipe.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
-            pipe.close();
-            zero = 0;
-            sub_sock.setsockopt(ZMQ_LINGER, &zero, sizeof zero);
-            sub_sock.close();
+            cmd->done.signal(true);
+        }
+
+        _close_all();
+    }
+
+    bool ZMQTransportClient::Impl::connect(string urn)
+    {
+        _data_urn = urn;
+
+        if (!_connected)
+        {
+            _reactor = &SubReactor::assign();
+            SubReactor::command cmd(CONNECT, this);
+
+            if (_reactor->request(cmd))
+            {
+                _connected = true;
+                return true;
+            }
+
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQTransportClient for URN " << urn
+                 << ": subscriber reactor unavailable." << endl;
+        }
+
+        return false;
+    }
+
+    bool ZMQTransportClient::Impl::disconnect()
+    {
+        if (_connected)
+        {
+            SubReactor::command cmd(DISCONNECT, this);
+            int rval = _reactor->request(cmd);
+            _connected = false;
+            _own_reactor.reset();
+            _reactor = 0;
+            return rval ? true : false;
+        }
+
+        return false;
+    }
+
+    bool ZMQTransportClient::Impl::subscribe(string key, DataCallbackBase *cb)
+    {
+        if (_connected)
+        {
+            if (cb && cb->may_block() && !use_own_reactor())
+            {
+                return false;
+            }
+
+            SubReactor::command cmd(SUBSCRIBE, this, key, cb);
+            return _reactor->request(cmd) ? true : false;
+        }
+
+        return false;
+    }
+
+/**
+ * Moves the client, with its socket, from its shared reactor to one
+ * of its own, so that a callback that blocks holds up no other
+ * client. Does nothing if it already has its own. The socket changes
+ * threads between the two commands, each of which is waited for.
+ *
+ * @return true if the client is on its own reactor.
+ *
+ */
+
+    bool ZMQTransportClient::Impl::use_own_reactor()
+    {
+        if (_own_reactor)
+        {
+            return true;
+        }
+
+        SubReactor::command detach(DETACH, this);
+
+        if (!_reactor->request(detach))
+        {
+            return false;
+        }
+
+        _own_reactor.reset(new SubReactor());
+        _reactor = _own_reactor.get();
+        SubReactor::command attach(ATTACH, this);
+
+        if (!_reactor->request(attach))
+        {
+            cerr << Time::isoDateTime(Time::getUTC())
+                 << " -- ZMQTransportClient for URN " << _data_urn
+                 << ": subscriber reactor unavailable." << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ZMQTransportClient::Impl::unsubscribe(string key)
+    {
+        if (_connected)
+        {
+            SubReactor::command cmd(UNSUBSCRIBE, this, key);
+            return _reactor->request(cmd) ? true : false;
+        }
+
+        return false;
+    }
+
+/**
+ * Receives one published message, if there is one, and passes it on
+ * to the callback subscribed to its key. Runs in the reactor's
+ * thread.
+ *
+ * @return true if a message was received, false if there was none
+ * waiting.
+ *
+ */
+
+    bool ZMQTransportClient::Impl::receive()
+    {
+        int more;
+        size_t more_size = sizeof(more);
+        DataCallbackTable::entry *e = 0;
+        DataCallbackBase *f = 0;
+        wire_header hdr;
+        bool legacy = false;
+
+        // get the key, and the callback registered to it. The key is
+        // used in place, in its frame.
+        if (!_sub_sock->recv(&_key_msg, ZMQ_DONTWAIT))
+        {
+            return false;
+        }
+
+        key_ref key((const char *)_key_msg.data(), _key_msg.size());
+
+        if ((e = _subscribers.find_entry(key.data(), key.size())))
+        {
+            f = e->cb;
         }
+
+        _sub_sock->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        if (!more)
+        {
+            return true;
+        }
+
+        // The header follows, then the data (see 'wire_header'); or,
+        // from an older publisher, just the data.
+        _sub_sock->recv(&_msg);
+        _sub_sock->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        if (!more)
+        {
+            legacy = true;
+        }
+        else if (hdr.decode(_msg.data(), _msg.size()))
+        {
+            _sub_sock->recv(&_msg);
+
+            if (e)
+            {
+                // a number lower than expected is a restarted publisher.
+                if (e->synced && hdr.seq > e->next_seq && f)
+                {
+                    f->exec_lost(key, hdr.seq - e->next_seq);
+                }
+
+                e->next_seq = hdr.seq + hdr.count;
+                e->synced = true;
+            }
+        }
+        else
+        {
+            // an unknown header version: drop the message.
+            f = 0;
+        }
+
+        // execute only if we found a callback.
+        if (!f)
+        {
+            // nothing to do.
+        }
+        else if (!legacy && hdr.batch)
+        {
+            if (hdr.count && _msg.size() == hdr.count * hdr.size)
+            {
+                f->exec_n(key, _msg.data(), hdr.size, hdr.count);
+            }
+        }
+        else if (f->takes_shared())
+        {
+            // handed the message itself, and '_msg' starts afresh.
+            shared_ptr<zmq::message_t> m = make_shared<zmq::message_t>(std::move(_msg));
+
+            f->exec_shared(key, shared_ptr<const void>(m, m->data()), m->size());
+        }
+        else
+        {
+            f->exec(key, _msg.data(), _msg.size());
+        }
+
+        // anything more is drained and ignored.
+        _sub_sock->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+
+        while (more)
+        {
+            _sub_sock->recv(&_msg);
+            _sub_sock->getsockopt(ZMQ_RCVMORE, &more, &more_size);
+        }
+
+        return true;
+    }
+
+/**
+ * Sets the number of threads that run the SUB sockets of all the
+ * ZMQTransportClients in the process (see SubReactor). This only has
+ * an effect before the first ZMQTransportClient connects.
+ *
+ * @param n: The number of threads, 1 by default.
+ *
+ */
+
+    void ZMQTransportClient::set_reactor_threads(size_t n)
+    {
+        SubReactor::reactor_threads = n;
     }
 
 
@@ -650,6 +1271,18 @@ namespace matrix
         _impl->disconnect();
     }
 
+/**
+ * Keeps the transport's socket options (see `zmq_set_options()`) for
+ * the SUB socket, which is made on connecting.
+ *
+ */
+
+    bool ZMQTransportClient::_configure(YAML::Node options)
+    {
+        _impl->_options = YAML::Clone(options);
+        return true;
+    }
+
     bool ZMQTransportClient::_connect()
     {
         return _impl->connect(_urn);
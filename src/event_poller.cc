@@ -0,0 +1,343 @@
+/*******************************************************************
+ *  event_poller.cc - Waits on many DataSinks at once, with epoll.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "matrix/event_poller.h"
+#include "matrix/ThreadLock.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+namespace matrix
+{
+/**
+ * The notifier given to each sink's receive queue. It owns the sink's
+ * eventfd, so that the descriptor stays open for as long as the queue
+ * may still signal it, and signals it only when the queue goes from
+ * empty to not empty, which costs one write() per burst rather than
+ * one per item.
+ *
+ */
+
+    struct event_poller::notifier : public fifo_notifier
+    {
+        notifier()
+            : efd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+        {
+            if (efd == -1)
+            {
+                throw MatrixException("event_poller", string("eventfd(): ") + strerror(errno));
+            }
+        }
+
+        ~notifier()
+        {
+            close(efd);
+        }
+
+        void clear()
+        {
+            uint64_t count;
+
+            if (read(efd, &count, sizeof count) == -1)
+            {
+                // EAGAIN: nothing to clear.
+            }
+        }
+
+        int efd;
+
+    private:
+
+        virtual void _call(int items)
+        {
+            if (items == 1)
+            {
+                uint64_t one = 1;
+
+                if (write(efd, &one, sizeof one) == -1)
+                {
+                    // EAGAIN: the counter is saturated, and so still readable.
+                }
+            }
+        }
+    };
+
+/**
+ * Creates the poller.
+ *
+ * @param edge_triggered: if true, `wait()` returns a sink once per
+ * transition from empty to not empty; if false (the default), for as
+ * long as it has data.
+ *
+ */
+
+    event_poller::event_poller(bool edge_triggered)
+        : _edge_triggered(edge_triggered),
+          _epoll_fd(epoll_create1(EPOLL_CLOEXEC))
+    {
+        if (_epoll_fd == -1)
+        {
+            throw MatrixException("event_poller", string("epoll_create1(): ") + strerror(errno));
+        }
+    }
+
+/**
+ * Destroys the poller, giving the sinks still in it back their default
+ * (do nothing) notifiers.
+ *
+ */
+
+    event_poller::~event_poller()
+    {
+        for (auto i = _sinks.begin(); i != _sinks.end(); ++i)
+        {
+            i->first->set_notifier(make_shared<fifo_notifier>());
+        }
+
+        close(_epoll_fd);
+    }
+
+/**
+ * Adds a DataSink to the poller. A sink that already has data is
+ * ready at once.
+ *
+ * @param ds: Address of the DataSink.
+ *
+ */
+
+    void event_poller::push_back(DataSinkBase *ds)
+    {
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+
+        if (_sinks.count(ds))
+        {
+            return;
+        }
+
+        shared_ptr<notifier> n = make_shared<notifier>();
+        epoll_event ev;
+
+        memset(&ev, 0, sizeof ev);
+        ev.events = _edge_triggered ? EPOLLIN | EPOLLET : EPOLLIN;
+        ev.data.fd = n->efd;
+
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, n->efd, &ev) == -1)
+        {
+            throw MatrixException("event_poller::push_back()",
+                                  string("epoll_ctl(): ") + strerror(errno));
+        }
+
+        _sinks[ds] = n;
+        _fds[n->efd] = ds;
+        ds->set_notifier(n);
+
+        // data that arrived before the notifier was in place
+        if (ds->items() > 0)
+        {
+            uint64_t one = 1;
+
+            if (write(n->efd, &one, sizeof one) == -1)
+            {
+                // EAGAIN: already readable.
+            }
+        }
+    }
+
+/**
+ * Removes a DataSink from the poller, giving it back a default
+ * notifier.
+ *
+ * @param ds: Address of the DataSink.
+ *
+ */
+
+    void event_poller::remove(DataSinkBase *ds)
+    {
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+
+        auto i = _sinks.find(ds);
+
+        if (i == _sinks.end())
+        {
+            return;
+        }
+
+        ds->set_notifier(make_shared<fifo_notifier>());
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, i->second->efd, 0);
+        _fds.erase(i->second->efd);
+        _sinks.erase(i);
+        _last_ready.erase(std::remove(_last_ready.begin(), _last_ready.end(), ds),
+                          _last_ready.end());
+    }
+
+    size_t event_poller::size()
+    {
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+        return _sinks.size();
+    }
+
+/**
+ * Waits for `usecs` microseconds or until one or more of the sinks
+ * becomes readable.
+ *
+ * @param ready: set to the sinks that are ready to read; emptied on
+ * time-out.
+ *
+ * @param usecs: the time to wait, in microseconds. 0 does not wait at
+ * all; a negative time waits for as long as it takes.
+ *
+ * @return The number of sinks in 'ready'.
+ *
+ */
+
+    size_t event_poller::wait(vector<DataSinkBase *> &ready, int usecs)
+    {
+        ready.clear();
+
+        if (!_edge_triggered)
+        {
+            ThreadLock<Mutex> l(_lock);
+            l.lock();
+
+            for (auto i = _last_ready.begin(); i != _last_ready.end(); ++i)
+            {
+                if ((*i)->items() > 0)
+                {
+                    ready.push_back(*i);
+                }
+            }
+        }
+
+        // whatever else is ready, without waiting if something already is.
+        int ms = ready.empty() ? (usecs < 0 ? -1 : (usecs + 999) / 1000) : 0;
+        _collect(ready, ms);
+
+        if (!_edge_triggered)
+        {
+            ThreadLock<Mutex> l(_lock);
+            l.lock();
+            _last_ready = ready;
+        }
+
+        return ready.size();
+    }
+
+/**
+ * As `poller::any_of()`.
+ *
+ * @param usecs: the time to wait, in microseconds.
+ *
+ * @return true if one of the DataSinks became ready to read, false if
+ * it times out.
+ *
+ */
+
+    bool event_poller::any_of(int usecs)
+    {
+        vector<DataSinkBase *> ready;
+        return wait(ready, usecs) > 0;
+    }
+
+/**
+ * The epoll file descriptor, readable when any sink has become ready.
+ * It should be waited on for reading only, and `wait()` called to
+ * find out which sinks are ready.
+ *
+ */
+
+    int event_poller::fd() const
+    {
+        return _epoll_fd;
+    }
+
+/**
+ * A sink's own eventfd, or -1 if the sink is not in this poller.
+ *
+ */
+
+    int event_poller::fd(DataSinkBase *ds)
+    {
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+
+        auto i = _sinks.find(ds);
+        return i == _sinks.end() ? -1 : i->second->efd;
+    }
+
+/**
+ * Collects the sinks whose eventfds have been signalled, clearing
+ * them, and adds those that do have data to 'ready'.
+ *
+ */
+
+    size_t event_poller::_collect(vector<DataSinkBase *> &ready, int ms)
+    {
+        const int MAX_EVENTS = 64;
+        epoll_event events[MAX_EVENTS];
+        size_t found = 0;
+        int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, ms);
+
+        // with more than MAX_EVENTS ready, the rest are there next time.
+        if (n <= 0)
+        {
+            return 0;               // time-out, or EINTR
+        }
+
+        ThreadLock<Mutex> l(_lock);
+        l.lock();
+
+        for (int i = 0; i < n; ++i)
+        {
+            auto s = _fds.find(events[i].data.fd);
+
+            if (s == _fds.end())
+            {
+                continue;           // removed meanwhile
+            }
+
+            _sinks[s->second]->clear();
+
+            if (s->second->items() > 0
+                && std::find(ready.begin(), ready.end(), s->second) == ready.end())
+            {
+                ready.push_back(s->second);
+                ++found;
+            }
+        }
+
+        return found;
+    }
+}
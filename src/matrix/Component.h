@@ -25,6 +25,7 @@
 #define Component_h
 #include <string>
 #include <tuple>
+#include <iostream>
 #include <yaml-cpp/yaml.h>
 #include "matrix/FiniteStateMachine.h"
 #include <matrix/tsemfifo.h>
@@ -260,6 +261,8 @@ namespace matrix
         /// A thingy which has all the connection info for the current mode.
         /// Maps a key of <mode,component,sink> to the corresponding <component,source,transport>
         ConnectionMap connections;
+        /// The sinks' overflow policies, if given, by the same key.
+        std::map<ConnectionKey, YAML::Node> sink_policies;
         std::string current_mode;
         bool done;
         matrix::Thread<Component> cmd_thread;
@@ -269,13 +272,42 @@ namespace matrix
     };
 
 
+/// Connects a DataSink to the source the current mode's connections
+/// give for 'sinkname', with the overflow policy given there, or else
+/// the one the sink was constructed with, and has the sink's counters
+/// published under 'components.<this component>.stats.sinks.<sinkname>'.
+/// If the policy is not valid the sink is left disconnected, and
+/// false returned.
     template<typename T>
     bool Component::connect_sink(T &sink, std::string sinkname)
     {
         ConnectionKey q(current_mode, my_instance_name, sinkname);
+        auto policy = sink_policies.find(q);
+
         if (find_data_connection(q))
         {
+            // not while the transport may be using the sink
+            sink.disconnect();
+
+            try
+            {
+                if (policy != sink_policies.end() && policy->second.IsMap())
+                {
+                    sink.set_policy(policy->second);
+                }
+                else
+                {
+                    sink.reset_policy();
+                }
+            }
+            catch (matrix::MatrixException &e)
+            {
+                std::cerr << __PRETTY_FUNCTION__ << " " << sinkname << ": " << e.what() << std::endl;
+                return false;
+            }
+
             sink.connect(std::get<0>(q), std::get<1>(q), std::get<2>(q));
+            sink.stats().publish_to(keymaster_url, my_full_instance_name + ".stats.sinks." + sinkname);
         }
         return true;
     }
@@ -48,10 +48,14 @@
 #include "matrix/ThreadLock.h"
 
 #include <string>
+#include <vector>
 #include <memory>
 #include <exception>
+#include <stdint.h>
+#include <string.h>
 #include <yaml-cpp/yaml.h>
 #include <boost/algorithm/string.hpp>
+#include <boost/utility/string_ref.hpp>
 
 namespace matrix
 {
@@ -139,6 +143,11 @@ namespace matrix
             return _buffer.data();
         }
 
+        const unsigned char *data() const
+        {
+            return _buffer.data();
+        }
+
         const GenericBuffer &operator=(const GenericBuffer &rhs)
         {
             _copy(rhs);
@@ -159,6 +168,88 @@ namespace matrix
         std::vector<unsigned char> _buffer;
     };
 
+/**
+ * \class SharedBuffer
+ *
+ * A read-only reference to received data, for DataSinks of large
+ * payloads. Where the transport can (ZMQ), a DataSink<SharedBuffer>
+ * keeps the message it received in its queue, and `get()` hands out a
+ * reference to it, so the data is not copied on the way to the
+ * consumer. The message is freed when the last SharedBuffer referring
+ * to it is reset or destroyed:
+ *
+ *     DataSink<SharedBuffer> sink(km_urn);
+ *     SharedBuffer buf;
+ *     ...
+ *     sink.get(buf);
+ *     process(buf.data(), buf.size());
+ *     buf.reset(); // or just get() the next one into it
+ *
+ * Copying a SharedBuffer copies the reference, not the data. Other
+ * transports, and batches, are copied once into a new buffer.
+ *
+ */
+
+    class SharedBuffer
+    {
+    public:
+        SharedBuffer() : _size(0)
+        {
+        }
+
+        SharedBuffer(std::shared_ptr<const void> data, size_t size) :
+            _data(data),
+            _size(size)
+        {
+        }
+
+        static SharedBuffer copy(const void *data, size_t size)
+        {
+            std::shared_ptr<unsigned char> buf(new unsigned char[size],
+                                               std::default_delete<unsigned char[]>());
+
+            memcpy(buf.get(), data, size);
+            return SharedBuffer(buf, size);
+        }
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        const unsigned char *data() const
+        {
+            return static_cast<const unsigned char *>(_data.get());
+        }
+
+        std::shared_ptr<const void> shared() const
+        {
+            return _data;
+        }
+
+        void reset()
+        {
+            _data.reset();
+            _size = 0;
+        }
+
+    private:
+        std::shared_ptr<const void> _data;
+        size_t _size;
+    };
+
+    /**
+     * Drops a tsemfifo slot's reference to its SharedBuffer as soon as
+     * the item is taken out of the queue, rather than when the slot is
+     * next written (see `fifo_slot_released()` in tsemfifo.h).
+     *
+     */
+
+    inline void fifo_slot_released(SharedBuffer &buf)
+    {
+        buf.reset();
+    }
+
     struct data_description
     {
         enum types
@@ -223,6 +314,16 @@ namespace matrix
  * Callback classes
  **********************************************************************/
 
+/**
+ * A non-owning reference to a data key, as given to data
+ * callbacks. Transports hand over the key where they have it (a 0MQ
+ * frame, a std::string they already own) without constructing a
+ * std::string for every message. Use `to_string()` to keep a copy.
+ *
+ */
+
+    typedef boost::string_ref key_ref;
+
 /**
  * \class DataCallbackBase
  *
@@ -231,12 +332,78 @@ namespace matrix
  * published, it is received by the Keymaster client object, which then
  * calls the provided pointer to an object of this type.
  *
+ * Subclasses implement `_call()`, which receives the key as a
+ * std::string. Those on a hot path should also override `_call_ref()`,
+ * which receives it as a `key_ref` and by default makes the string
+ * and calls `_call()`.
+ *
+ * Data published as a batch (see `TransportServer::publish_batch()`)
+ * is delivered with `exec_n()`: 'n' items of 'sze' bytes each,
+ * contiguous in 'val'. Unless overridden, this is passed on as 'n'
+ * calls to `_call_ref()`.
+ *
+ * A callback that `takes_shared()` may be given the received data with
+ * `exec_shared()` instead, as a reference it may keep; a transport
+ * that can hand over its message without copying it does so. Unless
+ * overridden, this is passed on to `_call_ref()`.
+ *
+ * A transport that can tell that messages were lost on the way (the
+ * ZMQ transports, by their sequence numbers) says how many with
+ * `exec_lost()`, before delivering the next message. Unless
+ * overridden, this is ignored.
+ *
+ * A callback that `may_block()` (a DataSink with a BLOCK overflow
+ * policy, for instance) may hold up the thread it is called in for a
+ * while. A transport that calls many clients' callbacks in one thread
+ * keeps such callbacks out of it. Unless overridden, a callback is
+ * taken not to block.
+ *
  */
 
     struct DataCallbackBase
     {
-        void operator()(std::string key, void *val, size_t sze) {_call(key, val, sze);}
-        void exec(std::string key, void *val, size_t sze)       {_call(key, val, sze);}
+        void operator()(key_ref key, void *val, size_t sze) {_call_ref(key, val, sze);}
+        void exec(key_ref key, void *val, size_t sze)       {_call_ref(key, val, sze);}
+        void exec_n(key_ref key, void *val, size_t sze, size_t n) {_call_n(key, val, sze, n);}
+        void exec_shared(key_ref key, std::shared_ptr<const void> val, size_t sze)
+        {
+            _call_shared(key, val, sze);
+        }
+        bool takes_shared() const {return _takes_shared();}
+        void exec_lost(key_ref key, size_t n) {_call_lost(key, n);}
+        bool may_block() const {return _may_block();}
+    protected:
+        virtual void _call_ref(key_ref key, void *val, size_t sze)
+        {
+            _call(key.to_string(), val, sze);
+        }
+
+        virtual void _call_n(key_ref key, void *val, size_t sze, size_t n)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                _call_ref(key, (char *)val + i * sze, sze);
+            }
+        }
+
+        virtual void _call_shared(key_ref key, std::shared_ptr<const void> val, size_t sze)
+        {
+            _call_ref(key, const_cast<void *>(val.get()), sze);
+        }
+
+        virtual bool _takes_shared() const
+        {
+            return false;
+        }
+
+        virtual void _call_lost(key_ref, size_t)
+        {
+        }
+
+        virtual bool _may_block() const
+        {
+            return false;
+        }
     private:
         virtual void _call(std::string key, void *val, size_t szed) = 0;
     };
@@ -270,6 +437,21 @@ namespace matrix
  *         ds->subscribe("Data", &my_cb); // assumes a data source named "Data"
  *     }
  *
+ * A second method, with the signature `void (std::string, void *,
+ * size_t, size_t)`, may optionally be given to receive batches
+ * (see `DataCallbackBase::exec_n()`) in one call.
+ *
+ * The methods may instead take a `key_ref` in place of the
+ * std::string, in which case no string is made per message.
+ *
+ * A method with the signature `void (key_ref, std::shared_ptr<const
+ * void>, size_t)` given to `set_shared()` receives the data as a
+ * reference it may keep (see `DataCallbackBase::exec_shared()`).
+ * Likewise a method `void (key_ref, size_t)` given to `set_lost()` is
+ * told of lost messages (see `DataCallbackBase::exec_lost()`).
+ * `set_may_block()` says whether the methods may block (see
+ * `DataCallbackBase::may_block()`).
+ *
  */
 #pragma GCC diagnostic pop
 
@@ -278,13 +460,51 @@ namespace matrix
     {
     public:
         typedef void (T::*ActionMethod)(std::string, void *, size_t);
+        typedef void (T::*BatchMethod)(std::string, void *, size_t, size_t);
+        typedef void (T::*RefActionMethod)(key_ref, void *, size_t);
+        typedef void (T::*RefBatchMethod)(key_ref, void *, size_t, size_t);
+        typedef void (T::*SharedMethod)(key_ref, std::shared_ptr<const void>, size_t);
+        typedef void (T::*LostMethod)(key_ref, size_t);
 
-        DataMemberCB(T *obj, ActionMethod cb) :
+        DataMemberCB(T *obj, ActionMethod cb, BatchMethod bcb = 0) :
             _object(obj),
-            _faction(cb)
+            _faction(cb),
+            _fbatch(bcb),
+            _frefaction(0),
+            _frefbatch(0),
+            _fshared(0),
+            _flost(0),
+            _blocks(false)
         {
         }
 
+        DataMemberCB(T *obj, RefActionMethod cb, RefBatchMethod bcb = 0) :
+            _object(obj),
+            _faction(0),
+            _fbatch(0),
+            _frefaction(cb),
+            _frefbatch(bcb),
+            _fshared(0),
+            _flost(0),
+            _blocks(false)
+        {
+        }
+
+        void set_shared(SharedMethod scb)
+        {
+            _fshared = scb;
+        }
+
+        void set_lost(LostMethod lcb)
+        {
+            _flost = lcb;
+        }
+
+        void set_may_block(bool blocks)
+        {
+            _blocks = blocks;
+        }
+
     private:
         ///
         /// Invoke a call to the user provided callback
@@ -295,10 +515,186 @@ namespace matrix
             {
                 (_object->*_faction)(key, buf, len);
             }
+            else if (_object && _frefaction)
+            {
+                (_object->*_frefaction)(key, buf, len);
+            }
+        }
+
+        void _call_ref(key_ref key, void *buf, size_t len)
+        {
+            if (_object && _frefaction)
+            {
+                (_object->*_frefaction)(key, buf, len);
+            }
+            else
+            {
+                DataCallbackBase::_call_ref(key, buf, len);
+            }
+        }
+
+        ///
+        /// Invoke the user provided batch callback, if any.
+        ///
+        void _call_n(key_ref key, void *buf, size_t len, size_t n)
+        {
+            if (_object && _frefbatch)
+            {
+                (_object->*_frefbatch)(key, buf, len, n);
+            }
+            else if (_object && _fbatch)
+            {
+                (_object->*_fbatch)(key.to_string(), buf, len, n);
+            }
+            else
+            {
+                DataCallbackBase::_call_n(key, buf, len, n);
+            }
+        }
+
+        ///
+        /// Invoke the user provided shared data callback, if any.
+        ///
+        void _call_shared(key_ref key, std::shared_ptr<const void> buf, size_t len)
+        {
+            if (_object && _fshared)
+            {
+                (_object->*_fshared)(key, buf, len);
+            }
+            else
+            {
+                DataCallbackBase::_call_shared(key, buf, len);
+            }
+        }
+
+        bool _takes_shared() const
+        {
+            return _object && _fshared;
+        }
+
+        void _call_lost(key_ref key, size_t n)
+        {
+            if (_object && _flost)
+            {
+                (_object->*_flost)(key, n);
+            }
+        }
+
+        bool _may_block() const
+        {
+            return _blocks;
         }
 
         T  *_object;
         ActionMethod _faction;
+        BatchMethod _fbatch;
+        RefActionMethod _frefaction;
+        RefBatchMethod _frefbatch;
+        SharedMethod _fshared;
+        LostMethod _flost;
+        bool _blocks;
+    };
+
+/**
+ * \class DataCallbackTable
+ *
+ * Maps data keys to callbacks for the subscriber side of a
+ * transport. It is a flat vector searched by a hash of the key,
+ * which suits the handful of subscriptions a TransportClient
+ * has. `find()` takes the key as raw bytes, so a received key frame
+ * may be looked up in place. `find_entry()` also gives the transport
+ * the entry's per-stream state, the sequence number it next expects
+ * on that key.
+ *
+ */
+
+    class DataCallbackTable
+    {
+    public:
+        struct entry
+        {
+            uint64_t hash;
+            std::string key;
+            DataCallbackBase *cb;
+            uint64_t next_seq;   // the sequence number expected next
+            bool synced;         // false until a sequence number is seen
+        };
+
+        void set(std::string key, DataCallbackBase *cb)
+        {
+            uint64_t h = hash(key.data(), key.size());
+
+            for (entry &e : _entries)
+            {
+                if (e.hash == h && e.key == key)
+                {
+                    e.cb = cb;
+                    return;
+                }
+            }
+
+            _entries.push_back(entry {h, key, cb, 0, false});
+        }
+
+        bool erase(std::string key)
+        {
+            uint64_t h = hash(key.data(), key.size());
+
+            for (size_t i = 0; i < _entries.size(); ++i)
+            {
+                if (_entries[i].hash == h && _entries[i].key == key)
+                {
+                    _entries[i] = _entries.back();
+                    _entries.pop_back();
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        DataCallbackBase *find(const char *key, size_t len)
+        {
+            entry *e = find_entry(key, len);
+            return e ? e->cb : NULL;
+        }
+
+        entry *find_entry(const char *key, size_t len)
+        {
+            uint64_t h = hash(key, len);
+
+            for (entry &e : _entries)
+            {
+                if (e.hash == h && e.key.size() == len
+                    && (!len || memcmp(e.key.data(), key, len) == 0))
+                {
+                    return &e;
+                }
+            }
+
+            return NULL;
+        }
+
+        size_t size() const
+        {
+            return _entries.size();
+        }
+
+        // FNV-1a
+        static uint64_t hash(const char *key, size_t len)
+        {
+            uint64_t h = 14695981039346656037ULL;
+
+            for (size_t i = 0; i < len; ++i)
+            {
+                h = (h ^ (unsigned char)key[i]) * 1099511628211ULL;
+            }
+
+            return h;
+        }
+
+    private:
+        std::vector<entry> _entries;
     };
 
 /**
@@ -488,6 +884,13 @@ namespace matrix
   *         ~MyTransportServer();
   *         bool publish(std::string, const void *, size_t);
   *         bool publish(std::string, std::string);
+  *         // optional; the default publishes each element in turn.
+  *         bool publish_batch(std::string, const void *, size_t, size_t);
+  *         // optional; see 'intern()' below.
+  *         key_handle_t intern(std::string);
+  *         bool publish_interned(key_handle_t, const std::string &, const void *, size_t);
+  *         bool publish_batch_interned(key_handle_t, const std::string &, const void *,
+  *                                     size_t, size_t);
   *
   *         static TransportServer *factory(std::string, std::string);
   *     };
@@ -499,6 +902,18 @@ namespace matrix
   *     vector<string> transports = {'my_transport'};
   *     TransportServer::add_factory(transports, TransportServer *(*)(string, string));
   *
+  * A publisher that publishes the same key over and over (as a
+  * DataSource does) may `intern()` the key once, and then publish with
+  * the returned handle *and* the key. A transport that supports this
+  * uses the handle to find its subscribers without looking up the key;
+  * the default ignores the handle and publishes by key.
+  *
+  * `publish_shared()` publishes a buffer owned by a std::shared_ptr. A
+  * transport that can send the buffer without copying it (ZMQ) keeps
+  * a reference to it until it has been sent, so the publisher must not
+  * change the buffer after publishing it; the default copies the data
+  * as `publish()` does, and keeps no reference.
+  *
   */
 #pragma GCC diagnostic pop
 
@@ -511,6 +926,20 @@ namespace matrix
         bool bind(std::vector<std::string> urns);
         bool publish(std::string key, const void *data, size_t size_of_data);
         bool publish(std::string key, std::string data);
+        bool publish_batch(std::string key, const void *data, size_t size_of_element,
+                           size_t count);
+
+        // An interned data key. See 'intern()'.
+        typedef int32_t key_handle_t;
+        static const key_handle_t NO_HANDLE = -1;
+
+        key_handle_t intern(std::string key);
+        bool publish(key_handle_t h, const std::string &key, const void *data,
+                     size_t size_of_data);
+        bool publish_batch(key_handle_t h, const std::string &key, const void *data,
+                           size_t size_of_element, size_t count);
+        bool publish_shared(key_handle_t h, const std::string &key,
+                            std::shared_ptr<const void> data, size_t size_of_data);
 
         // exception type for this class.
         class CreationError : public std::exception
@@ -550,6 +979,16 @@ namespace matrix
         virtual bool _bind(std::vector<std::string> urns);
         virtual bool _publish(std::string key, const void *data, size_t size_of_data);
         virtual bool _publish(std::string key, std::string data);
+        virtual bool _publish_batch(std::string key, const void *data, size_t size_of_element,
+                                    size_t count);
+        virtual key_handle_t _intern(std::string key);
+        virtual bool _publish_interned(key_handle_t h, const std::string &key,
+                                       const void *data, size_t size_of_data);
+        virtual bool _publish_batch_interned(key_handle_t h, const std::string &key,
+                                             const void *data, size_t size_of_element,
+                                             size_t count);
+        virtual bool _publish_shared(key_handle_t h, const std::string &key,
+                                     std::shared_ptr<const void> data, size_t size_of_data);
 
         bool _register_urn(std::vector<std::string> urns);
         bool _unregister_urn();
@@ -585,6 +1024,37 @@ namespace matrix
         return _publish(key, data);
     }
 
+    inline bool TransportServer::publish_batch(std::string key, const void *data,
+                                               size_t size_of_element, size_t count)
+    {
+        return _publish_batch(key, data, size_of_element, count);
+    }
+
+    inline TransportServer::key_handle_t TransportServer::intern(std::string key)
+    {
+        return _intern(key);
+    }
+
+    inline bool TransportServer::publish(key_handle_t h, const std::string &key,
+                                         const void *data, size_t size_of_data)
+    {
+        return _publish_interned(h, key, data, size_of_data);
+    }
+
+    inline bool TransportServer::publish_batch(key_handle_t h, const std::string &key,
+                                               const void *data, size_t size_of_element,
+                                               size_t count)
+    {
+        return _publish_batch_interned(h, key, data, size_of_element, count);
+    }
+
+    inline bool TransportServer::publish_shared(key_handle_t h, const std::string &key,
+                                                std::shared_ptr<const void> data,
+                                                size_t size_of_data)
+    {
+        return _publish_shared(h, key, data, size_of_data);
+    }
+
 /**********************************************************************
  * Transport Client
  **********************************************************************/
@@ -613,6 +1083,10 @@ namespace matrix
  * keys. That function checks to see if the stored shared_ptr is
  * unique, and if so, it resets it, terminating the TransportClient.
  *
+ * Before connecting, the DataSink passes the client the transport's
+ * 'Options' entry, if any, with `configure()`. A client shared by
+ * several DataSinks takes the options as they are when it connects.
+ *
  */
 
     class TransportClient
@@ -621,6 +1095,7 @@ namespace matrix
         TransportClient(std::string urn);
         virtual ~TransportClient();
 
+        bool configure(YAML::Node options);
         bool connect(std::string urn = "");
         bool disconnect();
         bool subscribe(std::string key, DataCallbackBase *cb);
@@ -657,6 +1132,7 @@ namespace matrix
 
     protected:
 
+        virtual bool _configure(YAML::Node options);
         virtual bool _connect();
         virtual bool _disconnect();
         virtual bool _subscribe(std::string key, DataCallbackBase *cb);
@@ -678,6 +1154,13 @@ namespace matrix
         static client_map_t transports;
     };
 
+    inline bool TransportClient::configure(YAML::Node options)
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_shared_lock);
+        l.lock();
+        return _configure(options);
+    }
+
     inline bool TransportClient::connect(std::string urn)
     {
         matrix::ThreadLock<matrix::Mutex> l(_shared_lock);
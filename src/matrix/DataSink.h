@@ -31,8 +31,10 @@
 #include "matrix/Time.h"
 #include "matrix/tsemfifo.h"
 #include "matrix/DataInterface.h"
+#include "matrix/DataStats.h"
 
 #include <sstream>
+#include <type_traits>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wcomment"
@@ -149,8 +151,7 @@ namespace matrix
 
         std::string operator() (std::string component, std::string data_name)
         {
-            matrix::Keymaster km(_km_urn);
-            YAML::Node n = km.get("components." + component);
+            YAML::Node n = matrix::Keymaster::shared_client(_km_urn)->get("components." + component);
             std::string transport = n["Sources"][data_name].as<std::string>();
             std::vector<std::string> urls =
                 n["Transports"][transport]["AsConfigured"].as<std::vector<std::string> >();
@@ -198,8 +199,7 @@ namespace matrix
 
         std::string operator() (std::string component, std::string data_name)
         {
-            matrix::Keymaster km(_km_urn);
-            YAML::Node n = km.get("components." + component);
+            YAML::Node n = matrix::Keymaster::shared_client(_km_urn)->get("components." + component);
             std::string transport = n["Sources"][data_name].as<std::string>();
             std::vector<std::string> urls =
                 n["Transports"][transport]["AsConfigured"].as<std::vector<std::string> >();
@@ -290,6 +290,9 @@ namespace matrix
  *          }
  *      }
  *
+ * Every wake looks at every sink; for more than a few sinks, see
+ * event_poller.
+ *
  */
 #pragma GCC diagnostic pop
 
@@ -462,8 +465,114 @@ namespace matrix
  *     mbsink.get(rcv_msg);
  *     cout << "Received: " << rcv_msg << endl;
  *
+ * A DataSink<SharedBuffer> receives large payloads without copying
+ * them: the ZMQ transports hand over the received message, which the
+ * queue holds until the SharedBuffer it is got into lets it go.
+ *
  */
 #pragma GCC diagnostic pop
+/**
+ * \struct sink_policy
+ *
+ * What a DataSink does with data arriving faster than it is read:
+ *
+ *   - DROP_OLDEST (the default): when the receive queue is full, the
+ *     oldest item is dropped to make room for the new one. In SPSC
+ *     mode the transport may not take items out of the queue, so the
+ *     new item is dropped instead.
+ *
+ *   - DROP_NEWEST: when the queue is full, the new item is dropped.
+ *
+ *   - BLOCK: the transport waits for room in the queue, for at most
+ *     'timeout' nanoseconds if that is not 0, after which the new item
+ *     is dropped. Note that while it waits, no other subscriber of
+ *     the same transport client gets any data either. (The ZMQ
+ *     transports give such a client a thread of its own, so that
+ *     other clients are not held up too.)
+ *
+ * Independently of these, with 'decimate' N greater than 1 the sink
+ * keeps only every Nth item received and discards the rest. These do
+ * not count as dropped.
+ *
+ * In a component's configuration a policy is given by a map at the
+ * end of the sink's entry in the 'connections' section (see
+ * Component::parse_data_connections()):
+ *
+ *     connections:
+ *       OBSERVING:
+ *         - [nettask, data, display, input, {overflow: drop_oldest}]
+ *         - [nettask, data, fits_logger, input, tcp,
+ *            {overflow: block, timeout_ms: 50}]
+ *         - [nettask, data, monitor, input, {decimate: 10}]
+ *
+ */
+
+    struct sink_policy
+    {
+        enum overflow_policy
+        {
+            DROP_OLDEST,
+            DROP_NEWEST,
+            BLOCK
+        };
+
+        sink_policy(overflow_policy o = DROP_OLDEST, Time::Time_t t = 0, unsigned int d = 1)
+            : overflow(o),
+              timeout(t),
+              decimate(d)
+        {
+        }
+
+        static sink_policy from_yaml(YAML::Node n);
+
+        overflow_policy overflow;
+        Time::Time_t timeout;       // BLOCK: the longest wait, in ns; 0 forever
+        unsigned int decimate;      // keep 1 item in 'decimate'
+    };
+
+    /**
+     * Gets a free slot in the DataSink's tsemfifo as the policy says,
+     * for the specializations of _data_handler that fill the slot in
+     * place.
+     *
+     * @param ringbuf: the DataSink's receive queue.
+     * @param policy: the DataSink's overflow policy.
+     * @param dropped: set to the number of items dropped, the new one
+     * included if there is no slot.
+     *
+     * @return The slot, to be committed or rolled back, or 0.
+     *
+     */
+
+    template <typename T>
+    T *_reserve_slot(matrix::tsemfifo<T> &ringbuf, const sink_policy &policy,
+                     unsigned int &dropped)
+    {
+        T *slot = 0;
+
+        dropped = 0;
+
+        switch (policy.overflow)
+        {
+        case sink_policy::BLOCK:
+            slot = policy.timeout ? ringbuf.timed_reserve(policy.timeout) : ringbuf.reserve();
+            break;
+        case sink_policy::DROP_NEWEST:
+            slot = ringbuf.try_reserve();
+            break;
+        case sink_policy::DROP_OLDEST:
+            slot = ringbuf.reserve_no_block(dropped);
+            break;
+        }
+
+        if (!slot)
+        {
+            dropped = 1;
+        }
+
+        return slot;
+    }
+
     /**
      * General implementation for all types T. This is used by the
      * transport to provide the data to the tsemfifo belonging to a
@@ -472,14 +581,16 @@ namespace matrix
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
      * @param ringbuf: the ringbuf to place the string into.
+     * @param policy: what to do if 'ringbuf' is full.
      *
-     * @return The number of the oldest entries flushed from the
-     * buffer to make room for this one. Ideally this is 0.
+     * @return The number of entries dropped, old ones to make room
+     * for this one or this one itself. Ideally this is 0.
      *
      */
 
     template <typename T>
-    int _data_handler(void *data, size_t sze, matrix::tsemfifo<T> &ringbuf, bool blocking)
+    int _data_handler(void *data, size_t sze, matrix::tsemfifo<T> &ringbuf,
+                      const sink_policy &policy)
     {
         if (sizeof(T) != sze)
         {
@@ -488,48 +599,56 @@ namespace matrix
                 << " and given data buffer size is " << sze;
             throw matrix::MatrixException("DataSink::_data_handler()", msg.str());
         }
-        if (blocking)
-        {
-            return ringbuf.put(*(T*)data);
-        }
-        else
+
+        switch (policy.overflow)
         {
-            return ringbuf.put_no_block(*(T *) data);
+        case sink_policy::BLOCK:
+            if (policy.timeout)
+            {
+                return ringbuf.timed_put(*(T *)data, policy.timeout) ? 0 : 1;
+            }
+
+            return ringbuf.put(*(T *)data) ? 0 : 1;
+        case sink_policy::DROP_NEWEST:
+            return ringbuf.try_put(*(T *)data) ? 0 : 1;
+        default:
+            return ringbuf.put_no_block(*(T *)data);
         }
     }
 
     /**
      * std::string specialization for _data_handler, wich is used by
      * the transport to provide the data to the DataSink's
-     * tsemfifo. Using std::strings has some implications: When the
-     * string is placed into the fifo, it's operator=() will be used
-     * to transfer the data. This means whatever previous buffer the
-     * string inside the fifo was using will be deleted, and a pointer
-     * to a new buffer given to it (by std::string, in this
-     * function). This means memory allocation and deallocation.
+     * tsemfifo. The data is assigned directly into the next free
+     * string in the fifo (see `tsemfifo::reserve()`), so that
+     * string's buffer is reused, and memory is only allocated when an
+     * incoming string is longer than any that slot has held before.
      *
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
      * @param ringbuf: the ringbuf to place the string into.
+     * @param policy: what to do if 'ringbuf' is full.
      *
-     * @return The number of the oldest entries flushed from the
-     * buffer to make room for this one. Ideally this is 0.
+     * @return The number of entries dropped, old ones to make room
+     * for this one or this one itself. Ideally this is 0.
      *
      */
 
     template <>
-    inline int _data_handler<std::string>(void *data, size_t sze, matrix::tsemfifo<std::string> &ringbuf, bool blocking)
+    inline int _data_handler<std::string>(void *data, size_t sze, matrix::tsemfifo<std::string> &ringbuf,
+                                          const sink_policy &policy)
     {
-        std::string val(sze, 0);
-        std::memmove((char *)val.data(), data, sze);
-        if (blocking)
-        {
-            return ringbuf.put(val);
-        }
-        else
+        unsigned int dropped;
+        std::string *val = _reserve_slot(ringbuf, policy, dropped);
+
+        if (!val)
         {
-            return ringbuf.put_no_block(val);
+            return dropped;
         }
+
+        val->assign((const char *)data, sze);
+        ringbuf.commit();
+        return dropped;
     }
 
     /**
@@ -539,62 +658,166 @@ namespace matrix
      * resizable buffer. In a DataSource, it is useful for matching
      * the expected size of a DataSink, and when used in a DataSync,
      * useful for matching the incoming size from a
-     * DataSource. GenericBuffers will only resize themselves when the
-     * incoming data size does not match the previously allocated
-     * size. In that case a new buffer of the right size will be
-     * allocated. Otherwise data is copied to the buffers without any
-     * allocation or deallocation or transfer of buffer, as with
-     * std::string.
+     * DataSource. The data is copied straight into the next free
+     * GenericBuffer in the fifo (see `tsemfifo::reserve()`), which
+     * will only resize itself when the incoming data size does not
+     * match the previously allocated size. Otherwise there is exactly
+     * one copy, and no allocation or deallocation.
      *
      * @param data: The data buffer
      * @param sze: The size in bytes of the buffer
      * @param ringbuf: the ringbuf to place the string into.
+     * @param policy: what to do if 'ringbuf' is full.
      *
-     * @return The number of the oldest entries flushed from the
-     * buffer to make room for this one. Ideally this is 0.
+     * @return The number of entries dropped, old ones to make room
+     * for this one or this one itself. Ideally this is 0.
      *
      */
 
     template <>
     inline int _data_handler<matrix::GenericBuffer>(void *data, size_t sze,
-                                                    matrix::tsemfifo<matrix::GenericBuffer> &ringbuf, bool blocking)
+                                                    matrix::tsemfifo<matrix::GenericBuffer> &ringbuf,
+                                                    const sink_policy &policy)
     {
-        matrix::GenericBuffer buf;
+        unsigned int dropped;
+        matrix::GenericBuffer *buf = _reserve_slot(ringbuf, policy, dropped);
 
-        if (buf.size() != sze)
+        if (!buf)
         {
-            buf.resize(sze);
+            return dropped;
         }
 
-        // TBF? A copy could be eliminated here if tsemfifo had a
-        // 'get_next_no_block()' and a 'put()' (with empty parameter list),
-        // wich would handle the semaphores properly to mark it as put,
-        // to get the next available slot and copy it directly to this.
-        std::memmove((unsigned char *)buf.data(), data, sze);
-        if (blocking)
+        if (buf->size() != sze)
         {
-            return ringbuf.put(buf);
+            try
+            {
+                buf->resize(sze);
+            }
+            catch (...)
+            {
+                ringbuf.rollback();
+                throw;
+            }
         }
-        else
+
+        std::memcpy(buf->data(), data, sze);
+        ringbuf.commit();
+        return dropped;
+    }
+
+    /**
+     * matrix::SharedBuffer specialization for _data_handler, for
+     * transports that do not hand over their messages: the data is
+     * copied once, into a new buffer.
+     *
+     * @param data: The data buffer
+     * @param sze: The size in bytes of the buffer
+     * @param ringbuf: the ringbuf to place the buffer into.
+     * @param policy: what to do if 'ringbuf' is full.
+     *
+     * @return The number of entries dropped, old ones to make room
+     * for this one or this one itself. Ideally this is 0.
+     *
+     */
+
+    template <>
+    inline int _data_handler<matrix::SharedBuffer>(void *data, size_t sze,
+                                                   matrix::tsemfifo<matrix::SharedBuffer> &ringbuf,
+                                                   const sink_policy &policy)
+    {
+        unsigned int dropped;
+        matrix::SharedBuffer *buf = _reserve_slot(ringbuf, policy, dropped);
+
+        if (!buf)
+        {
+            return dropped;
+        }
+
+        try
+        {
+            *buf = matrix::SharedBuffer::copy(data, sze);
+        }
+        catch (...)
+        {
+            ringbuf.rollback();
+            throw;
+        }
+
+        ringbuf.commit();
+        return dropped;
+    }
+
+    /**
+     * Places data handed over by the transport (see
+     * `DataCallbackBase::exec_shared()`) into the DataSink's
+     * tsemfifo. Only a DataSink<SharedBuffer> takes its data this way,
+     * keeping a reference to the transport's message in the queue; for
+     * any other type the data is handled as by `_data_handler()`.
+     *
+     * @param data: The data, and the reference to it.
+     * @param sze: The size in bytes of the data.
+     * @param ringbuf: the ringbuf to place the data into.
+     * @param policy: what to do if 'ringbuf' is full.
+     *
+     * @return The number of entries dropped.
+     *
+     */
+
+    template <typename T>
+    int _shared_data_handler(std::shared_ptr<const void> data, size_t sze,
+                             matrix::tsemfifo<T> &ringbuf, const sink_policy &policy)
+    {
+        return _data_handler<T>(const_cast<void *>(data.get()), sze, ringbuf, policy);
+    }
+
+    template <>
+    inline int _shared_data_handler<matrix::SharedBuffer>(std::shared_ptr<const void> data, size_t sze,
+                                                          matrix::tsemfifo<matrix::SharedBuffer> &ringbuf,
+                                                          const sink_policy &policy)
+    {
+        unsigned int dropped;
+        matrix::SharedBuffer *buf = _reserve_slot(ringbuf, policy, dropped);
+
+        if (!buf)
         {
-            return ringbuf.put_no_block(buf);
+            return dropped;
         }
+
+        *buf = matrix::SharedBuffer(data, sze);
+        ringbuf.commit();
+        return dropped;
     }
 
     template <typename T, typename U = select_specified>
     class DataSink : public matrix::DataSinkBase
     {
     public:
-        DataSink(std::string km_urn, size_t ringbuf_size = 10, bool blocking=false);
+        DataSink(std::string km_urn, size_t ringbuf_size = 10, bool blocking=false,
+                 matrix::fifo_mode mode = matrix::MPMC);
+        DataSink(std::string km_urn, size_t ringbuf_size, const matrix::sink_policy &policy,
+                 matrix::fifo_mode mode = matrix::MPMC);
         ~DataSink() throw();
 
         void get(T &);
         bool try_get(T &);
         bool timed_get(T &, Time::Time_t);
+        size_t get_n(T *, size_t, Time::Time_t time_out = 0);
+        bool wait_get_n(T *, size_t, Time::Time_t time_out = 0);
+        size_t drain(std::vector<T> &);
+        T *peek();
+        T *try_peek();
+        T *timed_peek(Time::Time_t);
+        void release_slot();
         size_t items();
         size_t lost_items();
         size_t flush(int items);
         void set_notifier(std::shared_ptr<matrix::fifo_notifier> n);
+        matrix::DataStats &stats() {return _stats;}
+        void set_queue_latency(bool on);
+        void set_policy(const matrix::sink_policy &policy);
+        void set_policy(YAML::Node policy);
+        void reset_policy();
+        matrix::sink_policy policy() {return _policy;}
 
         void connect(std::string component_name, std::string data_name,
                      std::string transport = "");
@@ -609,7 +832,10 @@ namespace matrix
         void _reconnect(std::string component_name, std::string data_name,
                         std::string transport = "");
         void _disconnect();
-        void _data_handler(std::string key, void *data, size_t sze);
+        void _data_handler(matrix::key_ref key, void *data, size_t sze);
+        void _batch_handler(matrix::key_ref key, void *data, size_t sze, size_t n);
+        void _shared_handler(matrix::key_ref key, std::shared_ptr<const void> data, size_t sze);
+        void _lost_handler(matrix::key_ref key, size_t n);
         std::string _get_as_configured_key(std::string component_name, std::string data_name);
 
         bool _connected;
@@ -624,9 +850,12 @@ namespace matrix
         std::string _transport;
 
         std::shared_ptr<matrix::TransportClient> _tc;
+        matrix::DataStats _stats;
         matrix::tsemfifo<T> _ringbuf;
         matrix::DataMemberCB<DataSink> _cb;
-        bool _blocking;
+        matrix::sink_policy _policy;
+        matrix::sink_policy _default_policy;   // as constructed
+        unsigned int _decimation;
     };
 
 /**
@@ -634,16 +863,116 @@ namespace matrix
  *
  * @param km_urn: Access to the keymaster.
  *
+ * @param ringbuf_size: The capacity of the receive queue.
+ *
+ * @param blocking: If true the transport blocks when the receive
+ * queue is full, otherwise the oldest item is dropped to make room.
+ * The second form takes a sink_policy instead, for the other choices.
+ *
+ * @param mode: matrix::MPMC (default) or matrix::SPSC. SPSC uses a
+ * lock-free receive queue, which is much cheaper per sample, but
+ * requires that only one thread ever calls the get functions and
+ * `flush()`. When not blocking, a full SPSC queue drops the newest
+ * item instead of the oldest.
+ *
+ * The DataSink counts what it receives and drops, and, if asked to
+ * with `set_queue_latency()`, the time items spend in its receive
+ * queue; see `stats()`, and DataStats for having the counts published
+ * to the Keymaster.
+ *
  */
 
     template <typename T, typename U>
-    DataSink<T, U>::DataSink(std::string km_urn, size_t ringbuf_size, bool blocking)
+    DataSink<T, U>::DataSink(std::string km_urn, size_t ringbuf_size, bool blocking,
+                             matrix::fifo_mode mode)
+        : _connected(false),
+          _km_urn(km_urn),
+          _ringbuf(ringbuf_size, mode),
+          _cb(this, &DataSink::_data_handler, &DataSink::_batch_handler),
+          _policy(blocking ? matrix::sink_policy::BLOCK : matrix::sink_policy::DROP_OLDEST),
+          _default_policy(_policy),
+          _decimation(0)
+    {
+        _cb.set_lost(&DataSink::_lost_handler);
+        _cb.set_may_block(_policy.overflow == matrix::sink_policy::BLOCK);
+
+        if (std::is_same<T, matrix::SharedBuffer>::value)
+        {
+            _cb.set_shared(&DataSink::_shared_handler);
+        }
+    }
+
+    template <typename T, typename U>
+    DataSink<T, U>::DataSink(std::string km_urn, size_t ringbuf_size,
+                             const matrix::sink_policy &policy, matrix::fifo_mode mode)
         : _connected(false),
           _km_urn(km_urn),
-          _ringbuf(ringbuf_size),
-          _cb(this, &DataSink::_data_handler),
-          _blocking(blocking)
+          _ringbuf(ringbuf_size, mode),
+          _cb(this, &DataSink::_data_handler, &DataSink::_batch_handler),
+          _policy(policy),
+          _default_policy(policy),
+          _decimation(0)
+    {
+        _cb.set_lost(&DataSink::_lost_handler);
+        _cb.set_may_block(_policy.overflow == matrix::sink_policy::BLOCK);
+
+        if (std::is_same<T, matrix::SharedBuffer>::value)
+        {
+            _cb.set_shared(&DataSink::_shared_handler);
+        }
+    }
+
+/**
+ * Changes the DataSink's overflow policy (see sink_policy). This
+ * should be done while the DataSink is not connected, as the
+ * transport reads the policy without a lock.
+ *
+ * @param policy: the new policy, or its YAML description, as for
+ * `sink_policy::from_yaml()`.
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::set_policy(const matrix::sink_policy &policy)
+    {
+        _policy = policy;
+        _decimation = 0;
+        _cb.set_may_block(_policy.overflow == matrix::sink_policy::BLOCK);
+    }
+
+    template <typename T, typename U>
+    void DataSink<T, U>::set_policy(YAML::Node policy)
     {
+        set_policy(matrix::sink_policy::from_yaml(policy));
+    }
+
+/**
+ * Has the DataSink keep a histogram of the time items spend in its
+ * receive queue, in `stats().queue_latency`. This costs a clock read
+ * as each item is put in the queue and another as it is taken out, so
+ * is off unless asked for. Should be set before the DataSink is
+ * connected.
+ *
+ * @param on: true to keep the histogram, false to stop.
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::set_queue_latency(bool on)
+    {
+        _ringbuf.set_latency_histogram(on ? &_stats.queue_latency : 0);
+    }
+
+/**
+ * Restores the overflow policy the DataSink was constructed with. As
+ * with `set_policy()`, this should be done while it is not connected.
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::reset_policy()
+    {
+        set_policy(_default_policy);
     }
 
 /**
@@ -699,11 +1028,111 @@ namespace matrix
  */
 
     template <typename T, typename U>
-    void DataSink<T, U>::_data_handler(std::string key, void *data, size_t sze)
+    void DataSink<T, U>::_data_handler(matrix::key_ref key, void *data, size_t sze)
+    {
+        if (key == _key)
+        {
+            if (_policy.decimate > 1 && _decimation++ % _policy.decimate)
+            {
+                return;
+            }
+
+            Time::Time_t start = Time::getUTC();
+            size_t lost = matrix::_data_handler<T>(data, sze, _ringbuf, _policy);
+
+            _lost_data += lost;
+            _stats.dropped(lost);
+            _stats.depth(_ringbuf.max_size());
+            _stats.message(sze, Time::getUTC() - start);
+        }
+    }
+
+/**
+ * This handler handles data handed over by the transport, for a
+ * DataSink<SharedBuffer>, which keeps a reference to it rather than a
+ * copy.
+ *
+ * @param key: The key to the data source
+ * @param data: The data blob from the source, and the reference to it
+ * @param sze: The size, in bytes, of this blob.
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::_shared_handler(matrix::key_ref key, std::shared_ptr<const void> data,
+                                         size_t sze)
+    {
+        if (key == _key)
+        {
+            if (_policy.decimate > 1 && _decimation++ % _policy.decimate)
+            {
+                return;
+            }
+
+            Time::Time_t start = Time::getUTC();
+            size_t lost = matrix::_shared_data_handler<T>(data, sze, _ringbuf, _policy);
+
+            _lost_data += lost;
+            _stats.dropped(lost);
+            _stats.depth(_ringbuf.max_size());
+            _stats.message(sze, Time::getUTC() - start);
+        }
+    }
+
+/**
+ * Counts messages the transport lost on the way from the DataSource,
+ * as lost items, and in `stats().losses()`.
+ *
+ * @param key: The key to the data source
+ * @param n: The number of messages lost
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::_lost_handler(matrix::key_ref key, size_t n)
+    {
+        if (key == _key)
+        {
+            _lost_data += n;
+            _stats.lost(n);
+        }
+    }
+
+/**
+ * This handler handles a batch of data from a DataSource's
+ * `publish_n()`, placing each element into the ring buffer as if it
+ * had arrived on its own.
+ *
+ * @param key: The key to the data source
+ * @param data: The first element of the batch
+ * @param sze: The size, in bytes, of each element
+ * @param n: The number of elements
+ *
+ */
+
+    template <typename T, typename U>
+    void DataSink<T, U>::_batch_handler(matrix::key_ref key, void *data, size_t sze, size_t n)
     {
         if (key == _key)
         {
-            _lost_data += matrix::_data_handler<T>(data, sze, _ringbuf, _blocking);
+            Time::Time_t start = Time::getUTC();
+            size_t lost = 0;
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (_policy.decimate > 1 && _decimation++ % _policy.decimate)
+                {
+                    continue;
+                }
+
+                lost += matrix::_data_handler<T>((char *)data + i * sze, sze,
+                                                 _ringbuf, _policy);
+            }
+
+            _stats.messages(n, sze * n, Time::getUTC() - start);
+            _lost_data += lost;
+            _stats.dropped(lost);
+            _stats.depth(_ringbuf.max_size());
         }
     }
 
@@ -759,6 +1188,121 @@ namespace matrix
         return _ringbuf.timed_get(val, time_out);
     }
 
+/**
+ * Gets up to 'max' items at once. This is much cheaper per item than
+ * calling `get()` repeatedly, as the receive queue is locked (and the
+ * thread woken) once for all of them. Blocks until at least one item
+ * is available. For example, to collect 'N' samples:
+ *
+ *     for (size_t i = 0; i < N; )
+ *     {
+ *         i += sink.get_n(&samples[i], N - i);
+ *     }
+ *
+ * @param out: An array of at least 'max' items.
+ * @param max: The most items to get.
+ * @param time_out: If not 0, the most time to wait, in nanoseconds.
+ *
+ * @return The number of items placed in 'out', 0 on time-out.
+ *
+ */
+
+    template <typename T, typename U>
+    size_t DataSink<T, U>::get_n(T *out, size_t max, Time::Time_t time_out)
+    {
+        _check_connected();
+        return _ringbuf.get_n(out, max, time_out);
+    }
+
+/**
+ * Gets exactly 'n' items, waiting until that many are available. 'n'
+ * may not exceed the DataSink's ring buffer size.
+ *
+ * @param out: An array of at least 'n' items.
+ * @param n: The number of items to get.
+ * @param time_out: If not 0, the most time to wait, in nanoseconds.
+ *
+ * @return true if 'n' items were placed in 'out', false on time-out.
+ *
+ */
+
+    template <typename T, typename U>
+    bool DataSink<T, U>::wait_get_n(T *out, size_t n, Time::Time_t time_out)
+    {
+        _check_connected();
+        return _ringbuf.wait_get_n(out, n, time_out);
+    }
+
+/**
+ * Takes everything currently in the receive queue without
+ * blocking. 'out' is resized to the number of items taken; reusing
+ * the same vector avoids allocation.
+ *
+ * @param out: The vector to receive the items, oldest first.
+ *
+ * @return The number of items taken, which may be 0.
+ *
+ */
+
+    template <typename T, typename U>
+    size_t DataSink<T, U>::drain(std::vector<T> &out)
+    {
+        _check_connected();
+        out.resize(_ringbuf.capacity());
+        out.resize(_ringbuf.try_get_n(out.data(), out.size()));
+        return out.size();
+    }
+
+/**
+ * Zero-copy counterparts to `get()`, `try_get()` and `timed_get()`:
+ * these return a pointer to the item at the head of the receive
+ * queue rather than copying it out. The item remains valid, and in
+ * the queue, until `release_slot()` is called, which must be done
+ * exactly once for every non-null pointer returned. Useful for large
+ * GenericBuffer or std::string payloads:
+ *
+ *     GenericBuffer *buf = sink.timed_peek(5000000);
+ *
+ *     if (buf)
+ *     {
+ *         process(buf->data(), buf->size());
+ *         sink.release_slot();
+ *     }
+ *
+ * @param time_out: (timed_peek) the time-out, in nanoseconds (relative)
+ *
+ * @return A pointer to the head item, or 0 if there is none (no
+ * data, time-out, or queue released).
+ *
+ */
+
+    template <typename T, typename U>
+    T *DataSink<T, U>::peek()
+    {
+        _check_connected();
+        return _ringbuf.peek();
+    }
+
+    template <typename T, typename U>
+    T *DataSink<T, U>::try_peek()
+    {
+        _check_connected();
+        return _ringbuf.try_peek();
+    }
+
+    template <typename T, typename U>
+    T *DataSink<T, U>::timed_peek(Time::Time_t time_out)
+    {
+        _check_connected();
+        return _ringbuf.timed_peek(time_out);
+    }
+
+    template <typename T, typename U>
+    void DataSink<T, U>::release_slot()
+    {
+        _ringbuf.release_slot();
+    }
+
 /**
  * Connects to a data source. DataSink does this by obtaining a
  * pointer to a TransportClient and subscribing to the desired key,
@@ -809,6 +1353,12 @@ namespace matrix
         _asconf_key = _get_as_configured_key(component_name, data_name);
         _lost_data = 0L;
         _tc = TransportClient::get_transport(_urn);
+
+        // the transport's socket options, if it has any.
+        mxutils::yaml_result options;
+        std::string transport_key = _asconf_key.substr(0, _asconf_key.rfind('.'));
+        Keymaster::shared_client(_km_urn)->get(transport_key + ".Options", options);
+        _tc->configure(options.result ? options.node : YAML::Node());
         _tc->connect(_urn);
         _tc->subscribe(_key, &_cb);
         _connected = true;
@@ -830,11 +1380,10 @@ namespace matrix
     template <typename T, typename U>
     std::string DataSink<T, U>::_get_as_configured_key(std::string component_name, std::string data_name)
     {
-        Keymaster km(_km_urn);
         // This will be something like 'foo_component.bar_data' and will be
         // used to get the actual transport
         std::string key = "components." + component_name + ".Sources." + data_name;
-        std::string transport = km.get_as<std::string>(key);
+        std::string transport = Keymaster::shared_client(_km_urn)->get_as<std::string>(key);
         return "components." + component_name + ".Transports." + transport + ".AsConfigured";
     }
 
@@ -880,7 +1429,10 @@ namespace matrix
 /**
  * Returns the number of items dropped off the end of the
  * ringbuffer. This happens if the ring buffer is being filled faster
- * than it is being emptied.
+ * than it is being emptied. Also counted are items the transport lost
+ * before they reached the DataSink, where it can tell (the ZMQ
+ * transports, when a subscriber falls behind its high water mark);
+ * `stats()` keeps the two apart.
  *
  * The count of lost items is reset upon connection, so is meaningful
  * only for that connection period.
@@ -31,6 +31,7 @@
 
 #include "matrix/Keymaster.h"
 #include "matrix/DataInterface.h"
+#include "matrix/DataStats.h"
 
 #include <vector>
 #include <msgpack.hpp>
@@ -78,6 +79,19 @@ namespace matrix
  * then translate to a 't->put("log", data)', where 't' is the correct
  * transport specified in the configuration.
  *
+ * The DataSource counts what it publishes, and the time publishing
+ * takes (see DataStats), and puts the counts to the Keymaster under
+ * 'components.<component>.stats.sources.<data name>'.
+ *
+ * Large buffers may be published from a std::shared_ptr, which lets a
+ * ZMQ transport send the buffer itself rather than a copy of it:
+ *
+ *     auto spec = std::make_shared<matrix::GenericBuffer>();
+ *     spec->resize(8 << 20);
+ *     ...
+ *     spectra->publish(std::shared_ptr<const matrix::GenericBuffer>(spec));
+ *     spec.reset(); // don't touch it again; use a new buffer next time
+ *
  */
 
     template<typename T>
@@ -89,14 +103,25 @@ namespace matrix
         ~DataSource() throw();
 
         bool publish(T &);
+        bool publish_n(const T *, size_t);
+        bool publish(std::shared_ptr<const T>);
+
+        matrix::DataStats &stats() {return _stats;}
 
     private:
+
+        bool _publish(const void *data, size_t size);
+        bool _publish_batch(const void *data, size_t size, size_t n);
+        bool _publish_shared(std::shared_ptr<const void> data, size_t size);
+
         std::string _km_urn;
         std::string _component_name;
         std::string _transport_name;
         std::string _data_name;
         std::string _key;
         std::shared_ptr<matrix::TransportServer> _ts;
+        matrix::TransportServer::key_handle_t _handle;
+        matrix::DataStats _stats;
     };
 
 /**
@@ -127,6 +152,8 @@ namespace matrix
                                                  + ".Sources."
                                                  + data_name);
         _ts = matrix::TransportServer::get_transport(km_urn, _component_name, _transport_name);
+        _handle = _ts->intern(_key);
+        _stats.publish_to(km_urn, "components." + component_name + ".stats.sources." + data_name);
     }
 
     template<typename T>
@@ -149,7 +176,89 @@ namespace matrix
     template<typename T>
     bool DataSource<T>::publish(T &val)
     {
-        return _ts->publish(_key, &val, sizeof val);
+        return _publish(&val, sizeof val);
+    }
+
+/**
+ * Publishes 'n' values of type 'T' at once. Subscribers receive them
+ * just as if they had been published one at a time, but the
+ * transport sends them as a single message, which is much cheaper
+ * for high rate data. As with `publish()`, 'T' must be a contiguous
+ * type.
+ *
+ * @param vals: An array of 'n' values.
+ *
+ * @param n: The number of values to send.
+ *
+ * @return true if the put succeeds, false otherwise.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::publish_n(const T *vals, size_t n)
+    {
+        return _publish_batch(vals, sizeof(T), n);
+    }
+
+/**
+ * Publishes a value held by a std::shared_ptr. A transport that can
+ * (ZMQ) sends the value without copying it, holding a reference to it
+ * until it has been sent, so the value must not be changed after it
+ * is published. The buffer is freed by its shared_ptr's deleter once
+ * both the caller and the transport are done with it; a deleter that
+ * returns the buffer to a pool allows the buffers to be reused. Other
+ * transports copy the value as `publish(T &)` does.
+ *
+ * @param val: The value to send.
+ *
+ * @return true if the put succeeds, false otherwise.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::publish(std::shared_ptr<const T> val)
+    {
+        return _publish_shared(std::shared_ptr<const void>(val, val.get()), sizeof(T));
+    }
+
+/**
+ * Publishes, and counts, one message, or a batch of 'n' of 'size'
+ * bytes each. A message the transport fails to send counts as
+ * dropped.
+ *
+ */
+
+    template<typename T>
+    bool DataSource<T>::_publish(const void *data, size_t size)
+    {
+        Time::Time_t start = Time::getUTC();
+        bool rval = _ts->publish(_handle, _key, data, size);
+
+        _stats.message(size, Time::getUTC() - start);
+        _stats.dropped(rval ? 0 : 1);
+        return rval;
+    }
+
+    template<typename T>
+    bool DataSource<T>::_publish_batch(const void *data, size_t size, size_t n)
+    {
+        Time::Time_t start = Time::getUTC();
+        bool rval = _ts->publish_batch(_handle, _key, data, size, n);
+
+        _stats.messages(n, size * n, Time::getUTC() - start);
+        _stats.dropped(rval ? 0 : n);
+        return rval;
+    }
+
+    template<typename T>
+    bool DataSource<T>::_publish_shared(std::shared_ptr<const void> data, size_t size)
+    {
+        Time::Time_t start = Time::getUTC();
+        bool rval = _ts->publish_shared(_handle, _key, data, size);
+
+        _stats.message(size, Time::getUTC() - start);
+        _stats.dropped(rval ? 0 : 1);
+        return rval;
     }
 
 /**
@@ -164,7 +273,7 @@ namespace matrix
     template<>
     inline bool DataSource<std::string>::publish(std::string &val)
     {
-        return _ts->publish(_key, val);
+        return _publish(val.data(), val.size());
     }
 
 /**
@@ -180,7 +289,7 @@ namespace matrix
     template<>
     inline bool DataSource<matrix::GenericBuffer>::publish(matrix::GenericBuffer &val)
     {
-        return _ts->publish(_key, val.data(), val.size());
+        return _publish(val.data(), val.size());
     }
 
 
@@ -197,7 +306,89 @@ namespace matrix
     template<>
     inline bool DataSource<msgpack::sbuffer>::publish(msgpack::sbuffer &val)
     {
-        return _ts->publish(_key, val.data(), val.size());
+        return _publish(val.data(), val.size());
+    }
+
+/**
+ * Specializations of the shared `publish()` for the buffer types,
+ * which send the buffer's contents. The std::shared_ptr aliasing
+ * constructor points the reference at the contents while keeping the
+ * whole buffer alive.
+ *
+ * @param val: The buffer to send.
+ *
+ * @return true if the put succeeds, false otherwise.
+ *
+ */
+
+    template<>
+    inline bool DataSource<std::string>::publish(std::shared_ptr<const std::string> val)
+    {
+        return _publish_shared(std::shared_ptr<const void>(val, val->data()), val->size());
+    }
+
+    template<>
+    inline bool DataSource<matrix::GenericBuffer>::publish(std::shared_ptr<const matrix::GenericBuffer> val)
+    {
+        return _publish_shared(std::shared_ptr<const void>(val, val->data()), val->size());
+    }
+
+    template<>
+    inline bool DataSource<msgpack::sbuffer>::publish(std::shared_ptr<const msgpack::sbuffer> val)
+    {
+        return _publish_shared(std::shared_ptr<const void>(val, val->data()), val->size());
+    }
+
+/**
+ * Specializations of `publish_n()` for the buffer types. Since each
+ * buffer may be a different size they can't be sent as one
+ * contiguous batch, so they are published one at a time.
+ *
+ * @param vals: An array of 'n' buffers.
+ *
+ * @param n: The number of buffers to send.
+ *
+ * @return true if all the puts succeed, false otherwise.
+ *
+ */
+
+    template<>
+    inline bool DataSource<std::string>::publish_n(const std::string *vals, size_t n)
+    {
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _publish(vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return rval;
+    }
+
+    template<>
+    inline bool DataSource<matrix::GenericBuffer>::publish_n(const matrix::GenericBuffer *vals, size_t n)
+    {
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _publish(vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return rval;
+    }
+
+    template<>
+    inline bool DataSource<msgpack::sbuffer>::publish_n(const msgpack::sbuffer *vals, size_t n)
+    {
+        bool rval = true;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            rval = _publish(vals[i].data(), vals[i].size()) && rval;
+        }
+
+        return rval;
     }
 
 }
@@ -0,0 +1,179 @@
+/*******************************************************************
+ *  DataStats.h - Counters for DataSources and DataSinks.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_DATASTATS_H_)
+#define _DATASTATS_H_
+
+#include "matrix/LatencyHistogram.h"
+#include "matrix/Time.h"
+
+#include <yaml-cpp/yaml.h>
+#include <string>
+#include <atomic>
+#include <cstdint>
+
+namespace matrix
+{
+/**
+ * \class DataStats
+ *
+ * The counters kept by a DataSource or DataSink: the messages and
+ * bytes passed, the messages dropped, the messages the transport lost
+ * before they reached a DataSink, the deepest the receive queue
+ * has been, the time spent handling each message (publishing it, for
+ * a source, or placing it in the receive queue, for a sink) and, if
+ * the DataSink is asked to (`DataSink::set_queue_latency()`), the time
+ * each message spent in the receive queue. Everything is a relaxed
+ * atomic, updated by the one thread that moves the data. Counting a
+ * message costs two clock reads, two uncontended atomic additions and
+ * a `LatencyHistogram::record()`; a batch, from `publish_n()`, is
+ * counted at the same cost as one message.
+ *
+ * Once given a Keymaster key, with `publish_to()`, the counters are
+ * put to the Keymaster every `interval()` seconds (default 5) by a
+ * thread shared by every DataStats in the process, under that key:
+ *
+ *     components:
+ *       nettask:
+ *         stats:
+ *           sources:
+ *             data: {messages: 1200345, bytes: 38411040, dropped: 0,
+ *                    lost: 0, max_depth: 0, handling: {count: ..., p50: ...}}
+ *           sinks:
+ *             input: {..., queue_latency: {count: ..., p50: ...}}
+ *
+ */
+
+    class DataStats
+    {
+    public:
+
+        DataStats();
+        ~DataStats();
+
+        void message(size_t bytes, Time::Time_t handling_time);
+        void messages(size_t n, size_t bytes, Time::Time_t handling_time);
+        void dropped(size_t n);
+        void lost(size_t n);
+        void depth(size_t d);
+
+        uint64_t messages() const;
+        uint64_t bytes() const;
+        uint64_t drops() const;
+        uint64_t losses() const;
+        uint64_t max_depth() const;
+
+        void reset();
+        YAML::Node to_yaml() const;
+
+        void publish_to(std::string km_urn, std::string key);
+        void unpublish();
+
+        static void interval(int seconds);
+        static int interval();
+
+        LatencyHistogram queue_latency;
+        LatencyHistogram handling;
+
+    private:
+
+        friend class DataStatsPublisher;
+
+        std::atomic<uint64_t> _messages;
+        std::atomic<uint64_t> _bytes;
+        std::atomic<uint64_t> _dropped;
+        std::atomic<uint64_t> _lost;
+        std::atomic<uint64_t> _max_depth;
+
+        // set by publish_to(), read by the publisher, under its lock
+        std::string _km_urn;
+        std::string _key;
+    };
+
+/**
+ * Counts a message handled.
+ *
+ * @param bytes: the size of the message.
+ * @param handling_time: the time it took to handle it, in nanoseconds.
+ *
+ */
+
+    inline void DataStats::message(size_t bytes, Time::Time_t handling_time)
+    {
+        _messages.fetch_add(1, std::memory_order_relaxed);
+        _bytes.fetch_add(bytes, std::memory_order_relaxed);
+        handling.record(handling_time);
+    }
+
+/**
+ * Counts a batch of messages handled together, as if each had been
+ * counted by `message()`, but updating each counter once.
+ *
+ * @param n: the number of messages.
+ * @param bytes: their total size.
+ * @param handling_time: the time it took to handle them all, in
+ * nanoseconds, which is counted as 'n' of the average.
+ *
+ */
+
+    inline void DataStats::messages(size_t n, size_t bytes, Time::Time_t handling_time)
+    {
+        if (n)
+        {
+            _messages.fetch_add(n, std::memory_order_relaxed);
+            _bytes.fetch_add(bytes, std::memory_order_relaxed);
+            handling.record(handling_time / n, n);
+        }
+    }
+
+    inline void DataStats::dropped(size_t n)
+    {
+        if (n)
+        {
+            _dropped.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    inline void DataStats::lost(size_t n)
+    {
+        if (n)
+        {
+            _lost.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    inline void DataStats::depth(size_t d)
+    {
+        uint64_t m = _max_depth.load(std::memory_order_relaxed);
+
+        while (d > m && !_max_depth.compare_exchange_weak(m, d, std::memory_order_relaxed))
+        {
+        }
+    }
+}
+
+#endif
@@ -29,6 +29,7 @@
 #define _KEYMASTER_H_
 
 #include "matrix/yaml_util.h"
+#include "matrix/KeymasterStore.h"
 #include "matrix/matrix_util.h"
 #include "matrix/Thread.h"
 #include "matrix/TCondition.h"
@@ -40,6 +41,13 @@
 #include <stdexcept>
 #include <sstream>
 #include <tuple>
+#include <memory>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <atomic>
+#include <future>
+#include <utility>
 
 #include <boost/shared_ptr.hpp>
 #include <yaml-cpp/yaml.h>
@@ -223,18 +231,38 @@ namespace matrix
 
         bool del(std::string key);
 
-        bool subscribe(std::string key, matrix::KeymasterCallbackBase *f);
+        bool subscribe(std::string key, matrix::KeymasterCallbackBase *f,
+                       int min_interval_ms = 0);
 
         bool unsubscribe(std::string key);
 
         template<typename T>
         T get_as(std::string key);
 
+        std::future< ::mxutils::yaml_result> get_async(std::string key);
+
+        std::future< ::mxutils::yaml_result> put_async(std::string key, YAML::Node n,
+                                                       bool create = false);
+
+        std::vector< ::mxutils::yaml_result> multi_get(std::vector<std::string> keys);
+
+        std::vector< ::mxutils::yaml_result>
+        multi_put(std::vector<std::pair<std::string, YAML::Node> > vals, bool create = false);
+
+        std::vector< ::mxutils::yaml_result>
+        transaction(const std::vector<KeymasterStore::change> &changes);
+
+        ::mxutils::yaml_result stats();
+
         template<typename T>
         bool put(std::string key, T v, bool create = false);
 
         ::mxutils::yaml_result get_last_result();
 
+        void enable_cache(bool enable = true);
+
+        static std::shared_ptr<Keymaster> shared_client(std::string keymaster_url);
+
     private:
 
         void _subscriber_task();
@@ -247,9 +275,45 @@ namespace matrix
 
         void _handle_keymaster_server_exception();
 
+        bool _get_snapshot(uint64_t &seq, std::string &epoch, std::string &text);
+
+        void _handle_delta(std::vector<std::string> &frames);
+
+        void _dispatch(const std::string &key);
+
+        void _notify(const std::string &key, const std::string &text);
+
+        int _deliver_notifications();
+
+        bool _load_mirror();
+
+        bool _cache_get(const std::string &key, ::mxutils::yaml_result &yr);
+
+        bool _cache_watch(const std::string &key, uint64_t &gen);
+
+        void _cache_add(const std::string &key, YAML::Node n, uint64_t gen);
+
+        void _cache_publication(const std::string &key, const std::string &val);
+
         ::mxutils::yaml_result _call_keymaster(std::string cmd, std::string key,
                                              std::string val = "", std::string flag = "");
 
+        std::vector< ::mxutils::yaml_result> _call_keymaster_multi(std::string cmd,
+                                                                  std::vector<std::string> &frames,
+                                                                  size_t replies);
+
+        struct KmAsync;
+
+        // A subscription's latest value, not yet given to its
+        // callback, and when it may be (see `subscribe()`).
+        struct Notification
+        {
+            uint64_t interval;  // ns
+            uint64_t next;      // ns, UTC
+            bool pending;
+            std::string text;
+        };
+
         std::shared_ptr<zmq::socket_t> _keymaster_socket();
 
         std::shared_ptr<zmq::socket_t> _km_;
@@ -259,6 +323,7 @@ namespace matrix
         std::vector<std::string> _km_pub_urls;
 
         std::map<std::string, matrix::KeymasterCallbackBase *> _callbacks;
+        std::map<std::string, Notification> _notifications;
         matrix::Thread<Keymaster> _subscriber_thread;
         matrix::TCondition<bool> _subscriber_thread_ready;
         matrix::Thread<Keymaster> _put_thread;
@@ -266,6 +331,21 @@ namespace matrix
         bool _put_thread_run;
         matrix::tsemfifo<std::tuple<std::string, std::string, bool> > _put_fifo;
         matrix::Mutex _shared_lock;
+        // Mirror of the KeymasterServer's store, for delta publishing
+        bool _delta;
+        std::shared_ptr<matrix::KeymasterStore> _mirror;
+        uint64_t _mirror_seq;
+        std::string _mirror_epoch;
+        // The read cache (see `enable_cache()`)
+        std::atomic<bool> _caching;
+        matrix::Mutex _cache_lock;
+        std::shared_ptr<matrix::KeymasterStore> _cache;
+        std::set<std::string> _cached_keys;
+        std::map<std::string, uint64_t> _cache_gen;
+        // top level keys whose subscriptions are known to be in effect
+        std::set<std::string> _cache_live;
+        // The asynchronous request channel (see `get_async()`)
+        std::shared_ptr<KmAsync> _async;
     };
 
     template<typename T>
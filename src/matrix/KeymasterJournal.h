@@ -0,0 +1,116 @@
+/*******************************************************************
+ *  KeymasterJournal.h - Persistence for the Keymaster's store.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_KEYMASTERJOURNAL_H_)
+#define _KEYMASTERJOURNAL_H_
+
+#include "matrix/KeymasterStore.h"
+#include "matrix/Mutex.h"
+#include "matrix/Thread.h"
+#include "matrix/TCondition.h"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace matrix
+{
+/**
+ * \class KeymasterJournal
+ *
+ * Keeps a KeymasterStore on disk, so that a KeymasterServer that is
+ * restarted comes back with the keys it had, and not just those of
+ * its configuration file. Two files are kept: `<path>.snapshot`, the
+ * whole store as of some version, and `<path>.journal`, every change
+ * made to the store since, appended as it is made. Restoring the store
+ * is loading the snapshot and replaying the journal on it. Every
+ * 'snapshot_interval' changes a new snapshot is written and the
+ * journal emptied, so that neither the journal nor the time to
+ * replay it grows without bound.
+ *
+ * When the journal is written to disk is set by the sync policy:
+ *
+ *   - SYNC_ALWAYS: after every change, before the change is
+ *     acknowledged. No acknowledged change is ever lost, but every
+ *     change waits on the disk.
+ *   - SYNC_PERIODIC: every 'sync_interval_ms' milliseconds, by a
+ *     thread of the journal's own. At most that much is lost if the
+ *     host goes down; a crash of the KeymasterServer alone loses
+ *     nothing, as the operating system has the data.
+ *   - SYNC_NEVER: when the operating system sees fit.
+ *
+ * The journal is a series of transactions, each made of a header
+ * line, `T <version> <count>`, and 'count' changes: `P <create>
+ * <keylen> <vallen>` or `D <keylen>` lines, each followed by the key,
+ * the YAML text of the value for a PUT, and a newline. A transaction
+ * cut short by a crash is ignored, and the journal truncated to the
+ * last complete one.
+ *
+ */
+
+    class KeymasterJournal
+    {
+    public:
+
+        enum sync_policy
+        {
+            SYNC_ALWAYS,
+            SYNC_PERIODIC,
+            SYNC_NEVER
+        };
+
+        KeymasterJournal(std::string path, sync_policy sync = SYNC_PERIODIC,
+                         int sync_interval_ms = 100, uint64_t snapshot_interval = 10000);
+        ~KeymasterJournal();
+
+        bool restore(KeymasterStore &store);
+        void append(const std::vector<KeymasterStore::change> &changes,
+                    const KeymasterStore &store);
+        bool snapshot(const KeymasterStore &store);
+        void sync();
+
+        static sync_policy policy(std::string name);
+
+    private:
+
+        bool _replay(KeymasterStore &store, uint64_t version);
+        void _sync_task();
+
+        std::string _path;
+        sync_policy _sync;
+        int _sync_interval_ms;
+        uint64_t _snapshot_interval;
+        uint64_t _entries;
+        int _fd;
+        bool _dirty;
+        Mutex _lock;
+        Thread<KeymasterJournal> _sync_thread;
+        TCondition<bool> _quit;
+    };
+}
+
+#endif
@@ -0,0 +1,157 @@
+/*******************************************************************
+ *  KeymasterStore.h - The Keymaster's key/value tree.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_KEYMASTERSTORE_H_)
+#define _KEYMASTERSTORE_H_
+
+#include "matrix/Mutex.h"
+
+#include <yaml-cpp/yaml.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+
+namespace matrix
+{
+/**
+ * \class KeymasterStore
+ *
+ * The data store behind the KeymasterServer. It holds the same
+ * hierarchy of maps, sequences and scalars as the YAML configuration
+ * it is loaded from, addressed by the same period-separated
+ * keychains, but each node also caches its own serialized (YAML flow
+ * style) text. A PUT or DEL rebuilds only the nodes on the path from
+ * the root to the changed key; every other subtree, and its cached
+ * text, is shared with the previous version of the tree. Serializing
+ * a node that has not changed is then a string copy, and serializing
+ * one that has costs only the concatenation of its children's text.
+ *
+ * Since a node is never modified once it is in the tree, readers work
+ * on the version of the tree that was current when they started
+ * without any lock, while writers are serialized internally. Old
+ * versions are freed when their last reader is done with them, so
+ * unlike a YAML::Node the store does not grow with the number of
+ * writes made to it.
+ *
+ * The `get()`, `put()` and `del()` results are the text of the
+ * equivalent mxutils::yaml_result, ready to be sent to a Keymaster
+ * client.
+ *
+ * Every change to the store increments its version number, which
+ * thus serves as the sequence number of the change. Several changes
+ * may be made as one with `apply()`, which makes them visible all at
+ * once, under a single version number, or not at all.
+ *
+ */
+
+    class KeymasterStore
+    {
+    public:
+
+        struct change
+        {
+            std::string keychain;
+            YAML::Node val;     // the new value, for a PUT
+            bool create;        // create missing keys, for a PUT
+            bool del;           // true for a DEL, false for a PUT
+        };
+
+        KeymasterStore(YAML::Node root = YAML::Node());
+
+        bool get(std::string keychain, std::string &result) const;
+        bool put(std::string keychain, YAML::Node val, bool create, std::string &result);
+        bool del(std::string keychain, std::string &result);
+        bool apply(const std::vector<change> &changes, std::vector<std::string> &results);
+        bool text(std::string keychain, std::string &val, uint64_t *version = nullptr) const;
+        uint64_t version() const;
+        void load(YAML::Node root, uint64_t version);
+
+        struct node;
+        typedef std::shared_ptr<const node> node_ptr;
+
+    private:
+
+        node_ptr _get_root(uint64_t *version = nullptr) const;
+        void _set_root(node_ptr root);
+
+        mutable Mutex _root_lock;
+        Mutex _write_lock;
+        node_ptr _root;
+        uint64_t _version;
+    };
+
+/**
+ * \struct KeymasterStore::node
+ *
+ * One node of the store. Maps keep their keys in insertion order,
+ * as a YAML::Node does, in `keys`, with the corresponding values at
+ * the same index in `children`; a sequence uses `children` alone. The
+ * serialized text is made on first use and kept for the life of the
+ * node.
+ *
+ */
+
+    struct KeymasterStore::node
+    {
+        enum node_type
+        {
+            NUL,
+            SCALAR,
+            SEQUENCE,
+            MAP
+        };
+
+        node(node_type t = NUL);
+        node(const node &n);
+        ~node();
+
+        static node_ptr from_yaml(const YAML::Node &n);
+        static std::string emit_scalar(const std::string &s);
+
+        node_ptr find(const std::string &key) const;
+        node_ptr with_child(const std::string &key, node_ptr child) const;
+        node_ptr without_child(const std::string &key) const;
+        const std::string &serialized() const;
+
+        node_type type;
+        std::string scalar;
+        std::vector<std::string> keys;
+        std::vector<std::string> key_text;
+        std::vector<node_ptr> children;
+
+    private:
+
+        int _index(const std::string &key) const;
+
+        mutable std::atomic<const std::string *> _text;
+    };
+
+}
+
+#endif
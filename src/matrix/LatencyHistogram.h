@@ -0,0 +1,138 @@
+/*******************************************************************
+ *  LatencyHistogram.h - A lock-free histogram of durations.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_LATENCYHISTOGRAM_H_)
+#define _LATENCYHISTOGRAM_H_
+
+#include <yaml-cpp/yaml.h>
+#include <atomic>
+#include <cstdint>
+
+namespace matrix
+{
+/**
+ * \class LatencyHistogram
+ *
+ * Counts durations (in nanoseconds, as `Time::getUTC()` differences)
+ * in the manner of an HDR histogram: each power of two is divided into
+ * 16 equal buckets, so that every value is known to within 1/16th (a
+ * little over 6%) whatever its magnitude, from nanoseconds to the
+ * largest value kept, about 18 minutes; larger values count as that.
+ * `record()` takes no lock and may be called from any number of
+ * threads. It costs three relaxed atomic additions (the bucket, the
+ * count and the sum), a load of the maximum, and a compare-and-swap
+ * loop on it when the value is a new maximum. Reading the histogram
+ * while it is being recorded to gives a result that is consistent to
+ * within the values being recorded at the time.
+ *
+ *     LatencyHistogram h;
+ *     Time::Time_t start = Time::getUTC();
+ *     do_something();
+ *     h.record(Time::getUTC() - start);
+ *     ...
+ *     cout << h.percentile(99.0) << endl;
+ *
+ */
+
+    class LatencyHistogram
+    {
+    public:
+
+        enum
+        {
+            SUB_BITS = 4,
+            SUB_BUCKETS = 1 << SUB_BITS,
+            MAX_BITS = 40,
+            BUCKETS = (MAX_BITS - SUB_BITS + 2) * SUB_BUCKETS
+        };
+
+        LatencyHistogram();
+
+        void record(uint64_t ns, uint64_t n = 1);
+        uint64_t count() const;
+        uint64_t max() const;
+        double mean() const;
+        uint64_t percentile(double p) const;
+        void reset();
+        YAML::Node to_yaml() const;
+
+        static int bucket(uint64_t ns);
+        static uint64_t bucket_value(int b);
+
+    private:
+
+        std::atomic<uint64_t> _buckets[BUCKETS];
+        std::atomic<uint64_t> _count;
+        std::atomic<uint64_t> _sum;
+        std::atomic<uint64_t> _max;
+    };
+
+/**
+ * Records a duration, or 'n' of the same duration at the cost of one,
+ * as for the average of a batch of 'n' items.
+ *
+ * @param ns: the duration, in nanoseconds.
+ * @param n: how many times to count it.
+ *
+ */
+
+    inline void LatencyHistogram::record(uint64_t ns, uint64_t n)
+    {
+        _buckets[bucket(ns)].fetch_add(n, std::memory_order_relaxed);
+        _count.fetch_add(n, std::memory_order_relaxed);
+        _sum.fetch_add(ns * n, std::memory_order_relaxed);
+        uint64_t m = _max.load(std::memory_order_relaxed);
+
+        while (ns > m && !_max.compare_exchange_weak(m, ns, std::memory_order_relaxed))
+        {
+        }
+    }
+
+/**
+ * The bucket a duration is counted in.
+ *
+ */
+
+    inline int LatencyHistogram::bucket(uint64_t ns)
+    {
+        if (ns < SUB_BUCKETS)
+        {
+            return (int)ns;
+        }
+
+        if (ns >> (MAX_BITS + 1))
+        {
+            ns = (1ULL << (MAX_BITS + 1)) - 1;
+        }
+
+        int e = 63 - __builtin_clzll(ns);
+        int sub = (int)(ns >> (e - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return (e - SUB_BITS + 1) * SUB_BUCKETS + sub;
+    }
+}
+
+#endif
@@ -42,6 +42,9 @@ namespace matrix
  * tsemfifo<T>s. This class is generally not called or used directly,
  * instead being set up behind the scenes by a DataSource<T>.
  *
+ * Publishing by interned key handle (`intern()`, which DataSource<T>
+ * does) takes no lock and does no allocation.
+ *
  */
 
     class RTTransportServer : public matrix::TransportServer
@@ -61,6 +64,14 @@ namespace matrix
 
         bool _publish(std::string key, const void *data, size_t size_of_data);
         bool _publish(std::string key, std::string data);
+        bool _publish_batch(std::string key, const void *data, size_t size_of_element,
+                            size_t count);
+        key_handle_t _intern(std::string key);
+        bool _publish_interned(key_handle_t h, const std::string &key,
+                               const void *data, size_t size_of_data);
+        bool _publish_batch_interned(key_handle_t h, const std::string &key,
+                                     const void *data, size_t size_of_element,
+                                     size_t count);
 
         struct Impl;
         std::shared_ptr<Impl> _impl;
@@ -88,10 +99,10 @@ namespace matrix
 
     private:
 
-        bool _connect(std::string urn = "");
+        bool _connect();
         bool _disconnect();
         bool _subscribe(std::string key, DataCallbackBase *cb);
-        bool _unsubscribe(std::string key, DataCallbackBase *cb);
+        bool _unsubscribe(std::string key);
 
         std::string _key;
         matrix::DataCallbackBase *_cb;
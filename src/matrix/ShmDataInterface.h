@@ -0,0 +1,111 @@
+/*******************************************************************
+ *  ShmDataInterface.h - A DataInterface transport for processes on
+ *  the same host, using a POSIX shared memory ring.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_SHMDATAINTERFACE_H_)
+#define _SHMDATAINTERFACE_H_
+
+#include "matrix/DataInterface.h"
+#include <string>
+
+namespace matrix
+{
+/**
+ * \class ShmTransportServer
+ *
+ * Publishes data into a POSIX shared memory ring ("shm://name"). The
+ * ring is a broadcast buffer: the server writes each message once,
+ * and every subscriber, in this or any other process on the host,
+ * reads it using its own read cursor. Like a 0MQ PUB socket the
+ * server never waits for slow readers; a reader that falls more than
+ * a ring's worth behind loses the overwritten messages and resumes
+ * at the oldest one still in the ring. Waiting readers are woken
+ * through a process-shared futex in the ring header.
+ *
+ * The ring size defaults to 4 MiB and may be set with an optional
+ * 'ShmSize' key (in bytes) next to the transport's 'Specified'
+ * key. A single message may not exceed half the ring.
+ *
+ * This class is generally not called or used directly, instead being
+ * set up behind the scenes by a DataSource<T>.
+ *
+ */
+
+    class ShmTransportServer : public matrix::TransportServer
+    {
+    public:
+
+        ShmTransportServer(std::string keymaster_url, std::string key);
+        virtual ~ShmTransportServer();
+
+    private:
+
+        bool _publish(std::string key, const void *data, size_t size_of_data);
+        bool _publish(std::string key, std::string data);
+        bool _publish_batch(std::string key, const void *data, size_t size_of_element,
+                            size_t count);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportServer;
+        static matrix::TransportServer *factory(std::string, std::string);
+    };
+
+/**
+ * \class ShmTransportClient
+ *
+ * Subscriber for a "shm://" transport. Maps the server's ring and
+ * runs a reader thread that follows it, handing messages whose keys
+ * have been subscribed to the registered callbacks.
+ *
+ */
+
+    class ShmTransportClient : public matrix::TransportClient
+    {
+    public:
+
+        ShmTransportClient(std::string urn);
+        virtual ~ShmTransportClient();
+
+    private:
+
+        bool _connect();
+        bool _disconnect();
+        bool _subscribe(std::string key, matrix::DataCallbackBase *cb);
+        bool _unsubscribe(std::string key);
+
+        struct Impl;
+        std::shared_ptr<Impl> _impl;
+
+        friend class matrix::TransportClient;
+        static matrix::TransportClient *factory(std::string);
+    };
+
+}
+
+#endif
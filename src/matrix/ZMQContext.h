@@ -34,6 +34,7 @@
 #include "matrix/Mutex.h"
 
 #include <memory>
+#include <vector>
 
 namespace matrix
 {
@@ -48,6 +49,8 @@ namespace matrix
 
         static void RemoveInstance();
 
+        static bool configure(int io_threads, std::vector<int> cpu_affinity = std::vector<int>());
+
     private:
 
         zmq::context_t _context;
@@ -56,6 +59,8 @@ namespace matrix
 
         static std::shared_ptr<ZMQContext> _instance;
         static matrix::Mutex _instance_lock;
+        static int _io_threads;
+        static std::vector<int> _cpu_affinity;
     };
 };
 
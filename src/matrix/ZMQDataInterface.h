@@ -38,6 +38,10 @@ namespace matrix
     private:
         bool _publish(std::string key, const void *data, size_t size_of_data);
         bool _publish(std::string key, std::string data);
+        bool _publish_batch(std::string key, const void *data, size_t size_of_element,
+                            size_t count);
+        bool _publish_shared(key_handle_t h, const std::string &key,
+                             std::shared_ptr<const void> data, size_t size_of_data);
 
         struct PubImpl;
         std::shared_ptr<PubImpl> _impl;
@@ -54,7 +58,10 @@ namespace matrix
         ZMQTransportClient(std::string urn);
         virtual ~ZMQTransportClient();
 
+        static void set_reactor_threads(size_t n);
+
     private:
+        bool _configure(YAML::Node options);
         bool _connect();
         bool _disconnect();
         bool _subscribe(std::string key, matrix::DataCallbackBase *cb);
@@ -64,6 +71,7 @@ namespace matrix
         std::shared_ptr<Impl> _impl;
 
         friend class matrix::TransportClient;
+        friend class SubReactor;
         static matrix::TransportClient *factory(std::string);
     };
 
@@ -0,0 +1,120 @@
+/*******************************************************************
+ *  event_poller.h - Waits on many DataSinks at once, with epoll.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#if !defined(_EVENT_POLLER_H_)
+#define _EVENT_POLLER_H_
+
+#include "matrix/DataSink.h"
+#include "matrix/Mutex.h"
+
+#include <vector>
+#include <map>
+#include <memory>
+
+namespace matrix
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcomment"
+/**
+ * \class event_poller
+ *
+ * Like `poller`, waits for DataSinks to have data, but scales to many
+ * sinks: each sink gets its own eventfd, which its receive queue
+ * signals when it goes from empty to not empty, and the eventfds are
+ * watched with epoll. `wait()` then costs the same however many sinks
+ * there are, and says exactly which sinks are ready, without looking
+ * at the others:
+ *
+ *      event_poller p;
+ *      vector<DataSinkBase *> ready;
+ *
+ *      p.push_back(&x);
+ *      p.push_back(&y);
+ *      ...
+ *
+ *      while (run)
+ *      {
+ *          p.wait(ready, 5000);   // in us; 0 ready on time-out
+ *
+ *          for (auto i : ready)
+ *          {
+ *              // read from *i
+ *          }
+ *      }
+ *
+ * By default readiness is level-triggered: a sink that was returned
+ * ready and still has data is returned again by the next `wait()`. If
+ * constructed with 'edge_triggered' true, a sink is returned once per
+ * transition from empty to not empty, and the caller must empty it to
+ * hear of it again.
+ *
+ * The poller's own file descriptor, `fd()`, is readable whenever a
+ * sink has become ready, so that the poller may itself be waited on
+ * by another epoll, or by a zmq_poll() as a zmq_pollitem_t with
+ * 'fd' set. Each sink's eventfd is available as `fd(sink)`.
+ *
+ * A DataSink has one notifier, so it may be in one poller (of either
+ * kind) at a time. `wait()` should be called by one thread at a time.
+ * Linux only.
+ *
+ */
+#pragma GCC diagnostic pop
+
+    class event_poller
+    {
+    public:
+
+        event_poller(bool edge_triggered = false);
+        ~event_poller();
+
+        void push_back(matrix::DataSinkBase *ds);
+        void remove(matrix::DataSinkBase *ds);
+        size_t size();
+
+        size_t wait(std::vector<matrix::DataSinkBase *> &ready, int usecs);
+        bool any_of(int usecs);
+
+        int fd() const;
+        int fd(matrix::DataSinkBase *ds);
+
+    private:
+
+        struct notifier;
+
+        size_t _collect(std::vector<matrix::DataSinkBase *> &ready, int ms);
+
+        bool _edge_triggered;
+        int _epoll_fd;
+        matrix::Mutex _lock;
+        std::map<matrix::DataSinkBase *, std::shared_ptr<notifier> > _sinks;
+        std::map<int, matrix::DataSinkBase *> _fds;
+        // level-triggered: returned by the last wait(), to look at again.
+        std::vector<matrix::DataSinkBase *> _last_ready;
+    };
+}
+
+#endif
@@ -33,12 +33,18 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
 #include <vector>
 #include <memory>
 #include "matrix/TCondition.h"
 #include "matrix/Mutex.h"
 #include "matrix/ThreadLock.h"
 #include "matrix/Time.h"
+#include "matrix/LatencyHistogram.h"
 
 namespace matrix
 {
@@ -61,6 +67,43 @@ namespace matrix
 
     };
 
+    /**
+     * Called on an item once it has been taken out of a tsemfifo (by
+     * `get()`, `get_n()`, `release_slot()` and their variants), while
+     * it is still in its slot. Does nothing, but may be overloaded, in
+     * namespace matrix, for a type holding a resource that should be
+     * let go as soon as the consumer has its copy rather than when the
+     * slot is next written (see SharedBuffer).
+     *
+     * @param obj: the item left in the slot.
+     *
+     */
+
+    template <typename T>
+    inline void fifo_slot_released(T &)
+    {
+    }
+
+    /**
+     * The synchronization strategy used by a tsemfifo.
+     *
+     *   - MPMC: Any number of threads may put() and get(). Every
+     *     operation takes the FIFO mutex and a pair of semaphores.
+     *
+     *   - SPSC: Exactly one thread puts and exactly one thread
+     *     gets. The indices are lock-free atomics, and the system is
+     *     only entered to wake a peer that is actually parked waiting
+     *     on the FIFO. This is the common DataSink case: the transport
+     *     thread produces, the component thread consumes.
+     *
+     */
+
+    enum fifo_mode
+    {
+        MPMC,
+        SPSC
+    };
+
 /**
  * \class tsemfifo
  *
@@ -97,6 +140,38 @@ namespace matrix
  *  For a post that blocks, use `put()` instead of `try_put()`, and for
  *  a get that doesn't block use `try_get()` instead of `get()`.
  *
+ *  If there will only ever be one posting thread and one handling
+ *  thread, the FIFO may be constructed in SPSC mode:
+ *
+ *     tsemfifo<int> fifo(10, SPSC);
+ *
+ *  The interface is the same, but in this mode `flush()` must only
+ *  be called by the handling thread, and `put_no_block()` drops the
+ *  new object rather than the oldest one when the FIFO is full,
+ *  since the posting thread may not touch the head of the queue.
+ *
+ *  To avoid the copies made by `put()` and `get()` (for large objects,
+ *  or objects that own memory), a slot may be filled or read in
+ *  place:
+ *
+ *     T *slot = fifo.reserve();  // blocks until there is room
+ *     ... fill *slot ...
+ *     fifo.commit();             // now visible to get() or peek()
+ *
+ *     T *item = fifo.peek();     // blocks until there is data
+ *     ... use *item ...
+ *     fifo.release_slot();       // slot returned for reuse
+ *
+ *  Only one reservation and one peek may be outstanding at a time;
+ *  other producers (consumers) wait for the commit (release_slot).
+ *
+ *  Many items may also be taken out at once, which is much cheaper
+ *  than one at a time:
+ *
+ *     int data[100];
+ *     size_t n = fifo.get_n(data, 100);   // 1 to 100 items
+ *     fifo.wait_get_n(data, 50);          // exactly 50 items
+ *
  */
 
     template<typename T>
@@ -136,7 +211,7 @@ namespace matrix
             FIFO_SIZE = 100,
         };
 
-        tsemfifo(size_t size = FIFO_SIZE);
+        tsemfifo(size_t size = FIFO_SIZE, fifo_mode mode = MPMC);
 
         ~tsemfifo();
 
@@ -160,16 +235,51 @@ namespace matrix
 
         bool timed_get(T &obj, Time::Time_t time_out);
 
+        size_t get_n(T *out, size_t max, Time::Time_t time_out = 0);
+
+        size_t try_get_n(T *out, size_t max);
+
+        bool wait_get_n(T *out, size_t n, Time::Time_t time_out = 0);
+
         bool wait_for_empty(int milliseconds = -1);
 
         unsigned int size();
 
+        unsigned int max_size();
+
         unsigned int capacity();
 
         void resize(size_t size = FIFO_SIZE);
 
         void set_notifier(std::shared_ptr<fifo_notifier>);
 
+        void set_latency_histogram(LatencyHistogram *h);
+
+        T *reserve();
+
+        T *try_reserve();
+
+        T *timed_reserve(Time::Time_t time_out);
+
+        T *reserve_no_block(unsigned int &dropped);
+
+        void commit();
+
+        void rollback();
+
+        T *peek();
+
+        T *try_peek();
+
+        T *timed_peek(Time::Time_t time_out);
+
+        void release_slot();
+
+        fifo_mode mode()
+        {
+            return _mode;
+        }
+
     private:
 
         tsemfifo(const tsemfifo &);
@@ -184,6 +294,63 @@ namespace matrix
 
         void _put(T &obj);
 
+        bool _sem_wait(sem_t &sem, bool block, Time::Time_t time_out, char const *who);
+
+        T *_reserve(bool block, Time::Time_t time_out);
+
+        T *_peek(bool block, Time::Time_t time_out);
+
+        size_t _get_n(T *out, size_t min, size_t max, bool block, Time::Time_t time_out);
+
+        bool _spsc_put(T &obj, bool block, Time::Time_t time_out);
+
+        bool _spsc_get(T &obj, bool block, Time::Time_t time_out);
+
+        T *_spsc_reserve(bool block, Time::Time_t time_out);
+
+        void _spsc_commit();
+
+        T *_spsc_peek(bool block, Time::Time_t time_out);
+
+        void _spsc_release_slot();
+
+        size_t _spsc_get_n(T *out, size_t min, size_t max, bool block, Time::Time_t time_out);
+
+        unsigned int _spsc_flush(int items);
+
+        bool _spsc_park(std::atomic<int> &parked, bool consumer, uint64_t want,
+                        bool block, Time::Time_t time_out);
+
+        void _spsc_wake(std::atomic<int> &parked);
+
+        T *_claim_head();
+
+        bool _drop_oldest();
+
+        void _stamp(size_t slot)
+        {
+            if (_latency)
+            {
+                _stamps[slot] = Time::getUTC();
+            }
+        }
+
+        void _record(size_t slot, Time::Time_t now)
+        {
+            if (_latency)
+            {
+                _latency->record(now - _stamps[slot]);
+            }
+        }
+
+        void _note_depth(uint64_t items)
+        {
+            if (items > _max_objects.load(std::memory_order_relaxed))
+            {
+                _max_objects.store((unsigned int)items, std::memory_order_relaxed);
+            }
+        }
+
         std::vector<T> _buffer;
         unsigned int _head;
         unsigned int _tail;
@@ -194,7 +361,46 @@ namespace matrix
         matrix::TCondition<bool> _release;
         matrix::TCondition<bool> _empty;
         std::shared_ptr<matrix::fifo_notifier> _notifier;
+        // when '_latency' is set, the time each slot was committed, to
+        // histogram the time items spend in the FIFO.
+        std::vector<Time::Time_t> _stamps;
+        LatencyHistogram *_latency;
+        // the most items there have been in the FIFO, kept by the
+        // producer as it commits (under '_critical_section' in MPMC
+        // mode), so that max_size() needs no lock.
+        std::atomic<unsigned int> _max_objects;
         matrix::Mutex _critical_section;
+        // MPMC mode: held from reserve() to commit()/rollback(), and
+        // from peek() to release_slot(), so that the slot being
+        // filled or read in place stays put.
+        matrix::Mutex _producer_lock;
+        matrix::Mutex _consumer_lock;
+        // MPMC mode: the head slot is held by a peek() (or a get() in
+        // progress), so it may not be dropped. Guarded by
+        // '_critical_section'.
+        bool _peeked;
+
+        // SPSC mode state. '_spsc_head' is written only by the
+        // consumer, '_spsc_tail' only by the producer. Both are free
+        // running counters (the slot is the counter modulo
+        // '_buf_len'), and are padded onto separate cache lines so
+        // that the two threads do not false-share.
+        fifo_mode _mode;
+        char _pad0[64];
+        std::atomic<uint64_t> _spsc_head;
+        char _pad1[64 - sizeof(std::atomic<uint64_t>)];
+        std::atomic<uint64_t> _spsc_tail;
+        char _pad2[64 - sizeof(std::atomic<uint64_t>)];
+        std::atomic<int> _consumer_parked;
+        std::atomic<int> _producer_parked;
+        std::atomic<uint64_t> _spsc_want;  // tail count a parked consumer needs
+        std::atomic<bool> _spsc_released;
+        std::atomic<matrix::fifo_notifier *> _spsc_notifier;
+        // set by the producer while it calls the notifier, so that
+        // set_notifier() can tell when a replaced one is unused.
+        std::atomic<bool> _spsc_notifying;
+        // notifiers replaced while the producer may still be calling them.
+        std::vector<std::shared_ptr<matrix::fifo_notifier> > _retired_notifiers;
     };
 
 /**
@@ -237,15 +443,32 @@ namespace matrix
  * @param size The capacity of the semaphore queue. If this capacity is
  * reached, `put()` will block, or `try_put()` will return an error.
  *
+ * @param mode: MPMC (the default) for any number of producer and
+ * consumer threads, or SPSC for the lock-free single producer/single
+ * consumer queue.
+ *
  */
 
     template<class T>
-    matrix::tsemfifo<T>::tsemfifo(size_t size)
+    matrix::tsemfifo<T>::tsemfifo(size_t size, fifo_mode mode)
             : _buffer(size),
               _buf_len(size),
               _release(false),
               _empty(true),
-              _notifier(new fifo_notifier)
+              _notifier(new fifo_notifier),
+              _stamps(size),
+              _latency(0),
+              _max_objects(0),
+              _peeked(false),
+              _mode(mode),
+              _spsc_head(0),
+              _spsc_tail(0),
+              _consumer_parked(0),
+              _producer_parked(0),
+              _spsc_want(0),
+              _spsc_released(false),
+              _spsc_notifier(_notifier.get()),
+              _spsc_notifying(false)
     {
         matrix::ThreadLock<matrix::Mutex> l(_critical_section);
 
@@ -295,16 +518,36 @@ namespace matrix
 
 /**
  * Empties the queue. Throws a tsemfifo<T>::Exception if there is a
-   semaphore resource issue.
+   semaphore resource issue. Waits for any outstanding reservation to
+   be committed (or rolled back) and any outstanding peek to be
+   released first, so the calling thread must not hold either.
  *
  */
 
     template<class T>
     void matrix::tsemfifo<T>::flush()
     {
+        if (_mode == SPSC)
+        {
+            _spsc_released.store(false);
+            _spsc_flush(_buf_len);
+            return;
+        }
+
+        matrix::ThreadLock<matrix::Mutex> p(_producer_lock);
+        matrix::ThreadLock<matrix::Mutex> c(_consumer_lock);
         matrix::ThreadLock<matrix::Mutex> l(_critical_section);
 
+        p.lock();
+        c.lock();
         l.lock();
+
+        for (unsigned int i = 0, h = _head; i < _objects; ++i)
+        {
+            fifo_slot_released(_buffer[h]);
+            h = h < (_buf_len - 1) ? h + 1 : 0;
+        }
+
         _close_sem();
         _create_sem();
 
@@ -327,7 +570,15 @@ namespace matrix
     template<class T>
     unsigned int matrix::tsemfifo<T>::flush(int items)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_flush(items);
+        }
+
+        // don't pull the head slot out from under a peek()
+        matrix::ThreadLock<matrix::Mutex> c(_consumer_lock);
         matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+        c.lock();
         l.lock();
 
         bool all_but_nitems = (items < 0);
@@ -363,25 +614,26 @@ namespace matrix
             nitems = _objects;
         }
 
-        _head = (_head + nitems) % _buf_len;
-        _objects = _objects - nitems;
+        // Only drop what can be taken off '_full_sem' without
+        // waiting: a get() that has already counted an object down,
+        // but not yet taken the consumer lock, keeps that object.
+        unsigned int dropped;
+
+        for (dropped = 0; dropped < nitems && sem_trywait(&_full_sem) == 0; ++dropped)
+        {
+            fifo_slot_released(_buffer[_head]);
+            _head = _head < (_buf_len - 1) ? _head + 1 : 0;
+        }
+
+        _objects = _objects - dropped;
 
         if (!_objects)               // Was not empty, now empty.  Set empty event.
         {
             _empty.broadcast(true);
         }
 
-        for (unsigned int i = 0; i < nitems; ++i)
+        for (unsigned int i = 0; i < dropped; ++i)
         {
-            int r = sem_wait(&_full_sem);
-
-            if (r == -1 && errno != EINTR)
-            {
-                Exception e;
-                e.what(errno, "tsemfifo<T>::get()");
-                throw e;
-            }
-
             if (sem_post(&_empty_sem) == -1)
             {
                 Exception e;
@@ -393,6 +645,51 @@ namespace matrix
         return _objects;
     }
 
+/**
+ * MPMC mode: drops the object at the head of the FIFO to make room
+ * for a new one, for `put_no_block()` and `reserve_no_block()`. Unlike
+ * `flush(int)` this does not take the consumer lock, so a consumer
+ * working on a peeked slot does not hold up the producer; but for the
+ * same reason a peeked head slot is never dropped.
+ *
+ * @return true if an object was dropped, false if the head slot is
+ * held by a consumer (or the FIFO is empty).
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_drop_oldest()
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        l.lock();
+
+        if (_peeked || sem_trywait(&_full_sem) == -1)
+        {
+            return false;
+        }
+
+        fifo_slot_released(_buffer[_head]);
+        _head = _head < (_buf_len - 1) ? _head + 1 : 0;
+        --_objects;
+        bool now_empty = !_objects;
+        l.unlock();
+
+        if (now_empty)
+        {
+            _empty.broadcast(true);
+        }
+
+        if (sem_post(&_empty_sem) == -1)
+        {
+            Exception e;
+            e.what(errno, "tsemfifo<T>::put_no_block()");
+            throw e;
+        }
+
+        return true;
+    }
+
 /**
  * Blocks until the FIFO is empty.  This is useful for another task to
  * wait until the FIFO is empty before doing something, like closing a
@@ -408,6 +705,25 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::wait_for_empty(int milliseconds)
     {
+        if (_mode == SPSC)
+        {
+            // There is no empty event in SPSC mode (maintaining one
+            // would put a lock back into the data path), so poll.
+            Time::Time_t end = Time::getUTC() + (Time::Time_t)milliseconds * 1000000;
+
+            while (size())
+            {
+                if (milliseconds != -1 && Time::getUTC() > end)
+                {
+                    return false;
+                }
+
+                Time::thread_delay(100000);
+            }
+
+            return true;
+        }
+
         if (milliseconds == -1)
         {
             _empty.wait(true);
@@ -429,36 +745,19 @@ namespace matrix
     template<class T>
     void matrix::tsemfifo<T>::_put(T &obj)
     {
-        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+        _producer_lock.lock();
 
-
-        l.lock();
-        _buffer[_tail] = obj;
-
-        if (_tail < (_buf_len - 1))
+        try
         {
-            ++_tail;
+            _buffer[_tail] = obj;
         }
-        else
+        catch (...)
         {
-            _tail = 0;
-        }
-
-        if (!_objects)                   // Was empty, now has something.
-        {                                // clear the empty condition variable/event
-            _empty.set_value(false);
+            rollback();
+            throw;
         }
 
-        ++_objects;
-        _notifier->exec(_objects);
-        l.unlock();
-
-        if (sem_post(&_full_sem) == -1)
-        {
-            Exception e;
-            e.what(errno, "tsemfifo<T>::_put()");
-            throw e;
-        }
+        commit();
     }
 
 /**
@@ -474,6 +773,11 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::put(T &obj)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_put(obj, true, 0);
+        }
+
         int r;
 
         do
@@ -516,6 +820,11 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::try_put(T &obj)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_put(obj, false, 0);
+        }
+
         if (sem_trywait(&_empty_sem) == -1)
         {
             if (errno == EAGAIN)
@@ -553,6 +862,11 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::timed_put(T &obj, Time::Time_t time_out)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_put(obj, time_out != 0, time_out);
+        }
+
         timespec ts;
 
         Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
@@ -575,23 +889,39 @@ namespace matrix
 
 /**
  * This put does not block, and bumps off the oldest entry if the fifo
- * is full.
+ * is full. It never waits on the consumer: if the oldest entry is
+ * being read in place by `peek()`, the new object is dropped
+ * instead. In SPSC mode the producer may not move the head of the
+ * queue, so it is always the new object that is dropped.
  *
  * @param obj: object to place into the FIFO
  *
+ * @return The number of objects dropped.
+ *
  */
 
     template<class T>
     unsigned int matrix::tsemfifo<T>::put_no_block(T &obj)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_put(obj, false, 0) ? 0 : 1;
+        }
+
         unsigned int flushed(0);
 
         // try_put() will fail and return 'false' if the fifo is full. In
-        // that case, flush the oldest ojbect, and this should provide
+        // that case, drop the oldest ojbect, and this should provide
         // enough room to put the object.
         while (!try_put(obj))
         {
-            flush(1);
+            if (!_drop_oldest())
+            {
+                // head is peeked: a release_slot() may have made
+                // room meanwhile, otherwise drop the new object.
+                return try_put(obj) ? flushed : flushed + 1;
+            }
+
             ++flushed;
         }
 
@@ -610,35 +940,24 @@ namespace matrix
     template<class T>
     void matrix::tsemfifo<T>::_get(T &obj)
     {
-        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
-
-        l.lock();
-        obj = _buffer[_head];
+        T *slot = _claim_head();
 
-        if (_head < (_buf_len - 1))
-        {
-            ++_head;
-        }
-        else
+        try
         {
-            _head = 0;
+            obj = *slot;
         }
-
-        --_objects;
-
-        l.unlock();
-
-        if (!_objects)               // Was not empty, now empty.  Set empty event.
+        catch (...)
         {
-            _empty.broadcast(true);
+            matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+            l.lock();
+            _peeked = false;
+            l.unlock();
+            _consumer_lock.unlock();
+            sem_post(&_full_sem);
+            throw;
         }
 
-        if (sem_post(&_empty_sem) == -1)
-        {
-            Exception e;
-            e.what(errno, "tsemfifo<T>::_get()");
-            throw e;
-        }
+        release_slot();
     }
 
 /**
@@ -656,6 +975,11 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::get(T &obj)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_get(obj, true, 0);
+        }
+
         int r;
 
         do
@@ -694,6 +1018,11 @@ namespace matrix
     template<class T>
     bool matrix::tsemfifo<T>::try_get(T &obj)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_get(obj, false, 0);
+        }
+
         if (sem_trywait(&_full_sem) == -1)
         {
             if (errno == EAGAIN)
@@ -722,13 +1051,18 @@ namespace matrix
  *
  * @return timed_get() will return true if there was a value at the head
  *         of the FIFO, false if the FIFO was empty at the expiration
- *         of 'time_out'.
+ *         of 'time_out', or was released.
  *
  */
 
     template<class T>
     bool matrix::tsemfifo<T>::timed_get(T &obj, Time::Time_t time_out)
     {
+        if (_mode == SPSC)
+        {
+            return _spsc_get(obj, time_out != 0, time_out);
+        }
+
         timespec ts;
 
         Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
@@ -745,82 +1079,1012 @@ namespace matrix
             throw e;
         }
 
+        if (_release.wait(true, 0))
+        {
+            return false;
+        }
+
         _get(obj);
         return true;
     }
 
 
 /**
- * If any thread is waiting on get() or put(), this will release them.
- * The queue should not be used after this call unless the next call is
- * flush().
+ * Gets up to 'max' objects out of the head of the FIFO in one
+ * operation: the FIFO is locked once for all of them, and (in SPSC
+ * mode) the producer is signaled once. `get_n()` blocks until there
+ * is at least one object, `try_get_n()` never blocks.
  *
- */
-
-    template<class T>
-    void matrix::tsemfifo<T>::release()
-    {
-        _release.broadcast(true);
-        sem_post(&_full_sem);
-        sem_post(&_empty_sem);
-    }
-
-/**
- * Returns the number of objects in the FIFO.
+ * @param out: array of at least 'max' objects, to which the FIFO
+ * objects are copied, oldest first.
+ * @param max: the most objects to get.
+ * @param time_out: (get_n) if not 0, the most time in nano seconds to
+ * wait for the first object.
  *
- * @return The number of objects in the FIFO.
+ * @return the number of objects copied to 'out'. 0 if the FIFO
+ * remained empty for 'time_out', or was released.
  *
  */
 
     template<class T>
-    unsigned int matrix::tsemfifo<T>::size()
+    size_t matrix::tsemfifo<T>::get_n(T *out, size_t max, Time::Time_t time_out)
     {
-        unsigned int o;
-        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+        if (_mode == SPSC)
+        {
+            return _spsc_get_n(out, 1, max, true, time_out);
+        }
 
+        return _get_n(out, 1, max, true, time_out);
+    }
 
-        l.lock();
-        o = _objects;
-        return o;
+    template<class T>
+    size_t matrix::tsemfifo<T>::try_get_n(T *out, size_t max)
+    {
+        if (_mode == SPSC)
+        {
+            return _spsc_get_n(out, 1, max, false, 0);
+        }
 
+        return _get_n(out, 1, max, false, 0);
     }
 
 /**
- * Returns the maximum size of the FIFO, in objects of type T.
+ * Gets exactly 'n' objects out of the head of the FIFO, waiting until
+ * that many are available. In SPSC mode the waiting consumer is only
+ * woken once the 'n'th object arrives. 'n' may not exceed the FIFO
+ * capacity.
  *
-   @return The maximum number of objects that the FIFO can hold.
+ * @param out: array of at least 'n' objects, to which the FIFO
+ * objects are copied, oldest first.
+ * @param n: the number of objects to get.
+ * @param time_out: if not 0, the most time in nano seconds to wait.
+ *
+ * @return true if 'n' objects were copied to 'out', false on time-out
+ * or release, in which case the FIFO is left as it was.
  *
  */
 
     template<class T>
-    unsigned int matrix::tsemfifo<T>::capacity()
+    bool matrix::tsemfifo<T>::wait_get_n(T *out, size_t n, Time::Time_t time_out)
     {
-        unsigned int o;
-        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
-
+        if (n > _buf_len)
+        {
+            Exception e;
+            e.what(EINVAL, "tsemfifo<T>::wait_get_n(): n exceeds capacity");
+            throw e;
+        }
 
-        l.lock();
-        o = _buf_len;
-        return o;
+        if (_mode == SPSC)
+        {
+            return _spsc_get_n(out, n, n, true, time_out) == n;
+        }
 
+        return _get_n(out, n, n, true, time_out) == n;
     }
 
 /**
- * Allows another party to insert a snipped of code to execute when
- * the `tsemfifo::_put()` is called. The code is a functor of base
- * type 'notifier', which receives the number of items in the queue
- * after the successful `_put()`.
+ * MPMC implementation of the get_n() family. The semaphore can only
+ * be counted down one at a time, but past the first 'min' (which may
+ * wait) these are uncontended atomic decrements; the objects
+ * themselves are then moved under a single lock.
  *
- * @param n: A `std::shared_ptr` pointing to a `fifo_notifier` derived functor.
+ * @param out: destination array.
+ * @param min: the number of objects that must be available.
+ * @param max: the most objects to get.
+ * @param block: wait for the first 'min' objects.
+ * @param time_out: if blocking and not 0, the most time to wait.
+ *
+ * @return the number of objects copied to 'out'.
  *
  */
 
     template<class T>
-    void matrix::tsemfifo<T>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
+    size_t matrix::tsemfifo<T>::_get_n(T *out, size_t min, size_t max, bool block,
+                                       Time::Time_t time_out)
     {
-        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
-        l.lock();
-        _notifier = n;
+        Time::Time_t end = Time::getUTC() + time_out;
+        size_t n = 0;
+
+        while (n < min)
+        {
+            Time::Time_t to = 0;
+
+            if (block && time_out)
+            {
+                Time::Time_t now = Time::getUTC();
+                to = now < end ? end - now : 1;
+            }
+
+            if (!_sem_wait(_full_sem, block, to, "tsemfifo<T>::get_n()"))
+            {
+                // didn't get 'min': put back what was taken.
+                for (; n > 0; --n)
+                {
+                    sem_post(&_full_sem);
+                }
+
+                return 0;
+            }
+
+            ++n;
+        }
+
+        while (n < max && sem_trywait(&_full_sem) == 0)
+        {
+            ++n;
+        }
+
+        matrix::ThreadLock<matrix::Mutex> c(_consumer_lock);
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        c.lock();
+        l.lock();
+
+        Time::Time_t now = _latency ? Time::getUTC() : 0;
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            out[i] = _buffer[_head];
+            fifo_slot_released(_buffer[_head]);
+            _record(_head, now);
+            _head = _head < (_buf_len - 1) ? _head + 1 : 0;
+        }
+
+        _objects -= n;
+        bool now_empty = !_objects;
+        l.unlock();
+        c.unlock();
+
+        if (now_empty)
+        {
+            _empty.broadcast(true);
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            if (sem_post(&_empty_sem) == -1)
+            {
+                Exception e;
+                e.what(errno, "tsemfifo<T>::get_n()");
+                throw e;
+            }
+        }
+
+        return n;
+    }
+
+/**
+ * If any thread is waiting on get() or put(), this will release them.
+ * The queue should not be used after this call unless the next call is
+ * flush().
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::release()
+    {
+        if (_mode == SPSC)
+        {
+            _spsc_released.store(true);
+            _spsc_wake(_consumer_parked);
+            _spsc_wake(_producer_parked);
+            return;
+        }
+
+        _release.broadcast(true);
+        sem_post(&_full_sem);
+        sem_post(&_empty_sem);
+    }
+
+/**
+ * Returns the number of objects in the FIFO.
+ *
+ * @return The number of objects in the FIFO.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::size()
+    {
+        if (_mode == SPSC)
+        {
+            // head first: the tail never moves backwards, so this can
+            // not underflow, but it can briefly overstate.
+            uint64_t head = _spsc_head.load(std::memory_order_acquire);
+            uint64_t tail = _spsc_tail.load(std::memory_order_acquire);
+            uint64_t o = tail - head;
+            return o > _buf_len ? _buf_len : (unsigned int)o;
+        }
+
+        unsigned int o;
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+
+        l.lock();
+        o = _objects;
+        return o;
+
+    }
+
+/**
+ * Returns the most objects there have been in the FIFO at once. This
+ * is kept as items are put, so unlike `size()` it takes no lock, and
+ * is cheap enough to call on every put.
+ *
+ * @return The deepest the FIFO has been.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::max_size()
+    {
+        return _max_objects.load(std::memory_order_relaxed);
+    }
+
+/**
+ * Returns the maximum size of the FIFO, in objects of type T.
+ *
+   @return The maximum number of objects that the FIFO can hold.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::capacity()
+    {
+        unsigned int o;
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+
+        l.lock();
+        o = _buf_len;
+        return o;
+
+    }
+
+/**
+ * Allows another party to insert a snipped of code to execute when
+ * the `tsemfifo::_put()` is called. The code is a functor of base
+ * type 'notifier', which receives the number of items in the queue
+ * after the successful `_put()`.
+ *
+ * @param n: A `std::shared_ptr` pointing to a `fifo_notifier` derived functor.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::set_notifier(std::shared_ptr<matrix::fifo_notifier> n)
+    {
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+        l.lock();
+        // In SPSC mode the producer reads the notifier without the
+        // lock, so the one being replaced must outlive this call,
+        // unless the producer is not calling it.
+        if (_mode == SPSC)
+        {
+            _retired_notifiers.push_back(_notifier);
+        }
+
+        _notifier = n;
+        _spsc_notifier.store(_notifier.get(), std::memory_order_seq_cst);
+
+        if (_mode == SPSC)
+        {
+            // pairs with the fence in _spsc_commit(): either the
+            // producer will load the new notifier, or this sees it
+            // busy with an old one, which is then kept until a later
+            // call finds it idle.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            if (!_spsc_notifying.load(std::memory_order_acquire))
+            {
+                _retired_notifiers.clear();
+            }
+        }
+    }
+
+/**
+ * Has the FIFO keep a histogram of the time items spend in it, from
+ * `commit()` (or `put()`) to the get, or `release_slot()`, that takes
+ * them out. Items flushed are not counted. The cost is a clock read
+ * on each side. Should be set before the FIFO is in use.
+ *
+ * @param h: the histogram to record into, which must outlive the
+ * FIFO; or 0 (the default) to stop.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::set_latency_histogram(LatencyHistogram *h)
+    {
+        _latency = h;
+    }
+
+/**
+ * Waits on one of the two counting semaphores. This is the common
+ * part of the blocking, non-blocking and timed put and get variants.
+ *
+ * @param sem: _empty_sem (to put) or _full_sem (to get).
+ * @param block: if false, do not wait at all.
+ * @param time_out: if blocking, the relative time-out in nano
+ * seconds. 0 means wait indefinitely.
+ * @param who: the caller, for the exception message.
+ *
+ * @return true if the semaphore was taken, false if it was not, or if
+ * an indefinite wait was released by `release()`.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_sem_wait(sem_t &sem, bool block, Time::Time_t time_out,
+                                        char const *who)
+    {
+        int r;
+
+        if (!block)
+        {
+            r = sem_trywait(&sem);
+        }
+        else if (time_out)
+        {
+            timespec ts;
+
+            Time::time2timespec(Time::getUTC(CLOCK_REALTIME) + time_out, ts);
+
+            do
+            {
+                r = sem_timedwait(&sem, &ts);
+            }
+            while (r == -1 && errno == EINTR);
+        }
+        else
+        {
+            do
+            {
+                r = sem_wait(&sem);
+            }
+            while (r == -1 && errno == EINTR);
+
+            if (r == 0 && _release.wait(true, 0))
+            {
+                return false;
+            }
+        }
+
+        if (r == -1)
+        {
+            if (errno == EAGAIN || errno == ETIMEDOUT)
+            {
+                return false;
+            }
+
+            Exception e;
+            e.what(errno, who);
+            throw e;
+        }
+
+        return true;
+    }
+
+/**
+ * Reserves the next free slot at the tail of the FIFO so that it may
+ * be filled in place, avoiding the copy made by `put()`. The object
+ * in the slot is whatever was last put there, so objects that
+ * own buffers (std::string, GenericBuffer) can usually be refilled
+ * without any allocation. Nothing is visible to the consumer until
+ * `commit()` is called. Every successful reserve must be followed by
+ * exactly one `commit()` or `rollback()` from the same thread.
+ *
+ * `reserve()` blocks until there is room, `try_reserve()` does not
+ * block, and `timed_reserve()` waits at most 'time_out' nano seconds.
+ *
+ * @return A pointer to the slot, or 0 if there is no room (or the
+ * FIFO was released).
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::reserve()
+    {
+        return _mode == SPSC ? _spsc_reserve(true, 0) : _reserve(true, 0);
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::try_reserve()
+    {
+        return _mode == SPSC ? _spsc_reserve(false, 0) : _reserve(false, 0);
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::timed_reserve(Time::Time_t time_out)
+    {
+        if (_mode == SPSC)
+        {
+            return _spsc_reserve(time_out != 0, time_out);
+        }
+
+        return time_out ? _reserve(true, time_out) : _reserve(false, 0);
+    }
+
+/**
+ * The `reserve()` counterpart to `put_no_block()`: never blocks, and
+ * if the FIFO is full drops the oldest entries to make room. In SPSC
+ * mode the oldest entry can't be dropped by the producer, nor in MPMC
+ * mode while it is peeked, so then if the FIFO is full no slot is
+ * returned and the caller should drop the new data instead.
+ *
+ * @param dropped: set to the number of entries dropped, plus 1 if no
+ * slot is returned.
+ *
+ * @return A pointer to the slot, or 0 if the FIFO is full and the
+ * oldest entry can't be dropped.
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::reserve_no_block(unsigned int &dropped)
+    {
+        T *slot;
+
+        dropped = 0;
+
+        if (_mode == SPSC)
+        {
+            if (!(slot = _spsc_reserve(false, 0)))
+            {
+                dropped = 1;
+            }
+
+            return slot;
+        }
+
+        while (!(slot = _reserve(false, 0)))
+        {
+            if (!_drop_oldest())
+            {
+                if (!(slot = _reserve(false, 0)))
+                {
+                    ++dropped;
+                }
+
+                return slot;
+            }
+
+            ++dropped;
+        }
+
+        return slot;
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::_reserve(bool block, Time::Time_t time_out)
+    {
+        if (!_sem_wait(_empty_sem, block, time_out, "tsemfifo<T>::reserve()"))
+        {
+            return 0;
+        }
+
+        // '_tail' only moves in commit(), which this lock excludes.
+        _producer_lock.lock();
+        return &_buffer[_tail];
+    }
+
+/**
+ * Publishes the slot obtained from `reserve()`, exactly as if it had
+ * been passed to `put()`.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::commit()
+    {
+        if (_mode == SPSC)
+        {
+            _spsc_commit();
+            return;
+        }
+
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        l.lock();
+        _stamp(_tail);
+
+        if (_tail < (_buf_len - 1))
+        {
+            ++_tail;
+        }
+        else
+        {
+            _tail = 0;
+        }
+
+        if (!_objects)                   // Was empty, now has something.
+        {                                // clear the empty condition variable/event
+            _empty.set_value(false);
+        }
+
+        ++_objects;
+        _note_depth(_objects);
+        _notifier->exec(_objects);
+        l.unlock();
+        _producer_lock.unlock();
+
+        if (sem_post(&_full_sem) == -1)
+        {
+            Exception e;
+            e.what(errno, "tsemfifo<T>::commit()");
+            throw e;
+        }
+    }
+
+/**
+ * Gives back the slot obtained from `reserve()` without publishing
+ * it. The slot's contents are left as they are.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::rollback()
+    {
+        if (_mode == SPSC)
+        {
+            return;
+        }
+
+        _producer_lock.unlock();
+        sem_post(&_empty_sem);
+    }
+
+/**
+ * Returns a pointer to the object at the head of the FIFO without
+ * copying it out, as `get()` would. The object stays in the FIFO,
+ * and may be used, or even swapped out, until `release_slot()` is
+ * called. Every successful peek must be followed by exactly one
+ * `release_slot()` from the same thread, and that thread must not
+ * call `flush()` in between.
+ *
+ * `peek()` blocks until there is data, `try_peek()` does not block,
+ * and `timed_peek()` waits at most 'time_out' nano seconds.
+ *
+ * @return A pointer to the object, or 0 if the FIFO is empty (or was
+ * released).
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::peek()
+    {
+        return _mode == SPSC ? _spsc_peek(true, 0) : _peek(true, 0);
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::try_peek()
+    {
+        return _mode == SPSC ? _spsc_peek(false, 0) : _peek(false, 0);
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::timed_peek(Time::Time_t time_out)
+    {
+        if (_mode == SPSC)
+        {
+            return _spsc_peek(time_out != 0, time_out);
+        }
+
+        return time_out ? _peek(true, time_out) : _peek(false, 0);
+    }
+
+    template<class T>
+    T *matrix::tsemfifo<T>::_peek(bool block, Time::Time_t time_out)
+    {
+        if (!_sem_wait(_full_sem, block, time_out, "tsemfifo<T>::peek()"))
+        {
+            return 0;
+        }
+
+        return _claim_head();
+    }
+
+/**
+ * MPMC mode: takes the consumer lock and marks the head slot as held,
+ * so that `put_no_block()` won't drop it. The caller has already
+ * counted the object down on '_full_sem'.
+ *
+ * @return A pointer to the head slot.
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::_claim_head()
+    {
+        // '_head' only moves in release_slot() and flush(int), which
+        // this lock excludes, and in _drop_oldest(), which '_peeked'
+        // excludes.
+        _consumer_lock.lock();
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+        l.lock();
+        _peeked = true;
+        return &_buffer[_head];
+    }
+
+/**
+ * Removes the object obtained by `peek()` from the FIFO, making its
+ * slot available to the producer.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::release_slot()
+    {
+        if (_mode == SPSC)
+        {
+            _spsc_release_slot();
+            return;
+        }
+
+        matrix::ThreadLock<matrix::Mutex> l(_critical_section);
+
+        fifo_slot_released(_buffer[_head]);
+        l.lock();
+        _record(_head, _latency ? Time::getUTC() : 0);
+
+        if (_head < (_buf_len - 1))
+        {
+            ++_head;
+        }
+        else
+        {
+            _head = 0;
+        }
+
+        --_objects;
+        _peeked = false;
+        bool now_empty = !_objects;
+        l.unlock();
+        _consumer_lock.unlock();
+
+        if (now_empty)               // Was not empty, now empty.  Set empty event.
+        {
+            _empty.broadcast(true);
+        }
+
+        if (sem_post(&_empty_sem) == -1)
+        {
+            Exception e;
+            e.what(errno, "tsemfifo<T>::release_slot()");
+            throw e;
+        }
+    }
+
+/**
+ * SPSC mode: parks the calling thread until its peer makes progress,
+ * the FIFO is released, or the time-out expires. The caller sets the
+ * futex word '_consumer_parked' or '_producer_parked' before checking
+ * the FIFO state one last time, and the peer clears it and wakes the
+ * caller only if it finds it set. This keeps the system out of the
+ * data path unless somebody is actually waiting.
+ *
+ * @param parked: the futex word of the calling side.
+ * @param consumer: true if the caller is the consumer (waiting for
+ * data), false if it is the producer (waiting for room).
+ * @param want: (consumer) the number of items to wait for.
+ * @param block: if false, return immediately.
+ * @param time_out: relative time-out in nanoseconds. 0 waits forever.
+ *
+ * @return true if the FIFO became ready, false on time-out or release.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_spsc_park(std::atomic<int> &parked, bool consumer, uint64_t want,
+                                         bool block, Time::Time_t time_out)
+    {
+        auto ready = [this, consumer, want]() -> bool
+        {
+            uint64_t head = _spsc_head.load(std::memory_order_seq_cst);
+            uint64_t tail = _spsc_tail.load(std::memory_order_seq_cst);
+            return consumer ? tail - head >= want : tail - head < _buf_len;
+        };
+
+        if (ready())
+        {
+            return true;
+        }
+
+        if (!block)
+        {
+            return false;
+        }
+
+        Time::Time_t end = Time::getUTC() + time_out;
+
+        while (!_spsc_released.load())
+        {
+            timespec ts, *tsp = 0;
+
+            if (time_out)
+            {
+                Time::Time_t now = Time::getUTC();
+
+                if (now >= end)
+                {
+                    return false;
+                }
+
+                Time::time2timespec(end - now, ts);
+                tsp = &ts;
+            }
+
+            if (consumer)
+            {
+                // the producer need not wake us until there are 'want' items.
+                _spsc_want.store(_spsc_head.load(std::memory_order_relaxed) + want,
+                                 std::memory_order_relaxed);
+            }
+
+            parked.store(1, std::memory_order_seq_cst);
+
+            if (ready())
+            {
+                parked.store(0, std::memory_order_relaxed);
+                return true;
+            }
+
+            if (_spsc_released.load())
+            {
+                break;
+            }
+
+            // Returns at once if the peer cleared 'parked' first.
+            syscall(SYS_futex, reinterpret_cast<int *>(&parked),
+                    FUTEX_WAIT_PRIVATE, 1, tsp, 0, 0);
+            parked.store(0, std::memory_order_relaxed);
+
+            if (ready())
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+/**
+ * SPSC mode: wakes the peer if, and only if, it is parked on 'parked'.
+ *
+ * @param parked: the futex word of the side to wake.
+ *
+ */
+
+    template<class T>
+    void matrix::tsemfifo<T>::_spsc_wake(std::atomic<int> &parked)
+    {
+        // pairs with the seq_cst store/load in _spsc_park(): either the
+        // peer sees our index update, or we see its 'parked' flag.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (parked.load(std::memory_order_relaxed)
+            && parked.exchange(0) == 1)
+        {
+            syscall(SYS_futex, reinterpret_cast<int *>(&parked),
+                    FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+        }
+    }
+
+/**
+ * SPSC mode put and get, in terms of the in-place slot functions
+ * below.
+ *
+ */
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_spsc_put(T &obj, bool block, Time::Time_t time_out)
+    {
+        T *slot = _spsc_reserve(block, time_out);
+
+        if (!slot)
+        {
+            return false;
+        }
+
+        *slot = obj;
+        _spsc_commit();
+        return true;
+    }
+
+    template<class T>
+    bool matrix::tsemfifo<T>::_spsc_get(T &obj, bool block, Time::Time_t time_out)
+    {
+        T *slot = _spsc_peek(block, time_out);
+
+        if (!slot)
+        {
+            return false;
+        }
+
+        obj = *slot;
+        _spsc_release_slot();
+        return true;
+    }
+
+/**
+ * SPSC mode reserve. Must only ever be called from the one producer
+ * thread.
+ *
+ * @param block: wait for room if the FIFO is full.
+ * @param time_out: if blocking, the relative time-out in nanoseconds,
+ * 0 meaning wait forever.
+ *
+ * @return the tail slot, or 0 if there was no room.
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::_spsc_reserve(bool block, Time::Time_t time_out)
+    {
+        uint64_t tail = _spsc_tail.load(std::memory_order_relaxed);
+
+        if (tail - _spsc_head.load(std::memory_order_acquire) >= _buf_len
+            && !_spsc_park(_producer_parked, false, 1, block, time_out))
+        {
+            return 0;
+        }
+
+        if (block && _spsc_released.load(std::memory_order_relaxed))
+        {
+            return 0;
+        }
+
+        return &_buffer[tail % _buf_len];
+    }
+
+    template<class T>
+    void matrix::tsemfifo<T>::_spsc_commit()
+    {
+        // only this thread writes '_spsc_tail', so no RMW needed.
+        uint64_t tail = _spsc_tail.load(std::memory_order_relaxed) + 1;
+
+        _stamp((tail - 1) % _buf_len);
+        _spsc_tail.store(tail, std::memory_order_release);
+        _spsc_notifying.store(true, std::memory_order_relaxed);
+        // pairs with the fence in _spsc_wake(), which the consumer
+        // goes through after moving the head: either it sees this
+        // tail, or this sees its head. So the count given to the
+        // notifier is exact when it goes from 0 to 1, the edge
+        // event_poller signals on. Also pairs with set_notifier().
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        uint64_t items = tail - _spsc_head.load(std::memory_order_relaxed);
+        _note_depth(items);
+        _spsc_notifier.load(std::memory_order_acquire)->exec((int)items);
+        _spsc_notifying.store(false, std::memory_order_release);
+
+        // a consumer in wait_get_n() may want more than this.
+        if (_consumer_parked.load(std::memory_order_acquire)
+            && tail >= _spsc_want.load(std::memory_order_relaxed))
+        {
+            _spsc_wake(_consumer_parked);
+        }
+    }
+
+/**
+ * SPSC mode peek. Must only ever be called from the one consumer
+ * thread.
+ *
+ * @param block: wait for data if the FIFO is empty.
+ * @param time_out: if blocking, the relative time-out in nanoseconds,
+ * 0 meaning wait forever.
+ *
+ * @return the head slot, or 0 if there was no data.
+ *
+ */
+
+    template<class T>
+    T *matrix::tsemfifo<T>::_spsc_peek(bool block, Time::Time_t time_out)
+    {
+        uint64_t head = _spsc_head.load(std::memory_order_relaxed);
+
+        if (_spsc_tail.load(std::memory_order_acquire) == head
+            && !_spsc_park(_consumer_parked, true, 1, block, time_out))
+        {
+            return 0;
+        }
+
+        if (block && _spsc_released.load(std::memory_order_relaxed))
+        {
+            return 0;
+        }
+
+        return &_buffer[head % _buf_len];
+    }
+
+    template<class T>
+    void matrix::tsemfifo<T>::_spsc_release_slot()
+    {
+        fifo_slot_released(_buffer[_spsc_head.load(std::memory_order_relaxed) % _buf_len]);
+        _record(_spsc_head.load(std::memory_order_relaxed) % _buf_len,
+                _latency ? Time::getUTC() : 0);
+        _spsc_head.store(_spsc_head.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_release);
+        _spsc_wake(_producer_parked);
+    }
+
+/**
+ * SPSC implementation of the get_n() family. See _get_n().
+ *
+ */
+
+    template<class T>
+    size_t matrix::tsemfifo<T>::_spsc_get_n(T *out, size_t min, size_t max, bool block,
+                                            Time::Time_t time_out)
+    {
+        uint64_t head = _spsc_head.load(std::memory_order_relaxed);
+
+        if (_spsc_tail.load(std::memory_order_acquire) - head < min
+            && !_spsc_park(_consumer_parked, true, min, block, time_out))
+        {
+            return 0;
+        }
+
+        if (block && _spsc_released.load(std::memory_order_relaxed))
+        {
+            return 0;
+        }
+
+        uint64_t n = _spsc_tail.load(std::memory_order_acquire) - head;
+
+        n = n < max ? n : max;
+        Time::Time_t now = _latency ? Time::getUTC() : 0;
+
+        for (uint64_t i = 0; i < n; ++i)
+        {
+            out[i] = _buffer[(head + i) % _buf_len];
+            fifo_slot_released(_buffer[(head + i) % _buf_len]);
+            _record((head + i) % _buf_len, now);
+        }
+
+        _spsc_head.store(head + n, std::memory_order_release);
+        _spsc_wake(_producer_parked);
+        return (size_t)n;
+    }
+
+/**
+ * SPSC mode flush. Since this moves the head of the queue, it must
+ * only be called from the consumer thread.
+ *
+ * @param items: see flush(int items).
+ *
+ * @return the number of items remaining in the queue.
+ *
+ */
+
+    template<class T>
+    unsigned int matrix::tsemfifo<T>::_spsc_flush(int items)
+    {
+        uint64_t head = _spsc_head.load(std::memory_order_relaxed);
+        uint64_t objects = _spsc_tail.load(std::memory_order_acquire) - head;
+        uint64_t nitems = static_cast<uint64_t>(abs(items));
+
+        if (items < 0)
+        {
+            nitems = nitems < objects ? objects - nitems : 0;
+        }
+
+        if (nitems > objects)
+        {
+            nitems = objects;
+        }
+
+        if (nitems)
+        {
+            for (uint64_t i = 0; i < nitems; ++i)
+            {
+                fifo_slot_released(_buffer[(head + i) % _buf_len]);
+            }
+
+            _spsc_head.store(head + nitems, std::memory_order_release);
+            _spsc_wake(_producer_parked);
+        }
+
+        return (unsigned int)(objects - nitems);
     }
 };
 
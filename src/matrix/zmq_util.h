@@ -30,6 +30,7 @@
 
 #include "zmq.hpp"
 
+#include <yaml-cpp/yaml.h>
 #include <string>
 #include <vector>
 
@@ -96,6 +97,9 @@ namespace mxutils
     // process urns for zmq services
     std::string process_zmq_urn(const std::string input);
 
+    // set socket options given as a YAML map
+    void zmq_set_options(zmq::socket_t &s, YAML::Node options, bool sender);
+
 }
 
 #endif // _MATRIX_ZMQ_UTIL_H_
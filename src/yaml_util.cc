@@ -205,19 +205,35 @@ namespace mxutils
 
         for (i = 0; i < keys.size(); ++i)
         {
-            if (!nodes.back()[keys[i]])
+            if (create)
             {
-                if (create)
+                if (!nodes.back()[keys[i]])
                 {
                     nodes.back()[keys[i]] = YAML::Node();
                 }
-                else
+
+                nodes.push_back(nodes.back()[keys[i]]);
+            }
+            else
+            {
+                // Look up through a const node: the non-const
+                // operator[] adds an empty node for a missing key
+                // (and turns a sequence into a map), so a plain
+                // lookup would modify the tree. Kept read-only, a
+                // tree may be searched by several threads at once.
+                const YAML::Node &cur = nodes.back();
+                const string &k = keys[i];
+                bool index = cur.IsSequence() && !k.empty()
+                    && k.find_first_not_of("0123456789") == string::npos;
+                YAML::Node next = index ? cur[(size_t)stoul(k)] : cur[k];
+
+                if (!next)
                 {
                     return false;
                 }
-            }
 
-            nodes.push_back(nodes.back()[keys[i]]);
+                nodes.push_back(next);
+            }
         }
 
         return true;
@@ -382,7 +398,16 @@ namespace mxutils
             if (rval)
             {
                 int k = nodes.size() - 2;
-                nodes[k].remove(keys.back());
+
+                if (nodes[k].IsSequence())
+                {
+                    nodes[k].remove((size_t)stoul(keys.back()));
+                }
+                else
+                {
+                    nodes[k].remove(keys.back());
+                }
+
                 nodes.pop_back();
             }
 
@@ -28,6 +28,7 @@
 
 #include "matrix/zmq_util.h"
 #include "matrix/matrix_util.h"
+#include "matrix/Time.h"
 
 #include <algorithm>
 #include <functional>
@@ -565,4 +566,117 @@ std::string process_zmq_urn(const std::string input)
                                   "send timed out.");
         }
     }
+
+/**
+ * Sets a ZMQ socket's options from a YAML map of option names to
+ * values, as given in a transport's 'Options' entry:
+ *
+ *     Transports:
+ *       A:
+ *         Specified: [tcp]
+ *         Options:
+ *           sndhwm: 10000        # messages queued per subscriber
+ *           rcvhwm: 10000
+ *           sndbuf: 16777216     # kernel socket buffers, bytes
+ *           rcvbuf: 16777216
+ *           tcp_keepalive: 1
+ *           tcp_keepalive_idle: 60
+ *           tcp_keepalive_intvl: 10
+ *           tcp_keepalive_cnt: 5
+ *           affinity: 1          # bit mask of the context's I/O threads
+ *
+ * Both ends of a transport read the same map: a sending socket takes
+ * the 'snd' options, a receiving one the 'rcv' options, and both take
+ * the rest. Unknown or malformed options are reported and skipped.
+ * The options must be set before the socket is bound or connected.
+ *
+ * @param s: The ZeroMQ socket.
+ * @param options: The options map. It may be null.
+ * @param sender: true for a sending (PUB) socket, false for a
+ * receiving (SUB) one.
+ *
+ */
+
+    void zmq_set_options(zmq::socket_t &s, YAML::Node options, bool sender)
+    {
+        enum {SEND, RECEIVE, BOTH};
+
+        struct socket_option
+        {
+            const char *name;
+            int option;
+            int side;
+        };
+
+        static const socket_option known_options[] =
+        {
+            {"sndhwm",              ZMQ_SNDHWM,              SEND},
+            {"rcvhwm",              ZMQ_RCVHWM,              RECEIVE},
+            {"sndbuf",              ZMQ_SNDBUF,              SEND},
+            {"rcvbuf",              ZMQ_RCVBUF,              RECEIVE},
+            {"tcp_keepalive",       ZMQ_TCP_KEEPALIVE,       BOTH},
+            {"tcp_keepalive_idle",  ZMQ_TCP_KEEPALIVE_IDLE,  BOTH},
+            {"tcp_keepalive_intvl", ZMQ_TCP_KEEPALIVE_INTVL, BOTH},
+            {"tcp_keepalive_cnt",   ZMQ_TCP_KEEPALIVE_CNT,   BOTH},
+            {"affinity",            ZMQ_AFFINITY,            BOTH}
+        };
+
+        if (!options.IsMap())
+        {
+            return;
+        }
+
+        for (YAML::const_iterator i = options.begin(); i != options.end(); ++i)
+        {
+            string name = i->first.as<string>();
+            const socket_option *opt = 0;
+
+            for (auto &k : known_options)
+            {
+                if (name == k.name)
+                {
+                    opt = &k;
+                    break;
+                }
+            }
+
+            if (!opt)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- zmq_set_options(): unknown socket option '" << name << "'" << endl;
+                continue;
+            }
+
+            if (opt->side != BOTH && (opt->side == SEND) != sender)
+            {
+                continue;
+            }
+
+            try
+            {
+                if (opt->option == ZMQ_AFFINITY)
+                {
+                    uint64_t val = i->second.as<uint64_t>();
+                    s.setsockopt(opt->option, &val, sizeof val);
+                }
+                else
+                {
+                    int val = i->second.as<int>();
+                    s.setsockopt(opt->option, &val, sizeof val);
+                }
+            }
+            catch (YAML::Exception &e)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- zmq_set_options(): bad value for '" << name << "': "
+                     << e.what() << endl;
+            }
+            catch (zmq::error_t &e)
+            {
+                cerr << Time::isoDateTime(Time::getUTC())
+                     << " -- zmq_set_options(): cannot set '" << name << "': "
+                     << e.what() << endl;
+            }
+        }
+    }
 }
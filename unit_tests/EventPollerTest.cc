@@ -0,0 +1,262 @@
+/*******************************************************************
+ *  EventPollerTest.cc - Tests for the event_poller.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "EventPollerTest.h"
+#include "matrix/event_poller.h"
+#include "matrix/Thread.h"
+
+#include <poll.h>
+#include <dirent.h>
+
+using namespace std;
+using namespace matrix;
+
+/**
+ * A stand-in for a DataSink: its receive queue, without the
+ * transport, so that the tests can fill it directly.
+ *
+ */
+
+struct fifo_sink : public DataSinkBase
+{
+    fifo_sink(fifo_mode mode = MPMC)
+        : fifo(10, mode)
+    {
+    }
+
+    size_t items() {return fifo.size();}
+    void set_notifier(shared_ptr<fifo_notifier> n) {fifo.set_notifier(n);}
+    string current_source_urn() {return "";}
+    string current_source_key() {return "";}
+    void disconnect() {}
+    void connect(string, string, string) {}
+    bool connected() {return true;}
+
+    tsemfifo<int> fifo;
+};
+
+void EventPollerTest::test_level_triggered()
+{
+    fifo_sink a, b(SPSC);
+    event_poller p;
+    vector<DataSinkBase *> ready;
+    int v = 1;
+
+    a.fifo.put(v);                        // before it is in the poller
+    p.push_back(&a);
+    p.push_back(&b);
+    CPPUNIT_ASSERT(p.size() == 2);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &a);
+
+    // not read, so ready again
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &a);
+    a.fifo.get(v);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 0);
+
+    b.fifo.put(v);
+    b.fifo.put(v);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &b);
+
+    // the poller's fd is readable while a sink is signalled
+    struct pollfd pfd = {p.fd(), POLLIN, 0};
+    a.fifo.put(v);
+    CPPUNIT_ASSERT(poll(&pfd, 1, 100) == 1);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 2);
+
+    p.remove(&a);
+    CPPUNIT_ASSERT(p.fd(&a) == -1 && p.fd(&b) != -1);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &b);
+}
+
+void EventPollerTest::test_edge_triggered()
+{
+    fifo_sink a;
+    event_poller p(true);
+    vector<DataSinkBase *> ready;
+    int v = 1;
+
+    p.push_back(&a);
+    a.fifo.put(v);
+    a.fifo.put(v);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &a);
+
+    // not emptied: no new edge, so not ready again
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 0);
+    a.fifo.flush();
+    a.fifo.put(v);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 1 && ready[0] == &a);
+}
+
+void EventPollerTest::test_many_sinks()
+{
+    const int N = 200;
+    vector<shared_ptr<fifo_sink> > sinks;
+    event_poller p;
+    vector<DataSinkBase *> ready;
+    int v = 1;
+
+    for (int i = 0; i < N; ++i)
+    {
+        sinks.push_back(make_shared<fifo_sink>());
+        p.push_back(sinks.back().get());
+    }
+
+    sinks[17]->fifo.put(v);
+    sinks[150]->fifo.put(v);
+    CPPUNIT_ASSERT(p.wait(ready, 1000) == 2);
+    CPPUNIT_ASSERT((ready[0] == sinks[17].get() && ready[1] == sinks[150].get())
+                   || (ready[1] == sinks[17].get() && ready[0] == sinks[150].get()));
+
+    // more than one epoll_wait's worth
+    for (int i = 0; i < N; ++i)
+    {
+        sinks[i]->fifo.put(v);
+    }
+
+    size_t seen = 0;
+
+    for (int i = 0; i < 10 && seen < N; ++i)
+    {
+        seen = p.wait(ready, 1000);
+    }
+
+    CPPUNIT_ASSERT(seen == N);
+}
+
+/**
+ * Helper for test_spsc_edges(): fills a sink's queue from its own
+ * thread, in bursts, so that the queue keeps going from empty to not
+ * empty while the consumer drains it.
+ *
+ */
+
+struct edge_producer
+{
+    edge_producer(fifo_sink &s, int n)
+        : sink(s), count(n)
+    {
+    }
+
+    void run()
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            sink.fifo.put(i);
+
+            if (i % 7 == 0)
+            {
+                sched_yield();
+            }
+        }
+    }
+
+    fifo_sink &sink;
+    int count;
+};
+
+/**
+ * An edge-triggered poller on a SPSC queue is only signalled when the
+ * queue goes from empty to not empty, so it must never miss that
+ * edge while the consumer is emptying the queue: a missed one shows
+ * as a `wait()` timing out with data still to come.
+ *
+ */
+
+void EventPollerTest::test_spsc_edges()
+{
+    fifo_sink a(SPSC);
+    event_poller p(true);
+    vector<DataSinkBase *> ready;
+    edge_producer ep(a, 200000);
+    Thread<edge_producer> t(&ep, &edge_producer::run);
+    int v, received = 0;
+
+    p.push_back(&a);
+    t.start();
+
+    while (received < ep.count)
+    {
+        if (!p.wait(ready, 1000000))
+        {
+            break;
+        }
+
+        while (a.fifo.try_get(v))
+        {
+            ++received;
+        }
+    }
+
+    t.join();
+    CPPUNIT_ASSERT(received == ep.count);
+}
+
+static int open_fds()
+{
+    int n = 0;
+    DIR *d = opendir("/proc/self/fd");
+
+    while (d && readdir(d))
+    {
+        ++n;
+    }
+
+    if (d)
+    {
+        closedir(d);
+    }
+
+    return n;
+}
+
+/**
+ * Adding a SPSC sink to a poller and removing it again replaces its
+ * queue's notifier twice; the replaced notifiers, and their eventfds,
+ * must not pile up.
+ *
+ */
+
+void EventPollerTest::test_notifier_reclaim()
+{
+    fifo_sink a(SPSC);
+    event_poller p;
+    int v = 1;
+
+    a.fifo.put(v);
+    a.fifo.get(v);
+    int before = open_fds();
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        p.push_back(&a);
+        a.fifo.put(v);
+        a.fifo.get(v);
+        p.remove(&a);
+    }
+
+    CPPUNIT_ASSERT(open_fds() <= before + 1);
+}
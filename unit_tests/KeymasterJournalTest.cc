@@ -0,0 +1,235 @@
+/*******************************************************************
+ *  KeymasterJournalTest.cc - Tests the Keymaster's journal
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "KeymasterJournalTest.h"
+#include "matrix/KeymasterJournal.h"
+#include "matrix/KeymasterStore.h"
+#include "matrix/Keymaster.h"
+#include "matrix/zmq_util.h"
+#include "matrix/matrix_util.h"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+using namespace std;
+using namespace matrix;
+
+static string journal_path;
+
+static const char *sample =
+    "components:\n"
+    "  foocomponent:\n"
+    "    sources: {A: [inproc, IPC, TCP]}\n"
+    "    ID: 4660\n";
+
+// Makes changes as the KeymasterServer does: to the store, then to
+// the journal.
+static void put(KeymasterStore &ks, KeymasterJournal &j, string key, YAML::Node val)
+{
+    string r;
+    CPPUNIT_ASSERT(ks.put(key, val, true, r));
+    j.append({{key, val, true, false}}, ks);
+}
+
+static void del(KeymasterStore &ks, KeymasterJournal &j, string key)
+{
+    string r;
+    CPPUNIT_ASSERT(ks.del(key, r));
+    j.append({{key, YAML::Node(), false, true}}, ks);
+}
+
+static string root_text(const KeymasterStore &ks)
+{
+    string text;
+    ks.text("", text);
+    return text;
+}
+
+void KeymasterJournalTest::setUp()
+{
+    journal_path = "/tmp/km_journal_test_" + to_string(getpid());
+}
+
+void KeymasterJournalTest::tearDown()
+{
+    unlink((journal_path + ".journal").c_str());
+    unlink((journal_path + ".snapshot").c_str());
+}
+
+void KeymasterJournalTest::test_restore()
+{
+    string saved;
+    uint64_t version;
+
+    {
+        KeymasterStore ks(YAML::Load(sample));
+        KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+
+        // nothing to restore the first time
+        CPPUNIT_ASSERT(!j.restore(ks));
+        put(ks, j, "components.foocomponent.ID", YAML::Node(1));
+        put(ks, j, "components.new.mode", YAML::Load("{a: [1, 2], b: \"multi\nline\"}"));
+        del(ks, j, "components.foocomponent.sources");
+
+        vector<KeymasterStore::change> t =
+            {
+                {"components.new.active", YAML::Node(true), true, false},
+                {"components.new.mode.a", YAML::Node(), false, true}
+            };
+        vector<string> r;
+        CPPUNIT_ASSERT(ks.apply(t, r));
+        j.append(t, ks);
+        saved = root_text(ks);
+        version = ks.version();
+    }
+
+    // the configuration is superseded by what was journaled
+    KeymasterStore ks(YAML::Load("components: {}"));
+    KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+    CPPUNIT_ASSERT(j.restore(ks));
+    CPPUNIT_ASSERT(root_text(ks) == saved);
+    CPPUNIT_ASSERT(ks.version() == version);
+}
+
+void KeymasterJournalTest::test_snapshot()
+{
+    string saved;
+
+    {
+        KeymasterStore ks(YAML::Load(sample));
+        KeymasterJournal j(journal_path, KeymasterJournal::SYNC_ALWAYS, 100, 3);
+
+        j.restore(ks);
+
+        for (int i = 0; i < 10; ++i)
+        {
+            put(ks, j, "counter", YAML::Node(i));
+        }
+
+        saved = root_text(ks);
+    }
+
+    // a snapshot was made after the 9th change: one change left in
+    // the journal.
+    ifstream in((journal_path + ".journal").c_str());
+    string line;
+    int transactions = 0;
+
+    while (getline(in, line))
+    {
+        transactions += line.compare(0, 2, "T ") == 0;
+    }
+
+    CPPUNIT_ASSERT(transactions == 1);
+
+    KeymasterStore ks;
+    KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+    CPPUNIT_ASSERT(j.restore(ks));
+    CPPUNIT_ASSERT(root_text(ks) == saved);
+}
+
+void KeymasterJournalTest::test_torn_tail()
+{
+    string saved;
+
+    {
+        KeymasterStore ks(YAML::Load(sample));
+        KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+
+        j.restore(ks);
+        put(ks, j, "components.foocomponent.ID", YAML::Node(1));
+        saved = root_text(ks);
+    }
+
+    // a crash in the middle of writing a transaction
+    {
+        ofstream out((journal_path + ".journal").c_str(), ios::app);
+        out << "T 99 2\nP 1 5 1\nab";
+    }
+
+    {
+        KeymasterStore ks;
+        KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+        CPPUNIT_ASSERT(j.restore(ks));
+        CPPUNIT_ASSERT(root_text(ks) == saved);
+        put(ks, j, "components.foocomponent.ID", YAML::Node(2));
+        saved = root_text(ks);
+    }
+
+    // the torn transaction was dropped, and later ones are intact
+    KeymasterStore ks;
+    KeymasterJournal j(journal_path, KeymasterJournal::SYNC_NEVER);
+    CPPUNIT_ASSERT(j.restore(ks));
+    CPPUNIT_ASSERT(root_text(ks) == saved);
+}
+
+/**
+ * A KeymasterServer restarted with a journal gets its keys back, but
+ * its 'Keymaster' section from the new configuration, which is what
+ * it runs by.
+ *
+ */
+
+void KeymasterJournalTest::test_server_restore()
+{
+    YAML::Node config = YAML::Load(sample);
+    string url = "inproc://km_journal_test." + mxutils::gen_random_string(10);
+
+    config["Keymaster"]["URLS"]["Initial"] = vector<string>({url});
+    config["Keymaster"]["delta_publishing"] = false;
+    config["Keymaster"]["journal"]["path"] = journal_path;
+    config["Keymaster"]["journal"]["sync"] = "always";
+
+    {
+        KeymasterServer kms(config);
+        kms.run();
+        Keymaster km(url);
+        CPPUNIT_ASSERT(km.put("components.foocomponent.ID", 1, true));
+        // long enough for some heartbeats, which are not journaled.
+        mxutils::do_nanosleep(2, 500000000);
+    }
+
+    ifstream in((journal_path + ".journal").c_str());
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+    CPPUNIT_ASSERT(text.find("components.foocomponent.ID") != string::npos);
+    CPPUNIT_ASSERT(text.find("Keymaster.heartbeat") == string::npos);
+
+    // a fresh URL: the last one may not be released yet.
+    url = "inproc://km_journal_test." + mxutils::gen_random_string(10);
+    config["Keymaster"]["URLS"]["Initial"] = vector<string>({url});
+    config["Keymaster"]["delta_publishing"] = true;
+    KeymasterServer kms(config);
+    kms.run();
+    Keymaster km(url);
+
+    CPPUNIT_ASSERT(km.get_as<int>("components.foocomponent.ID") == 1);
+    CPPUNIT_ASSERT(km.get_as<bool>("Keymaster.delta_publishing"));
+}
@@ -0,0 +1,223 @@
+/*******************************************************************
+ *  KeymasterStoreTest.cc - Tests the Keymaster's data store
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "KeymasterStoreTest.h"
+#include "matrix/KeymasterStore.h"
+#include "matrix/yaml_util.h"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace mxutils;
+using namespace matrix;
+
+static const char *sample =
+    "components:\n"
+    "  foocomponent:\n"
+    "    sources: {A: [inproc, IPC, TCP]}\n"
+    "    ID: 4660\n"
+    "  \"bar,baz\": \"x: y\"\n"
+    "nothing: ~\n";
+
+// Store results are the text of a yaml_result, as sent to a client.
+static yaml_result as_result(const string &text)
+{
+    return yaml_result(YAML::Load(text));
+}
+
+void KeymasterStoreTest::test_get()
+{
+    KeymasterStore ks(YAML::Load(sample));
+    string text;
+    yaml_result r;
+
+    CPPUNIT_ASSERT(ks.get("components.foocomponent.ID", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.result);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent.ID");
+    CPPUNIT_ASSERT(r.node.as<int>() == 0x1234);
+
+    CPPUNIT_ASSERT(ks.get("components.foocomponent.sources.A.1", text));
+    CPPUNIT_ASSERT(as_result(text).node.as<string>() == "IPC");
+
+    // keys and values that need quoting survive the trip
+    CPPUNIT_ASSERT(ks.get("components.bar,baz", text));
+    CPPUNIT_ASSERT(as_result(text).node.as<string>() == "x: y");
+
+    CPPUNIT_ASSERT(ks.get("nothing", text));
+    CPPUNIT_ASSERT(as_result(text).node.IsNull());
+
+    // failures give the last good key and node, like get_yaml_node()
+    CPPUNIT_ASSERT(!ks.get("components.faocomponent.ID", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(!r.result);
+    CPPUNIT_ASSERT(r.key == "components");
+    CPPUNIT_ASSERT(r.err == "No such key: faocomponent");
+    CPPUNIT_ASSERT(r.node["foocomponent"]["ID"].as<int>() == 0x1234);
+
+    CPPUNIT_ASSERT(!ks.get("components.foocomponent.ID.foo.bar", text));
+    CPPUNIT_ASSERT(as_result(text).key == "components.foocomponent.ID");
+
+    CPPUNIT_ASSERT(ks.get("", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key.empty());
+    CPPUNIT_ASSERT(r.node["components"]["foocomponent"]["ID"].as<int>() == 0x1234);
+}
+
+void KeymasterStoreTest::test_put()
+{
+    KeymasterStore ks(YAML::Load(sample));
+    string text;
+    yaml_result r;
+
+    CPPUNIT_ASSERT(ks.put("components.foocomponent.ID", YAML::Node(1111), false, text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent.ID");
+    CPPUNIT_ASSERT(r.node.as<int>() == 1111);
+
+    // the parents' text must reflect the change
+    CPPUNIT_ASSERT(ks.get("components", text));
+    CPPUNIT_ASSERT(as_result(text).node["foocomponent"]["ID"].as<int>() == 1111);
+
+    // no 'create'
+    CPPUNIT_ASSERT(!ks.put("components.foocomponent.PI", YAML::Node(3.14159), false, text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent");
+    CPPUNIT_ASSERT(!r.err.empty());
+
+    vector<int> xs = {1, 2, 3, 4, 5};
+    CPPUNIT_ASSERT(ks.put("components.bar.quux", YAML::Node(xs), true, text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components.bar.quux");
+    CPPUNIT_ASSERT(xs == r.node.as<vector<int> >());
+
+    CPPUNIT_ASSERT(ks.get("", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(xs == r.node["components"]["bar"]["quux"].as<vector<int> >());
+    CPPUNIT_ASSERT(r.node["components"]["foocomponent"]["ID"].as<int>() == 1111);
+
+    // a null node may be given keys
+    CPPUNIT_ASSERT(ks.put("nothing.here", YAML::Node("now"), true, text));
+    CPPUNIT_ASSERT(ks.get("nothing", text));
+    CPPUNIT_ASSERT(as_result(text).node["here"].as<string>() == "now");
+
+    // sequence elements may be replaced, but not added to by key
+    CPPUNIT_ASSERT(ks.put("components.bar.quux.0", YAML::Node(10), false, text));
+    CPPUNIT_ASSERT(ks.get("components.bar.quux", text));
+    CPPUNIT_ASSERT(as_result(text).node[0].as<int>() == 10);
+    CPPUNIT_ASSERT(!ks.put("components.bar.quux.foo", YAML::Node(10), true, text));
+
+    // a whole new tree
+    CPPUNIT_ASSERT(ks.put("", YAML::Load("{a: 1}"), false, text));
+    CPPUNIT_ASSERT(!ks.get("components", text));
+    CPPUNIT_ASSERT(ks.get("a", text));
+}
+
+void KeymasterStoreTest::test_del()
+{
+    KeymasterStore ks(YAML::Load(sample));
+    string text;
+    yaml_result r;
+
+    CPPUNIT_ASSERT(ks.del("components.foocomponent.sources.A.0", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components.foocomponent.sources.A");
+    CPPUNIT_ASSERT(r.node.size() == 2);
+    CPPUNIT_ASSERT(r.node[0].as<string>() == "IPC");
+
+    CPPUNIT_ASSERT(ks.del("components.foocomponent", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components");
+    CPPUNIT_ASSERT(!r.node["foocomponent"]);
+    CPPUNIT_ASSERT(r.node["bar,baz"]);
+
+    CPPUNIT_ASSERT(!ks.del("components.foocomponent", text));
+    r = as_result(text);
+    CPPUNIT_ASSERT(r.key == "components");
+    CPPUNIT_ASSERT(r.err == "No such key: foocomponent");
+}
+
+void KeymasterStoreTest::test_text()
+{
+    KeymasterStore ks(YAML::Load(sample));
+    string before, after;
+
+    CPPUNIT_ASSERT(ks.text("", before));
+    CPPUNIT_ASSERT(ks.text("components.foocomponent.sources.A", before));
+    CPPUNIT_ASSERT(YAML::Load(before).size() == 3);
+    CPPUNIT_ASSERT(!ks.text("components.none", before));
+
+    // unchanged subtrees keep their text, changed ones are remade
+    CPPUNIT_ASSERT(ks.text("components.foocomponent.sources", before));
+    CPPUNIT_ASSERT(ks.put("components.foocomponent.ID", YAML::Node(1), false, after));
+    CPPUNIT_ASSERT(ks.text("components.foocomponent.sources", after));
+    CPPUNIT_ASSERT(before == after);
+    CPPUNIT_ASSERT(ks.text("components.foocomponent", after));
+    CPPUNIT_ASSERT(YAML::Load(after)["ID"].as<int>() == 1);
+}
+
+void KeymasterStoreTest::test_apply()
+{
+    KeymasterStore ks(YAML::Load(sample));
+    vector<string> results;
+    string text;
+    uint64_t v = ks.version();
+
+    // all or nothing: the failed DEL undoes the PUT before it
+    vector<KeymasterStore::change> bad = {
+        {"components.foocomponent.ID", YAML::Node(1), false, false},
+        {"components.none", YAML::Node(), false, true}
+    };
+
+    CPPUNIT_ASSERT(!ks.apply(bad, results));
+    CPPUNIT_ASSERT(results.size() == 2);
+    CPPUNIT_ASSERT(!as_result(results[0]).result);
+    CPPUNIT_ASSERT(as_result(results[1]).err == "No such key: none");
+    CPPUNIT_ASSERT(ks.version() == v);
+    CPPUNIT_ASSERT(ks.text("components.foocomponent", text));
+    CPPUNIT_ASSERT(YAML::Load(text)["ID"].as<int>() == 0x1234);
+
+    // each change sees the ones before it; one new version for all
+    vector<KeymasterStore::change> good = {
+        {"components.foocomponent.ID", YAML::Node(1), false, false},
+        {"components.new.mode", YAML::Node("default"), true, false},
+        {"components.new.active", YAML::Node(true), true, false},
+        {"components.foocomponent.sources", YAML::Node(), false, true}
+    };
+
+    CPPUNIT_ASSERT(ks.apply(good, results));
+    CPPUNIT_ASSERT(results.size() == 4);
+    CPPUNIT_ASSERT(as_result(results[3]).key == "components.foocomponent");
+    CPPUNIT_ASSERT(ks.version() == v + 1);
+    CPPUNIT_ASSERT(ks.text("components", text));
+    YAML::Node n = YAML::Load(text);
+    CPPUNIT_ASSERT(n["foocomponent"]["ID"].as<int>() == 1);
+    CPPUNIT_ASSERT(!n["foocomponent"]["sources"]);
+    CPPUNIT_ASSERT(n["new"]["mode"].as<string>() == "default");
+    CPPUNIT_ASSERT(n["new"]["active"].as<bool>());
+}
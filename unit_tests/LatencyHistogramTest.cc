@@ -0,0 +1,90 @@
+/*******************************************************************
+ *  LatencyHistogramTest.cc - Tests the latency histogram
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+#include "LatencyHistogramTest.h"
+#include "matrix/LatencyHistogram.h"
+
+#include <cstdlib>
+
+using namespace std;
+using namespace matrix;
+
+void LatencyHistogramTest::test_buckets()
+{
+    // small values are exact
+    for (uint64_t v = 0; v < 32; ++v)
+    {
+        CPPUNIT_ASSERT(LatencyHistogram::bucket_value(LatencyHistogram::bucket(v)) == v);
+    }
+
+    // every value is within 1/16th of its bucket's lowest
+    for (uint64_t v = 32; v < (1ULL << 40); v = v * 3 + 7)
+    {
+        int b = LatencyHistogram::bucket(v);
+        uint64_t lo = LatencyHistogram::bucket_value(b);
+        CPPUNIT_ASSERT(lo <= v);
+        CPPUNIT_ASSERT(v < LatencyHistogram::bucket_value(b + 1));
+        CPPUNIT_ASSERT(v - lo <= lo / 16);
+    }
+
+    // too large to tell apart
+    CPPUNIT_ASSERT(LatencyHistogram::bucket(~0ULL) == LatencyHistogram::BUCKETS - 1);
+}
+
+void LatencyHistogramTest::test_percentiles()
+{
+    LatencyHistogram h;
+
+    CPPUNIT_ASSERT(h.percentile(50.0) == 0);
+
+    // 1 us to 1000 us
+    for (uint64_t i = 1; i <= 1000; ++i)
+    {
+        h.record(i * 1000);
+    }
+
+    CPPUNIT_ASSERT(h.count() == 1000);
+    CPPUNIT_ASSERT(h.max() == 1000000);
+    CPPUNIT_ASSERT(abs(h.mean() - 500500.0) < 1.0);
+    CPPUNIT_ASSERT(labs((long)h.percentile(50.0) - 500000) < 500000 / 16);
+    CPPUNIT_ASSERT(labs((long)h.percentile(99.0) - 990000) < 990000 / 16);
+    CPPUNIT_ASSERT(h.percentile(100.0) == 1000000);
+
+    YAML::Node n = h.to_yaml();
+    CPPUNIT_ASSERT(n["count"].as<uint64_t>() == 1000);
+    CPPUNIT_ASSERT(n["p999"].as<uint64_t>() <= 1000000);
+
+    h.reset();
+    CPPUNIT_ASSERT(h.count() == 0);
+    CPPUNIT_ASSERT(h.max() == 0);
+
+    // a batch of the same duration
+    h.record(2000, 10);
+    CPPUNIT_ASSERT(h.count() == 10);
+    CPPUNIT_ASSERT(abs(h.mean() - 2000.0) < 1.0);
+    CPPUNIT_ASSERT(labs((long)h.percentile(50.0) - 2000) < 2000 / 16);
+}
@@ -27,6 +27,8 @@
 
 #include "TSemfifoTest.h"
 #include "matrix/tsemfifo.h"
+#include "matrix/Thread.h"
+#include "matrix/DataInterface.h"
 
 using namespace std;
 using namespace Time;
@@ -98,6 +100,12 @@ void TSemfifoTest::test_get()
     // machine differences, but it should take significantly less time
     // than the actual time-out.
     CPPUNIT_ASSERT(diff < to);
+
+    // a released fifo gives nothing, and does not wait.
+    fifo.release();
+    start = getUTC();
+    CPPUNIT_ASSERT(fifo.timed_get(out, to) == false);
+    CPPUNIT_ASSERT(getUTC() - start < to);
 }
 
 void TSemfifoTest::test_flush()
@@ -119,7 +127,7 @@ void TSemfifoTest::test_flush()
     CPPUNIT_ASSERT(fifo.size() == 2);    
 
     // this forces a roll-around, and since 'put_no_block()' was used
-    // (which calls 'flush(1)', oldest value will be flushed every
+    // (which drops the oldest entry), oldest value will be flushed every
     // time the buffer is full. It is full at 15, and already had
     // 2. So the next value that 'get()' fetches should be 1.
     for (int i = 0; i < 16; ++i)
@@ -156,3 +164,378 @@ void TSemfifoTest::test_flush()
     fifo.flush(100);
     CPPUNIT_ASSERT(fifo.size() == 0);
 }
+
+/**
+ * Helper for test_spsc(): puts 'count' consecutive integers into a
+ * SPSC fifo from its own thread.
+ *
+ */
+
+struct spsc_producer
+{
+    spsc_producer(tsemfifo<int> &f, int n)
+        : fifo(f), count(n)
+    {
+    }
+
+    void run()
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            fifo.put(i);
+        }
+    }
+
+    tsemfifo<int> &fifo;
+    int count;
+};
+
+/**
+ * Tests the lock-free single producer/single consumer mode. The
+ * producer runs in its own thread and is forced to park repeatedly
+ * on a small queue; every item must arrive, in order. Also checks the
+ * non-blocking and time-out behavior, and that `put_no_block()` drops
+ * the newest item in this mode.
+ *
+ */
+
+void TSemfifoTest::test_spsc()
+{
+    tsemfifo<int> fifo(4, SPSC);
+    spsc_producer p(fifo, 10000);
+    Thread<spsc_producer> t(&p, &spsc_producer::run);
+    int k;
+    bool in_order = true;
+
+    CPPUNIT_ASSERT(fifo.mode() == SPSC);
+    t.start();
+
+    for (int i = 0; i < p.count; ++i)
+    {
+        fifo.get(k);
+        in_order = in_order && (k == i);
+    }
+
+    t.join();
+    CPPUNIT_ASSERT(in_order);
+    CPPUNIT_ASSERT(fifo.size() == 0);
+    CPPUNIT_ASSERT(fifo.try_get(k) == false);
+
+    Time_t to = 5000000;
+    Time_t start = getUTC();
+    CPPUNIT_ASSERT(fifo.timed_get(k, to) == false);
+    CPPUNIT_ASSERT(getUTC() - start > to);
+
+    for (int i = 0; i < 6; ++i)
+    {
+        fifo.put_no_block(i);
+    }
+
+    CPPUNIT_ASSERT(fifo.size() == 4);
+    CPPUNIT_ASSERT(fifo.flush(-1) == 1);
+    fifo.get(k);
+    CPPUNIT_ASSERT(k == 3);
+}
+
+/**
+ * Tests the in-place slot API, `reserve()`/`commit()` and
+ * `peek()`/`release_slot()`, in both modes. Slots must not be visible
+ * before they are committed, must stay at the head until released,
+ * and must be reused (here, a string slot keeps its capacity).
+ *
+ */
+
+void TSemfifoTest::test_reserve_peek()
+{
+    fifo_mode modes[] = {MPMC, SPSC};
+
+    for (auto m : modes)
+    {
+        tsemfifo<string> fifo(2, m);
+        string *slot, *item;
+        unsigned int dropped;
+
+        slot = fifo.reserve();
+        CPPUNIT_ASSERT(slot != 0);
+        slot->assign(1000, 'a');
+        CPPUNIT_ASSERT(fifo.try_peek() == 0); // not yet committed
+        fifo.commit();
+        CPPUNIT_ASSERT(fifo.size() == 1);
+
+        item = fifo.peek();
+        CPPUNIT_ASSERT(item != 0);
+        CPPUNIT_ASSERT(item->size() == 1000);
+        CPPUNIT_ASSERT(fifo.size() == 1);     // still there until released
+        fifo.release_slot();
+        CPPUNIT_ASSERT(fifo.size() == 0);
+        CPPUNIT_ASSERT(fifo.timed_peek(1000000) == 0);
+
+        // a rolled back reservation is never seen
+        slot = fifo.try_reserve();
+        CPPUNIT_ASSERT(slot != 0);
+        fifo.rollback();
+        CPPUNIT_ASSERT(fifo.size() == 0);
+
+        // fill it up; the next reservation either drops the oldest
+        // (MPMC) or is refused (SPSC).
+        for (int i = 0; i < 2; ++i)
+        {
+            slot = fifo.try_reserve();
+            CPPUNIT_ASSERT(slot != 0);
+            *slot = to_string(i);
+            fifo.commit();
+        }
+
+        CPPUNIT_ASSERT(fifo.try_reserve() == 0);
+        CPPUNIT_ASSERT(fifo.timed_reserve(1000000) == 0);
+        slot = fifo.reserve_no_block(dropped);
+        CPPUNIT_ASSERT(dropped == 1);
+
+        if (m == MPMC)
+        {
+            CPPUNIT_ASSERT(slot != 0);
+            *slot = "2";
+            fifo.commit();
+            item = fifo.peek();
+            CPPUNIT_ASSERT(*item == "1");
+        }
+        else
+        {
+            CPPUNIT_ASSERT(slot == 0);
+            item = fifo.peek();
+            CPPUNIT_ASSERT(*item == "0");
+        }
+
+        fifo.release_slot();
+        CPPUNIT_ASSERT(fifo.size() == 1);
+    }
+}
+
+/**
+ * Tests the batched gets, `get_n()`, `try_get_n()` and
+ * `wait_get_n()`, in both modes, including a producer thread feeding
+ * a consumer that waits for more items than are present.
+ *
+ */
+
+void TSemfifoTest::test_get_n()
+{
+    fifo_mode modes[] = {MPMC, SPSC};
+
+    for (auto m : modes)
+    {
+        tsemfifo<int> fifo(20, m);
+        int out[20];
+
+        CPPUNIT_ASSERT(fifo.try_get_n(out, 20) == 0);
+        CPPUNIT_ASSERT(fifo.get_n(out, 20, 1000000) == 0);
+
+        for (int i = 0; i < 5; ++i)
+        {
+            fifo.put(i);
+        }
+
+        CPPUNIT_ASSERT(fifo.get_n(out, 3) == 3);
+        CPPUNIT_ASSERT(out[0] == 0 && out[2] == 2);
+        CPPUNIT_ASSERT(fifo.size() == 2);
+        // the deepest it has been
+        CPPUNIT_ASSERT(fifo.max_size() == 5);
+        // fewer than asked for are there; not enough to wait for
+        CPPUNIT_ASSERT(fifo.wait_get_n(out, 3, 1000000) == false);
+        CPPUNIT_ASSERT(fifo.size() == 2);
+        CPPUNIT_ASSERT(fifo.get_n(out, 20) == 2);
+        CPPUNIT_ASSERT(out[0] == 3 && out[1] == 4);
+        CPPUNIT_ASSERT(fifo.size() == 0);
+        CPPUNIT_ASSERT_THROW(fifo.wait_get_n(out, 21), tsemfifo<int>::Exception);
+
+        spsc_producer p(fifo, 1000);
+        Thread<spsc_producer> t(&p, &spsc_producer::run);
+        bool in_order = true;
+
+        t.start();
+
+        for (int i = 0; i < p.count; i += 20)
+        {
+            CPPUNIT_ASSERT(fifo.wait_get_n(out, 20));
+
+            for (int j = 0; j < 20; ++j)
+            {
+                in_order = in_order && (out[j] == i + j);
+            }
+        }
+
+        t.join();
+        CPPUNIT_ASSERT(in_order);
+        CPPUNIT_ASSERT(fifo.size() == 0);
+    }
+}
+
+/**
+ * Tests the histogram of time spent in the FIFO: every item taken
+ * out, by whichever get, counts once; items flushed do not.
+ *
+ */
+
+void TSemfifoTest::test_latency()
+{
+    fifo_mode modes[] = {MPMC, SPSC};
+
+    for (auto m : modes)
+    {
+        LatencyHistogram h;
+        tsemfifo<int> fifo(20, m);
+        int out[20], v;
+
+        fifo.set_latency_histogram(&h);
+
+        for (int i = 0; i < 10; ++i)
+        {
+            fifo.put(i);
+        }
+
+        thread_delay(2000000);
+        CPPUNIT_ASSERT(fifo.get(v));
+        CPPUNIT_ASSERT(fifo.try_get(v));
+        CPPUNIT_ASSERT(fifo.get_n(out, 3) == 3);
+        CPPUNIT_ASSERT(fifo.peek() != 0);
+        fifo.release_slot();
+        CPPUNIT_ASSERT(fifo.flush(2) == 2);
+        CPPUNIT_ASSERT(h.count() == 6);
+        // everything waited at least the 2 ms delay
+        CPPUNIT_ASSERT(h.percentile(0) >= 1900000);
+
+        fifo.set_latency_histogram(0);
+        CPPUNIT_ASSERT(fifo.get_n(out, 2) == 2);
+        CPPUNIT_ASSERT(h.count() == 6);
+    }
+}
+
+/**
+ * Tests that an item's slot lets go of it when it is taken out (see
+ * `fifo_slot_released()`), so a SharedBuffer's data is freed as soon
+ * as the consumer is done with it, not when the slot is reused.
+ *
+ */
+
+void TSemfifoTest::test_slot_release()
+{
+    fifo_mode modes[] = {MPMC, SPSC};
+
+    for (auto m : modes)
+    {
+        tsemfifo<SharedBuffer> fifo(5, m);
+        shared_ptr<int> data(new int(42));
+        SharedBuffer in(data, sizeof(int)), out[2];
+
+        CPPUNIT_ASSERT(fifo.put(in));
+        in.reset();
+        CPPUNIT_ASSERT(data.use_count() == 2);
+        CPPUNIT_ASSERT(fifo.get(out[0]));
+        CPPUNIT_ASSERT(*(const int *)out[0].data() == 42);
+        CPPUNIT_ASSERT(data.use_count() == 2);
+        out[0].reset();
+        CPPUNIT_ASSERT(data.use_count() == 1);
+
+        in = SharedBuffer(data, sizeof(int));
+        fifo.put(in);
+        fifo.put(in);
+        in.reset();
+        CPPUNIT_ASSERT(fifo.get_n(out, 2) == 2);
+        CPPUNIT_ASSERT(data.use_count() == 3);
+
+        in = SharedBuffer(data, sizeof(int));
+        fifo.put(in);
+        in.reset();
+        CPPUNIT_ASSERT(fifo.peek() != 0);
+        fifo.release_slot();
+        CPPUNIT_ASSERT(data.use_count() == 3);
+
+        // flushed items are let go of too
+        in = SharedBuffer(data, sizeof(int));
+        fifo.put(in);
+        fifo.put(in);
+        fifo.put(in);
+        in.reset();
+        CPPUNIT_ASSERT(data.use_count() == 6);
+        CPPUNIT_ASSERT(fifo.flush(2) == 1);
+        CPPUNIT_ASSERT(data.use_count() == 4);
+        fifo.flush();
+        CPPUNIT_ASSERT(data.use_count() == 3);
+    }
+}
+
+/**
+ * Helper for test_no_block_peeked(): holds a peeked slot from its own
+ * thread for a while.
+ *
+ */
+
+struct slot_peeker
+{
+    slot_peeker(tsemfifo<int> &f)
+        : fifo(f), peeked(false)
+    {
+    }
+
+    void run()
+    {
+        fifo.peek();
+        peeked.signal(true);
+        thread_delay(50000000);
+        fifo.release_slot();
+    }
+
+    tsemfifo<int> &fifo;
+    TCondition<bool> peeked;
+};
+
+/**
+ * `put_no_block()` and `reserve_no_block()` must never wait on a
+ * consumer holding a peeked slot (here the same thread, which would
+ * deadlock), and must not drop that slot; `flush()` must wait for it
+ * to be released.
+ *
+ */
+
+void TSemfifoTest::test_no_block_peeked()
+{
+    tsemfifo<int> fifo(3);
+    unsigned int dropped;
+    int k;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        fifo.put(i);
+    }
+
+    // the oldest entry is being read in place, so it may not be
+    // dropped, and (without waiting on this thread) the new one is.
+    int *p = fifo.peek();
+    CPPUNIT_ASSERT(p != 0 && *p == 0);
+    k = 3;
+    CPPUNIT_ASSERT(fifo.put_no_block(k) == 1);
+    CPPUNIT_ASSERT(fifo.reserve_no_block(dropped) == 0);
+    CPPUNIT_ASSERT(dropped == 1);
+    CPPUNIT_ASSERT(*p == 0);
+    fifo.release_slot();
+    CPPUNIT_ASSERT(fifo.size() == 2);
+
+    // with the peek released the oldest is dropped as usual.
+    fifo.put(k);
+    k = 4;
+    CPPUNIT_ASSERT(fifo.put_no_block(k) == 1);
+    fifo.get(k);
+    CPPUNIT_ASSERT(k == 2);
+
+    // flush() waits out a peek held by another thread.
+    slot_peeker sp(fifo);
+    Thread<slot_peeker> t(&sp, &slot_peeker::run);
+
+    t.start();
+    sp.peeked.wait(true);
+    fifo.flush();
+    CPPUNIT_ASSERT(fifo.size() == 0);
+    t.join();
+    fifo.put(k);
+    CPPUNIT_ASSERT(fifo.size() == 1);
+}
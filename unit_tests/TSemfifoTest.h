@@ -36,12 +36,24 @@ class TSemfifoTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_size);
     CPPUNIT_TEST(test_get);
     CPPUNIT_TEST(test_flush);
+    CPPUNIT_TEST(test_spsc);
+    CPPUNIT_TEST(test_reserve_peek);
+    CPPUNIT_TEST(test_get_n);
+    CPPUNIT_TEST(test_latency);
+    CPPUNIT_TEST(test_slot_release);
+    CPPUNIT_TEST(test_no_block_peeked);
     CPPUNIT_TEST_SUITE_END();
     
     public:
     void test_size();
     void test_get();
     void test_flush();
+    void test_spsc();
+    void test_reserve_peek();
+    void test_get_n();
+    void test_latency();
+    void test_slot_release();
+    void test_no_block_peeked();
 
 };
 
@@ -28,6 +28,7 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <atomic>
 #include <yaml-cpp/yaml.h>
 #include <boost/shared_ptr.hpp>
 
@@ -37,18 +38,23 @@
 #include "TransportTest.h"
 #include "matrix/TCondition.h"
 #include "matrix/DataInterface.h"
+#include "matrix/zmq_util.h"
+#include "matrix/Thread.h"
+#include "matrix/Component.h"
 
 using namespace std;
 using namespace mxutils;
 using namespace matrix;
 
-static std::string km_urn("inproc://interface_tests.keymaster");
+// set anew for each test: an inproc endpoint is only released some
+// time after its socket is closed, so the next test's Keymaster may
+// not be able to bind to it.
+static std::string km_urn;
 
 static std::string yaml_configuration =
     "Keymaster:\n"\
     "  URLS:\n"\
-    "    Initial:\n"\
-    "      - inproc://interface_tests.keymaster\n"\
+    "    Initial: []\n"\
     "\n"\
     "components:\n"\
     "  moby_dick:\n"\
@@ -59,9 +65,42 @@ static std::string yaml_configuration =
     "      lines: A\n";
 
 
+/**
+ * A ZMQ subscription takes effect some time after `connect()` returns,
+ * and anything published before then is lost. This publishes 'val'
+ * until 'sink' receives it, then drains 'sink'.
+ *
+ * @return true if the sink received data within about a second.
+ *
+ */
+
+template <typename T, typename U, typename Sel>
+static bool sync_sink(DataSource<T> &source, DataSink<U, Sel> &sink, T val)
+{
+    U v;
+
+    for (int i = 0; i < 100; ++i)
+    {
+        source.publish(val);
+
+        if (sink.timed_get(v, 10000000))
+        {
+            while (sink.timed_get(v, 10000000))
+            {
+            }
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void TransportTest::setUp()
 {
     YAML::Node n = YAML::Load(yaml_configuration);
+    km_urn = "inproc://interface_tests.keymaster." + gen_random_string(10);
+    n["Keymaster"]["URLS"]["Initial"].push_back(km_urn);
     _kms.reset(new matrix::KeymasterServer(n));
     _kms->run();
     _km.reset(new matrix::Keymaster(km_urn));
@@ -115,7 +154,7 @@ void TransportTest::do_the_transaction(string transport)
     shared_ptr<DataSink<double, select_only> > dsink((new DataSink<double, select_only>(km_urn)));
 
     dsink->connect("moby_dick", "lines");
-    do_nanosleep(0, 1000000);
+    CPPUNIT_ASSERT(sync_sink(*dsource, *dsink, d_sent));
     dsource->publish(d_sent);
 
     // try_get() returns false if there is nothing, true if there is.
@@ -134,6 +173,21 @@ void TransportTest::do_the_transaction(string transport)
     CPPUNIT_ASSERT(i < 100);
     CPPUNIT_ASSERT_DOUBLES_EQUAL(d_sent, d_recv, 0.000001);
 
+    // a batch should arrive as the individual values, in order.
+    double batch_sent[5] = {1.0, 2.0, 3.0, 4.0, 5.0}, batch_recv[5];
+    size_t n = 0;
+
+    dsource->publish_n(batch_sent, 5);
+
+    for (i = 0; n < 5 && i < 10; ++i)
+    {
+        n += dsink->get_n(&batch_recv[n], 5 - n, 100000000);
+    }
+
+    CPPUNIT_ASSERT(n == 5);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(batch_sent[0], batch_recv[0], 0.000001);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(batch_sent[4], batch_recv[4], 0.000001);
+
     // this wipes out any '.AsConfigured' entries in the keymaster
     // for the transport used here.
     dsink->disconnect();
@@ -144,21 +198,10 @@ void TransportTest::do_the_transaction(string transport)
     shared_ptr<DataSink<string, select_only> > ssink((new DataSink<string, select_only>(km_urn)));
 
     ssink->connect("moby_dick", "lines");
-    do_nanosleep(0, 1000000);
+    CPPUNIT_ASSERT(sync_sink(*ssource, *ssink, s_sent));
     ssource->publish(s_sent);
-    i = 0;
-
-    while (!ssink->try_get(s_recv))
-    {
-        do_nanosleep(0, 100000);
-
-        if (i++ == 100)
-        {
-            break;
-        }
-    }
-
-    CPPUNIT_ASSERT_EQUAL(d_sent, d_recv);
+    CPPUNIT_ASSERT(ssink->timed_get(s_recv, 1000000000));
+    CPPUNIT_ASSERT_EQUAL(s_sent, s_recv);
 
     if (transport != "rtinproc")
     {
@@ -166,23 +209,11 @@ void TransportTest::do_the_transaction(string transport)
         // connected. We will reset ssource. ssink should reconnect.
         ssource.reset();
         ssource.reset(new DataSource<string>(km_urn, "moby_dick", "lines"));
-        Time::thread_delay(100000000);
+        s_recv.clear();
+        CPPUNIT_ASSERT(sync_sink(*ssource, *ssink, s_sent));
         ssource->publish(s_sent);
-
-        i = 0;
-        ssink->get(s_recv);
-        // while (!ssink->try_get(s_recv))
-        // {
-        //     do_nanosleep(0, 1000000);
-
-        //     if (i++ == 100)
-        //     {
-        //         break;
-        //     }
-        // }
-
-        CPPUNIT_ASSERT(i < 100);
-        CPPUNIT_ASSERT_EQUAL(d_sent, d_recv);
+        CPPUNIT_ASSERT(ssink->timed_get(s_recv, 1000000000));
+        CPPUNIT_ASSERT_EQUAL(s_sent, s_recv);
         ssink->disconnect();
     }
 }
@@ -206,3 +237,631 @@ void TransportTest::test_rtinproc_publish()
 {
     do_the_transaction("rtinproc");
 }
+
+void TransportTest::test_shm_publish()
+{
+    do_the_transaction("shm");
+}
+
+/**
+ * Helpers for test_shm_ring(): a payload of 5000 bytes, its sequence
+ * number in the first bytes and the low byte of that in the rest, so
+ * that a torn copy shows.
+ *
+ */
+
+static void shm_fill(GenericBuffer &buf, int seq)
+{
+    buf.resize(5000);
+    memset(buf.data(), seq & 0xff, buf.size());
+    memcpy(buf.data(), &seq, sizeof seq);
+}
+
+static int shm_check(GenericBuffer &buf)
+{
+    int seq = -1;
+
+    if (buf.size() == 5000)
+    {
+        memcpy(&seq, buf.data(), sizeof seq);
+
+        for (size_t i = sizeof seq; i < buf.size(); ++i)
+        {
+            if (buf.data()[i] != (unsigned char)(seq & 0xff))
+            {
+                return -1;
+            }
+        }
+    }
+
+    return seq;
+}
+
+/**
+ * Tests the shm ring, made as small as it can be, with a reader that
+ * falls behind: its sink's queue is full, and blocking. The writer
+ * goes round the ring several times meanwhile, leaving wrap records
+ * where a message doesn't fit before the end (5000 byte messages
+ * don't divide the ring evenly). Once the sink is emptied, the reader
+ * must resume at the oldest message still in the ring, deliver
+ * everything from there intact and in order, and miss nothing once
+ * caught up. A message larger than half the ring is refused.
+ *
+ */
+
+void TransportTest::test_shm_ring()
+{
+    vector<string> tr = {"shm"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.ShmSize", 65536, true);
+
+    DataSource<GenericBuffer> source(km_urn, "moby_dick", "lines");
+    DataSink<GenericBuffer, select_only> sink(km_urn, 2, sink_policy(sink_policy::BLOCK));
+    GenericBuffer buf, recv;
+    vector<int> received;
+    bool in_order = true;
+
+    sink.connect("moby_dick", "lines");
+    shm_fill(buf, 1000);
+    CPPUNIT_ASSERT(sync_sink(source, sink, buf));
+
+    for (int i = 0; i < 100; ++i)
+    {
+        shm_fill(buf, i);
+        CPPUNIT_ASSERT(source.publish(buf));
+    }
+
+    while (sink.timed_get(recv, 200000000))
+    {
+        int seq = shm_check(recv);
+
+        in_order = in_order && seq >= 0 && (received.empty() || seq > received.back());
+        received.push_back(seq);
+    }
+
+    // the ring holds about a dozen; the rest were overwritten.
+    CPPUNIT_ASSERT(in_order);
+    CPPUNIT_ASSERT(received.size() > 3 && received.size() < 100);
+    CPPUNIT_ASSERT(received.back() == 99);
+
+    for (int i = 100; i < 120; ++i)
+    {
+        shm_fill(buf, i);
+        CPPUNIT_ASSERT(source.publish(buf));
+        CPPUNIT_ASSERT(sink.timed_get(recv, 1000000000));
+        CPPUNIT_ASSERT(shm_check(recv) == i);
+    }
+
+    uint64_t drops = source.stats().drops();
+
+    buf.resize(40000);
+    CPPUNIT_ASSERT(!source.publish(buf));
+    CPPUNIT_ASSERT(source.stats().drops() == drops + 1);
+    // and the ring carries on
+    shm_fill(buf, 120);
+    CPPUNIT_ASSERT(source.publish(buf));
+    CPPUNIT_ASSERT(sink.timed_get(recv, 1000000000));
+    CPPUNIT_ASSERT(shm_check(recv) == 120);
+}
+
+/**
+ * Tests the DataSink overflow policies. 'rtinproc' delivers in the
+ * publishing thread, so the receive queue fills predictably.
+ *
+ */
+
+void TransportTest::test_sink_policy()
+{
+    vector<string> tr = {"rtinproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    DataSink<int, select_only> oldest(km_urn, 3, sink_policy(sink_policy::DROP_OLDEST));
+    DataSink<int, select_only> newest(km_urn, 3, sink_policy(sink_policy::DROP_NEWEST));
+    DataSink<int, select_only> timed(km_urn, 3, sink_policy(sink_policy::BLOCK, 1000000));
+    DataSink<int, select_only> decimated(km_urn, 3);
+    int v;
+
+    decimated.set_policy(YAML::Load("{overflow: drop_newest, decimate: 4}"));
+    CPPUNIT_ASSERT(decimated.policy().decimate == 4);
+    CPPUNIT_ASSERT_THROW(decimated.set_policy(YAML::Load("{overflow: sometimes}")),
+                         MatrixException);
+
+    // back to the policy it was constructed with
+    timed.set_policy(sink_policy(sink_policy::DROP_NEWEST));
+    timed.reset_policy();
+    CPPUNIT_ASSERT(timed.policy().overflow == sink_policy::BLOCK);
+    CPPUNIT_ASSERT(timed.policy().timeout == 1000000);
+
+    oldest.set_queue_latency(true);
+    oldest.connect("moby_dick", "lines");
+    newest.connect("moby_dick", "lines");
+    timed.connect("moby_dick", "lines");
+    decimated.connect("moby_dick", "lines");
+
+    for (int i = 0; i < 10; ++i)
+    {
+        source.publish(i);
+    }
+
+    // the last 3 are kept...
+    CPPUNIT_ASSERT(oldest.items() == 3 && oldest.try_get(v) && v == 7);
+    CPPUNIT_ASSERT(oldest.stats().drops() == 7);
+    CPPUNIT_ASSERT(oldest.stats().max_depth() == 3);
+    // only kept when asked for
+    CPPUNIT_ASSERT(oldest.stats().queue_latency.count() == 1);
+    CPPUNIT_ASSERT(newest.stats().queue_latency.count() == 0);
+    // ...or the first 3.
+    CPPUNIT_ASSERT(newest.items() == 3 && newest.try_get(v) && v == 0);
+    CPPUNIT_ASSERT(newest.stats().drops() == 7);
+    CPPUNIT_ASSERT(timed.items() == 3 && timed.try_get(v) && v == 0);
+    CPPUNIT_ASSERT(timed.stats().drops() == 7);
+    // 0, 4 and 8, none dropped.
+    CPPUNIT_ASSERT(decimated.items() == 3 && decimated.try_get(v) && v == 0);
+    CPPUNIT_ASSERT(decimated.try_get(v) && v == 4);
+    CPPUNIT_ASSERT(decimated.stats().drops() == 0);
+}
+
+/**
+ * A Component that connects its sinks when told to, for
+ * test_component_sink_policy().
+ *
+ */
+
+class SinkComponent : public Component
+{
+public:
+    SinkComponent(string myname, string k_url) : Component(myname, k_url)
+    {
+    }
+
+    template <typename T>
+    bool connect_in_mode(T &sink, string sinkname, string mode)
+    {
+        current_mode = mode;
+        return connect_sink(sink, sinkname);
+    }
+};
+
+/**
+ * Tests that `Component::connect_sink()` gives a sink the policy its
+ * connection lists, and puts a sink whose connection lists none back
+ * to the policy it was constructed with.
+ *
+ */
+
+void TransportTest::test_component_sink_policy()
+{
+    _km->put("connections",
+             YAML::Load("{default: [[moby_dick, lines, ahab, plain],"
+                        "           [moby_dick, lines, ahab, limited, {overflow: drop_newest}]],"
+                        " bad: [[moby_dick, lines, ahab, plain, {overflow: sometimes}]]}"),
+             true);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    SinkComponent ahab("ahab", km_urn);
+    DataSink<int, select_only> plain(km_urn, 3, sink_policy(sink_policy::BLOCK, 1000000));
+    DataSink<int, select_only> limited(km_urn, 3);
+
+    plain.set_policy(sink_policy(sink_policy::DROP_NEWEST));
+    CPPUNIT_ASSERT(ahab.connect_in_mode(plain, "plain", "default"));
+    CPPUNIT_ASSERT(plain.connected());
+    CPPUNIT_ASSERT(plain.policy().overflow == sink_policy::BLOCK);
+    CPPUNIT_ASSERT(plain.policy().timeout == 1000000);
+
+    CPPUNIT_ASSERT(ahab.connect_in_mode(limited, "limited", "default"));
+    CPPUNIT_ASSERT(limited.connected());
+    CPPUNIT_ASSERT(limited.policy().overflow == sink_policy::DROP_NEWEST);
+
+    // the bad policy left the connection out, so there is nothing to
+    // connect to in that mode.
+    plain.disconnect();
+    CPPUNIT_ASSERT(ahab.connect_in_mode(plain, "plain", "bad"));
+    CPPUNIT_ASSERT(!plain.connected());
+}
+
+/**
+ * Tests publishing a buffer held by a shared_ptr. ZMQ sends the
+ * buffer itself, so it holds a reference to it until the message has
+ * gone out, and must then let it go.
+ *
+ */
+
+void TransportTest::test_shared_publish()
+{
+    vector<string> tr = {"tcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    DataSource<GenericBuffer> source(km_urn, "moby_dick", "lines");
+    DataSink<GenericBuffer, select_only> sink(km_urn);
+    shared_ptr<GenericBuffer> sent(new GenericBuffer());
+    GenericBuffer recv;
+
+    sent->resize(1 << 20);
+
+    for (size_t i = 0; i < sent->size(); ++i)
+    {
+        sent->data()[i] = (unsigned char)i;
+    }
+
+    recv.resize(1);
+    sink.connect("moby_dick", "lines");
+    CPPUNIT_ASSERT(sync_sink(source, sink, recv));
+    uint64_t published = source.stats().messages();
+    CPPUNIT_ASSERT(source.publish(shared_ptr<const GenericBuffer>(sent)));
+    CPPUNIT_ASSERT(sink.timed_get(recv, 1000000000));
+    CPPUNIT_ASSERT(recv.size() == sent->size());
+    CPPUNIT_ASSERT(memcmp(recv.data(), sent->data(), recv.size()) == 0);
+    CPPUNIT_ASSERT(source.stats().messages() == published + 1);
+
+    // the message has been received, so ZMQ is done with the buffer.
+    for (int i = 0; sent.use_count() > 1 && i < 100; ++i)
+    {
+        do_nanosleep(0, 1000000);
+    }
+
+    CPPUNIT_ASSERT(sent.use_count() == 1);
+    sink.disconnect();
+}
+
+/**
+ * Tests receiving into a DataSink<SharedBuffer>, which the ZMQ
+ * transports fill with the received message itself, and the others
+ * with a copy.
+ *
+ */
+
+void TransportTest::test_shared_receive()
+{
+    vector<string> transports = {"tcp", "rtinproc"};
+
+    for (auto t : transports)
+    {
+        vector<string> tr = {t};
+        _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+        DataSource<string> source(km_urn, "moby_dick", "lines");
+        DataSink<SharedBuffer, select_only> sink(km_urn);
+        string sent(100000, 'x');
+        SharedBuffer recv;
+
+        sent += "Call me Ishmael.";
+        sink.connect("moby_dick", "lines");
+        CPPUNIT_ASSERT(sync_sink(source, sink, string("sync")));
+        source.publish(sent);
+        CPPUNIT_ASSERT(sink.timed_get(recv, 1000000000));
+        CPPUNIT_ASSERT(string((const char *)recv.data(), recv.size()) == sent);
+        // the queue no longer refers to it.
+        CPPUNIT_ASSERT(recv.shared().use_count() == 2);
+        sink.disconnect();
+    }
+}
+
+/**
+ * Tests several ZMQTransportClients sharing the subscriber reactor:
+ * each gets its own data, and one disconnecting leaves the others be.
+ *
+ */
+
+void TransportTest::test_reactor()
+{
+    vector<string> tr = {"inproc", "ipc", "tcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    vector<shared_ptr<DataSink<int, select_specified> > > sinks;
+    int v;
+
+    for (auto t : tr)
+    {
+        sinks.emplace_back(new DataSink<int, select_specified>(km_urn));
+        sinks.back()->connect("moby_dick", "lines", t);
+    }
+
+    for (auto s : sinks)
+    {
+        CPPUNIT_ASSERT(sync_sink(source, *s, 0));
+    }
+
+    // syncing the later sinks sent the earlier ones more.
+    for (auto s : sinks)
+    {
+        while (s->timed_get(v, 10000000))
+        {
+        }
+    }
+
+    v = 42;
+    source.publish(v);
+
+    for (auto s : sinks)
+    {
+        CPPUNIT_ASSERT(s->timed_get(v, 1000000000) && v == 42);
+    }
+
+    sinks[0]->disconnect();
+    v = 43;
+    source.publish(v);
+
+    for (size_t i = 1; i < sinks.size(); ++i)
+    {
+        CPPUNIT_ASSERT(sinks[i]->timed_get(v, 1000000000) && v == 43);
+        sinks[i]->disconnect();
+    }
+}
+
+/**
+ * Tests that a sink blocking on its full queue does not hold up the
+ * other clients of the reactor it was given: it is moved to one of
+ * its own when subscribed.
+ *
+ */
+
+void TransportTest::test_blocking_sink()
+{
+    vector<string> tr = {"inproc", "tcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    DataSink<int, select_specified> blocking(km_urn, 1, sink_policy(sink_policy::BLOCK));
+    DataSink<int, select_specified> other(km_urn);
+    int v;
+
+    blocking.connect("moby_dick", "lines", "inproc");
+    other.connect("moby_dick", "lines", "tcp");
+    CPPUNIT_ASSERT(sync_sink(source, blocking, 0));
+    CPPUNIT_ASSERT(sync_sink(source, other, 0));
+
+    while (blocking.timed_get(v, 10000000))
+    {
+    }
+
+    // 'blocking' takes one, then blocks its subscriber.
+    for (int i = 1; i <= 5; ++i)
+    {
+        source.publish(i);
+    }
+
+    for (int i = 1; i <= 5; ++i)
+    {
+        CPPUNIT_ASSERT(other.timed_get(v, 1000000000) && v == i);
+    }
+
+    // let it go, so that it can be disconnected.
+    while (blocking.timed_get(v, 100000000))
+    {
+    }
+
+    blocking.disconnect();
+    other.disconnect();
+}
+
+/**
+ * Tests a transport with socket options: both ends set them, and an
+ * unknown option is reported rather than stopping the transport.
+ *
+ */
+
+void TransportTest::test_socket_options()
+{
+    vector<string> tr = {"tcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Options",
+             YAML::Load("{sndhwm: 5000, rcvhwm: 5000, sndbuf: 1048576, rcvbuf: 1048576, "
+                        "tcp_keepalive: 1, affinity: 1, no_such_option: 3}"), true);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    DataSink<int, select_only> sink(km_urn);
+    int v = 42;
+
+    sink.connect("moby_dick", "lines");
+    CPPUNIT_ASSERT(sync_sink(source, sink, 0));
+    source.publish(v);
+    v = 0;
+    CPPUNIT_ASSERT(sink.timed_get(v, 1000000000) && v == 42);
+    sink.disconnect();
+    _km->del("components.moby_dick.Transports.A.Options");
+}
+
+/**
+ * Tests the detection of messages lost by ZMQ. The sink blocks the
+ * subscriber while its queue is full, and the buffers and high water
+ * marks are kept small, so the PUB socket soon drops messages. Every
+ * message published is then either received or counted as lost, once
+ * a later message shows the gap.
+ *
+ */
+
+void TransportTest::test_lost_messages()
+{
+    vector<string> tr = {"tcp"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+    _km->put("components.moby_dick.Transports.A.Options",
+             YAML::Load("{sndhwm: 10, rcvhwm: 10, sndbuf: 4096, rcvbuf: 4096}"), true);
+
+    DataSource<string> source(km_urn, "moby_dick", "lines");
+    DataSink<string, select_only> sink(km_urn, 10, sink_policy(sink_policy::BLOCK));
+    string line(1000, 'x');
+    size_t published = 5000, received = 0;
+
+    sink.connect("moby_dick", "lines");
+    // from here on the sink is in step with the sequence numbers.
+    CPPUNIT_ASSERT(sync_sink(source, sink, line));
+    CPPUNIT_ASSERT(sink.stats().losses() == 0);
+
+    for (size_t i = 0; i < published; ++i)
+    {
+        source.publish(line);
+    }
+
+    while (sink.timed_get(line, 100000000))
+    {
+        ++received;
+    }
+
+    // one more, to show any gap at the end.
+    source.publish(line);
+    ++published;
+    CPPUNIT_ASSERT(sink.timed_get(line, 1000000000));
+    ++received;
+
+    CPPUNIT_ASSERT(sink.stats().losses() > 0);
+    CPPUNIT_ASSERT(received + sink.stats().losses() == published);
+    CPPUNIT_ASSERT(sink.lost_items() == sink.stats().losses());
+    sink.disconnect();
+    _km->del("components.moby_dick.Transports.A.Options");
+}
+
+/**
+ * Helper for test_rt_unsubscribe(): publishes from its own thread
+ * until told to stop.
+ *
+ */
+
+struct rt_publisher
+{
+    rt_publisher(DataSource<int> &s)
+        : source(s), running(true)
+    {
+    }
+
+    void run()
+    {
+        for (int i = 0; running; ++i)
+        {
+            source.publish(i);
+        }
+    }
+
+    DataSource<int> &source;
+    std::atomic<bool> running;
+};
+
+/**
+ * 'rtinproc' calls its subscribers from the publishing thread without
+ * a lock. Once `disconnect()` returns a publish that was already in
+ * flight must have finished with the sink, and no later one may
+ * reach it: the sink's count must not move, and destroying the sink
+ * (as each pass does) must be safe while publishing goes on.
+ *
+ */
+
+void TransportTest::test_rt_unsubscribe()
+{
+    vector<string> tr = {"rtinproc"};
+    _km->put("components.moby_dick.Transports.A.Specified", tr);
+
+    DataSource<int> source(km_urn, "moby_dick", "lines");
+    rt_publisher p(source);
+    Thread<rt_publisher> t(&p, &rt_publisher::run);
+
+    t.start();
+
+    for (int i = 0; i < 200; ++i)
+    {
+        DataSink<int, select_only> sink(km_urn, 10, sink_policy(sink_policy::DROP_OLDEST));
+
+        sink.connect("moby_dick", "lines");
+
+        for (int j = 0; j < 1000 && !sink.stats().messages(); ++j)
+        {
+            do_nanosleep(0, 100000);
+        }
+
+        CPPUNIT_ASSERT(sink.stats().messages() > 0);
+        sink.disconnect();
+        uint64_t received = sink.stats().messages();
+        do_nanosleep(0, 100000);
+        CPPUNIT_ASSERT(sink.stats().messages() == received);
+    }
+
+    p.running = false;
+    t.join();
+}
+
+/**
+ * Helper for test_callback_table(): keeps the key it was called with,
+ * through either the std::string or the key_ref interface.
+ *
+ */
+
+struct key_recorder
+{
+    key_recorder()
+        : by_string(this, &key_recorder::string_cb),
+          by_ref(this, &key_recorder::ref_cb)
+    {
+    }
+
+    void string_cb(string key, void *, size_t)
+    {
+        skey = key;
+    }
+
+    void ref_cb(key_ref key, void *, size_t)
+    {
+        rkey = key;
+    }
+
+    DataMemberCB<key_recorder> by_string;
+    DataMemberCB<key_recorder> by_ref;
+    string skey;
+    key_ref rkey;
+};
+
+/**
+ * Tests the DataCallbackTable lookup of keys in place, as the ZMQ
+ * transports do on a received frame: only an exact match counts, not
+ * a prefix (ZMQ's own subscription matching is by prefix), and the
+ * empty key and keys holding NULs are keys like any other. The key
+ * handed on to the callback is just the key, and a key_ref callback
+ * gets it without a copy.
+ *
+ */
+
+void TransportTest::test_callback_table()
+{
+    DataCallbackTable table;
+    key_recorder a, b, c, d;
+    string nul_key("a\0b", 3);
+    // a received key frame: the key, followed by other data.
+    char frame[] = "lines.b\x01\x02\x03\x04\x05\x06\x07\x08";
+
+    table.set("lines", &a.by_string);
+    table.set("lines.b", &b.by_ref);
+    table.set("", &c.by_string);
+    table.set(nul_key, &d.by_string);
+    CPPUNIT_ASSERT(table.size() == 4);
+
+    CPPUNIT_ASSERT(table.find(frame, 7) == &b.by_ref);
+    CPPUNIT_ASSERT(table.find(frame, 5) == &a.by_string);
+    CPPUNIT_ASSERT(table.find(frame, 6) == NULL);        // "lines."
+    CPPUNIT_ASSERT(table.find(frame, 8) == NULL);        // "lines.b\x01"
+    CPPUNIT_ASSERT(table.find("line", 4) == NULL);
+    CPPUNIT_ASSERT(table.find(frame, 0) == &c.by_string);
+    CPPUNIT_ASSERT(table.find(NULL, 0) == &c.by_string);
+    CPPUNIT_ASSERT(table.find(nul_key.data(), 3) == &d.by_string);
+    CPPUNIT_ASSERT(table.find(nul_key.data(), 1) == NULL);
+
+    DataCallbackTable::entry *e = table.find_entry(frame, 7);
+    CPPUNIT_ASSERT(e && e->key == "lines.b" && e->next_seq == 0 && !e->synced);
+
+    table.find(frame, 7)->exec(key_ref(frame, 7), frame, sizeof(frame));
+    CPPUNIT_ASSERT(b.rkey == "lines.b");
+    CPPUNIT_ASSERT(b.rkey.data() == frame);
+    table.find(frame, 5)->exec(key_ref(frame, 5), frame, sizeof(frame));
+    CPPUNIT_ASSERT(a.skey == "lines");
+    table.find(nul_key.data(), 3)->exec(key_ref(nul_key.data(), 3), frame, 1);
+    CPPUNIT_ASSERT(d.skey == nul_key);
+
+    // replacing and removing
+    table.set("lines", &b.by_string);
+    CPPUNIT_ASSERT(table.size() == 4);
+    CPPUNIT_ASSERT(table.find(frame, 5) == &b.by_string);
+    CPPUNIT_ASSERT(table.erase(""));
+    CPPUNIT_ASSERT(!table.erase(""));
+    CPPUNIT_ASSERT(table.find(NULL, 0) == NULL);
+    CPPUNIT_ASSERT(table.erase("lines"));
+    CPPUNIT_ASSERT(table.find(frame, 7) == &b.by_ref);
+    CPPUNIT_ASSERT(table.size() == 2);
+}
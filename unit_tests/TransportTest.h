@@ -44,6 +44,18 @@ class TransportTest : public CppUnit::TestCase
     CPPUNIT_TEST(test_ipc_publish);
     CPPUNIT_TEST(test_tcp_publish);
     CPPUNIT_TEST(test_rtinproc_publish);
+    CPPUNIT_TEST(test_shm_publish);
+    CPPUNIT_TEST(test_shm_ring);
+    CPPUNIT_TEST(test_sink_policy);
+    CPPUNIT_TEST(test_component_sink_policy);
+    CPPUNIT_TEST(test_shared_publish);
+    CPPUNIT_TEST(test_shared_receive);
+    CPPUNIT_TEST(test_reactor);
+    CPPUNIT_TEST(test_blocking_sink);
+    CPPUNIT_TEST(test_socket_options);
+    CPPUNIT_TEST(test_lost_messages);
+    CPPUNIT_TEST(test_rt_unsubscribe);
+    CPPUNIT_TEST(test_callback_table);
     CPPUNIT_TEST_SUITE_END();
 
     std::shared_ptr<matrix::KeymasterServer> _kms;
@@ -61,6 +73,18 @@ public:
     void test_ipc_publish();
     void test_tcp_publish();
     void test_rtinproc_publish();
+    void test_shm_publish();
+    void test_shm_ring();
+    void test_sink_policy();
+    void test_component_sink_policy();
+    void test_shared_publish();
+    void test_shared_receive();
+    void test_reactor();
+    void test_blocking_sink();
+    void test_socket_options();
+    void test_lost_messages();
+    void test_rt_unsubscribe();
+    void test_callback_table();
 };
 
 #endif
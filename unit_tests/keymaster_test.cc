@@ -28,6 +28,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <future>
+#include <atomic>
 #include <yaml-cpp/yaml.h>
 #include <boost/shared_ptr.hpp>
 
@@ -37,25 +39,71 @@
 #include "keymaster_test.h"
 #include "matrix/TCondition.h"
 #include "matrix/Time.h"
+#include "matrix/Thread.h"
 
 using namespace std;
 using namespace mxutils;
 using namespace matrix;
 
-std::string keymaster_url = "inproc://matrix.keymaster";
-std::string tcp_keymaster_url = "tcp://ajax:42000";
+/**
+ * Starts a KeymasterServer on an inproc URL of its own. An inproc
+ * endpoint (or TCP port) is only released some time after its socket
+ * is closed, so one test's server may not be able to bind where the
+ * last one was.
+ *
+ * @param km_server: set to the new server.
+ * @param config: the configuration, whose URLs are replaced.
+ *
+ * @return the server's URL.
+ *
+ */
+
+static string start_server(boost::shared_ptr<KeymasterServer> &km_server, YAML::Node config)
+{
+    string url = "inproc://matrix.keymaster." + gen_random_string(10);
+
+    config["Keymaster"]["URLS"]["Initial"] = vector<string>({url});
+    km_server.reset(new KeymasterServer(config));
+    km_server->run();
+    return url;
+}
+
+/**
+ * A subscription takes effect some time after `subscribe()` returns,
+ * and publications made before then are lost. This puts 'val' at
+ * 'key' until 'done()' (which should wait a little) says it arrived.
+ *
+ * @return true if it arrived within about 5 seconds.
+ *
+ */
+
+template <typename T, typename F>
+static bool put_until(Keymaster &km, string key, T val, F done)
+{
+    for (int i = 0; i < 50; ++i)
+    {
+        km.put(key, val, true);
+
+        if (done())
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
 
 void KeymasterTest::test_keymaster()
 {
     yaml_result r;
     boost::shared_ptr<KeymasterServer> km_server;
+    string url;
 
     CPPUNIT_ASSERT_NO_THROW(
-        km_server.reset(new KeymasterServer("test.yaml"));
-        km_server->run();
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
         );
 
-    Keymaster km(keymaster_url);
+    Keymaster km(url);
     // get a value as a YAML::Node
     YAML::Node n;
     CPPUNIT_ASSERT_NO_THROW(n = km.get("components.nettask.source.URLs"));
@@ -126,6 +174,46 @@ private:
     }
 };
 
+// Follows the 'ID' of a subscribed parent node
+struct ParentCallback : public KeymasterCallbackBase
+{
+    ParentCallback()
+    : id(0)
+    {}
+
+    TCondition<int> id;
+
+private:
+    void _call(string key, YAML::Node val)
+    {
+        const YAML::Node &v = val;
+
+        if (v["ID"])
+        {
+            id.signal(v["ID"].as<int>());
+        }
+    }
+};
+
+// Counts its calls, and keeps the last value
+struct CountingCallback : public KeymasterCallbackBase
+{
+    CountingCallback()
+    : calls(0),
+      last(-1)
+    {}
+
+    std::atomic<int> calls;
+    TCondition<int> last;
+
+private:
+    void _call(string key, YAML::Node val)
+    {
+        ++calls;
+        last.signal(val.as<int>());
+    }
+};
+
 class Foo
 {
 public:
@@ -162,13 +250,13 @@ void KeymasterTest::test_keymaster_publisher()
 {
     yaml_result r;
     boost::shared_ptr<KeymasterServer> km_server;
+    string url;
 
     CPPUNIT_ASSERT_NO_THROW(
-        km_server.reset(new KeymasterServer("test.yaml"));
-        km_server->run();
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
         );
 
-    Keymaster km(keymaster_url);
+    Keymaster km(url);
 
     // first kind of callback: a custom callback based on
     // KeymasterCallbackBase.
@@ -178,9 +266,8 @@ void KeymasterTest::test_keymaster_publisher()
     km.subscribe("components.nettask.source.ID", &cb);
 
     // Put a new value into the keymaster
-    km.put("components.nettask.source.ID", 1234, true);
-
-    CPPUNIT_ASSERT(cb.data.wait(1234, 100000));
+    CPPUNIT_ASSERT(put_until(km, "components.nettask.source.ID", 1234,
+                             [&]() {return cb.data.wait(1234, 100000);}));
 
     // Replace an existing value in the keymaster
     km.put("components.nettask.source.ID", 9999);
@@ -191,8 +278,419 @@ void KeymasterTest::test_keymaster_publisher()
     // a callback, using the KeymasterMemberCB<T> class to enclose
     // it. Foo creates its own keymaster client, given a keymaster URL,
     // just as a component would do.
-    Foo foo(keymaster_url);
-    foo.put(5);
+    Foo foo(url);
+    bool got = false;
+
     cout << "Testing publisher" << endl;
-    CPPUNIT_ASSERT(foo.get_data(5) == 5);
+
+    for (int i = 0; i < 5 && !got; ++i)
+    {
+        foo.put(5);
+        got = foo.get_data(5) == 5;
+    }
+
+    CPPUNIT_ASSERT(got);
+}
+
+void KeymasterTest::test_keymaster_delta()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+    YAML::Node config = YAML::LoadFile("test.yaml");
+
+    config["Keymaster"]["delta_publishing"] = true;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, config);
+        );
+
+    Keymaster km(url);
+    MyCallback<int> cb(0);
+    ParentCallback pcb;
+
+    CPPUNIT_ASSERT(km.subscribe("components.nettask.source.ID", &cb));
+    CPPUNIT_ASSERT(km.subscribe("components.nettask.source", &pcb));
+
+    // Only the change is published, but subscribers to the key and
+    // to its parent both get their values, made from the client's
+    // mirror of the store.
+    CPPUNIT_ASSERT(put_until(km, "components.nettask.source.ID", 1234,
+                             [&]() {return cb.data.wait(1234, 100000);}));
+    CPPUNIT_ASSERT(pcb.id.wait(1234, 5000000));
+
+    km.put("components.nettask.source.ID", 9999);
+    CPPUNIT_ASSERT(cb.data.wait(9999, 5000000));
+    CPPUNIT_ASSERT(pcb.id.wait(9999, 5000000));
+
+    // the mirror stays in step with the store
+    km.del("components.nettask.source.ID");
+    km.put("components.nettask.source", YAML::Load("{ID: 42}"));
+    CPPUNIT_ASSERT(pcb.id.wait(42, 5000000));
+    CPPUNIT_ASSERT(km.get_as<int>("components.nettask.source.ID") == 42);
+}
+
+/**
+ * Tests that a client mirroring the store follows a KeymasterServer
+ * restarted on the same URL, whose sequence numbers start over below
+ * those already in the mirror. The URL is an ipc one, since a client
+ * does not reconnect to a new inproc endpoint.
+ *
+ */
+
+void KeymasterTest::test_keymaster_delta_restart()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url = "ipc:///tmp/matrix.keymaster." + gen_random_string(10);
+    YAML::Node config = YAML::LoadFile("test.yaml");
+
+    config["Keymaster"]["delta_publishing"] = true;
+    config["Keymaster"]["URLS"]["Initial"] = vector<string>({url});
+
+    CPPUNIT_ASSERT_NO_THROW(
+        km_server.reset(new KeymasterServer(config));
+        km_server->run();
+        );
+
+    Keymaster km(url);
+    MyCallback<int> cb(0);
+
+    CPPUNIT_ASSERT(km.subscribe("components.nettask.source.ID", &cb));
+    CPPUNIT_ASSERT(put_until(km, "components.nettask.source.ID", 1234,
+                             [&]() {return cb.data.wait(1234, 100000);}));
+
+    // well past any sequence number the new server will reach here
+    for (int i = 0; i < 200; ++i)
+    {
+        km.put("test.delta.count", i, true);
+    }
+
+    km.put("components.nettask.source.ID", 4321);
+    CPPUNIT_ASSERT(cb.data.wait(4321, 5000000));
+
+    CPPUNIT_ASSERT_NO_THROW(
+        km_server.reset();
+        km_server.reset(new KeymasterServer(config));
+        km_server->run();
+        );
+
+    Keymaster writer(url);
+
+    CPPUNIT_ASSERT(put_until(writer, "components.nettask.source.ID", 5678,
+                             [&]() {return cb.data.wait(5678, 100000);}));
+    writer.put("components.nettask.source.ID", 8765);
+    CPPUNIT_ASSERT(cb.data.wait(8765, 5000000));
+}
+
+void KeymasterTest::test_keymaster_cache()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
+        );
+
+    Keymaster km(url);
+    Keymaster writer(url);
+    MyCallback<int> cb(0);
+
+    km.enable_cache();
+    writer.put("components.nettask.source.ID", 1234, true);
+    CPPUNIT_ASSERT(km.get_as<int>("components.nettask.source.ID") == 1234);
+    // caches the parent, and so everything below it
+    CPPUNIT_ASSERT(km.get("components.nettask.source")["ID"].as<int>() == 1234);
+    CPPUNIT_ASSERT(km.get("components.nettask.source.URLs").size() == 3);
+
+    // changes made elsewhere reach the cache through the publications
+    km.subscribe("components.nettask.source.ID", &cb);
+    CPPUNIT_ASSERT(put_until(writer, "components.nettask.source.ID", 9999,
+                             [&]() {return cb.data.wait(9999, 100000);}));
+    CPPUNIT_ASSERT(km.get_as<int>("components.nettask.source.ID") == 9999);
+
+    // a missing key still gets the KeymasterServer's answer
+    yaml_result r;
+    CPPUNIT_ASSERT(!km.get("components.nettask.source.foo", r));
+    CPPUNIT_ASSERT(r.key == "components.nettask.source");
+
+    // Once the subscription is known to be in effect, reads are
+    // answered by the cache, and the KeymasterServer doesn't see them.
+    auto gets = [&]() {return km.stats().node["requests"]["GET"]["count"].as<uint64_t>();};
+    uint64_t before = 0;
+
+    for (int i = 0; i < 100; ++i)
+    {
+        before = gets();
+        km.get("components.nettask.source.ID");
+
+        if (gets() == before)
+        {
+            break;
+        }
+
+        Time::thread_delay(50000000);
+    }
+
+    CPPUNIT_ASSERT(gets() == before);
+    CPPUNIT_ASSERT(put_until(writer, "components.nettask.source.ID", 4321,
+                             [&]() {return cb.data.wait(4321, 100000);}));
+    CPPUNIT_ASSERT(km.get_as<int>("components.nettask.source.ID") == 4321);
+    CPPUNIT_ASSERT(gets() == before);
+}
+
+void KeymasterTest::test_keymaster_async()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
+        );
+
+    Keymaster km(url);
+    vector<future<yaml_result> > f;
+
+    // many requests outstanding at once
+    for (int i = 0; i < 20; ++i)
+    {
+        f.push_back(km.put_async("test.async.k" + to_string(i), YAML::Node(i), true));
+    }
+
+    for (int i = 0; i < 20; ++i)
+    {
+        yaml_result r = f[i].get();
+        CPPUNIT_ASSERT(r.result);
+        CPPUNIT_ASSERT(r.key == "test.async.k" + to_string(i));
+    }
+
+    future<yaml_result> g = km.get_async("test.async.k7");
+    CPPUNIT_ASSERT(g.get().node.as<int>() == 7);
+    CPPUNIT_ASSERT(!km.get_async("test.async.nope").get().result);
+
+    // batches
+    vector<pair<string, YAML::Node> > vals =
+        {
+            {"test.multi.a", YAML::Node(1)},
+            {"test.multi.b", YAML::Node("two")}
+        };
+
+    vector<yaml_result> rs = km.multi_put(vals);
+    CPPUNIT_ASSERT(rs.size() == 2);
+    CPPUNIT_ASSERT(!rs[0].result);   // no 'create'
+    rs = km.multi_put(vals, true);
+    CPPUNIT_ASSERT(rs[0].result && rs[1].result);
+
+    rs = km.multi_get({"test.multi.a", "test.multi.b", "test.multi.c"});
+    CPPUNIT_ASSERT(rs.size() == 3);
+    CPPUNIT_ASSERT(rs[0].node.as<int>() == 1);
+    CPPUNIT_ASSERT(rs[1].node.as<string>() == "two");
+    CPPUNIT_ASSERT(!rs[2].result);
+    CPPUNIT_ASSERT(rs[2].key == "test.multi");
+}
+
+void KeymasterTest::test_keymaster_transaction()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+    YAML::Node config = YAML::LoadFile("test.yaml");
+
+    config["Keymaster"]["delta_publishing"] = true;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, config);
+        );
+
+    Keymaster km(url);
+    ParentCallback pcb;
+
+    CPPUNIT_ASSERT(km.subscribe("components.nettask.source", &pcb));
+    CPPUNIT_ASSERT(put_until(km, "components.nettask.source.ID", -1,
+                             [&]() {return pcb.id.wait(-1, 100000);}));
+    km.del("components.nettask.source.ID");
+
+    // a failed change leaves the store as it was
+    vector<KeymasterStore::change> bad =
+        {
+            {"components.nettask.source.ID", YAML::Node(1), true, false},
+            {"components.nettask.nope", YAML::Node(), false, true}
+        };
+
+    vector<yaml_result> rs = km.transaction(bad);
+    CPPUNIT_ASSERT(rs.size() == 2);
+    CPPUNIT_ASSERT(!rs[0].result && !rs[1].result);
+    CPPUNIT_ASSERT(rs[1].err == "No such key: nope");
+    CPPUNIT_ASSERT(!km.get("components.nettask.source.ID", rs[0]));
+
+    // all the changes, one publication
+    vector<KeymasterStore::change> good =
+        {
+            {"components.nettask.source.ID", YAML::Node(77), true, false},
+            {"components.nettask.source.mode", YAML::Node("txn"), true, false},
+            {"components.nettask.source.URLs", YAML::Node(), false, true}
+        };
+
+    rs = km.transaction(good);
+    CPPUNIT_ASSERT(rs.size() == 3);
+    CPPUNIT_ASSERT(rs[0].result && rs[1].result && rs[2].result);
+    CPPUNIT_ASSERT(pcb.id.wait(77, 5000000));
+    YAML::Node n = km.get("components.nettask.source");
+    CPPUNIT_ASSERT(n["mode"].as<string>() == "txn");
+    CPPUNIT_ASSERT(!n["URLs"]);
+}
+
+void KeymasterTest::test_keymaster_rate_limit()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
+        );
+
+    Keymaster km(url);
+    CountingCallback cb;
+
+    km.put("test.rate.position", 0, true);
+    CPPUNIT_ASSERT(km.subscribe("test.rate.position", &cb, 200));
+    CPPUNIT_ASSERT(put_until(km, "test.rate.position", 0,
+                             [&]() {return cb.last.wait(0, 100000);}));
+    cb.calls = 0;
+
+    // a burst of updates is conflated to a few calls, the last of
+    // which has the last value.
+    for (int i = 1; i <= 100; ++i)
+    {
+        km.put("test.rate.position", i);
+    }
+
+    CPPUNIT_ASSERT(cb.last.wait(100, 5000000));
+    CPPUNIT_ASSERT(cb.calls < 10);
+}
+
+void KeymasterTest::test_keymaster_stats()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, YAML::LoadFile("test.yaml"));
+        );
+
+    Keymaster km(url);
+
+    for (int i = 0; i < 10; ++i)
+    {
+        km.put("test.stats.value", i, true);
+        km.get("test.stats.value");
+    }
+
+    yaml_result yr = km.stats();
+    CPPUNIT_ASSERT(yr.result);
+    CPPUNIT_ASSERT(yr.node["requests"]["GET"]["count"].as<int>() >= 10);
+    CPPUNIT_ASSERT(yr.node["requests"]["PUT"]["count"].as<int>() >= 10);
+    CPPUNIT_ASSERT(yr.node["requests"]["PUT"]["max"].as<uint64_t>()
+                   >= yr.node["requests"]["PUT"]["p50"].as<uint64_t>());
+    CPPUNIT_ASSERT(yr.node["publications"]["sent"].as<int>() >= 10);
+}
+
+/**
+ * Helper for test_keymaster_concurrent(): a client in its own thread
+ * that puts its own key, reads it back, and reads the whole subtree
+ * the other clients are writing to.
+ *
+ */
+
+struct km_client_task
+{
+    km_client_task(string u, int i)
+        : url(u), id(i), errors(0)
+    {
+    }
+
+    void run()
+    {
+        try
+        {
+            Keymaster km(url);
+            string key = "test.concurrent.t" + to_string(id);
+
+            for (int i = 0; i < 200; ++i)
+            {
+                if (!km.put(key, i, true))
+                {
+                    ++errors;
+                }
+
+                // a GET after a PUT sees it, however many workers.
+                if (km.get_as<int>(key) != i)
+                {
+                    ++errors;
+                }
+
+                YAML::Node n = km.get("test.concurrent");
+
+                for (YAML::const_iterator j = n.begin(); j != n.end(); ++j)
+                {
+                    if (j->second.as<int>() < 0 || j->second.as<int>() >= 200)
+                    {
+                        ++errors;
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+            ++errors;
+        }
+    }
+
+    string url;
+    int id;
+    int errors;
+};
+
+/**
+ * Runs GETs and PUTs from several clients at once against a
+ * KeymasterServer with several workers: every client must read back
+ * what it wrote, and reads of the subtree being written must be whole.
+ *
+ */
+
+void KeymasterTest::test_keymaster_concurrent()
+{
+    boost::shared_ptr<KeymasterServer> km_server;
+    string url;
+    YAML::Node config = YAML::LoadFile("test.yaml");
+
+    config["Keymaster"]["workers"] = 4;
+
+    CPPUNIT_ASSERT_NO_THROW(
+        url = start_server(km_server, config);
+        );
+
+    Keymaster km(url);
+    CPPUNIT_ASSERT(km.put("test.concurrent.t0", 0, true));
+
+    vector<shared_ptr<km_client_task> > tasks;
+    vector<shared_ptr<Thread<km_client_task> > > threads;
+
+    for (int i = 0; i < 8; ++i)
+    {
+        tasks.emplace_back(new km_client_task(url, i));
+        threads.emplace_back(new Thread<km_client_task>(tasks.back().get(), &km_client_task::run));
+        threads.back()->start();
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        threads[i]->join();
+        CPPUNIT_ASSERT(tasks[i]->errors == 0);
+    }
+
+    YAML::Node n = km.get("test.concurrent");
+    CPPUNIT_ASSERT(n.size() == 8);
+
+    for (int i = 0; i < 8; ++i)
+    {
+        CPPUNIT_ASSERT(n["t" + to_string(i)].as<int>() == 199);
+    }
 }
@@ -35,12 +35,28 @@ class KeymasterTest : public CppUnit::TestCase
     CPPUNIT_TEST_SUITE(KeymasterTest);
     CPPUNIT_TEST(test_keymaster);
     CPPUNIT_TEST(test_keymaster_publisher);
+    CPPUNIT_TEST(test_keymaster_delta);
+    CPPUNIT_TEST(test_keymaster_delta_restart);
+    CPPUNIT_TEST(test_keymaster_cache);
+    CPPUNIT_TEST(test_keymaster_async);
+    CPPUNIT_TEST(test_keymaster_transaction);
+    CPPUNIT_TEST(test_keymaster_rate_limit);
+    CPPUNIT_TEST(test_keymaster_stats);
+    CPPUNIT_TEST(test_keymaster_concurrent);
 
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void test_keymaster();
     void test_keymaster_publisher();
+    void test_keymaster_delta();
+    void test_keymaster_delta_restart();
+    void test_keymaster_cache();
+    void test_keymaster_async();
+    void test_keymaster_transaction();
+    void test_keymaster_rate_limit();
+    void test_keymaster_stats();
+    void test_keymaster_concurrent();
 };
 
 #endif
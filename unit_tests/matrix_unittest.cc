@@ -27,9 +27,13 @@
 #include "StateTransitionTest.h"
 #include "TimeTest.h"
 #include "ArchitectTest.h"
+#include "EventPollerTest.h"
 #include "publisher_test.h"
 #include "utility_test.h"
 #include "keymaster_test.h"
+#include "KeymasterJournalTest.h"
+#include "KeymasterStoreTest.h"
+#include "LatencyHistogramTest.h"
 #include "TransportTest.h"
 #include "TSemfifoTest.h"
 #include "matrix/Thread.h"
@@ -51,8 +55,12 @@ int main(int argc, char **argv)
     runner.addTest(TimeTest::suite());
 //    runner.addTest(ArchitectTest::suite());
     runner.addTest(UtilityTest::suite());
-//    runner.addTest(KeymasterTest::suite());
-//    runner.addTest(TransportTest::suite());
+    runner.addTest(EventPollerTest::suite());
+    runner.addTest(KeymasterTest::suite());
+    runner.addTest(KeymasterJournalTest::suite());
+    runner.addTest(KeymasterStoreTest::suite());
+    runner.addTest(LatencyHistogramTest::suite());
+    runner.addTest(TransportTest::suite());
     runner.addTest(TSemfifoTest::suite());
     runner.addTest(log_tTest::suite());
     runner.run();
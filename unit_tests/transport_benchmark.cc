@@ -0,0 +1,467 @@
+/*******************************************************************
+ *  transport_benchmark.cc - Throughput and latency of the DataSource/
+ *  DataSink transports.
+ *
+ *  Copyright (C) 2015 Associated Universities, Inc. Washington DC, USA.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful, but
+ *  WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *  Correspondence concerning GBT software should be addressed as follows:
+ *  GBT Operations
+ *  National Radio Astronomy Observatory
+ *  P. O. Box 2
+ *  Green Bank, WV 24944-0002 USA
+ *
+ *******************************************************************/
+
+/**
+ * matrix_benchmark: measures, for each transport, how fast and with
+ * what latency a DataSource's messages reach its DataSinks, over a
+ * range of payload sizes, numbers of sinks (fan-out) and sink receive
+ * queue (ring buffer) sizes. Each combination is one run, reported as
+ * one line of CSV (or one YAML document, with '-y'):
+ *
+ *     transport,payload,fanout,ring,sent,rejected,received,dropped,
+ *     seconds,msgs_per_sec,bytes_per_sec,p50_ns,p99_ns,p999_ns,max_ns
+ *
+ * 'sent' counts the payloads the transport accepted, and 'rejected'
+ * those it refused outright (the source's `publish()` returned
+ * false), which are not counted as dropped. 'received', 'dropped' and
+ * the rates are per sink, averaged over the sinks. The latency is one-way, from the call to `publish()` to the
+ * return of the sink's `get()`, measured with the time stamp carried
+ * in the first 8 bytes of every payload; all sinks and the source are
+ * in this process, so they share a clock.
+ *
+ * The source publishes as fast as it can. Sinks that don't keep up
+ * drop messages (see DataSink's 'blocking' parameter, '-B' here), and
+ * the drops show up as such.
+ *
+ * The shm transport's ring is sized from the largest payload, since
+ * it refuses any message larger than half the ring.
+ *
+ * Usage: matrix_benchmark [-t transports] [-s sizes] [-f fan-outs]
+ *                         [-r ring sizes] [-n messages] [-b bytes]
+ *                         [-m megabytes] [-B] [-y]
+ *
+ *   -t: transports, comma separated (inproc,ipc,tcp,rtinproc,shm)
+ *   -s: payload sizes in bytes, comma separated; 'k' and 'M' suffixes
+ *       are allowed (8,64,512,4k,32k,256k,1M,16M)
+ *   -f: numbers of sinks (1,4)
+ *   -r: sink ring buffer sizes (10,1000)
+ *   -n: messages per run, at most (100000)
+ *   -b: bytes per run, at most; large payloads send fewer messages,
+ *       but never fewer than 100 (1G)
+ *   -m: skip runs whose sink ring buffers would need more than this
+ *       many megabytes in all (2048)
+ *   -B: blocking sinks: the source waits for room instead of the
+ *       sinks dropping data.
+ *   -y: YAML output.
+ *
+ */
+
+#include "matrix/Keymaster.h"
+#include "matrix/DataSource.h"
+#include "matrix/DataSink.h"
+#include "matrix/LatencyHistogram.h"
+#include "matrix/Thread.h"
+#include "matrix/Time.h"
+#include "matrix/matrix_util.h"
+
+#include <boost/algorithm/string.hpp>
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+using namespace mxutils;
+using namespace matrix;
+
+static string km_urn("inproc://matrix_benchmark.keymaster");
+
+struct options
+{
+    vector<string> transports = {"inproc", "ipc", "tcp", "rtinproc", "shm"};
+    vector<size_t> sizes = {8, 64, 512, 4096, 32768, 262144, 1048576, 16777216};
+    vector<size_t> fanouts = {1, 4};
+    vector<size_t> rings = {10, 1000};
+    size_t messages = 100000;
+    size_t bytes = 1UL << 30;
+    size_t megabytes = 2048;
+    bool blocking = false;
+    bool yaml = false;
+};
+
+struct result
+{
+    size_t sent;
+    size_t rejected;
+    size_t received;
+    size_t dropped;
+    double seconds;
+    LatencyHistogram latency;
+};
+
+/**
+ * One DataSink and the thread that empties it.
+ *
+ */
+
+class Receiver
+{
+public:
+
+    Receiver(size_t ring, bool blocking, LatencyHistogram &latency, const atomic<bool> &done)
+        : sink(km_urn, ring, blocking),
+          received(0),
+          last(0),
+          _latency(latency),
+          _done(done),
+          _thread(this, &Receiver::run)
+    {
+    }
+
+    void start(size_t expected)
+    {
+        _expected = expected;
+        _thread.start("benchmark sink");
+    }
+
+    void join()
+    {
+        _thread.join();
+    }
+
+    DataSink<GenericBuffer, select_only> sink;
+    size_t received;
+    Time::Time_t last;
+
+private:
+
+    void run()
+    {
+        GenericBuffer buf;
+        Time::Time_t sent;
+
+        // once the source is done, a quiet sink is taken to be done too.
+        while (received < _expected)
+        {
+            if (sink.timed_get(buf, 500000000L))
+            {
+                last = Time::getUTC();
+                memcpy(&sent, buf.data(), sizeof sent);
+                _latency.record(last - sent);
+                ++received;
+            }
+            else if (_done)
+            {
+                break;
+            }
+        }
+    }
+
+    size_t _expected;
+    LatencyHistogram &_latency;
+    const atomic<bool> &_done;
+    Thread<Receiver> _thread;
+};
+
+/**
+ * Parses a comma separated list of sizes, each of which may have a
+ * 'k', 'M' or 'G' suffix.
+ *
+ */
+
+static vector<size_t> parse_sizes(string s)
+{
+    vector<string> parts;
+    vector<size_t> sizes;
+
+    boost::split(parts, s, boost::is_any_of(","));
+
+    for (auto i = parts.begin(); i != parts.end(); ++i)
+    {
+        char *end;
+        size_t v = strtoul(i->c_str(), &end, 10);
+
+        switch (*end)
+        {
+        case 'k':
+        case 'K':
+            v <<= 10;
+            break;
+        case 'M':
+            v <<= 20;
+            break;
+        case 'G':
+            v <<= 30;
+            break;
+        }
+
+        sizes.push_back(v);
+    }
+
+    return sizes;
+}
+
+static bool parse_options(int argc, char *argv[], options &opts)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "t:s:f:r:n:b:m:By")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            opts.transports.clear();
+            boost::split(opts.transports, string(optarg), boost::is_any_of(","));
+            break;
+        case 's':
+            opts.sizes = parse_sizes(optarg);
+            break;
+        case 'f':
+            opts.fanouts = parse_sizes(optarg);
+            break;
+        case 'r':
+            opts.rings = parse_sizes(optarg);
+            break;
+        case 'n':
+            opts.messages = parse_sizes(optarg).front();
+            break;
+        case 'b':
+            opts.bytes = parse_sizes(optarg).front();
+            break;
+        case 'm':
+            opts.megabytes = parse_sizes(optarg).front();
+            break;
+        case 'B':
+            opts.blocking = true;
+            break;
+        case 'y':
+            opts.yaml = true;
+            break;
+        default:
+            cerr << "usage: " << argv[0] << " [-t transports] [-s sizes] [-f fan-outs]" << endl
+                 << "           [-r ring sizes] [-n messages] [-b bytes] [-m megabytes] [-B] [-y]" << endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * The Keymaster configuration: one component per transport, each with
+ * a single source, 'data', on that transport. The shm ring is made
+ * big enough for a few of the largest payload, 'largest', and at
+ * least its default 4 MiB.
+ *
+ */
+
+static YAML::Node configuration(const vector<string> &transports, size_t largest)
+{
+    YAML::Node n;
+
+    n["Keymaster"]["URLS"]["Initial"].push_back(km_urn);
+
+    for (auto i = transports.begin(); i != transports.end(); ++i)
+    {
+        YAML::Node c;
+
+        c["Transports"]["A"]["Specified"].push_back(*i);
+
+        if (*i == "shm")
+        {
+            // room for the key and record header too
+            c["Transports"]["A"]["ShmSize"] = max((size_t)4 << 20, 4 * (largest + 4096));
+        }
+
+        c["Sources"]["data"] = "A";
+        n["components"]["bench_" + *i] = c;
+    }
+
+    return n;
+}
+
+/**
+ * Does one run: connects 'fanout' sinks, each with a receive queue of
+ * 'ring' payloads, to a new source on 'transport', and publishes
+ * 'count' payloads of 'size' bytes.
+ *
+ */
+
+static void run(string transport, size_t size, size_t fanout, size_t ring,
+                size_t count, bool blocking, result &r)
+{
+    string component = "bench_" + transport;
+    atomic<bool> done(false);
+    vector<shared_ptr<Receiver> > receivers;
+    DataSource<GenericBuffer> source(km_urn, component, "data");
+    GenericBuffer buf;
+
+    for (size_t i = 0; i < fanout; ++i)
+    {
+        receivers.push_back(make_shared<Receiver>(ring, blocking, r.latency, done));
+        receivers.back()->sink.connect(component, "data");
+        receivers.back()->start(count);
+    }
+
+    // let the subscriptions get through before publishing.
+    Time::thread_delay(200000000L);
+
+    buf.resize(size);
+    memset(buf.data(), 0, size);
+    Time::Time_t start = Time::getUTC(), end = start;
+
+    r.sent = 0;
+    r.rejected = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        Time::Time_t now = Time::getUTC();
+        memcpy(buf.data(), &now, sizeof now);
+
+        if (source.publish(buf))
+        {
+            ++r.sent;
+        }
+        else
+        {
+            ++r.rejected;
+        }
+    }
+
+    done = true;
+    r.received = 0;
+
+    for (auto i = receivers.begin(); i != receivers.end(); ++i)
+    {
+        (*i)->join();
+        r.received += (*i)->received;
+        end = max(end, (*i)->last);
+        (*i)->sink.disconnect();
+    }
+
+    r.received /= fanout;
+    r.dropped = r.sent - r.received;
+    r.seconds = (end - start) / 1e9;
+}
+
+static void report(const options &opts, string transport, size_t size, size_t fanout,
+                   size_t ring, const result &r)
+{
+    double rate = r.seconds > 0 ? r.received / r.seconds : 0.0;
+
+    if (opts.yaml)
+    {
+        YAML::Node n;
+        YAML::Node lat;
+
+        n["transport"] = transport;
+        n["payload"] = size;
+        n["fanout"] = fanout;
+        n["ring"] = ring;
+        n["sent"] = r.sent;
+        n["rejected"] = r.rejected;
+        n["received"] = r.received;
+        n["dropped"] = r.dropped;
+        n["seconds"] = r.seconds;
+        n["msgs_per_sec"] = rate;
+        n["bytes_per_sec"] = rate * size;
+        n["latency"] = r.latency.to_yaml();
+        cout << "---" << endl << n << endl;
+    }
+    else
+    {
+        cout << transport << "," << size << "," << fanout << "," << ring << ","
+             << r.sent << "," << r.rejected << "," << r.received << "," << r.dropped << ","
+             << r.seconds << "," << rate << "," << rate * size << ","
+             << r.latency.percentile(50) << "," << r.latency.percentile(99) << ","
+             << r.latency.percentile(99.9) << "," << r.latency.max() << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    options opts;
+
+    if (!parse_options(argc, argv, opts))
+    {
+        return 1;
+    }
+
+    size_t largest = 0;
+
+    for (auto s = opts.sizes.begin(); s != opts.sizes.end(); ++s)
+    {
+        largest = max(largest, *s);
+    }
+
+    KeymasterServer kms(configuration(opts.transports, largest));
+    kms.run();
+
+    if (!opts.yaml)
+    {
+        cout << "transport,payload,fanout,ring,sent,rejected,received,dropped,seconds,"
+             << "msgs_per_sec,bytes_per_sec,p50_ns,p99_ns,p999_ns,max_ns" << endl;
+    }
+
+    for (auto t = opts.transports.begin(); t != opts.transports.end(); ++t)
+    {
+        for (auto s = opts.sizes.begin(); s != opts.sizes.end(); ++s)
+        {
+            // room for the time stamp
+            size_t size = max(*s, sizeof(Time::Time_t));
+            size_t count = max(min(opts.messages, opts.bytes / size), (size_t)100);
+
+            for (auto f = opts.fanouts.begin(); f != opts.fanouts.end(); ++f)
+            {
+                for (auto r = opts.rings.begin(); r != opts.rings.end(); ++r)
+                {
+                    if ((*f) * (*r) * size > opts.megabytes << 20)
+                    {
+                        cerr << "skipping " << *t << ", payload " << size << ", fan-out " << *f
+                             << ", ring " << *r << ": the ring buffers would exceed "
+                             << opts.megabytes << " MB" << endl;
+                        continue;
+                    }
+
+                    try
+                    {
+                        result res;
+                        run(*t, size, *f, *r, count, opts.blocking, res);
+                        report(opts, *t, size, *f, *r, res);
+                    }
+                    catch (exception &e)
+                    {
+                        cerr << Time::isoDateTime(Time::getUTC()) << " -- " << *t
+                             << ": " << e.what() << endl;
+                    }
+                }
+            }
+        }
+    }
+
+    kms.terminate();
+    return 0;
+}